@@ -2456,21 +2456,44 @@ void MainFrame::OnCodeEditDwellStart(wxScintillaEvent& event)
             if (DebugFrontend::Get().Evaluate(m_vm, expression, m_stackLevel, result))
             {
 
-                wxStringInputStream stream(result.c_str());
-                wxXmlDocument document;
+                wxString text;
+                wxString type;
 
-                wxLogNull logNo;
-        
-                if (document.Load(stream))
+                if (ValueReader::GetIsValueStream(result.c_str(), result.length()))
                 {
-                    wxString text;
-                    wxString type;
-                    
-                    text += expression;
-                    text += " = ";
-                    text += WatchCtrl::GetNodeAsText(document.GetRoot(), type);
 
-                    edit->ShowToolTip(event.GetPosition(), text);
+                    ValueReader reader(result.c_str(), result.length());
+
+                    ValueTag tag;
+                    wxString value;
+
+                    if (reader.ReadTag(tag) && WatchCtrl::GetValueAsText(reader, tag, value, type))
+                    {
+                        text += expression;
+                        text += " = ";
+                        text += value;
+
+                        edit->ShowToolTip(event.GetPosition(), text);
+                    }
+
+                }
+                else
+                {
+
+                    wxStringInputStream stream(result.c_str());
+                    wxXmlDocument document;
+
+                    wxLogNull logNo;
+        
+                    if (document.Load(stream))
+                    {
+                        text += expression;
+                        text += " = ";
+                        text += WatchCtrl::GetNodeAsText(document.GetRoot(), type);
+
+                        edit->ShowToolTip(event.GetPosition(), text);
+                    }
+
                 }
                 
             }
@@ -143,35 +143,8 @@ bool WatchCtrl::AddCompoundExpression(wxTreeItemId item, wxXmlNode* root)
 
     wxString type;
     wxString text = GetNodeAsText(root, type);
-    
-    // Remove any embedded zeros in the text. This happens if we're displaying a wide
-    // string. Since we aren't using wide character wxWidgets, we cant' display that
-    // properly, so we just hack it for roman text.
 
-    bool englishWideCharacter = true;
-
-    for (unsigned int i = 0; i < text.Length(); i += 2)
-    {
-        if (text[i] != 0)
-        {
-            englishWideCharacter = false;
-        }
-    }
-
-    if (englishWideCharacter)
-    {
-
-        size_t convertedLength = WideCharToMultiByte(CP_UTF8, 0, (const wchar_t*)text.c_str(), text.Length() / sizeof(wchar_t), NULL, 0, 0, 0);
-
-        char* result = new char[convertedLength + 1]; 
-        convertedLength = WideCharToMultiByte(CP_UTF8, 0, (const wchar_t*)text.c_str(), text.Length() / sizeof(wchar_t), result, convertedLength, 0, 0);
-
-        text = wxString(result, convertedLength);
-    
-    }
-
-    SetItemText(item, 1, text);
-    SetItemText(item, 2, type);
+    SetItemValue(item, text, type);
 
     if (root != NULL)
     {
@@ -242,6 +215,231 @@ bool WatchCtrl::AddCompoundExpression(wxTreeItemId item, wxXmlNode* root)
 
 }
 
+void WatchCtrl::SetItemValue(wxTreeItemId item, const wxString& value, const wxString& type)
+{
+
+    wxString text = value;
+
+    // Remove any embedded zeros in the text. This happens if we're displaying a wide
+    // string. Since we aren't using wide character wxWidgets, we cant' display that
+    // properly, so we just hack it for roman text.
+
+    bool englishWideCharacter = true;
+
+    for (unsigned int i = 0; i < text.Length(); i += 2)
+    {
+        if (text[i] != 0)
+        {
+            englishWideCharacter = false;
+        }
+    }
+
+    if (englishWideCharacter)
+    {
+
+        size_t convertedLength = WideCharToMultiByte(CP_UTF8, 0, (const wchar_t*)text.c_str(), text.Length() / sizeof(wchar_t), NULL, 0, 0, 0);
+
+        char* result = new char[convertedLength + 1]; 
+        convertedLength = WideCharToMultiByte(CP_UTF8, 0, (const wchar_t*)text.c_str(), text.Length() / sizeof(wchar_t), result, convertedLength, 0, 0);
+
+        text = wxString(result, convertedLength);
+    
+    }
+
+    SetItemText(item, 1, text);
+    SetItemText(item, 2, type);
+
+}
+
+bool WatchCtrl::AddValue(wxTreeItemId item, ValueReader& reader, ValueTag tag, wxString& text)
+{
+
+    wxString type;
+    std::string data;
+
+    text.Clear();
+
+    switch (tag)
+    {
+    case ValueTag_Value:
+        {
+            std::string typeName;
+            if (!reader.ReadType(typeName) || !reader.ReadString(data))
+            {
+                return false;
+            }
+            text = wxString(data.c_str(), data.length());
+            type = typeName.c_str();
+        }
+        break;
+    case ValueTag_Error:
+        if (!reader.ReadString(data))
+        {
+            return false;
+        }
+        text = data.c_str();
+        break;
+    case ValueTag_Function:
+        {
+            unsigned int scriptIndex;
+            unsigned int lineNumber;
+            if (!reader.ReadVarint(scriptIndex) || !reader.ReadVarint(lineNumber))
+            {
+                return false;
+            }
+            text = GetFunctionAsText(scriptIndex, lineNumber);
+            type = "function";
+        }
+        break;
+    case ValueTag_Table:
+    case ValueTag_PagedTable:
+        if (!AddTable(item, reader, tag, text, type))
+        {
+            return false;
+        }
+        break;
+    case ValueTag_TableRef:
+        if (!GetValueAsText(reader, tag, text, type))
+        {
+            return false;
+        }
+        break;
+    case ValueTag_Values:
+        {
+
+            unsigned int count;
+
+            if (!reader.ReadVarint(count))
+            {
+                return false;
+            }
+
+            for (unsigned int i = 0; i < count; ++i)
+            {
+
+                wxTreeItemId child = AppendItem(item, wxString::Format("%d", i + 1));
+                SetItemFont(child, m_valueFont);
+
+                wxString value;
+
+                if (!reader.ReadTag(tag) || !AddValue(child, reader, tag, value))
+                {
+                    return false;
+                }
+
+                if (!text.IsEmpty())
+                {
+                    text += ", ";
+                }
+
+                text += value;
+
+            }
+
+        }
+        break;
+    default:
+        return false;
+    }
+
+    SetItemValue(item, text, type);
+    return true;
+
+}
+
+bool WatchCtrl::AddTable(wxTreeItemId item, ValueReader& reader, ValueTag tag, wxString& text, wxString& type)
+{
+
+    const int maxElements = 4;
+
+    std::string typeName;
+    unsigned int start;
+
+    if (!reader.ReadType(typeName))
+    {
+        return false;
+    }
+
+    if (tag == ValueTag_PagedTable && !reader.ReadVarint(start))
+    {
+        return false;
+    }
+
+    ValueTag tableTag = tag;
+
+    type = typeName.c_str();
+    text = "{";
+
+    // Add the elements of the table as tree children as they're read.
+
+    int numElements = 0;
+
+    while (reader.ReadTag(tag) && tag != ValueTag_End)
+    {
+
+        wxString key;
+        wxString keyType;
+
+        ValueTag dataTag;
+
+        if (!GetValueAsText(reader, tag, key, keyType) || !reader.ReadTag(dataTag))
+        {
+            return false;
+        }
+
+        wxTreeItemId child = AppendItem(item, key);
+        SetItemFont(child, m_valueFont);
+
+        wxString value;
+
+        if (!AddValue(child, reader, dataTag, value))
+        {
+            return false;
+        }
+
+        if (numElements < maxElements)
+        {
+            text += key + "=" + value + " ";
+        }
+        else if (numElements == maxElements)
+        {
+            text += "...";
+        }
+
+        ++numElements;
+
+    }
+
+    if (!reader.GetIsValid())
+    {
+        return false;
+    }
+
+    if (tableTag == ValueTag_PagedTable)
+    {
+
+        unsigned int handle;
+
+        if (!reader.ReadVarint(handle))
+        {
+            return false;
+        }
+
+        // The elements that weren't sent aren't shown since there's no way to
+        // request them yet, which is why the frontend mustn't ask for
+        // Capability_PagedTables (see Protocol.h).
+        if (handle != 0 && numElements <= maxElements)
+        {
+            text += "...";
+        }
+
+    }
+
+    text += "}";
+    return true;
+
+}
+
 void WatchCtrl::UpdateItem(wxTreeItemId item)
 {
 
@@ -249,27 +447,43 @@ void WatchCtrl::UpdateItem(wxTreeItemId item)
     {
 
         wxString expression = GetItemText(item);
-        wxString result;
+        std::string result;
 
         if (!expression.empty())
         {
-            std::string temp;
-            DebugFrontend::Get().Evaluate(m_vm, expression, m_stackLevel, temp);
-            result = temp.c_str();
+            DebugFrontend::Get().Evaluate(m_vm, expression, m_stackLevel, result);
         }
 
         DeleteChildren(item);
         SetItemFont(item, m_valueFont);
 
-        if (result.IsEmpty())
+        if (result.empty())
         {
             SetItemText(item, 1, "");
             SetItemText(item, 2, "");
         }
+        else if (ValueReader::GetIsValueStream(result.c_str(), result.length()))
+        {
+
+            // The value is decoded straight into the tree as it's read.
+
+            ValueReader reader(result.c_str(), result.length());
+
+            ValueTag tag;
+            wxString text;
+
+            if (!reader.ReadTag(tag) || !AddValue(item, reader, tag, text))
+            {
+                DeleteChildren(item);
+                SetItemText(item, 1, "Improperly formatted value data");
+                SetItemText(item, 2, "");
+            }
+
+        }
         else
         {
 
-            wxStringInputStream stream(result);
+            wxStringInputStream stream(result.c_str());
             wxXmlDocument document;
 
             wxLogNull logNo;
@@ -472,23 +686,216 @@ wxString WatchCtrl::GetNodeAsText(wxXmlNode* node, wxString& type)
                 child = child->GetNext();
             }
 
-            text = "function";
+            text = GetFunctionAsText(scriptIndex, lineNumber);
+            type = "function";
 
-            DebugFrontend::Script* script = DebugFrontend::Get().GetScript(scriptIndex);
+        }
+    }
+    
+    return text;
+
+}
 
-            if (script != NULL)
+wxString WatchCtrl::GetFunctionAsText(unsigned int scriptIndex, unsigned int lineNumber)
+{
+
+    wxString text = "function";
+
+    DebugFrontend::Script* script = DebugFrontend::Get().GetScript(scriptIndex);
+
+    if (script != NULL)
+    {
+        text += " defined at ";
+        text += script->name;
+        text += ":";
+        text += wxString::Format("%d", lineNumber + 1);
+    }
+
+    return text;
+
+}
+
+bool WatchCtrl::GetValueAsText(ValueReader& reader, ValueTag tag, wxString& text, wxString& type)
+{
+
+    const int maxElements = 4;
+
+    std::string data;
+
+    text.Clear();
+
+    switch (tag)
+    {
+    case ValueTag_Value:
+        {
+            std::string typeName;
+            if (!reader.ReadType(typeName) || !reader.ReadString(data))
             {
-                text += " defined at ";
-                text += script->name;
-                text += ":";
-                text += wxString::Format("%d", lineNumber + 1);
+                return false;
             }
-
+            text = wxString(data.c_str(), data.length());
+            type = typeName.c_str();
+        }
+        return true;
+    case ValueTag_Error:
+        if (!reader.ReadString(data))
+        {
+            return false;
+        }
+        text = data.c_str();
+        return true;
+    case ValueTag_Function:
+        {
+            unsigned int scriptIndex;
+            unsigned int lineNumber;
+            if (!reader.ReadVarint(scriptIndex) || !reader.ReadVarint(lineNumber))
+            {
+                return false;
+            }
+            text = GetFunctionAsText(scriptIndex, lineNumber);
             type = "function";
+        }
+        return true;
+    case ValueTag_TableRef:
+        {
+
+            // The table was already written earlier in the value, so we
+            // don't repeat its elements.
+
+            std::string typeName;
+            unsigned int table;
+
+            if (!reader.ReadType(typeName) || !reader.ReadVarint(table))
+            {
+                return false;
+            }
+
+            text = "{...} (shown above)";
+            type = typeName.c_str();
 
         }
+        return true;
+    case ValueTag_Table:
+    case ValueTag_PagedTable:
+        {
+
+            std::string typeName;
+            unsigned int start;
+
+            if (!reader.ReadType(typeName))
+            {
+                return false;
+            }
+
+            if (tag == ValueTag_PagedTable && !reader.ReadVarint(start))
+            {
+                return false;
+            }
+
+            ValueTag tableTag = tag;
+
+            text = "{";
+
+            int numElements = 0;
+
+            while (reader.ReadTag(tag) && tag != ValueTag_End)
+            {
+
+                ValueTag dataTag;
+
+                if (numElements < maxElements)
+                {
+
+                    wxString key;
+                    wxString value;
+                    wxString dummy;
+
+                    if (!GetValueAsText(reader, tag, key, dummy) || !reader.ReadTag(dataTag) ||
+                        !GetValueAsText(reader, dataTag, value, dummy))
+                    {
+                        return false;
+                    }
+
+                    text += key + "=" + value + " ";
+
+                }
+                else
+                {
+
+                    // Only the first few elements are displayed, so the rest
+                    // don't need to be decoded.
+
+                    if (numElements == maxElements)
+                    {
+                        text += "...";
+                    }
+
+                    if (!reader.SkipValue(tag) || !reader.ReadTag(dataTag) || !reader.SkipValue(dataTag))
+                    {
+                        return false;
+                    }
+
+                }
+
+                ++numElements;
+
+            }
+
+            if (tableTag == ValueTag_PagedTable)
+            {
+
+                unsigned int handle;
+
+                if (!reader.ReadVarint(handle))
+                {
+                    return false;
+                }
+
+                if (handle != 0 && numElements <= maxElements)
+                {
+                    text += "...";
+                }
+
+            }
+
+            text += "}";
+            return reader.GetIsValid();
+
+        }
+    case ValueTag_Values:
+        {
+
+            unsigned int count;
+
+            if (!reader.ReadVarint(count))
+            {
+                return false;
+            }
+
+            for (unsigned int i = 0; i < count; ++i)
+            {
+
+                wxString value;
+                wxString dummy;
+
+                if (!reader.ReadTag(tag) || !GetValueAsText(reader, tag, value, dummy))
+                {
+                    return false;
+                }
+
+                if (!text.IsEmpty())
+                {
+                    text += ", ";
+                }
+
+                text += value;
+
+            }
+
+        }
+        return true;
+    default:
+        return false;
     }
-    
-    return text;
 
 }
@@ -25,6 +25,7 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <wx/wx.h>
 #include "treelistctrl.h"
+#include "ValueStream.h"
 
 //
 // Forward declarations.
@@ -50,6 +51,14 @@ public:
      */
     bool AddCompoundExpression(wxTreeItemId parent, wxXmlNode* node);
 
+    /**
+     * Reads a value in the binary form from the stream and adds it to the
+     * specified item in the tree, with the elements of tables as subitems.
+     * The tag for the value has already been read. On return text holds the
+     * value collapsed into a single line.
+     */
+    bool AddValue(wxTreeItemId item, ValueReader& reader, ValueTag tag, wxString& text);
+
     /**
      * Updates the value for the express in the index spot in the list.
      */
@@ -82,6 +91,13 @@ public:
 
     static wxString GetTableAsText(wxXmlNode* root);
 
+    /**
+     * Reads a value in the binary form from the stream and collapses it
+     * into a single line of text. The tag for the value has already been
+     * read.
+     */
+    static bool GetValueAsText(ValueReader& reader, ValueTag tag, wxString& text, wxString& type);
+
     DECLARE_EVENT_TABLE()
 
 private:
@@ -104,6 +120,23 @@ private:
      */
     void UpdateFont(wxTreeItemId item);
 
+    /**
+     * Sets the value and type columns for an item.
+     */
+    void SetItemValue(wxTreeItemId item, const wxString& value, const wxString& type);
+
+    /**
+     * Reads the rest of a table from the stream, adding its elements as
+     * subitems of the specified item. Only the elements that were sent are
+     * added if the table was paged.
+     */
+    bool AddTable(wxTreeItemId item, ValueReader& reader, ValueTag tag, wxString& text, wxString& type);
+
+    /**
+     * Gets the text displayed for a function value.
+     */
+    static wxString GetFunctionAsText(unsigned int scriptIndex, unsigned int lineNumber);
+
 private:
 
     float                       m_columnSize[s_numColumns];
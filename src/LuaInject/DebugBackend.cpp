@@ -28,12 +28,19 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 #include "StlUtility.h"
 #include "XmlUtility.h"
 #include "DebugHelp.h"
+#include "ScriptSource.h"
+#include "ContentHash.h"
+#include "ValidLines.h"
+#include "ValueStream.h"
+#include "RingTransport.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <algorithm>
 #include <sstream>
 
 DebugBackend* DebugBackend::s_instance = NULL;
+char DebugBackend::s_universeKey = 0;
 
 extern HINSTANCE g_hInstance;
 
@@ -69,57 +76,49 @@ const char* MemoryReader(lua_State* L, void* data, size_t* size)
 
 bool DebugBackend::Script::GetHasBreakPoint(unsigned int line) const
 {
-    
-    for (size_t i = 0; i < breakpoints.size(); i++)
-    {
-        if(breakpoints[i] == line)
-        {
-            return true;
-        }
-    }
-    
-    return false;
+    return breakpoints.GetHasBreakpoint(line);
 }
 
 bool DebugBackend::Script::HasBreakPointInRange(unsigned int start, unsigned int end) const
 {
-    
-    for (size_t i = 0; i < breakpoints.size(); i++)
-    {
-        if(breakpoints[i] >= start && breakpoints[i] < end)
-        {
-            return true;
-        }
-    }
-    
-    return false;
+    return breakpoints.GetHasBreakpointInRange(start, end);
 }
 
 bool DebugBackend::Script::ToggleBreakpoint(unsigned int line)
 {
+    return breakpoints.Toggle(line);
+}
+
+void DebugBackend::Script::ClearBreakpoints()
+{
+    breakpoints.Clear();
+}
+
+bool DebugBackend::Script::HasBreakpointsActive()
+{
+  return breakpoints.GetNumBreakpoints() != 0;
+}
 
-    std::vector<unsigned int>::iterator result = std::find(breakpoints.begin(), breakpoints.end(), line);
+bool DebugBackend::Script::GetValidLine(unsigned int& line) const
+{
 
-    if (result == breakpoints.end())
+    // If we don't have the source, we don't know which lines are valid so the
+    // line is used as is.
+    if (validLines.empty())
     {
-        breakpoints.push_back(line);
         return true;
     }
-    else
+
+    std::vector<unsigned int>::const_iterator validLine = std::lower_bound(validLines.begin(), validLines.end(), line);
+
+    if (validLine == validLines.end())
     {
-        breakpoints.erase(result);
         return false;
     }
-}
 
-void DebugBackend::Script::ClearBreakpoints()
-{
-    breakpoints.resize(0);
-}
+    line = *validLine;
+    return true;
 
-bool DebugBackend::Script::HasBreakpointsActive()
-{
-  return breakpoints.size() != 0;
 }
 
 DebugBackend& DebugBackend::Get()
@@ -146,6 +145,22 @@ DebugBackend::DebugBackend()
     m_mode                  = Mode_Continue;
     m_log                   = NULL;
     m_warnedAboutUserData   = false;
+    m_sourceEncoding        = SourceEncoding_Raw;
+    m_sendSourceEncoding    = false;
+    m_protocolVersion       = ProtocolVersion_Legacy;
+    m_capabilities          = 0;
+    m_useLoadFilter         = false;
+    m_sendWaitForLoad       = false;
+    m_hookCacheIndex        = TlsAlloc();
+    m_vmGeneration          = 0;
+    m_scriptGeneration      = 0;
+    m_loadGeneration        = 0;
+    m_breakpointGeneration  = 0;
+    m_numBreakpoints        = 0;
+    m_logTimer              = NULL;
+
+    memset(m_functionCache, 0, sizeof(m_functionCache));
+    memset(m_scriptCache, 0, sizeof(m_scriptCache));
 }
 
 DebugBackend::~DebugBackend()
@@ -157,6 +172,9 @@ DebugBackend::~DebugBackend()
         Message("Warning 1000: Lua functions were not found during debugging session", MessageType_Warning);
     }
 
+    StopLogTimer();
+    FlushLogBuffers();
+
     if (m_log != NULL)
     {
         fclose(m_log);
@@ -197,6 +215,17 @@ DebugBackend::~DebugBackend()
 
     m_scripts.clear();
     m_nameToScript.clear();
+    m_sourceIndex.Clear();
+
+    if (m_hookCacheIndex != TLS_OUT_OF_INDEXES)
+    {
+        ThreadDetach();
+        TlsFree(m_hookCacheIndex);
+        m_hookCacheIndex = TLS_OUT_OF_INDEXES;
+    }
+
+    // Any output left after the timer was stopped has been sent.
+    ClearVector(m_logBuffers);
 
 }
 
@@ -292,8 +321,10 @@ bool DebugBackend::Initialize(HINSTANCE hInstance)
 
     // Give the front end the address of our Initialize function so that
     // it can call it once we're done loading.
+    m_eventChannel.BeginMessage();
     m_eventChannel.WriteUInt32(EventId_Initialize);
     m_eventChannel.WriteUInt32(reinterpret_cast<unsigned int>(FinishInitialize));
+    m_eventChannel.EndMessage();
     m_eventChannel.Flush();
 
     return true;
@@ -331,21 +362,35 @@ DebugBackend::VirtualMachine* DebugBackend::AttachState(unsigned long api, lua_S
     vm->lastStepLine        = -2;
     vm->lastStepScript      = -1;
     vm->api                 = api;
+    vm->universe            = NULL;
     vm->stackTop            = 0;
+    vm->stackDepth          = 0;
     vm->luaJitWorkAround    = false;
-    vm->breakpointInStack   = true;// Force the stack tobe checked when the first script is entered
+    vm->numBreakpointFrames = 0;
+    vm->breakpointFramesValid = false;// Force the stack to be checked when the first script is entered
+    vm->breakpointFramesScriptGeneration = 0;
+    vm->breakpointFramesBreakpointGeneration = 0;
     vm->haveActiveBreakpoints = false;
+    vm->stopped             = false;
+    vm->environment         = LUA_NOREF;
+    vm->environmentStackLevel = 0;
     
     m_vms.push_back(vm);
     m_stateToVm.insert(std::make_pair(L, vm));
    
     if (!lua_checkstack_dll(api, L, 3))
     {
+        vm->haveActiveBreakpoints = GetHaveActiveBreakpoints();
         return NULL;
     }
 
+    vm->universe = GetUniverse(api, L);
+    vm->haveActiveBreakpoints = GetUniverseHasBreakpoints(vm->universe);
+
+    m_eventChannel.BeginMessage();
     m_eventChannel.WriteUInt32(EventId_CreateVM);
     m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
+    m_eventChannel.EndMessage();
     m_eventChannel.Flush();
 
     // Register the debug API.
@@ -408,23 +453,44 @@ void DebugBackend::DetachState(unsigned long api, lua_State* L)
     if (stateIterator != m_stateToVm.end())
     {
 
+        m_eventChannel.BeginMessage();
         m_eventChannel.WriteUInt32(EventId_DestroyVM);
         m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
+        m_eventChannel.EndMessage();
         m_eventChannel.Flush();
 
         m_stateToVm.erase(stateIterator);
     
     }
 
-    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    lua_State* universe = NULL;
+
+    unsigned int i = 0;
+
+    while (i < m_vms.size())
     {
         VirtualMachine* vm = m_vms[i];
         if (vm->L == L)
         {
+            universe = vm->universe;
+            // Invalidate the hook caches that could be pointing at the vm.
+            InterlockedIncrement(&m_vmGeneration);
             CloseHandle(vm->hThread);
             delete vm;
             m_vms.erase(m_vms.begin() + i);
         }
+        else
+        {
+            ++i;
+        }
+    }
+
+    // The universe is identified by its first thread, so once that's gone the
+    // state is being closed and its address could be reused by a new one.
+
+    if (universe != NULL && universe == L)
+    {
+        RemoveUniverse(universe);
     }
 
 }
@@ -441,7 +507,9 @@ int DebugBackend::PostLoadScript(unsigned long api, int result, lua_State* L, co
 
     // Register the script before dealing with errors, since the front end has enough
     // information to display the error.
-    if (RegisterScript(L, source, size, name, false) != -1)
+    int scriptIndex = RegisterScript(L, source, size, name, false);
+
+    if (scriptIndex != -1)
     {
         registered = true;
     }
@@ -462,58 +530,25 @@ int DebugBackend::PostLoadScript(unsigned long api, int result, lua_State* L, co
             SendBreakEvent(api, L, 1);
 
             // Send an error event.
+            m_eventChannel.BeginMessage();
             m_eventChannel.WriteUInt32(EventId_LoadError);
             m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
             m_eventChannel.WriteString(message);
+            m_eventChannel.EndMessage();
             m_eventChannel.Flush();
         
         }
 
         // Wait for the front-end to tell use to continue.
-        WaitForContinue();
-
-    }
-    /*
-    else
-    {
-
-        // Get the valid line numbers for placing breakpoints for this script.
-
-        lua_Debug ar;
-        lua_pushvalue_dll(L, -1);
-        
-        if (lua_getinfo_dll(L, ">L", &ar))
-        {
-
-            int lineTable = lua_gettop_dll(L);
+        WaitForContinue(api, L);
 
-            lua_pushnil_dll(L);
-            while (lua_next_dll(L, lineTable) != 0)
-            {
-
-                int lineNumber = lua_tointeger_dll(L, -2);
-                script->validLines.push_back(lineNumber);
-
-                lua_pop_dll(L, 1);
-
-            }
-
-            // Pop the line table.
-            lua_pop_dll(L, 1);
-
-        }
-
-        // Sort the valid line numbers for easier/faster processing.
-        std::sort(script->validLines.begin(), script->validLines.end());
-        
     }
-    */
 
     if (registered)
     {
         // Stop execution so that the frontend has an opportunity to send us the break points
         // before we start executing the first line of the script.
-        WaitForEvent(m_loadEvent);
+        WaitForLoad(scriptIndex);
     }
 
     return result;
@@ -525,6 +560,11 @@ int DebugBackend::RegisterScript(lua_State* L, const char* source, size_t size,
 
     CriticalSectionLock lock(m_criticalSection);
 
+    // A load can reuse the address of a source string that was garbage
+    // collected, so the source name to script mapping cached by address is
+    // now suspect.
+    ++m_loadGeneration;
+
     bool freeName = false;
 
     // If no name was specified, use the source as the name. This is similar to what
@@ -542,8 +582,12 @@ int DebugBackend::RegisterScript(lua_State* L, const char* source, size_t size,
     // Check that we haven't already assigned this script an index. That happens
     // if the same script is loaded twice by the application.
 
-    if (GetScriptIndex(name) != -1)
+    int existingIndex = GetScriptIndex(name);
+
+    if (existingIndex != -1)
     {
+        InvalidateBreakpointCaches(existingIndex);
+        AddScriptUniverse(existingIndex, L);
         if (freeName)
         {
             delete [] name;
@@ -558,38 +602,54 @@ int DebugBackend::RegisterScript(lua_State* L, const char* source, size_t size,
     std::string title;
     GetFileTitle(name, title);
 
-    for (unsigned int i = 0; i < m_scripts.size(); ++i)
-    {   
-        if (m_scripts[i]->title == title)
+    if (source == NULL)
+    {
+        size = 0;
+    }
+
+    // Look up scripts with the same contents by hash rather than comparing
+    // against the source of every script with the same title.
+    unsigned long long hash = GetContentHash(source, size);
+
+    int duplicateIndex = m_sourceIndex.Find(title, source, size, hash);
+
+    if (duplicateIndex != -1)
+    {
+        // Record the script index under this other name.
+        m_nameToScript.insert(std::make_pair(name, duplicateIndex));
+        InvalidateBreakpointCaches(duplicateIndex);
+        AddScriptUniverse(duplicateIndex, L);
+        if (freeName)
         {
-            // Check that the source matches.
-            if (m_scripts[i]->source == std::string(source, size))
-            {
-                // Record the script index under this other name.
-                m_nameToScript.insert(std::make_pair(name, i));
-                if (freeName)
-                {
-                    delete [] name;
-                    name = NULL;
-                }
-                return -1;
-            }
+            delete [] name;
+            name = NULL;
         }
+        return -1;
     }
     
     Script* script = new Script;
     script->name    = name;
     script->title   = title;
+    script->isFile  = name[0] == '@';
+    script->hash    = hash;
+    script->waitForLoad = GetShouldWaitForLoad(script);
 
-    if (size > 0 && source != NULL)
+    if (size > 0)
     {
-        script->source = std::string(source, size);
+        script->source.assign(source, size);
     }
     
     unsigned int scriptIndex = m_scripts.size();
     m_scripts.push_back(script);
 
+    // The functions in the new script may have been cached as not having
+    // breakpoints under an address that's been reused.
+    ++m_scriptGeneration;
+
     m_nameToScript.insert(std::make_pair(name, scriptIndex));
+    m_sourceIndex.Insert(scriptIndex, script->title, script->source, hash);
+
+    AddScriptUniverse(scriptIndex, L);
 
     std::string fileName;
 
@@ -633,12 +693,35 @@ int DebugBackend::RegisterScript(lua_State* L, const char* source, size_t size,
         }
     }
 
+    // Find the lines breakpoints can be placed on so that they can be moved off
+    // of blank lines and comments, where they would never be hit.
+    if (state == CodeState_Normal && !script->source.empty())
+    {
+        GetValidLines(script->source.data(), script->source.size(), script->validLines);
+    }
+
+    m_eventChannel.BeginMessage();
     m_eventChannel.WriteUInt32(EventId_LoadScript);
     m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
     m_eventChannel.WriteString(fileName);
-    m_eventChannel.WriteString(script->source);
+
+    if (m_sendSourceEncoding)
+    {
+        WriteScriptSource(script, m_sourceEncoding);
+    }
+    else
+    {
+        m_eventChannel.WriteString(script->source);
+    }
 
     m_eventChannel.WriteUInt32(state);
+
+    if (m_sendWaitForLoad)
+    {
+        m_eventChannel.WriteBool(script->waitForLoad);
+    }
+
+    m_eventChannel.EndMessage();
     m_eventChannel.Flush();
 
     if (freeName)
@@ -673,171 +756,455 @@ int DebugBackend::RegisterScript(unsigned long api, lua_State* L, lua_Debug* ar)
     {
         // Stop execution so that the frontend has an opportunity to send us the break points
         // before we start executing the first line of the script.
-        WaitForEvent(m_loadEvent);
+        WaitForLoad(scriptIndex);
     }
   
     m_criticalSection.Enter();
   
     // Since the script indices may have changed while we released the critical section,
     // require the script index.
-    return GetScriptIndex(arsource);
+    return GetScriptIndexForSource(arsource);
+}
+
+void DebugBackend::SetVmName(lua_State* L, const char* name)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    StateToVmMap::iterator iterator = m_stateToVm.find(L);
+
+    if (iterator != m_stateToVm.end())
+    {
+        UpdateVmName(iterator->second, name != NULL ? name : "");
+    }
+
+}
+
+void DebugBackend::UpdateVmName(VirtualMachine* vm, const char* name)
+{
+    if (name != vm->name)
+    {
+        vm->name = name;
+        m_eventChannel.BeginMessage();
+        m_eventChannel.WriteUInt32(EventId_NameVM);
+        m_eventChannel.WriteUInt32(reinterpret_cast<int>(vm->L));
+        m_eventChannel.WriteString(vm->name);
+        m_eventChannel.EndMessage();
+        m_eventChannel.Flush();
+    }
+}
+
+void DebugBackend::PollVmName(unsigned long api, lua_State* L, VirtualMachine* vm)
+{
+
+    lua_rawgetglobal_dll(api, L, "decoda_name");
+    const char* name = lua_tostring_dll(api, L, -1);
+
+    // Only a string means the script is using the global; otherwise leave
+    // any name set with decoda.set_vm_name alone.
+    if (name != NULL)
+    {
+        UpdateVmName(vm, name);
+    }
+
+    lua_pop_dll(api, L, 1);
+
 }
 
 void DebugBackend::Message(const char* message, MessageType type)
 {
     // Send a message.
+    m_eventChannel.BeginMessage();
     m_eventChannel.WriteUInt32(EventId_Message);
     m_eventChannel.WriteUInt32(0);
     m_eventChannel.WriteUInt32(type);
     m_eventChannel.WriteString(message);
+    m_eventChannel.EndMessage();
     m_eventChannel.Flush();
 }
 
-void DebugBackend::HookCallback(unsigned long api, lua_State* L, lua_Debug* ar)
+void DebugBackend::Handshake(unsigned int handshake)
 {
 
-    m_criticalSection.Enter(); 
-   
-    if (!lua_checkstack_dll(api, L, 2))
-    {
-        m_criticalSection.Exit();
-        return;
-    }
-
-    // Note this executes in the thread of the script being debugged,
-    // not our debugger, so we can block.
-
-    VirtualMachine* vm = NULL;
-    StateToVmMap::const_iterator iterator = m_stateToVm.find(L);
+    RingTransport* ring = NULL;
 
-    if (iterator == m_stateToVm.end())
-    {
-        // If somehow a thread was started without us intercepting the
-        // lua_newthread call, we can reach this point. If so, attach
-        // to the VM.
-        vm = AttachState(api, L);
-    }
-    else
     {
-        vm = iterator->second;
-    }
 
-    assert(vm->api == api);
+        // Hold the critical section so that every load event sent after the
+        // handshake event uses the formats we agree on here.
+        CriticalSectionLock lock(m_criticalSection);
 
-    if (!vm->initialized && GetEvent(api, ar) == LUA_HOOKLINE)
-    {
-            
-        // We do this initialization work here since we check for things that
-        // are registered after the state is created.
+        NegotiateHandshake(handshake, s_capabilities, m_protocolVersion, m_capabilities);
 
-        // Check if we need to use the LuaJIT work around for the debug API.
+        // The ring has to exist before the frontend sees the handshake event,
+        // since that's when it tries to connect to it.
+        if (m_capabilities & Capability_RingTransport)
+        {
 
-        lua_rawgetglobal_dll(api, L, "jit");
-        int jitTable = lua_gettop_dll(api, L);
+            char eventChannelName[256];
+            _snprintf(eventChannelName, 256, "Decoda.Event.%x", GetCurrentProcessId());
 
-        if (!lua_isnil_dll(api, L, -1))
-        {
-            
-            lua_pushstring_dll(api, L, "version_num");
-            lua_gettable_dll(api, L, jitTable);
+            ring = new RingTransport;
 
-            int version = lua_tointeger_dll(api, L, -1);
-            if (version >= 20000)
+            if (!ring->Create(eventChannelName))
             {
-                vm->luaJitWorkAround = true;
-                Message("Warning 1009: Enabling LuaJIT C call return work-around", MessageType_Warning);
+                delete ring;
+                ring = NULL;
+                m_capabilities &= ~Capability_RingTransport;
             }
 
-            lua_pop_dll(api, L, 1);
+        }
 
+        // Pick the cheapest way to send sources that the frontend understands.
+        SourceEncoding encoding = GetSourceEncoding(m_capabilities);
+
+        if (encoding != SourceEncoding_Raw)
+        {
+            m_sourceEncoding     = encoding;
+            m_sendSourceEncoding = true;
         }
 
-        lua_pop_dll(api, L, 1);
+        // Loads keep waiting for the frontend until it sends a filter, but the
+        // frontend needs to know when we're waiting from here on.
+        if (m_capabilities & Capability_LoadFilter)
+        {
+            m_sendWaitForLoad = true;
+        }
 
-        vm->initialized = true;
+        m_eventChannel.BeginMessage();
+        m_eventChannel.WriteUInt32(EventId_Handshake);
+        m_eventChannel.WriteUInt32(PackHandshake(m_protocolVersion, m_capabilities));
+        m_eventChannel.EndMessage();
+        m_eventChannel.Flush();
 
     }
 
-    // Get the name of the VM. Polling like this is pretty excessive since the
-    // name won't change often, but it's the easiest way and works fine.
+    if (ring != NULL)
+    {
 
-    lua_rawgetglobal_dll(api, L, "decoda_name");
-    const char* name = lua_tostring_dll(api, L, -1);
+        // Wait without holding the critical section since the VMs keep
+        // sending events over the pipe until the frontend connects. If it
+        // never does we just stay on the pipe.
+        if (ring->WaitForConnection(s_ringConnectTimeout))
+        {
+            m_eventChannel.SwitchTransport(ring);
+        }
+        else
+        {
+            ring->Destroy();
+            delete ring;
+        }
 
-    if (name == NULL)
-    {
-        name = "";
     }
 
-    if (name != vm->name)
+}
+
+void DebugBackend::SetSourceEncoding(SourceEncoding encoding)
+{
+
+    if (encoding != SourceEncoding_Lz && encoding != SourceEncoding_Hash)
     {
-        vm->name = name;
-        m_eventChannel.WriteUInt32(EventId_NameVM);
-        m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
-        m_eventChannel.WriteString(vm->name);
+        encoding = SourceEncoding_Raw;
     }
 
-    lua_pop_dll(api, L, 1);
+    // Load events are sent while holding the critical section, so holding it
+    // here means every load event after the acknowledgement has the new format.
+    CriticalSectionLock lock(m_criticalSection);
 
-    // Log for debugging.
-    //LogHookEvent(api, L, ar);
+    m_sourceEncoding     = encoding;
+    m_sendSourceEncoding = true;
 
-    //Only try to downgrade the hook when the debugger is not stepping   
-    if(m_mode == Mode_Continue)
-    {
-        UpdateHookMode(api, L, ar);
-    }
-    else
+    m_eventChannel.BeginMessage();
+    m_eventChannel.WriteUInt32(EventId_SourceEncoding);
+    m_eventChannel.WriteUInt32(encoding);
+    m_eventChannel.EndMessage();
+    m_eventChannel.Flush();
+
+}
+
+void DebugBackend::SetLoadFilter(const std::vector<std::string>& titles)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    m_loadFilter.clear();
+
+    for (unsigned int i = 0; i < titles.size(); ++i)
     {
-        if(GetHookMode(api, L) != HookMode_Full)
-        {
-            SetHookMode(api, L, HookMode_Full);
-        }
-        
-        //Force UpdateHookMode to recheck the call stack for functions with breakpoints when switching back to Mode_Continue
-        vm->breakpointInStack = true;
+        m_loadFilter.insert(GetLoadFilterKey(titles[i]));
     }
 
-    int arevent = GetEvent(api, ar);
-    if (arevent == LUA_HOOKLINE)
-    {
+    m_useLoadFilter   = true;
+    m_sendWaitForLoad = true;
 
-        // Fill in the rest of the structure.
-        lua_getinfo_dll(api, L, "Sl", ar);
-        const char* arsource = GetSource(api, ar);
-        int scriptIndex = GetScriptIndex(arsource);
+    m_eventChannel.BeginMessage();
+    m_eventChannel.WriteUInt32(EventId_LoadFilter);
+    m_eventChannel.EndMessage();
+    m_eventChannel.Flush();
 
-        if (scriptIndex == -1)
-        {
-            // This isn't a script we've seen before, so tell the debugger about it.
-            scriptIndex = RegisterScript( api, L, ar);
-        }
+}
 
-        bool stop = false;
-        bool onLastStepLine = false;
+void DebugBackend::WaitForLoad(int scriptIndex)
+{
 
-        //Keep updating onLastStepLine even if the mode is Mode_Continue if were still on the same line so we don't trigger
-        if (vm->luaJitWorkAround)
-        {    
-            int stackDepth = GetStackDepth(api, L);
+    bool wait;
 
-            //We will get multiple line events for the same line in LuaJIT if there are only calls to C functions on the line 
-            if (vm->lastStepLine == GetCurrentLine(api, ar))
+    {
+        CriticalSectionLock lock(m_criticalSection);
+        wait = m_scripts[scriptIndex]->waitForLoad;
+    }
+
+    if (wait)
+    {
+        WaitForEvent(m_loadEvent);
+    }
+
+}
+
+bool DebugBackend::GetShouldWaitForLoad(const Script* script) const
+{
+
+    if (!m_useLoadFilter)
+    {
+        return true;
+    }
+
+    // A script that isn't a file can't have had breakpoints set in it yet.
+    if (!script->isFile)
+    {
+        return false;
+    }
+
+    return m_loadFilter.find(GetLoadFilterKey(script->title)) != m_loadFilter.end();
+
+}
+
+std::string DebugBackend::GetLoadFilterKey(const std::string& title)
+{
+    // File names aren't case sensitive on Windows.
+    std::string key = title;
+    std::transform(key.begin(), key.end(), key.begin(), tolower);
+    return key;
+}
+
+void DebugBackend::SendScriptSource(unsigned int scriptIndex)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    if (scriptIndex >= m_scripts.size())
+    {
+        return;
+    }
+
+    m_eventChannel.BeginMessage();
+    m_eventChannel.WriteUInt32(EventId_ScriptSource);
+    m_eventChannel.WriteUInt32(scriptIndex);
+    WriteScriptSource(m_scripts[scriptIndex], SourceEncoding_Lz);
+    m_eventChannel.EndMessage();
+    m_eventChannel.Flush();
+
+}
+
+void DebugBackend::WriteScriptSource(const Script* script, SourceEncoding encoding)
+{
+    ::WriteScriptSource(m_eventChannel, script->source, script->hash, script->isFile, encoding);
+}
+
+void DebugBackend::HookCallback(unsigned long api, lua_State* L, lua_Debug* ar)
+{
+
+    // Fast path for when nothing in this VM can cause a break. This doesn't
+    // take the critical section so that VMs running on different threads
+    // don't serialize on it when there's nothing to debug.
+
+    VirtualMachine* vm = GetCachedVm(L);
+
+    FastPathHook hook;
+    hook.backend = this;
+    hook.api     = api;
+    hook.L       = L;
+    hook.vm      = vm;
+
+    if (RunHookFastPath(vm, hook))
+    {
+        return;
+    }
+
+    m_criticalSection.Enter(); 
+   
+    if (!lua_checkstack_dll(api, L, 2))
+    {
+        m_criticalSection.Exit();
+        return;
+    }
+
+    // Note this executes in the thread of the script being debugged,
+    // not our debugger, so we can block.
+
+    StateToVmMap::const_iterator iterator = m_stateToVm.find(L);
+
+    if (iterator == m_stateToVm.end())
+    {
+        // If somehow a thread was started without us intercepting the
+        // lua_newthread call, we can reach this point. If so, attach
+        // to the VM.
+        vm = AttachState(api, L);
+    }
+    else
+    {
+        vm = iterator->second;
+    }
+
+    SetCachedVm(L, vm);
+
+    assert(vm->api == api);
+
+    if (!vm->initialized && GetEvent(api, ar) == LUA_HOOKLINE)
+    {
+            
+        // We do this initialization work here since we check for things that
+        // are registered after the state is created.
+
+        // Check if we need to use the LuaJIT work around for the debug API.
+
+        lua_rawgetglobal_dll(api, L, "jit");
+        int jitTable = lua_gettop_dll(api, L);
+
+        if (!lua_isnil_dll(api, L, -1))
+        {
+            
+            lua_pushstring_dll(api, L, "version_num");
+            lua_gettable_dll(api, L, jitTable);
+
+            int version = lua_tointeger_dll(api, L, -1);
+            if (version >= 20000)
             {
-                onLastStepLine = vm->lastStepScript == scriptIndex && vm->callStackDepth != 0 && stackDepth == vm->callStackDepth;
+                vm->luaJitWorkAround = true;
+                Message("Warning 1009: Enabling LuaJIT C call return work-around", MessageType_Warning);
             }
-            
-            // If we're stepping on each line or we just stepped out of a function that
-            // we were stepping over, break.
-            if (m_mode == Mode_StepOver && vm->callStackDepth > 0)
+
+            lua_pop_dll(api, L, 1);
+
+        }
+
+        lua_pop_dll(api, L, 1);
+
+        vm->initialized = true;
+
+    }
+
+    // Fill in the source information for calls and returns. This is the only
+    // lua_getinfo for those events; UpdateHookMode uses the same result.
+
+    if (GetIsHookEventCall(api, GetEvent(api, ar)) || GetIsHookEventRet(api, GetEvent(api, ar)))
+    {
+
+        lua_getinfo_dll(api, L, "S", ar);
+
+        // Scripts can name the VM with decoda.set_vm_name, but older scripts set
+        // the decoda_name global instead. Checking that on every event would be a
+        // lot of overhead, so it's only done when a main chunk is entered or left
+        // since that's where the global is usually set.
+        if (GetLineDefined(api, ar) == 0)
+        {
+            PollVmName(api, L, vm);
+        }
+
+    }
+
+    // Keep a running count of the stack depth so that the LuaJIT work-around
+    // doesn't need to walk the stack on line events. Returns from C functions
+    // and frames unwound by an error aren't reported, so this is only used as
+    // a hint for GetStackDepth. Tail calls in Lua 5.2 replace the current
+    // frame, so they don't change the depth.
+
+    if (vm->luaJitWorkAround)
+    {
+        int event = GetEvent(api, ar);
+        if (event == LUA_HOOKCALL)
+        {
+            ++vm->stackDepth;
+        }
+        else if (GetIsHookEventRet(api, event) && vm->stackDepth > 0)
+        {
+            --vm->stackDepth;
+        }
+    }
+
+    // Log for debugging.
+    //LogHookEvent(api, L, ar);
+
+    //Only try to downgrade the hook when the debugger is not stepping   
+    if(m_mode == Mode_Continue)
+    {
+        UpdateHookMode(api, L, ar);
+    }
+    else
+    {
+        if(GetHookMode(api, L) != HookMode_Full)
+        {
+            SetHookMode(api, L, HookMode_Full);
+        }
+        
+        //Force UpdateHookMode to recheck the call stack for functions with breakpoints when switching back to Mode_Continue
+        vm->breakpointFramesValid = false;
+    }
+
+    int arevent = GetEvent(api, ar);
+    if (arevent == LUA_HOOKLINE)
+    {
+
+        // Fill in the rest of the structure.
+        lua_getinfo_dll(api, L, "Sl", ar);
+        const char* arsource = GetSource(api, ar);
+        int scriptIndex = GetScriptIndexForSource(arsource);
+
+        if (scriptIndex == -1)
+        {
+            // This isn't a script we've seen before, so tell the debugger about it.
+            scriptIndex = RegisterScript( api, L, ar);
+        }
+
+        bool stop = false;
+        bool checkCondition = false;
+        bool onLastStepLine = false;
+
+        //Keep updating onLastStepLine even if the mode is Mode_Continue if were still on the same line so we don't trigger
+        if (vm->luaJitWorkAround)
+        {    
+
+            //We will get multiple line events for the same line in LuaJIT if there are only calls to C functions on the line 
+            bool checkLastStepLine = vm->callStackDepth != 0 && vm->lastStepLine == GetCurrentLine(api, ar) && vm->lastStepScript == scriptIndex;
+            bool checkStepOver     = m_mode == Mode_StepOver && vm->callStackDepth > 0;
+
+            // The depth is only needed when stepping or when we're back on the
+            // line we last stopped on, so don't look at the stack otherwise.
+            if (checkLastStepLine || checkStepOver)
             {
-                if (stackDepth < vm->callStackDepth || (stackDepth == vm->callStackDepth && !onLastStepLine))
+
+                int stackDepth = GetStackDepth(api, L, vm->stackDepth);
+                vm->stackDepth = stackDepth;
+
+                if (checkLastStepLine)
+                {
+                    onLastStepLine = stackDepth == vm->callStackDepth;
+                }
+            
+                // If we're stepping on each line or we just stepped out of a function that
+                // we were stepping over, break.
+                if (checkStepOver)
                 {
-                    // We've returned to the level when the function was called.
-                    vm->callCount       = 0;   
-                    vm->callStackDepth  = 0;
+                    if (stackDepth < vm->callStackDepth || (stackDepth == vm->callStackDepth && !onLastStepLine))
+                    {
+                        // We've returned to the level when the function was called.
+                        vm->callCount       = 0;   
+                        vm->callStackDepth  = 0;
+                    }
                 }
+
             }
+
         }
 
         if (scriptIndex != -1)
@@ -846,6 +1213,7 @@ void DebugBackend::HookCallback(unsigned long api, lua_State* L, lua_Debug* ar)
             if (!onLastStepLine && m_scripts[scriptIndex]->GetHasBreakPoint(GetCurrentLine(api, ar) - 1))
             {
                 stop = true;
+                checkCondition = !m_scripts[scriptIndex]->conditions.empty();
             }
         } 
         
@@ -853,19 +1221,35 @@ void DebugBackend::HookCallback(unsigned long api, lua_State* L, lua_Debug* ar)
         if (!onLastStepLine && (m_mode == Mode_StepInto || (m_mode == Mode_StepOver && vm->callCount == 0)))
         {
             stop = true;
+            checkCondition = false;
         }
        
         // We need to exit the critical section before waiting so that we don't
         // monopolize it.
         m_criticalSection.Exit();
 
+        // Conditions are checked here rather than in the frontend so that a
+        // breakpoint in a loop doesn't stop execution every time around.
+        if (checkCondition)
+        {
+            stop = GetBreakpointConditionMet(api, L, vm, scriptIndex, GetCurrentLine(api, ar) - 1);
+        }
+
         if (stop)
         {
+
+            // Send any logpoint output first so that it's shown before the break.
+            if (m_logTimer != NULL)
+            {
+                FlushLogBuffers();
+            }
+
             BreakFromScript(api, L);
             
             if(vm->luaJitWorkAround)
             {
-                vm->callStackDepth = GetStackDepth(api, L);
+                vm->callStackDepth = GetStackDepth(api, L, vm->stackDepth);
+                vm->stackDepth = vm->callStackDepth;
                 vm->lastStepLine = GetCurrentLine(api, ar);
                 vm->lastStepScript = scriptIndex;
             }
@@ -898,1755 +1282,3675 @@ void DebugBackend::HookCallback(unsigned long api, lua_State* L, lua_Debug* ar)
 
 }
 
-void DebugBackend::UpdateHookMode(unsigned long api, lua_State* L, lua_Debug* hookEvent)
+DebugBackend::VirtualMachine* DebugBackend::GetCachedVm(lua_State* L) const
 {
-    int arevent = GetEvent(api, hookEvent);
-    //Only update the hook mode for call or return hook events 
-    if (arevent == LUA_HOOKLINE)
+
+    const HookCache* cache = static_cast<const HookCache*>(TlsGetValue(m_hookCacheIndex));
+    VirtualMachine* vm = NULL;
+
+    if (GetHookCacheHit(cache, L, static_cast<unsigned int>(m_vmGeneration), vm))
     {
-        return;
+        return vm;
     }
 
-    VirtualMachine* vm = GetVm(L);
-    HookMode mode = HookMode_CallsOnly;
-
-    // Populate the line number and source name debug fields
-    lua_getinfo_dll(api, L, "S", hookEvent);
-    int linedefined = GetLineDefined(api, hookEvent);
+    return NULL;
 
-    if( GetIsHookEventCall( api, arevent) && linedefined != -1)
-    {
-        vm->lastFunctions = GetSource(api, hookEvent);
+}
 
-        int scriptIndex = GetScriptIndex(vm->lastFunctions.c_str());
+bool DebugBackend::FastPathHook::GetIsContinuing() const
+{
+    return backend->m_mode == Mode_Continue;
+}
 
-        if (scriptIndex == -1)
-        {
-            RegisterScript(api, L, hookEvent);
-            scriptIndex = GetScriptIndex(vm->lastFunctions.c_str());
-        }
+void DebugBackend::FastPathHook::TurnOff()
+{
+    // This is what UpdateHookMode would end up doing.
+    SetHookMode(api, L, HookMode_None);
+    vm->breakpointFramesValid = false;
+}
 
-        Script* script = scriptIndex != -1 ? m_scripts[scriptIndex] : NULL;
+void DebugBackend::FastPathHook::TurnOn()
+{
+    SetHookMode(api, L, HookMode_Full);
+}
 
-        int lastlinedefined = GetLastLineDefined( api, hookEvent);
-        if(script != NULL && (script->HasBreakPointInRange(linedefined, lastlinedefined) ||
-           //Check if the function is the top level chunk of a script because they always have there lastlinedefined set to 0                  
-           (script->HasBreakpointsActive() && linedefined == 0 && lastlinedefined == 0)))
-        {
-            mode = HookMode_Full;
-            vm->breakpointInStack = true;
-        }
-    }
+void DebugBackend::SetCachedVm(lua_State* L, VirtualMachine* vm)
+{
 
-    //Keep the hook in Full mode while theres a function in the stack somewhere that has a breakpoint in it
-    if(mode != HookMode_Full && vm->breakpointInStack)
+    if (m_hookCacheIndex == TLS_OUT_OF_INDEXES || vm == NULL)
     {
-      if(StackHasBreakpoint(api, L))
-      {
-          mode = HookMode_Full;
-      }
-      else
-      {
-          vm->breakpointInStack = false;
-      }
+        return;
     }
 
-    HookMode currentMode = GetHookMode(api, L);
+    HookCache* cache = GetHookCache();
 
-    if(!vm->haveActiveBreakpoints)
+    if (cache == NULL)
     {
-        mode = HookMode_None;
+        return;
     }
 
-    if(currentMode != mode)
-    {
-        //Always switch to Full hook mode when stepping
-        if(m_mode != Mode_Continue)
-        {
-            mode = HookMode_Full;
-        }
-        SetHookMode(api, L, mode);
-    }
+    cache->L            = L;
+    cache->vm           = vm;
+    cache->vmGeneration = static_cast<unsigned int>(m_vmGeneration);
+
 }
 
-bool DebugBackend::StackHasBreakpoint(unsigned long api, lua_State* L)
+void DebugBackend::ThreadDetach()
 {
-    
-    lua_Debug functionInfo;
-    VirtualMachine* vm = GetVm(L);
 
-    for(int stackIndex = 0; lua_getstack_dll(api, L, stackIndex, &functionInfo) ;stackIndex++)
+    if (m_hookCacheIndex == TLS_OUT_OF_INDEXES)
     {
-        lua_getinfo_dll(api, L, "S", &functionInfo);
-
-        int linedefined = GetLineDefined( api, &functionInfo);
-        if (linedefined == -1)
-        {
-            //ignore c functions
-            continue;
-        }
+        return;
+    }
 
-        vm->lastFunctions = GetSource( api, &functionInfo);
+    HookCache* cache = static_cast<HookCache*>(TlsGetValue(m_hookCacheIndex));
 
-        int scriptIndex = GetScriptIndex(vm->lastFunctions.c_str());
-        
-        Script* script = scriptIndex != -1 ? m_scripts[scriptIndex] : NULL;
+    if (cache != NULL)
+    {
 
-        int lastlinedefined = GetLastLineDefined( api, &functionInfo);
-        if(script != NULL && (script->HasBreakPointInRange(linedefined, lastlinedefined) ||
-           //Check if the function is the top level chunk of a source file                       
-           (script->HasBreakpointsActive() && linedefined == 0 && lastlinedefined == 0)))
+        // We can't send the thread's logpoint output from here since we're
+        // holding the loader lock, so the log timer sends and deletes it.
+        if (cache->logBuffer != NULL)
         {
-            return true;
+            CriticalSectionLock lock(m_logBuffersLock);
+            cache->logBuffer->orphaned = true;
         }
 
+        delete cache;
+        TlsSetValue(m_hookCacheIndex, NULL);
+
     }
 
-    return false;            
 }
 
-int DebugBackend::GetScriptIndex(const char* name) const
+DebugBackend::HookCache* DebugBackend::GetHookCache()
 {
-    if (name == NULL) 
+
+    if (m_hookCacheIndex == TLS_OUT_OF_INDEXES)
     {
-        return -1;
+        return NULL;
     }
 
-    NameToScriptMap::const_iterator iterator = m_nameToScript.find(name);
+    HookCache* cache = static_cast<HookCache*>(TlsGetValue(m_hookCacheIndex));
 
-    if (iterator == m_nameToScript.end())
+    if (cache == NULL)
     {
-        return -1;
+        cache = new HookCache;
+        cache->L            = NULL;
+        cache->vm           = NULL;
+        cache->vmGeneration = 0;
+        cache->logBuffer    = NULL;
+        TlsSetValue(m_hookCacheIndex, cache);
     }
 
-    return iterator->second;
-
-}
-
-void DebugBackend::WaitForContinue()
-{
-    // Wait until the UI to tell us to step to the next line.
-    WaitForEvent(m_stepEvent);
-}
-
-void DebugBackend::WaitForEvent(HANDLE hEvent)
-{
-    HANDLE hEvents[] = { hEvent, m_detachEvent };
-    WaitForMultipleObjects(2, hEvents, FALSE, INFINITE);
-}
+    return cache;
 
-bool DebugBackend::GetIsAttached() const
-{
-    return WaitForSingleObject(m_detachEvent, 0) != WAIT_OBJECT_0;
 }
 
-void DebugBackend::CommandThreadProc()
+void DebugBackend::WriteLog(const std::string& message)
 {
 
-    unsigned int commandId;
+    HookCache* cache = GetHookCache();
 
-    bool continueRunning = false;
+    if (cache == NULL)
+    {
+        std::string text = message;
+        SendLog(text);
+        return;
+    }
 
-    while (m_commandChannel.ReadUInt32(commandId))
+    if (cache->logBuffer == NULL)
     {
 
-        if (commandId == CommandId_Detach)
-        {
-            
-            m_commandChannel.ReadBool(continueRunning);
+        cache->logBuffer = new LogBuffer;
+        cache->logBuffer->orphaned = false;
 
-            // Detach the hook function from all of the script virtual machines.
+        CriticalSectionLock lock(m_logBuffersLock);
+        m_logBuffers.push_back(cache->logBuffer);
 
-            CriticalSectionLock lock(m_criticalSection);
+    }
 
-            for (unsigned int i = 0; i < m_vms.size(); ++i)
-            {
-                SetHookMode(m_vms[i]->api, m_vms[i]->L, HookMode_None);
-            }
+    std::string text;
 
-            // Signal that we're detached.
-            SetEvent(m_detachEvent);
+    {
 
-            // Note, we don't remove the vms here since they will be removed when
-            // lua_close is called by the host.
+        LogBuffer* buffer = cache->logBuffer;
+        CriticalSectionLock lock(buffer->criticalSection);
 
-            // If we're supposed to continue running the application after detaching,
-            // set the step event so that we don't stay broken forever.
-            if (continueRunning)
-            {
-                SetEvent(m_stepEvent);
-                SetEvent(m_loadEvent);
-            }
-            else
-            {
-                break;
-            }
-            
-        }
-        else if (commandId == CommandId_IgnoreException)
+        buffer->text += message;
+        buffer->text += '\n';
+
+        if (buffer->text.size() >= s_logBufferSize)
         {
-            std::string message;
-            m_commandChannel.ReadString(message);
-            IgnoreException(message);
+            text.swap(buffer->text);
         }
-        else
-        {
 
-            unsigned int vm;
-            m_commandChannel.ReadUInt32(vm);
+    }
 
-            lua_State* L = reinterpret_cast<lua_State*>(vm);
+    if (!text.empty())
+    {
+        SendLog(text);
+    }
 
-            switch (commandId)
-            {
-            case CommandId_Continue:
-                Continue();
-                break;
-            case CommandId_StepOver:
-                StepOver();
-                break;
-            case CommandId_StepInto:
-                StepInto();
-                break;
-            case CommandId_DeleteAllBreakpoints:
-                DeleteAllBreakpoints();
-                break;
-            case CommandId_ToggleBreakpoint:
-                {
-                    
-                    unsigned int scriptIndex;
-                    unsigned int line;
+}
 
-                    m_commandChannel.ReadUInt32(scriptIndex);
-                    m_commandChannel.ReadUInt32(line);
-                    
-                    ToggleBreakpoint(L, scriptIndex, line);
-                
-                }
-                break;
-            case CommandId_Break:
-                Break();
-                break;
-            case CommandId_Evaluate:
-                {
+void DebugBackend::FlushLogBuffers()
+{
 
-                    std::string expression;
-                    m_commandChannel.ReadString(expression);
-                    
-                    unsigned int stackLevel;
-                    m_commandChannel.ReadUInt32(stackLevel);
+    std::string text;
 
-                    unsigned long api = GetApiForVm(L);
+    {
 
-                    std::string result;
-                    bool success = false;
+        CriticalSectionLock lock(m_logBuffersLock);
 
-                    if (api != -1)
-                    {
-                        success = Evaluate(api, L, expression, stackLevel, result);
-                    }
-                    
-                    m_commandChannel.WriteUInt32(success);
-                    m_commandChannel.WriteString(result);
-                    m_commandChannel.Flush();
+        unsigned int i = 0;
 
-                }
-                break;
-            case CommandId_LoadDone:
-                SetEvent(m_loadEvent);
-                break;
+        while (i < m_logBuffers.size())
+        {
+
+            LogBuffer* buffer = m_logBuffers[i];
 
+            {
+                CriticalSectionLock bufferLock(buffer->criticalSection);
+                text += buffer->text;
+                buffer->text.clear();
+            }
+
+            if (buffer->orphaned)
+            {
+                delete buffer;
+                m_logBuffers.erase(m_logBuffers.begin() + i);
+            }
+            else
+            {
+                ++i;
             }
 
         }
 
     }
 
-    // Cleanup.
+    if (!text.empty())
+    {
+        SendLog(text);
+    }
 
-    m_classInfos.clear();
+}
 
-    for (unsigned int i = 0; i < m_scripts.size(); ++i)
+void DebugBackend::SendLog(std::string& text)
+{
+
+    // Each line ends with a newline, but the frontend adds its own to a message.
+    if (!text.empty() && text[text.size() - 1] == '\n')
     {
-        delete m_scripts[i];
+        text.erase(text.size() - 1);
     }
 
-    m_nameToScript.clear();
-
-    m_scripts.clear();
-    ClearVector(m_vms);
-    m_stateToVm.clear();
+    CriticalSectionLock lock(m_criticalSection);
+    Message(text.c_str(), MessageType_Normal);
 
-    m_eventChannel.Destroy();
-    m_commandChannel.Destroy();
-    
 }
 
-DWORD WINAPI DebugBackend::StaticCommandThreadProc(LPVOID param)
+VOID CALLBACK DebugBackend::StaticLogTimerProc(PVOID param, BOOLEAN timerOrWaitFired)
 {
     DebugBackend* self = static_cast<DebugBackend*>(param);
-    self->CommandThreadProc();
-    return 0;
+    self->FlushLogBuffers();
 }
 
-void DebugBackend::ActiveLuaHookInAllVms()
+void DebugBackend::StopLogTimer()
 {
-    StateToVmMap::iterator end = m_stateToVm.end();
-
-    for (StateToVmMap::iterator it = m_stateToVm.begin(); it != end; it++)
+    if (m_logTimer != NULL)
     {
-      VirtualMachine* vm = it->second;
-      //May have issues with L not being the currently running thread
-      SetHookMode(vm->api, vm->L, HookMode_Full);
+        DeleteTimerQueueTimer(NULL, m_logTimer, INVALID_HANDLE_VALUE);
+        m_logTimer = NULL;
     }
 }
 
-void DebugBackend::StepInto()
+void DebugBackend::UpdateHookMode(unsigned long api, lua_State* L, lua_Debug* hookEvent)
 {
-    
-    CriticalSectionLock lock(m_criticalSection);
-    
-    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    int arevent = GetEvent(api, hookEvent);
+    //Only update the hook mode for call or return hook events 
+    if (!GetIsHookEventCall(api, arevent) && !GetIsHookEventRet(api, arevent))
     {
-        m_vms[i]->callCount = 0;
+        return;
     }
 
-    m_mode = Mode_StepInto;
-    SetEvent(m_stepEvent);
+    VirtualMachine* vm = GetVm(L);
 
-    ActiveLuaHookInAllVms();
-}
+    // The line number and source name debug fields were filled in by HookCallback.
+    const char* source = GetSource(api, hookEvent);
+    int linedefined = GetLineDefined(api, hookEvent);
 
-void DebugBackend::StepOver()
-{
+    // Loading a script or changing a breakpoint can give a function that's
+    // already on the stack a breakpoint, so the shadow stack has to be rebuilt.
+    bool rebuilt = false;
 
-    CriticalSectionLock lock(m_criticalSection);
-    
-    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    if (!vm->breakpointFramesValid ||
+        vm->breakpointFramesScriptGeneration != m_scriptGeneration ||
+        vm->breakpointFramesBreakpointGeneration != m_breakpointGeneration)
     {
-        m_vms[i]->callCount = 0;
+        RebuildBreakpointFrames(api, L, vm);
+        rebuilt = true;
     }
 
-    m_mode = Mode_StepOver;
-    SetEvent(m_stepEvent);
+    // C functions never have breakpoints, and LuaJIT doesn't tell us when they
+    // return, so they're left out of the shadow stack.
+    if (linedefined != -1)
+    {
+        if (GetIsHookEventCall(api, arevent))
+        {
+            // A rebuilt stack already includes the function being called.
+            if (!rebuilt)
+            {
 
-    ActiveLuaHookInAllVms();
-}
+                bool hasBreakpoint = GetFunctionHasBreakpoint(api, L, hookEvent, true);
 
+                // If there are no functions with breakpoints on the stack, we only need
+                // to keep track of functions from here up.
+                if (hasBreakpoint || vm->numBreakpointFrames > 0)
+                {
 
-void DebugBackend::Continue()
-{
-    
-    CriticalSectionLock lock(m_criticalSection);
-    
-    for (unsigned int i = 0; i < m_vms.size(); ++i)
-    {
-        m_vms[i]->callCount = 0;
-    }
+                    BreakpointFrame frame;
+                    frame.source        = source;
+                    frame.lineDefined   = linedefined;
+                    frame.hasBreakpoint = hasBreakpoint;
 
-    m_mode = Mode_Continue;
-    SetEvent(m_stepEvent);
+                    vm->breakpointFrames.push_back(frame);
 
-}
+                    if (hasBreakpoint)
+                    {
+                        ++vm->numBreakpointFrames;
+                    }
 
-void DebugBackend::Break()
-{
-    m_mode = Mode_StepInto;
-    ActiveLuaHookInAllVms();
-}
+                }
 
-void DebugBackend::ToggleBreakpoint(lua_State* L, unsigned int scriptIndex, unsigned int line)
-{
+            }
+        }
+        else if (arevent == LUA_HOOKRET)
+        {
+            // Lua 5.1 also sends LUA_HOOKTAILRET for functions that made tail calls,
+            // but those are removed when the function below them returns.
+            PopBreakpointFrame(vm, source, linedefined);
+        }
+    }
 
-    assert(GetIsLuaLoaded());
+    // Registering a script while checking the function for a breakpoint changes
+    // the generation, but that doesn't affect the functions already on the stack.
+    vm->breakpointFramesScriptGeneration = m_scriptGeneration;
 
-    CriticalSectionLock lock(m_criticalSection);
+    //Keep the hook in Full mode while theres a function in the stack somewhere that has a breakpoint in it
+    HookMode mode = HookMode_CallsOnly;
 
-    Script* script = m_scripts[scriptIndex];
+    if (vm->numBreakpointFrames > 0)
+    {
+        mode = HookMode_Full;
+    }
 
-    // Move the line to the next line after the one the user specified that is
-    // valid for a breakpoint.
+    HookMode currentMode = GetHookMode(api, L);
 
-    bool foundValidLine = true;
+    if(!vm->haveActiveBreakpoints)
+    {
+        // We won't see the calls and returns while the hook is off.
+        mode = HookMode_None;
+        vm->breakpointFramesValid = false;
+    }
 
-    // Disabled since right now we are only generating valid lines at file scope.
-    /*
-    for (unsigned int i = 0; i < script->validLines.size() && !foundValidLine; ++i)
+    if(currentMode != mode)
     {
-        if (script->validLines[i] >= line)
+        //Always switch to Full hook mode when stepping
+        if(m_mode != Mode_Continue)
         {
-            line = script->validLines[i];
-            foundValidLine = true;
+            mode = HookMode_Full;
         }
+        SetHookMode(api, L, mode);
     }
-    */
+}
 
-    if (foundValidLine)
+void DebugBackend::RebuildBreakpointFrames(unsigned long api, lua_State* L, VirtualMachine* vm)
+{
+
+    vm->breakpointFrames.clear();
+    vm->numBreakpointFrames = 0;
+
+    lua_Debug functionInfo;
+
+    // The stack is walked from the top, so the frames are collected in reverse.
+    for (int stackIndex = 0; lua_getstack_dll(api, L, stackIndex, &functionInfo); ++stackIndex)
     {
-        
-        bool breakpointSet = script->ToggleBreakpoint(line);
 
-        if(breakpointSet)
-        {
-            BreakpointsActiveForScript(scriptIndex);
-        }
-        else
+        lua_getinfo_dll(api, L, "S", &functionInfo);
+
+        int linedefined = GetLineDefined(api, &functionInfo);
+        if (linedefined == -1)
         {
-            //Check to see if this was the last active breakpoint set if so switch back to fast mode
-            if(!GetHaveActiveBreakpoints())
-            {
-                for(StateToVmMap::iterator it = m_stateToVm.begin(); it != m_stateToVm.end(); it++)
-                {
-                    it->second->haveActiveBreakpoints = false;
-                }
-            }
+            //ignore c functions
+            continue;
         }
 
-        // Send back the event telling the frontend that we set/unset the breakpoint.
-        m_eventChannel.WriteUInt32(EventId_SetBreakpoint);    
-        m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));  
-        m_eventChannel.WriteUInt32(scriptIndex);
-        m_eventChannel.WriteUInt32(line);
-        m_eventChannel.WriteUInt32(breakpointSet);
-        m_eventChannel.Flush();
-    
-    }
+        BreakpointFrame frame;
+        frame.source        = GetSource(api, &functionInfo);
+        frame.lineDefined   = linedefined;
+        frame.hasBreakpoint = GetFunctionHasBreakpoint(api, L, &functionInfo, false);
 
-}
+        vm->breakpointFrames.push_back(frame);
 
-void DebugBackend::BreakpointsActiveForScript(int scriptIndex)
-{
-    //TODO this per VM
-    SetHaveActiveBreakpoints(true);
-}
+        if (frame.hasBreakpoint)
+        {
+            ++vm->numBreakpointFrames;
+        }
 
-bool DebugBackend::GetHaveActiveBreakpoints(){
+    }
 
-    for(std::vector<Script*>::iterator it = m_scripts.begin(); it != m_scripts.end(); it++)
+    // Drop the functions below the deepest one with a breakpoint.
+    while (!vm->breakpointFrames.empty() && !vm->breakpointFrames.back().hasBreakpoint)
     {
-        if((*it)->HasBreakpointsActive())
-        {
-            return true;
-        } 
+        vm->breakpointFrames.pop_back();
     }
 
-    return false;
+    std::reverse(vm->breakpointFrames.begin(), vm->breakpointFrames.end());
+
+    vm->breakpointFramesValid                   = true;
+    vm->breakpointFramesScriptGeneration        = m_scriptGeneration;
+    vm->breakpointFramesBreakpointGeneration    = m_breakpointGeneration;
+
 }
 
-void DebugBackend::SetHaveActiveBreakpoints(bool breakpointsActive)
+void DebugBackend::PopBreakpointFrame(VirtualMachine* vm, const char* source, int lineDefined) const
 {
 
-    //m_HookLock.Enter();
+    // Frames unwound by an error don't get return events, so there may be
+    // entries above the returning function. If the function isn't in the
+    // shadow stack at all, it's below the deepest function we're tracking,
+    // so everything we're tracking has returned.
 
-    for(StateToVmMap::iterator it = m_stateToVm.begin(); it != m_stateToVm.end(); it++)
+    size_t index = vm->breakpointFrames.size();
+
+    while (index > 0)
     {
-        it->second->haveActiveBreakpoints = breakpointsActive;
+        const BreakpointFrame& frame = vm->breakpointFrames[index - 1];
+        if (frame.source == source && frame.lineDefined == lineDefined)
+        {
+            break;
+        }
+        --index;
     }
-  
-    //We defer to UpdateHookMode to turn off the hook fully
-    if(breakpointsActive)
+
+    if (index > 0)
     {
-        ActiveLuaHookInAllVms();
+        --index;
     }
-}
 
-void DebugBackend::DeleteAllBreakpoints(){
-
-    for(std::vector<Script*>::iterator it = m_scripts.begin(); it != m_scripts.end(); it++)
+    for (size_t i = index; i < vm->breakpointFrames.size(); ++i)
     {
-        (*it)->breakpoints.clear();
+        if (vm->breakpointFrames[i].hasBreakpoint)
+        {
+            --vm->numBreakpointFrames;
+        }
     }
 
-    //Set all haveActiveBreakpoints for the vms back to false we leave to the hook being called for the vm
-    SetHaveActiveBreakpoints(false);
+    vm->breakpointFrames.resize(index);
+
 }
 
-void DebugBackend::SendBreakEvent(unsigned long api, lua_State* L, int stackTop)
+bool DebugBackend::GetFunctionHasBreakpoint(unsigned long api, lua_State* L, lua_Debug* ar, bool registerScript)
 {
 
-    CriticalSectionLock lock(m_criticalSection);
-
-    VirtualMachine* vm = GetVm(L);
-
-    // The C call stack will look something like this (may be any number of
-    // these stacked on top of each other):
-    //
-    //   +------+
-    //   |      | C function
-    //   +------+
-    //   |      |
-    //   | XXXX | Lua call mechanism (luaD_*, luaV_*, lua_*)
-    //   |      |
-    //   +------+
-    //   | XXXX | lua_call/lua_pcall/lua_load, etc.
-    //   +------+
-    //   |      |
-    //   |      | Pre-Lua code (main, etc.)
-    //   |      |
-    //   +------+
+    const char* source      = GetSource(api, ar);
+    int linedefined         = GetLineDefined(api, ar);
+    int lastlinedefined     = GetLastLineDefined(api, ar);
 
-    StackEntry nativeStack[100];
-    unsigned int nativeStackSize = 0;
+    // The source string is interned by Lua, so its address together with the
+    // line range identifies the function prototype. This saves looking up the
+    // script and its breakpoints on every call.
+    FunctionCacheEntry& entry = m_functionCache[GetFunctionCacheSlot(source, linedefined)];
 
-    if (vm != NULL)
-    {
-        // Remember how many stack levels to skip so when we evaluate we can adjust
-        // the stack level accordingly.
-        vm->stackTop = stackTop;
-        nativeStackSize = GetCStack(vm->hThread, nativeStack, 100);
-    }
-    else
+    if (source != NULL && entry.source == source &&
+        entry.lineDefined == linedefined && entry.lastLineDefined == lastlinedefined &&
+        entry.scriptGeneration == m_scriptGeneration && entry.breakpointGeneration == m_breakpointGeneration)
     {
-        // For whatever reason we couldn't remember how many stack levels we want to skip,
-        // so don't skip any. This shouldn't happen under any normal circumstance since
-        // the state should have a corresponding VM.
-        stackTop = 0;
+        return entry.hasBreakpoint;
     }
 
-    m_eventChannel.WriteUInt32(EventId_Break);
-    m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
-
-    // Send the call stack.
+    int scriptIndex = GetScriptIndexForSource(source);
 
-    lua_Debug scriptStack[s_maxStackSize];
-    unsigned int scriptStackSize = 0;
+    if (scriptIndex == -1 && registerScript)
+    {
+        RegisterScript(api, L, ar);
+        scriptIndex = GetScriptIndexForSource(source);
+    }
 
-    for (int level = stackTop; scriptStackSize < s_maxStackSize && lua_getstack_dll(api, L, level, &scriptStack[scriptStackSize]); ++level)
+    if (scriptIndex == -1)
     {
-        lua_getinfo_dll(api, L, "nSlu", &scriptStack[scriptStackSize]);
-        ++scriptStackSize;
+        return false;
     }
 
-    // Create a unified call stack.
-    StackEntry stack[s_maxStackSize];
-    unsigned int stackSize = GetUnifiedStack(api, nativeStack, nativeStackSize, scriptStack, scriptStackSize, stack);
+    Script* script = m_scripts[scriptIndex];
 
-    m_eventChannel.WriteUInt32(stackSize);
+    bool hasBreakpoint = script->HasBreakPointInRange(linedefined, lastlinedefined) ||
+        //Check if the function is the top level chunk of a script because they always have there lastlinedefined set to 0                  
+        (script->HasBreakpointsActive() && linedefined == 0 && lastlinedefined == 0);
 
-    for (unsigned int i = 0; i < stackSize; ++i)
-    {
-        unsigned int stackIndex = stackSize - i - 1;
-        m_eventChannel.WriteUInt32(stack[stackIndex].scriptIndex);
-        m_eventChannel.WriteUInt32(stack[stackIndex].line);
-        m_eventChannel.WriteString(stack[stackIndex].name);
-    }
+    entry.source                = source;
+    entry.lineDefined           = linedefined;
+    entry.lastLineDefined       = lastlinedefined;
+    entry.scriptGeneration      = m_scriptGeneration;
+    entry.breakpointGeneration  = m_breakpointGeneration;
+    entry.hasBreakpoint         = hasBreakpoint;
 
-    m_eventChannel.Flush();
+    return hasBreakpoint;
 
 }
 
-void DebugBackend::SendExceptionEvent(lua_State* L, const char* message)
+unsigned int DebugBackend::GetFunctionCacheSlot(const char* source, int lineDefined)
 {
-    m_eventChannel.WriteUInt32(EventId_Exception);
-    m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
-    m_eventChannel.WriteString(message);
-    m_eventChannel.Flush();
+    unsigned int hash = (reinterpret_cast<unsigned int>(source) >> 2) ^ (static_cast<unsigned int>(lineDefined) * 2654435761U);
+    return hash & (s_functionCacheSize - 1);
 }
 
-void DebugBackend::BreakFromScript(unsigned long api, lua_State* L)
+int DebugBackend::GetScriptIndex(const char* name) const
 {
-    CriticalSectionLock lock(m_breakLock);
-
-    SendBreakEvent(api, L);
-    WaitForContinue();        
-}
+    if (name == NULL) 
+    {
+        return -1;
+    }
 
-int DebugBackend::Call(unsigned long api, lua_State* L, int nargs, int nresults, int errorfunc)
-{
+    NameToScriptMap::const_iterator iterator = m_nameToScript.find(name);
 
-    // Check it's not our error handler that's getting called (happens when there's an
-    // error). We also need to check that our error handler is not the error function,
-    // since that can happen if one of the Lua interfaces we hooked calls another one
-    // internally.
-    if (lua_tocfunction_dll(api, L, -1) == StaticErrorHandler || (errorfunc != 0 && lua_tocfunction_dll(api, L, errorfunc) == StaticErrorHandler))
+    if (iterator == m_nameToScript.end())
     {
-        return lua_pcall_dll(api, L, nargs, nresults, errorfunc);
+        return -1;
     }
-    else
-    {
 
-        int result = 0;
+    return iterator->second;
 
-        if (lua_gettop_dll(api, L) >= nargs + 1)
-        {
-            
-            // Push our error handler onto the stack before the function and the arguments.
-            if (errorfunc != 0)
-            {
-                lua_pushvalue_dll(api, L, errorfunc);
-            }
-            else
-            {
-                lua_pushnil_dll(api, L);
-            }
-            lua_pushcclosure_dll(api, L, StaticErrorHandler, 1);
+}
 
-            int errorHandler = lua_gettop_dll(api, L) - (nargs + 1);
-            lua_insert_dll(api, L, errorHandler);
+int DebugBackend::GetScriptIndexForSource(const char* source)
+{
 
-            // Invoke the function
-            result = lua_pcall_dll(api, L, nargs, nresults, errorHandler);
+    if (source == NULL)
+    {
+        return -1;
+    }
 
-            // Remove our error handler from the stack.
-            lua_remove_dll(api, L, errorHandler);
-        
-        }
-        else
-        {
-            // In this case there wasn't a function on the top of the stack, so don't push our
-            // error handler there since it will get called instead.
-            result = lua_pcall_dll(api, L, nargs, nresults, errorfunc);
-        }
+    // Lua interns source names, so the same chunk always gives us the same
+    // pointer and we can usually skip hashing the whole string.
+    ScriptCacheEntry& entry = m_scriptCache[(reinterpret_cast<unsigned int>(source) >> 2) & (s_scriptCacheSize - 1)];
 
-        return result;
+    if (entry.source == source && entry.loadGeneration == m_loadGeneration)
+    {
+        return entry.scriptIndex;
+    }
+
+    int scriptIndex = GetScriptIndex(source);
 
+    if (scriptIndex != -1)
+    {
+        entry.source         = source;
+        entry.scriptIndex    = scriptIndex;
+        entry.loadGeneration = m_loadGeneration;
     }
 
-}
+    return scriptIndex;
 
-int DebugBackend::StaticErrorHandler(lua_State* L)
-{
-    unsigned long api = s_instance->GetApiForVm(L);
-    return s_instance->ErrorHandler(api, L);
 }
 
-int DebugBackend::ErrorHandler(unsigned long api, lua_State* L)
+void DebugBackend::InvalidateBreakpointCaches(unsigned int scriptIndex)
 {
 
-    int top = lua_gettop_dll(api, L);
-
-    // Get the error mesasge.
-    const char* message = lua_tostring_dll(api, L, -1);
-
-    if (message == NULL)
+    // Loading the code for a script again only matters to the cached
+    // breakpoint information if the code has breakpoints, since otherwise
+    // a stale entry can only claim a breakpoint that isn't there.
+    if (m_scripts[scriptIndex]->breakpoints.GetNumBreakpoints() > 0)
     {
-        message = "No error message available";
+        ++m_scriptGeneration;
     }
 
-    if (!GetIsExceptionIgnored(message))
+}
+
+void DebugBackend::WaitForContinue(unsigned long api, lua_State* L)
+{
+
     {
 
-        // Send the exception event. Ignore the top of the stack when we send the
-        // call stack since the top of the call stack is this function.
+        CriticalSectionLock lock(m_criticalSection);
 
-        // Sometimes the break lock will already be held.  For example, consider
-        // the following sequence of events:
-        //   1) The main lua thread is stopped in the debugger, holding the
-        //      break lock in DebugBackend::BreakFromScript.
-        //   2) The decoda thread tries to evaluate a variable from the watch
-        //      window
-        //   3) The evaluation of __towatch or __tostring calls lua_error()
-        // That will lead us right here, unable to grab the break lock.  To avoid
-        // deadlocking in this case, just send an error message.
+        VirtualMachine* vm = GetVm(L);
 
-        CriticalSectionTryLock lock(m_breakLock);
-        if (lock.IsHeld()) 
-        {
-            SendBreakEvent(api, L, 1);
-            SendExceptionEvent(L, message);
-            WaitForContinue();
-        } 
-        else 
+        if (vm != NULL)
         {
-            Message(message, MessageType_Error);
+            // Anything cached from the last time we stopped refers to stack
+            // levels that have changed since.
+            ReleaseBreakData(vm);
+            vm->stopped = true;
         }
 
     }
-        
-    // Try invoking the user specified error function.
 
-    lua_pushvalue_dll(api, L, lua_upvalueindex_dll(api, 1));
+    // Wait until the UI to tell us to step to the next line.
+    WaitForEvent(m_stepEvent);
 
-    if (!lua_isnil_dll(api, L, -1))
-    {
-        lua_pushvalue_dll(api, L, -2);
-        lua_pcall_dll(api, L, 1, 1, 0);
-    }
-    else
+    CriticalSectionLock lock(m_criticalSection);
+
+    VirtualMachine* vm = GetVm(L);
+
+    if (vm != NULL)
     {
-        lua_pop_dll(api, L, 1);
-        // Push the original message back as the return so that it will be available
-        // to custom error handlers.
-        lua_pushvalue_dll(api, L, -1);
+        vm->stopped = false;
+        ReleaseBreakData(vm);
     }
-        
-    return 1;
 
 }
 
-bool DebugBackend::GetStartupDirectory(char* path, int maxPathLength)
+void DebugBackend::WaitForEvent(HANDLE hEvent)
 {
+    HANDLE hEvents[] = { hEvent, m_detachEvent };
+    WaitForMultipleObjects(2, hEvents, FALSE, INFINITE);
+}
 
-    if (!GetModuleFileName(g_hInstance, path, maxPathLength))
-    {
-        return false;
-    }
+bool DebugBackend::GetIsAttached() const
+{
+    return WaitForSingleObject(m_detachEvent, 0) != WAIT_OBJECT_0;
+}
 
-    char* lastSlash = strrchr(path, '\\');
+void DebugBackend::CommandThreadProc()
+{
 
-    if (lastSlash == NULL)
-    {
-        return false;
-    }
+    unsigned int commandId;
 
-    // Terminate the path after the last slash.
+    bool continueRunning = false;
 
-    lastSlash[1] = 0;
-    return true;
+    while (m_commandChannel.ReadUInt32(commandId))
+    {
 
-}
+        if (commandId == CommandId_Detach)
+        {
+            
+            m_commandChannel.ReadBool(continueRunning);
 
-void DebugBackend::ChainTables(unsigned long api, lua_State* L, int child, int parent)
+            // Detach the hook function from all of the script virtual machines.
+
+            CriticalSectionLock lock(m_criticalSection);
+
+            for (unsigned int i = 0; i < m_vms.size(); ++i)
+            {
+                SetHookMode(m_vms[i]->api, m_vms[i]->L, HookMode_None);
+            }
+
+            // Signal that we're detached.
+            SetEvent(m_detachEvent);
+
+            // Note, we don't remove the vms here since they will be removed when
+            // lua_close is called by the host.
+
+            // If we're supposed to continue running the application after detaching,
+            // set the step event so that we don't stay broken forever.
+            if (continueRunning)
+            {
+                EndBreak();
+                SetEvent(m_stepEvent);
+                SetEvent(m_loadEvent);
+            }
+            else
+            {
+                break;
+            }
+            
+        }
+        else if (commandId == CommandId_IgnoreException)
+        {
+            std::string message;
+            m_commandChannel.ReadString(message);
+            IgnoreException(message);
+        }
+        else if (commandId == CommandId_Handshake)
+        {
+            unsigned int handshake;
+            m_commandChannel.ReadUInt32(handshake);
+            Handshake(handshake);
+        }
+        else if (commandId == CommandId_SetSourceEncoding)
+        {
+            unsigned int encoding;
+            m_commandChannel.ReadUInt32(encoding);
+            SetSourceEncoding(static_cast<SourceEncoding>(encoding));
+        }
+        else if (commandId == CommandId_SetLoadFilter)
+        {
+            unsigned int numTitles;
+            m_commandChannel.ReadUInt32(numTitles);
+            std::vector<std::string> titles(numTitles);
+            for (unsigned int i = 0; i < numTitles; ++i)
+            {
+                m_commandChannel.ReadString(titles[i]);
+            }
+            SetLoadFilter(titles);
+        }
+        else
+        {
+
+            unsigned int vm;
+            m_commandChannel.ReadUInt32(vm);
+
+            lua_State* L = reinterpret_cast<lua_State*>(vm);
+
+            switch (commandId)
+            {
+            case CommandId_Continue:
+                Continue();
+                break;
+            case CommandId_StepOver:
+                StepOver();
+                break;
+            case CommandId_StepInto:
+                StepInto();
+                break;
+            case CommandId_DeleteAllBreakpoints:
+                DeleteAllBreakpoints();
+                break;
+            case CommandId_ToggleBreakpoint:
+                {
+                    
+                    unsigned int scriptIndex;
+                    unsigned int line;
+
+                    m_commandChannel.ReadUInt32(scriptIndex);
+                    m_commandChannel.ReadUInt32(line);
+                    
+                    ToggleBreakpoint(L, scriptIndex, line);
+                
+                }
+                break;
+            case CommandId_SetBreakpointCondition:
+                {
+
+                    unsigned int scriptIndex;
+                    unsigned int line;
+                    std::string expression;
+                    unsigned int hitCount;
+
+                    m_commandChannel.ReadUInt32(scriptIndex);
+                    m_commandChannel.ReadUInt32(line);
+                    m_commandChannel.ReadString(expression);
+                    m_commandChannel.ReadUInt32(hitCount);
+
+                    SetBreakpointCondition(scriptIndex, line, expression, hitCount);
+
+                }
+                break;
+            case CommandId_SetLogpoint:
+                {
+
+                    unsigned int scriptIndex;
+                    unsigned int line;
+                    std::string message;
+
+                    m_commandChannel.ReadUInt32(scriptIndex);
+                    m_commandChannel.ReadUInt32(line);
+                    m_commandChannel.ReadString(message);
+
+                    SetLogpoint(scriptIndex, line, message);
+
+                }
+                break;
+            case CommandId_Break:
+                Break();
+                break;
+            case CommandId_Evaluate:
+                {
+
+                    std::string expression;
+                    m_commandChannel.ReadString(expression);
+                    
+                    unsigned int stackLevel;
+                    m_commandChannel.ReadUInt32(stackLevel);
+
+                    unsigned long api = GetApiForVm(L);
+
+                    std::string result;
+                    bool success = false;
+
+                    if (api != -1)
+                    {
+                        success = Evaluate(api, L, expression, stackLevel, GetReadOnlyEvaluate(), result);
+                    }
+                    
+                    m_commandChannel.WriteUInt32(success);
+                    m_commandChannel.WriteString(result);
+                    m_commandChannel.Flush();
+
+                }
+                break;
+            case CommandId_Execute:
+                {
+
+                    std::string expression;
+                    m_commandChannel.ReadString(expression);
+                    
+                    unsigned int stackLevel;
+                    m_commandChannel.ReadUInt32(stackLevel);
+
+                    unsigned long api = GetApiForVm(L);
+
+                    std::string result;
+                    bool success = false;
+
+                    if (api != -1)
+                    {
+                        success = Evaluate(api, L, expression, stackLevel, false, result);
+                    }
+                    
+                    m_commandChannel.WriteUInt32(success);
+                    m_commandChannel.WriteString(result);
+                    m_commandChannel.Flush();
+
+                }
+                break;
+            case CommandId_EvaluateAsync:
+                {
+
+                    unsigned int requestId;
+                    m_commandChannel.ReadUInt32(requestId);
+
+                    std::string expression;
+                    m_commandChannel.ReadString(expression);
+
+                    unsigned int stackLevel;
+                    m_commandChannel.ReadUInt32(stackLevel);
+
+                    WriteEvaluateResult(L, requestId, expression, stackLevel);
+                    m_eventChannel.Flush();
+
+                }
+                break;
+            case CommandId_EvaluateMany:
+                {
+
+                    unsigned int stackLevel;
+                    m_commandChannel.ReadUInt32(stackLevel);
+
+                    unsigned int numExpressions;
+                    m_commandChannel.ReadUInt32(numExpressions);
+
+                    std::string expression;
+
+                    // All of the results go to the frontend in a single flush.
+                    for (unsigned int i = 0; i < numExpressions; ++i)
+                    {
+                        unsigned int requestId;
+                        m_commandChannel.ReadUInt32(requestId);
+                        m_commandChannel.ReadString(expression);
+                        WriteEvaluateResult(L, requestId, expression, stackLevel);
+                    }
+
+                    m_eventChannel.Flush();
+
+                }
+                break;
+            case CommandId_ExpandTable:
+                {
+
+                    unsigned int handle;
+                    m_commandChannel.ReadUInt32(handle);
+
+                    unsigned int start;
+                    m_commandChannel.ReadUInt32(start);
+
+                    unsigned long api = GetApiForVm(L);
+
+                    std::string result;
+                    bool success = false;
+
+                    if (api != -1)
+                    {
+                        success = ExpandTable(api, L, handle, start, result);
+                    }
+
+                    m_commandChannel.WriteUInt32(success);
+                    m_commandChannel.WriteString(result);
+                    m_commandChannel.Flush();
+
+                }
+                break;
+            case CommandId_LoadDone:
+                SetEvent(m_loadEvent);
+                break;
+            case CommandId_RequestScriptSource:
+                {
+                    unsigned int scriptIndex;
+                    m_commandChannel.ReadUInt32(scriptIndex);
+                    SendScriptSource(scriptIndex);
+                }
+                break;
+
+            }
+
+        }
+
+    }
+
+    // Cleanup.
+
+    StopLogTimer();
+    FlushLogBuffers();
+
+    m_classInfos.clear();
+
+    for (unsigned int i = 0; i < m_scripts.size(); ++i)
+    {
+        delete m_scripts[i];
+    }
+
+    m_nameToScript.clear();
+    m_sourceIndex.Clear();
+
+    m_scripts.clear();
+    m_numBreakpoints = 0;
+    m_universeBreakpoints.clear();
+    m_unusedConditions.clear();
+    InterlockedIncrement(&m_vmGeneration);
+    ClearVector(m_vms);
+    m_stateToVm.clear();
+
+    m_eventChannel.Destroy();
+    m_commandChannel.Destroy();
+    
+}
+
+DWORD WINAPI DebugBackend::StaticCommandThreadProc(LPVOID param)
+{
+    DebugBackend* self = static_cast<DebugBackend*>(param);
+    self->CommandThreadProc();
+    return 0;
+}
+
+void DebugBackend::ActiveLuaHookInAllVms()
+{
+    StateToVmMap::iterator end = m_stateToVm.end();
+
+    for (StateToVmMap::iterator it = m_stateToVm.begin(); it != end; it++)
+    {
+      VirtualMachine* vm = it->second;
+      //May have issues with L not being the currently running thread
+      SetHookMode(vm->api, vm->L, HookMode_Full);
+    }
+}
+
+void DebugBackend::StepInto()
+{
+    
+    CriticalSectionLock lock(m_criticalSection);
+    
+    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    {
+        m_vms[i]->callCount = 0;
+    }
+
+    EndBreak();
+
+    m_mode = Mode_StepInto;
+    SetEvent(m_stepEvent);
+
+    ActiveLuaHookInAllVms();
+}
+
+void DebugBackend::StepOver()
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+    
+    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    {
+        m_vms[i]->callCount = 0;
+    }
+
+    EndBreak();
+
+    m_mode = Mode_StepOver;
+    SetEvent(m_stepEvent);
+
+    ActiveLuaHookInAllVms();
+}
+
+
+void DebugBackend::Continue()
+{
+    
+    CriticalSectionLock lock(m_criticalSection);
+    
+    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    {
+        m_vms[i]->callCount = 0;
+    }
+
+    EndBreak();
+
+    m_mode = Mode_Continue;
+    SetEvent(m_stepEvent);
+
+}
+
+void DebugBackend::Break()
+{
+    m_mode = Mode_StepInto;
+    ActiveLuaHookInAllVms();
+}
+
+void DebugBackend::ToggleBreakpoint(lua_State* L, unsigned int scriptIndex, unsigned int line)
+{
+
+    assert(GetIsLuaLoaded());
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    Script* script = m_scripts[scriptIndex];
+
+    // Move the line to the next line after the one the user specified that is
+    // valid for a breakpoint.
+
+    bool foundValidLine = script->GetValidLine(line);
+
+    if (foundValidLine)
+    {
+        
+        bool breakpointSet = script->ToggleBreakpoint(line);
+        ++m_breakpointGeneration;
+
+        if (!breakpointSet)
+        {
+            stdext::hash_map<unsigned int, BreakpointCondition>::iterator condition = script->conditions.find(line);
+            if (condition != script->conditions.end())
+            {
+                ReleaseBreakpointCondition(condition->second);
+                script->conditions.erase(condition);
+            }
+        }
+
+        // Only the universes that loaded the script need their hooks armed. If
+        // this was the last breakpoint for a universe, UpdateHookMode will switch
+        // its virtual machines back to fast mode.
+        int numBreakpoints = breakpointSet ? 1 : -1;
+        m_numBreakpoints += numBreakpoints;
+        AddScriptBreakpoints(script, numBreakpoints);
+
+        UpdateActiveBreakpoints();
+
+        // Send back the event telling the frontend that we set/unset the breakpoint.
+        m_eventChannel.BeginMessage();
+        m_eventChannel.WriteUInt32(EventId_SetBreakpoint);    
+        m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));  
+        m_eventChannel.WriteUInt32(scriptIndex);
+        m_eventChannel.WriteUInt32(line);
+        m_eventChannel.WriteUInt32(breakpointSet);
+        m_eventChannel.EndMessage();
+        m_eventChannel.Flush();
+    
+    }
+    else
+    {
+
+        // There's no code at or after the line, so the breakpoint could never
+        // be hit. Tell the frontend it isn't set so it doesn't display it.
+        m_eventChannel.BeginMessage();
+        m_eventChannel.WriteUInt32(EventId_SetBreakpoint);    
+        m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));  
+        m_eventChannel.WriteUInt32(scriptIndex);
+        m_eventChannel.WriteUInt32(line);
+        m_eventChannel.WriteUInt32(false);
+        m_eventChannel.EndMessage();
+        m_eventChannel.Flush();
+
+    }
+
+}
+
+void DebugBackend::SetBreakpointCondition(unsigned int scriptIndex, unsigned int line, const std::string& expression, unsigned int hitCount)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    if (scriptIndex >= m_scripts.size())
+    {
+        return;
+    }
+
+    Script* script = m_scripts[scriptIndex];
+
+    // The line is moved the same way it was when the breakpoint was set.
+    if (!script->GetValidLine(line) || !script->GetHasBreakPoint(line))
+    {
+        return;
+    }
+
+    BreakpointCondition& condition = script->conditions[line];
+
+    ReleaseBreakpointCondition(condition);
+
+    condition.expression    = expression;
+    condition.hitCount      = hitCount;
+    condition.numHits       = 0;
+
+    if (condition.expression.empty() && condition.hitCount == 0 && condition.logMessage.empty())
+    {
+        script->conditions.erase(line);
+    }
+
+}
+
+void DebugBackend::SetLogpoint(unsigned int scriptIndex, unsigned int line, const std::string& message)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    if (scriptIndex >= m_scripts.size())
+    {
+        return;
+    }
+
+    Script* script = m_scripts[scriptIndex];
+
+    // The line is moved the same way it was when the breakpoint was set.
+    if (!script->GetValidLine(line) || !script->GetHasBreakPoint(line))
+    {
+        return;
+    }
+
+    BreakpointCondition& condition = script->conditions[line];
+
+    // The message is compiled along with the condition.
+    ReleaseBreakpointCondition(condition);
+
+    condition.logMessage = message;
+
+    if (condition.expression.empty() && condition.hitCount == 0 && condition.logMessage.empty())
+    {
+        script->conditions.erase(line);
+        return;
+    }
+
+    if (!message.empty() && m_logTimer == NULL)
+    {
+        CreateTimerQueueTimer(&m_logTimer, NULL, StaticLogTimerProc, this, s_logFlushInterval, s_logFlushInterval, WT_EXECUTEDEFAULT);
+    }
+
+}
+
+bool DebugBackend::GetBreakpointConditionMet(unsigned long api, lua_State* L, VirtualMachine* vm, unsigned int scriptIndex, unsigned int line)
+{
+
+    // All of the threads in a universe share the registry, so the compiled
+    // condition can be too.
+    lua_State* universe = vm->universe != NULL ? vm->universe : L;
+
+    std::string expression;
+    std::string logMessage;
+    int function = LUA_NOREF;
+
+    {
+
+        CriticalSectionLock lock(m_criticalSection);
+
+        ReleaseUnusedConditions(api, L, universe);
+
+        Script* script = m_scripts[scriptIndex];
+        stdext::hash_map<unsigned int, BreakpointCondition>::const_iterator iterator = script->conditions.find(line);
+
+        if (iterator == script->conditions.end())
+        {
+            return true;
+        }
+
+        expression = iterator->second.expression;
+        logMessage = iterator->second.logMessage;
+
+        stdext::hash_map<lua_State*, int>::const_iterator functionIterator = iterator->second.functions.find(universe);
+
+        if (functionIterator != iterator->second.functions.end())
+        {
+            function = functionIterator->second;
+        }
+
+    }
+
+    bool conditionMet = true;
+    std::string message;
+    std::string error;
+
+    if ((!expression.empty() || !logMessage.empty()) && lua_checkstack_dll(api, L, 6))
+    {
+
+        int t1 = lua_gettop_dll(api, L);
+
+        // Disable the debugger hook so that we don't try to debug the expression.
+        SetHookMode(api, L, HookMode_None);
+        EnableIntercepts(false);
+
+        bool compiled = false;
+
+        if (function == LUA_NOREF)
+        {
+
+            // For a logpoint the message is only evaluated if the condition is
+            // met. The newline keeps a comment at the end of the condition from
+            // hiding the rest of the statement.
+
+            std::string statement;
+
+            if (logMessage.empty())
+            {
+                statement  = "return ";
+                statement += expression;
+            }
+            else
+            {
+                statement  = "if not (";
+                statement += expression.empty() ? "true" : expression;
+                statement += "\n) then return false end return true, ";
+                statement += logMessage;
+            }
+
+            if (LoadScriptWithoutIntercept(api, L, statement) == 0)
+            {
+                function = luaL_ref_dll(api, L, GetRegistryIndex(api));
+                compiled = true;
+            }
+            else
+            {
+                error = lua_tostring_dll(api, L, -1);
+                lua_pop_dll(api, L, 1);
+            }
+
+        }
+
+        if (function != LUA_NOREF)
+        {
+
+            // The expression is evaluated in the scope of the function that hit
+            // the breakpoint, which is at the top of the stack. Unlike a watch,
+            // assignments to locals in the condition aren't copied back.
+
+            PushNilSentinel(api, L);
+            int nilSentinel = lua_gettop_dll(api, L);
+
+            if (CreateEnvironment(api, L, 0, nilSentinel))
+            {
+
+                int envTable = lua_gettop_dll(api, L);
+
+                lua_rawgeti_dll(api, L, GetRegistryIndex(api), function);
+                lua_pushvalue_dll(api, L, envTable);
+                lua_setfenv_dll(api, L, -2);
+
+                if (lua_pcall_dll(api, L, 0, 2, 0) == 0)
+                {
+                    
+                    conditionMet = lua_toboolean_dll(api, L, -2) != 0;
+
+                    int type = lua_type_dll(api, L, -1);
+
+                    if (type == LUA_TSTRING || type == LUA_TNUMBER)
+                    {
+                        message = lua_tostring_dll(api, L, -1);
+                    }
+                    else if (type == LUA_TBOOLEAN)
+                    {
+                        message = lua_toboolean_dll(api, L, -1) ? "true" : "false";
+                    }
+                    else
+                    {
+                        message = lua_typename_dll(api, L, type);
+                    }
+
+                    lua_pop_dll(api, L, 2);
+
+                }
+                else
+                {
+                    error = lua_tostring_dll(api, L, -1);
+                    lua_pop_dll(api, L, 1);
+                }
+
+                // Remove the local, up value and environment tables.
+                lua_pop_dll(api, L, 3);
+
+            }
+
+            // Remove the nil sentinel.
+            lua_pop_dll(api, L, 1);
+
+        }
+
+        EnableIntercepts(true);
+        SetHookMode(api, L, HookMode_Full);
+
+        assert(lua_gettop_dll(api, L) == t1);
+
+        CriticalSectionLock lock(m_criticalSection);
+
+        if (compiled)
+        {
+
+            // Keep the compiled condition unless it was changed while we were
+            // evaluating it.
+
+            stdext::hash_map<unsigned int, BreakpointCondition>::iterator iterator = m_scripts[scriptIndex]->conditions.find(line);
+
+            if (iterator != m_scripts[scriptIndex]->conditions.end() &&
+                iterator->second.expression == expression && iterator->second.logMessage == logMessage &&
+                iterator->second.functions.find(universe) == iterator->second.functions.end())
+            {
+                iterator->second.functions[universe] = function;
+            }
+            else
+            {
+                m_unusedConditions.push_back(std::make_pair(universe, function));
+            }
+
+        }
+
+        // Stop on an error so the user can see what's wrong with the condition.
+        if (!error.empty())
+        {
+            std::string text;
+            text  = "Error in breakpoint condition: ";
+            text += error;
+            Message(text.c_str(), MessageType_Error);
+        }
+
+    }
+
+    if (!conditionMet)
+    {
+        return false;
+    }
+
+    {
+
+        CriticalSectionLock lock(m_criticalSection);
+
+        stdext::hash_map<unsigned int, BreakpointCondition>::iterator iterator = m_scripts[scriptIndex]->conditions.find(line);
+
+        if (iterator != m_scripts[scriptIndex]->conditions.end())
+        {
+            BreakpointCondition& condition = iterator->second;
+            ++condition.numHits;
+            if (condition.hitCount != 0 && condition.numHits != condition.hitCount)
+            {
+                return false;
+            }
+        }
+
+    }
+
+    // A logpoint writes its message instead of stopping. If the message couldn't
+    // be evaluated we stop so the error can be seen.
+    if (!logMessage.empty() && error.empty())
+    {
+        WriteLog(message);
+        return false;
+    }
+
+    return true;
+
+}
+
+void DebugBackend::ReleaseBreakpointCondition(BreakpointCondition& condition)
+{
+
+    stdext::hash_map<lua_State*, int>::const_iterator iterator;
+
+    for (iterator = condition.functions.begin(); iterator != condition.functions.end(); ++iterator)
+    {
+        m_unusedConditions.push_back(*iterator);
+    }
+
+    condition.functions.clear();
+
+}
+
+void DebugBackend::ReleaseUnusedConditions(unsigned long api, lua_State* L, lua_State* universe)
+{
+
+    unsigned int i = 0;
+
+    while (i < m_unusedConditions.size())
+    {
+        if (m_unusedConditions[i].first == universe)
+        {
+            luaL_unref_dll(api, L, GetRegistryIndex(api), m_unusedConditions[i].second);
+            m_unusedConditions.erase(m_unusedConditions.begin() + i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+}
+
+bool DebugBackend::GetHaveActiveBreakpoints() const
+{
+    return m_numBreakpoints != 0;
+}
+
+lua_State* DebugBackend::GetUniverse(unsigned long api, lua_State* L) const
+{
+
+    if (!lua_checkstack_dll(api, L, 3))
+    {
+        return NULL;
+    }
+
+    // The registry is shared by all of the threads of a state, so we store the
+    // first thread we see in it and use that to identify the universe.
+
+    lua_State* universe = L;
+
+    lua_pushlightuserdata_dll(api, L, &s_universeKey);
+    lua_rawget_dll(api, L, GetRegistryIndex(api));
+
+    if (lua_type_dll(api, L, -1) == LUA_TLIGHTUSERDATA)
+    {
+        universe = static_cast<lua_State*>(lua_touserdata_dll(api, L, -1));
+    }
+    else
+    {
+        lua_pushlightuserdata_dll(api, L, &s_universeKey);
+        lua_pushlightuserdata_dll(api, L, L);
+        lua_rawset_dll(api, L, GetRegistryIndex(api));
+    }
+
+    lua_pop_dll(api, L, 1);
+
+    return universe;
+
+}
+
+void DebugBackend::RemoveUniverse(lua_State* universe)
+{
+
+    for (unsigned int i = 0; i < m_scripts.size(); ++i)
+    {
+
+        Script* script = m_scripts[i];
+
+        std::vector<lua_State*>::iterator universeIterator = std::find(script->universes.begin(), script->universes.end(), universe);
+
+        if (universeIterator != script->universes.end())
+        {
+            script->universes.erase(universeIterator);
+        }
+
+        stdext::hash_map<unsigned int, BreakpointCondition>::iterator iterator;
+
+        for (iterator = script->conditions.begin(); iterator != script->conditions.end(); ++iterator)
+        {
+            iterator->second.functions.erase(universe);
+        }
+
+    }
+
+    unsigned int i = 0;
+
+    while (i < m_unusedConditions.size())
+    {
+        if (m_unusedConditions[i].first == universe)
+        {
+            m_unusedConditions.erase(m_unusedConditions.begin() + i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    m_universeBreakpoints.erase(universe);
+
+}
+
+void DebugBackend::AddScriptUniverse(unsigned int scriptIndex, lua_State* L)
+{
+
+    lua_State* universe = NULL;
+
+    StateToVmMap::const_iterator iterator = m_stateToVm.find(L);
+
+    if (iterator != m_stateToVm.end())
+    {
+        universe = iterator->second->universe;
+    }
+
+    Script* script = m_scripts[scriptIndex];
+
+    if (std::find(script->universes.begin(), script->universes.end(), universe) != script->universes.end())
+    {
+        return;
+    }
+
+    script->universes.push_back(universe);
+
+    if (script->breakpoints.GetNumBreakpoints() > 0)
+    {
+        m_universeBreakpoints[universe] += script->breakpoints.GetNumBreakpoints();
+        UpdateActiveBreakpoints();
+    }
+
+}
+
+void DebugBackend::AddScriptBreakpoints(const Script* script, int numBreakpoints)
+{
+    for (unsigned int i = 0; i < script->universes.size(); ++i)
+    {
+        m_universeBreakpoints[script->universes[i]] += numBreakpoints;
+    }
+}
+
+bool DebugBackend::GetUniverseHasBreakpoints(lua_State* universe) const
+{
+
+    if (m_numBreakpoints == 0)
+    {
+        return false;
+    }
+
+    if (universe == NULL)
+    {
+        return true;
+    }
+
+    // Breakpoints in scripts loaded by a virtual machine whose universe we
+    // don't know could be in any universe.
+
+    UniverseToCountMap::const_iterator iterator = m_universeBreakpoints.find(NULL);
+
+    if (iterator != m_universeBreakpoints.end() && iterator->second > 0)
+    {
+        return true;
+    }
+
+    iterator = m_universeBreakpoints.find(universe);
+    return iterator != m_universeBreakpoints.end() && iterator->second > 0;
+
+}
+
+void DebugBackend::UpdateActiveBreakpoints()
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    {
+
+        VirtualMachine* vm = m_vms[i];
+
+        bool wasActive = vm->haveActiveBreakpoints;
+
+        //We defer to UpdateHookMode to turn off the hook fully
+        vm->haveActiveBreakpoints = GetUniverseHasBreakpoints(vm->universe);
+
+        // The flag is set before the hook so that a hook callback turning the
+        // hook off will see it and turn it back on.
+        if (vm->haveActiveBreakpoints && !wasActive)
+        {
+            //May have issues with L not being the currently running thread
+            SetHookMode(vm->api, vm->L, HookMode_Full);
+        }
+
+    }
+
+}
+
+void DebugBackend::DeleteAllBreakpoints(){
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    for(std::vector<Script*>::iterator it = m_scripts.begin(); it != m_scripts.end(); it++)
+    {
+        
+        (*it)->ClearBreakpoints();
+
+        stdext::hash_map<unsigned int, BreakpointCondition>& conditions = (*it)->conditions;
+
+        for (stdext::hash_map<unsigned int, BreakpointCondition>::iterator condition = conditions.begin(); condition != conditions.end(); ++condition)
+        {
+            ReleaseBreakpointCondition(condition->second);
+        }
+
+        conditions.clear();
+
+    }
+
+    ++m_breakpointGeneration;
+
+    m_numBreakpoints = 0;
+    m_universeBreakpoints.clear();
+
+    // This clears haveActiveBreakpoints for every vm while we still hold the
+    // lock, so a vm attaching or a script loading can't see the old counts.
+    // Turning the hooks off is left to UpdateHookMode.
+    UpdateActiveBreakpoints();
+}
+
+void DebugBackend::SendBreakEvent(unsigned long api, lua_State* L, int stackTop)
+{
+
+    CriticalSectionLock lock(m_criticalSection);
+
+    VirtualMachine* vm = GetVm(L);
+
+    // The C call stack will look something like this (may be any number of
+    // these stacked on top of each other):
+    //
+    //   +------+
+    //   |      | C function
+    //   +------+
+    //   |      |
+    //   | XXXX | Lua call mechanism (luaD_*, luaV_*, lua_*)
+    //   |      |
+    //   +------+
+    //   | XXXX | lua_call/lua_pcall/lua_load, etc.
+    //   +------+
+    //   |      |
+    //   |      | Pre-Lua code (main, etc.)
+    //   |      |
+    //   +------+
+
+    StackEntry nativeStack[100];
+    unsigned int nativeStackSize = 0;
+
+    if (vm != NULL)
+    {
+        // Remember how many stack levels to skip so when we evaluate we can adjust
+        // the stack level accordingly.
+        vm->stackTop = stackTop;
+        nativeStackSize = GetCStack(vm->hThread, nativeStack, 100);
+    }
+    else
+    {
+        // For whatever reason we couldn't remember how many stack levels we want to skip,
+        // so don't skip any. This shouldn't happen under any normal circumstance since
+        // the state should have a corresponding VM.
+        stackTop = 0;
+    }
+
+    // Send the call stack.
+
+    lua_Debug scriptStack[s_maxStackSize];
+    unsigned int scriptStackSize = 0;
+
+    for (int level = stackTop; scriptStackSize < s_maxStackSize && lua_getstack_dll(api, L, level, &scriptStack[scriptStackSize]); ++level)
+    {
+        lua_getinfo_dll(api, L, "nSlu", &scriptStack[scriptStackSize]);
+        ++scriptStackSize;
+    }
+
+    // Create a unified call stack.
+    StackEntry stack[s_maxStackSize];
+    unsigned int stackSize = GetUnifiedStack(api, nativeStack, nativeStackSize, scriptStack, scriptStackSize, stack);
+
+    m_eventChannel.BeginMessage();
+
+    m_eventChannel.WriteUInt32(EventId_Break);
+    m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
+    m_eventChannel.WriteUInt32(stackSize);
+
+    for (unsigned int i = 0; i < stackSize; ++i)
+    {
+        unsigned int stackIndex = stackSize - i - 1;
+        m_eventChannel.WriteUInt32(stack[stackIndex].scriptIndex);
+        m_eventChannel.WriteUInt32(stack[stackIndex].line);
+        m_eventChannel.WriteString(stack[stackIndex].name);
+    }
+
+    m_eventChannel.EndMessage();
+    m_eventChannel.Flush();
+
+}
+
+void DebugBackend::SendExceptionEvent(lua_State* L, const char* message)
+{
+    m_eventChannel.BeginMessage();
+    m_eventChannel.WriteUInt32(EventId_Exception);
+    m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
+    m_eventChannel.WriteString(message);
+    m_eventChannel.EndMessage();
+    m_eventChannel.Flush();
+}
+
+void DebugBackend::BreakFromScript(unsigned long api, lua_State* L)
+{
+    CriticalSectionLock lock(m_breakLock);
+
+    SendBreakEvent(api, L);
+    WaitForContinue(api, L);
+}
+
+int DebugBackend::Call(unsigned long api, lua_State* L, int nargs, int nresults, int errorfunc)
+{
+
+    // Check it's not our error handler that's getting called (happens when there's an
+    // error). We also need to check that our error handler is not the error function,
+    // since that can happen if one of the Lua interfaces we hooked calls another one
+    // internally.
+    if (lua_tocfunction_dll(api, L, -1) == StaticErrorHandler || (errorfunc != 0 && lua_tocfunction_dll(api, L, errorfunc) == StaticErrorHandler))
+    {
+        return lua_pcall_dll(api, L, nargs, nresults, errorfunc);
+    }
+    else
+    {
+
+        int result = 0;
+
+        if (lua_gettop_dll(api, L) >= nargs + 1)
+        {
+            
+            // Push our error handler onto the stack before the function and the arguments.
+            if (errorfunc != 0)
+            {
+                lua_pushvalue_dll(api, L, errorfunc);
+            }
+            else
+            {
+                lua_pushnil_dll(api, L);
+            }
+            lua_pushcclosure_dll(api, L, StaticErrorHandler, 1);
+
+            int errorHandler = lua_gettop_dll(api, L) - (nargs + 1);
+            lua_insert_dll(api, L, errorHandler);
+
+            // Invoke the function
+            result = lua_pcall_dll(api, L, nargs, nresults, errorHandler);
+
+            // Remove our error handler from the stack.
+            lua_remove_dll(api, L, errorHandler);
+        
+        }
+        else
+        {
+            // In this case there wasn't a function on the top of the stack, so don't push our
+            // error handler there since it will get called instead.
+            result = lua_pcall_dll(api, L, nargs, nresults, errorfunc);
+        }
+
+        return result;
+
+    }
+
+}
+
+int DebugBackend::StaticErrorHandler(lua_State* L)
+{
+    unsigned long api = s_instance->GetApiForVm(L);
+    return s_instance->ErrorHandler(api, L);
+}
+
+int DebugBackend::ErrorHandler(unsigned long api, lua_State* L)
+{
+
+    int top = lua_gettop_dll(api, L);
+
+    // Get the error mesasge.
+    const char* message = lua_tostring_dll(api, L, -1);
+
+    if (message == NULL)
+    {
+        message = "No error message available";
+    }
+
+    if (!GetIsExceptionIgnored(message))
+    {
+
+        // Send the exception event. Ignore the top of the stack when we send the
+        // call stack since the top of the call stack is this function.
+
+        // Sometimes the break lock will already be held.  For example, consider
+        // the following sequence of events:
+        //   1) The main lua thread is stopped in the debugger, holding the
+        //      break lock in DebugBackend::BreakFromScript.
+        //   2) The decoda thread tries to evaluate a variable from the watch
+        //      window
+        //   3) The evaluation of __towatch or __tostring calls lua_error()
+        // That will lead us right here, unable to grab the break lock.  To avoid
+        // deadlocking in this case, just send an error message.
+
+        CriticalSectionTryLock lock(m_breakLock);
+        if (lock.IsHeld()) 
+        {
+            SendBreakEvent(api, L, 1);
+            SendExceptionEvent(L, message);
+            WaitForContinue(api, L);
+        } 
+        else 
+        {
+            Message(message, MessageType_Error);
+        }
+
+    }
+        
+    // Try invoking the user specified error function.
+
+    lua_pushvalue_dll(api, L, lua_upvalueindex_dll(api, 1));
+
+    if (!lua_isnil_dll(api, L, -1))
+    {
+        lua_pushvalue_dll(api, L, -2);
+        lua_pcall_dll(api, L, 1, 1, 0);
+    }
+    else
+    {
+        lua_pop_dll(api, L, 1);
+        // Push the original message back as the return so that it will be available
+        // to custom error handlers.
+        lua_pushvalue_dll(api, L, -1);
+    }
+        
+    return 1;
+
+}
+
+bool DebugBackend::GetStartupDirectory(char* path, int maxPathLength)
+{
+
+    if (!GetModuleFileName(g_hInstance, path, maxPathLength))
+    {
+        return false;
+    }
+
+    char* lastSlash = strrchr(path, '\\');
+
+    if (lastSlash == NULL)
+    {
+        return false;
+    }
+
+    // Terminate the path after the last slash.
+
+    lastSlash[1] = 0;
+    return true;
+
+}
+
+void DebugBackend::ChainTables(unsigned long api, lua_State* L, int child, int parent)
+{
+    
+    int t1 = lua_gettop_dll(api, L);
+
+    // Create the metatable to link them.
+    lua_newtable_dll(api, L);
+    int metaTable = lua_gettop_dll(api, L);
+
+    // Set the __index metamethod to point to the parent table.
+    lua_pushstring_dll(api, L, "__index");
+    lua_pushvalue_dll(api, L, parent);
+    lua_rawset_dll(api, L, metaTable);
+
+    // Set the __newindex metamethod to point to the parent table.
+    lua_pushstring_dll(api, L, "__newindex");
+    lua_pushvalue_dll(api, L, parent);
+    lua_rawset_dll(api, L, metaTable);
+
+    // Set the child's metatable.
+    lua_setmetatable_dll(api, L, child);
+
+    int t2 = lua_gettop_dll(api, L);
+    assert(t1 == t2);
+
+}
+
+bool DebugBackend::CreateEnvironment(unsigned long api, lua_State* L, int stackLevel, int nilSentinel)
+{
+
+    int t1 = lua_gettop_dll(api, L);
+
+    lua_Debug stackEntry = { 0 };
+
+    if (lua_getstack_dll(api, L, stackLevel, &stackEntry) != 1)
+    {
+        return false;
+    }
+
+    const char* name = NULL;
+
+    // Copy the local variables into a new table.
+
+    lua_newtable_dll(api, L);
+    int localTable = lua_gettop_dll(api, L);
+
+    for (int local = 1; name = lua_getlocal_dll(api, L, &stackEntry, local); ++local) 
+    {
+        if (!GetIsInternalVariable(name))
+        {
+            // If the value is nil, we use the nil sentinel so we can differentiate
+            // between undeclared, and declared but set to nil for lexical scoping.
+            if (lua_isnil_dll(api, L, -1))
+            {
+                lua_pop_dll(api, L, 1);
+                lua_pushstring_dll(api, L, name);
+                lua_pushvalue_dll(api, L, nilSentinel);
+            }
+            else
+            {
+                lua_pushstring_dll(api, L, name);
+                lua_insert_dll(api, L, -2);
+            }
+            lua_rawset_dll(api, L, localTable);
+        }
+        else
+        {
+            lua_pop_dll(api, L, 1);
+        }
+    }
+
+    // Copy the up values into a new table.
+    
+    lua_newtable_dll(api, L);
+    int upValueTable = lua_gettop_dll(api, L);
+    
+    // Get the function which is the call stack entry so that we can examine
+    // the up values and get the environment.
+    lua_getinfo_dll(api, L, "fu", &stackEntry);
+    int functionIndex = lua_gettop_dll(api, L);
+
+    for (int upValue = 1; name = lua_getupvalue_dll(api, L, functionIndex, upValue); ++upValue) 
+    {
+        // C function up values has no name, so skip those.
+        if( name && *name)
+        {
+            // If the value is nil, we use the nil sentinel so we can differentiate
+            // between undeclared, and declared but set to nil for lexical scoping.
+            if (lua_isnil_dll(api, L, -1))
+            {
+                lua_pop_dll(api, L, 1);
+                lua_pushstring_dll(api, L, name);
+                lua_pushvalue_dll(api, L, nilSentinel);
+            }
+            else
+            {
+                lua_pushstring_dll(api, L, name);
+                lua_insert_dll(api, L, -2);
+            }
+            lua_rawset_dll(api, L, upValueTable);
+        }
+        else
+        {
+            lua_pop_dll(api, L, 1);
+        }
+    }
+
+    // Create an environment table that chains all three of the tables together.
+    // They are accessed like this: local -> upvalue -> global
+    
+    lua_getfenv_dll(api, L, functionIndex);
+    int globalTable = lua_gettop_dll(api, L);
+
+    CreateChainedTable(api, L, nilSentinel, localTable, upValueTable, globalTable);
+
+    // Remove the function and global table from the stack.
+    lua_remove_dll(api, L, globalTable);
+    lua_remove_dll(api, L, functionIndex);
+
+    int t2 = lua_gettop_dll(api, L);
+    assert(t2 - t1 == 3);
+    
+    return true;
+
+}
+
+int DebugBackend::IndexChained(unsigned long api, lua_State* L)
+{
+
+    LUA_CHECK_STACK(api, L, 1)
+
+    int key = 2;
+
+    int nilSentinel = lua_upvalueindex_dll(api, 1);
+
+    int table[3];
+    table[0] = lua_upvalueindex_dll(api, 2); // Locals
+    table[1] = lua_upvalueindex_dll(api, 3); // Up values
+    table[2] = lua_upvalueindex_dll(api, 4); // Globals
+
+    // Get from the local table.
+    lua_pushvalue_dll(api, L, key);
+    lua_gettable_dll(api, L, table[0]);
+        
+    // If it wasn't found, get from the up value table.
+    if (lua_isnil_dll(api, L, -1))
+    {
+        lua_pop_dll(api, L, 1);
+        lua_pushvalue_dll(api, L, key);
+        lua_gettable_dll(api, L, table[1]);
+    }
+    
+    // If it wasn't found, get from the global table.
+    if (lua_isnil_dll(api, L, -1))
+    {
+        lua_pop_dll(api, L, 1);
+        lua_pushvalue_dll(api, L, key);
+        lua_gettable_dll(api, L, table[2]);
+    }
+
+    // If the value is our nil sentinel, convert it to an actual nil.
+    if (lua_rawequal_dll(api, L, -1, nilSentinel))
+    {
+        lua_pop_dll(api, L, 1);
+        lua_pushnil_dll(api, L);
+    }
+
+    return 1;
+
+}
+
+int DebugBackend::NewIndexChained(unsigned long api, lua_State* L)
+{
+
+    LUA_CHECK_STACK(api, L, 0)
+
+    int key   = 2;
+    int value = 3;
+
+    int nilSentinel = lua_upvalueindex_dll(api, 1);
+    
+    int table[3];
+    table[0] = lua_upvalueindex_dll(api, 2); // Locals
+    table[1] = lua_upvalueindex_dll(api, 3); // Up values
+    table[2] = lua_upvalueindex_dll(api, 4); // Globals
+
+    EnvironmentState* state = static_cast<EnvironmentState*>(lua_touserdata_dll(api, L, nilSentinel));
+
+    if (state->readOnly)
+    {
+
+        const char* name = lua_tostring_dll(api, L, key);
+
+        char message[256];
+        _snprintf(message, 256, "attempt to assign to '%s' in a read-only evaluation", name ? name : "?");
+        message[255] = 0;
+
+        lua_pushstring_dll(api, L, message);
+        return lua_error_dll(api, L);
+
+    }
+
+    // Try to set the value in the local table.
+    
+    for (int i = 0; i < 2; ++i)
+    {
+    
+        lua_pushvalue_dll(api, L, key);
+        lua_rawget_dll(api, L, table[i]); 
+
+        bool exists = !lua_isnil_dll(api, L, -1);
+        lua_pop_dll(api, L, 1);
+        
+        if (exists)
+        {
+
+            state->modified = true;
+            
+            lua_pushvalue_dll(api, L, key);
+            
+            // Convert from nils to sentinel nils if necessary.
+            if (lua_isnil_dll(api, L, value))
+            {
+                lua_pushvalue_dll(api, L, nilSentinel);
+            }
+            else
+            {
+                lua_pushvalue_dll(api, L, value);
+            }
+            
+            lua_settable_dll(api, L, table[i]);
+            return 0;
+
+        }
+
+    }
+
+    // Set on the global table.
+    lua_pushvalue_dll(api, L, key);
+    lua_pushvalue_dll(api, L, value);
+    lua_settable_dll(api, L, table[2]);
+
+    return 0;
+
+}
+
+void DebugBackend::CreateChainedTable(unsigned long api, lua_State* L, int nilSentinel, int localTable, int upValueTable, int globalTable)
+{
+
+    lua_newtable_dll(api, L);
+    int metaTable = lua_gettop_dll(api, L);
+
+    // Set the __index method of the metatable.
+
+    lua_pushstring_dll(api, L, "__index");
+    
+    lua_pushvalue_dll(api, L, nilSentinel);
+    lua_pushvalue_dll(api, L, localTable);
+    lua_pushvalue_dll(api, L, upValueTable);
+    lua_pushvalue_dll(api, L, globalTable);
+    
+    lua_pushcclosure_dll(api, L, m_apis[api].IndexChained, 4);
+    lua_settable_dll(api, L, metaTable);
+    
+    // Set the __newindex method of the metatable.
+
+    lua_pushstring_dll(api, L, "__newindex");
+    
+    lua_pushvalue_dll(api, L, nilSentinel);
+    lua_pushvalue_dll(api, L, localTable);
+    lua_pushvalue_dll(api, L, upValueTable);
+    lua_pushvalue_dll(api, L, globalTable);
+    
+    lua_pushcclosure_dll(api, L, m_apis[api].NewIndexChained, 4);
+    lua_settable_dll(api, L, metaTable);
+
+    // Set the table's metatable to be itself so we don't need an extra table
+    // to act as the proxy.
+
+    lua_pushvalue_dll(api, L, metaTable);
+    lua_setmetatable_dll(api, L, -1);
+
+}
+
+void DebugBackend::SetLocals(unsigned long api, lua_State* L, int stackLevel, int localTable, int nilSentinel)
+{
+
+    lua_Debug stackEntry;
+
+    int result = lua_getstack_dll(api, L, stackLevel, &stackEntry);
+    assert(result);        
+
+    const char* name = NULL;
+
+    for (int local = 1; name = lua_getlocal_dll(api, L, &stackEntry, local); ++local) 
+    {
+        
+        // Drop the local value, we don't need it.
+        lua_pop_dll(api, L, 1);
+
+        if (!GetIsInternalVariable(name))
+        {
+
+            // Get the new value for the local from the same named global.
+            lua_pushstring_dll(api, L, name);
+            lua_rawget_dll(api, L, localTable);
+
+            // Convert from nil sentinels to real nils.
+            if (lua_rawequal_dll(api, L, -1, nilSentinel))
+            {
+                lua_pop_dll(api, L, 1);
+                lua_pushnil_dll(api, L);
+            }
+            
+            // Update the local with this value.
+            lua_setlocal_dll(api, L, &stackEntry, local);
+
+        }
+
+    }              
+
+}
+
+void DebugBackend::SetUpValues(unsigned long api, lua_State* L, int stackLevel, int upValueTable, int nilSentinel)
+{
+
+    lua_Debug stackEntry;
+
+    int result = lua_getstack_dll(api, L, stackLevel, &stackEntry);
+    assert(result);        
+
+    // Get the function at the stack level.
+    lua_getinfo_dll(api, L, "f", &stackEntry);
+    int functionIndex = lua_gettop_dll(api, L);
+
+    const char* name = NULL;
+
+    for (int upValue = 1; name = lua_getupvalue_dll(api, L, functionIndex, upValue); ++upValue)
+    {
+        
+        // Drop the up value value, we don't need it.
+        lua_pop_dll(api, L, 1);
+
+        if (strlen(name) > 0)
+        {
+
+            // Get the new value for the local from the same named global.
+            lua_pushstring_dll(api, L, name);
+            lua_rawget_dll(api, L, upValueTable);
+
+            // Convert from nil sentinels to real nils.
+            if (lua_rawequal_dll(api, L, -1, nilSentinel))
+            {
+                lua_pop_dll(api, L, 1);
+                lua_pushnil_dll(api, L);
+            }
+
+            // Update the up value with this value.
+            lua_setupvalue_dll(api, L, functionIndex, upValue);
+
+        }
+
+    }    
+
+    // Remove the function from the stack.
+    lua_pop_dll(api, L, 1);
+
+}
+
+void DebugBackend::WriteEvaluateResult(lua_State* L, unsigned int requestId, const std::string& expression, int stackLevel)
+{
+
+    unsigned long api = GetApiForVm(L);
+
+    std::string result;
+    bool success = false;
+
+    if (api != -1)
+    {
+        success = Evaluate(api, L, expression, stackLevel, GetReadOnlyEvaluate(), result);
+    }
+
+    // Other threads send events at the same time, so keep the fields of
+    // this one together.
+    m_eventChannel.BeginMessage();
+    m_eventChannel.WriteUInt32(EventId_EvaluateResult);
+    m_eventChannel.WriteUInt32(reinterpret_cast<int>(L));
+    m_eventChannel.WriteUInt32(requestId);
+    m_eventChannel.WriteBool(success);
+    m_eventChannel.WriteString(result);
+    m_eventChannel.EndMessage();
+
+}
+
+/**
+ * Converts a value from the binary form written by ValueWriter into the XML
+ * form expected by frontends that don't support Capability_BinaryValues.
+ * The tag for the value has already been read. Returns NULL if the stream
+ * is corrupt.
+ */
+static TiXmlNode* ReadValueAsXml(ValueReader& reader, ValueTag tag)
+{
+
+    std::string type;
+    std::string text;
+
+    TiXmlNode* node = NULL;
+
+    switch (tag)
+    {
+    case ValueTag_Value:
+        if (reader.ReadType(type) && reader.ReadString(text))
+        {
+            node = new TiXmlElement("value");
+            node->LinkEndChild( WriteXmlNode("data", text) );
+            node->LinkEndChild( WriteXmlNode("type", type) );
+        }
+        break;
+    case ValueTag_Table:
+        if (reader.ReadType(type))
+        {
+
+            node = new TiXmlElement("table");
+
+            if (!type.empty())
+            {
+                node->LinkEndChild( WriteXmlNode("type", type) );
+            }
+
+            while (reader.ReadTag(tag) && tag != ValueTag_End)
+            {
+
+                TiXmlNode* key = new TiXmlElement("key");
+                TiXmlNode* value = new TiXmlElement("data");
+
+                TiXmlNode* element = new TiXmlElement("element");
+
+                element->LinkEndChild(key);
+                element->LinkEndChild(value);
+                node->LinkEndChild(element);
+
+                TiXmlNode* keyValue = ReadValueAsXml(reader, tag);
+                
+                if (keyValue == NULL || !reader.ReadTag(tag))
+                {
+                    delete keyValue;
+                    break;
+                }
+
+                key->LinkEndChild(keyValue);
+
+                TiXmlNode* dataValue = ReadValueAsXml(reader, tag);
+
+                if (dataValue == NULL)
+                {
+                    break;
+                }
+
+                value->LinkEndChild(dataValue);
+
+            }
+
+        }
+        break;
+    case ValueTag_Function:
+        {
+            unsigned int scriptIndex;
+            unsigned int line;
+            if (reader.ReadVarint(scriptIndex) && reader.ReadVarint(line))
+            {
+                node = new TiXmlElement("function");
+                node->LinkEndChild(WriteXmlNode("script", static_cast<int>(scriptIndex)));
+                node->LinkEndChild(WriteXmlNode("line",   static_cast<int>(line)));
+            }
+        }
+        break;
+    case ValueTag_Error:
+        if (reader.ReadString(text))
+        {
+            node = WriteXmlNode("error", text);
+        }
+        break;
+    case ValueTag_TableRef:
+        {
+            unsigned int table;
+            if (reader.ReadType(type) && reader.ReadVarint(table))
+            {
+                node = new TiXmlElement("value");
+                node->LinkEndChild( WriteXmlNode("data", "{...} (shown above)") );
+                node->LinkEndChild( WriteXmlNode("type", type) );
+            }
+        }
+        break;
+    case ValueTag_Values:
+        {
+
+            unsigned int count;
+
+            if (reader.ReadVarint(count))
+            {
+
+                node = new TiXmlElement("values");
+
+                for (unsigned int i = 0; i < count && reader.ReadTag(tag); ++i)
+                {
+
+                    TiXmlNode* child = ReadValueAsXml(reader, tag);
+
+                    if (child == NULL)
+                    {
+                        break;
+                    }
+
+                    node->LinkEndChild(child);
+
+                }
+
+            }
+
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!reader.GetIsValid())
+    {
+        delete node;
+        node = NULL;
+    }
+
+    return node;
+
+}
+
+/**
+ * Converts a value from the binary form written by ValueWriter into XML
+ * text.
+ */
+static void GetValueStreamAsXml(const std::string& stream, std::string& result)
+{
+
+    TiXmlDocument document;
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+
+    if (reader.ReadTag(tag))
+    {
+
+        TiXmlNode* node = ReadValueAsXml(reader, tag);
+
+        if (node != NULL)
+        {
+            document.LinkEndChild(node);
+        }
+
+    }
+
+    TiXmlPrinter printer;
+    printer.SetIndent("\t");
+
+    document.Accept( &printer );
+    result = printer.Str();
+
+}
+
+bool DebugBackend::Evaluate(unsigned long api, lua_State* L, const std::string& expression, int stackLevel, bool readOnly, std::string& result)
 {
+
+    if (!GetIsLuaLoaded())
+    {
+        return false;
+    }
+            
+    // Adjust the desired stack level based on the number of stack levels we skipped when
+    // we sent the front end the call stack.
+
+    VirtualMachine* vm = NULL;
+    bool stopped = false;
+
+    {
+
+        CriticalSectionLock lock(m_criticalSection);
+
+        StateToVmMap::iterator stateIterator = m_stateToVm.find(L);
+        assert(stateIterator != m_stateToVm.end());
+
+        if (stateIterator != m_stateToVm.end())
+        {
+            vm = stateIterator->second;
+            stackLevel += vm->stackTop;
+            stopped = vm->stopped;
+        }
     
+    }
+
+    if (vm == NULL)
+    {
+        return false;
+    }
+
+    if (!stopped)
+    {
+
+        // The state is running on its own thread, so we can't touch its stack
+        // and the environment cached at the last stop is out of date.
+
+        std::string stream;
+        ValueWriter writer(stream);
+        writer.WriteError("Error: expressions can only be evaluated while the virtual machine is stopped");
+
+        if (m_capabilities & Capability_BinaryValues)
+        {
+            result.swap(stream);
+        }
+        else
+        {
+            GetValueStreamAsXml(stream, result);
+        }
+
+        return false;
+
+    }
+
     int t1 = lua_gettop_dll(api, L);
 
-    // Create the metatable to link them.
-    lua_newtable_dll(api, L);
-    int metaTable = lua_gettop_dll(api, L);
+    if (!PushEnvironment(api, L, vm, stackLevel))
+    {
+        return false;
+    }
+
+    int envTable    = lua_gettop_dll(api, L);
+    int nilSentinel = envTable - 3;
+
+    // The environment may be shared with evaluations that allow assignments,
+    // so the mode is set every time.
+    EnvironmentState* state = static_cast<EnvironmentState*>(lua_touserdata_dll(api, L, nilSentinel));
+    state->readOnly = readOnly;
+
+    // Disable the debugger hook so that we don't try to debug the expression.
+    SetHookMode(api, L, HookMode_None);
+    EnableIntercepts(false);
+    
+    int stackTop = lua_gettop_dll(api, L);    
+    
+    int error = LoadExpression(api, L, vm, expression);
+
+    if (error == 0)
+    {
+        lua_pushvalue_dll(api, L, envTable);
+        lua_setfenv_dll(api, L, -2);
+        error = lua_pcall_dll(api, L, 0, LUA_MULTRET, 0);
+    }
+
+    // The values are written into the result as they're read from the stack.
+    // Frontends that don't understand the binary form get it converted to XML.
+
+    std::string stream;
+        
+    if (error == 0)
+    {
+
+        // Figure out how many values were pushed into the stack when we evaluated the
+        // expression.
+        int nresults = lua_gettop_dll(api, L) - stackTop;
+
+        if (nresults > 0)
+        {
+
+            ValueWriter writer(stream);
+
+            int maxDepth = GetPagedTables() ? s_pagedMaxDepth : 10;
+
+            // If there are multiple results, write them as a list of values.
+
+            if (nresults > 1)
+            {
+                writer.BeginValues(nresults);
+            }
+
+            for (int i = 0; i < nresults; ++i)
+            {
+                if (!WriteValue(api, L, writer, -1 - (nresults - 1 - i), maxDepth))
+                {
+                    writer.WriteError("Error: stack overflow");
+                }
+            }
+
+        }
+
+        // Remove the results from the stack.
+        lua_pop_dll(api, L, nresults);
+
+    }
+    else
+    {
+        
+        // The error message will have the form "junk:2: message" so remove the first bit
+        // that isn't useful.
+
+        const char* wholeMessage = lua_tostring_dll(api, L, -1);
+        const char* errorMessage = strstr(wholeMessage, ":2: ");
+        
+        if (errorMessage == NULL)
+        {
+            errorMessage = wholeMessage;
+        }
+        else
+        {
+            // Skip over the ":2: " part.
+            errorMessage += 4;
+        }
+
+        std::string text;
 
-    // Set the __index metamethod to point to the parent table.
-    lua_pushstring_dll(api, L, "__index");
-    lua_pushvalue_dll(api, L, parent);
-    lua_rawset_dll(api, L, metaTable);
+        text = "Error: ";
+        text += errorMessage;
 
-    // Set the __newindex metamethod to point to the parent table.
-    lua_pushstring_dll(api, L, "__newindex");
-    lua_pushvalue_dll(api, L, parent);
-    lua_rawset_dll(api, L, metaTable);
+        ValueWriter writer(stream);
+        writer.WriteError(text);
 
-    // Set the child's metatable.
-    lua_setmetatable_dll(api, L, child);
+        lua_pop_dll(api, L, 1);
+
+    }
+
+    // Remove the local, up value and environment tables and the nil sentinel
+    // from the stack. Changes made to the locals and up values are copied back
+    // when the environment is released.
+    lua_pop_dll(api, L, 4);
+
+    if (m_capabilities & Capability_BinaryValues)
+    {
+        result.swap(stream);
+    }
+    else
+    {
+        GetValueStreamAsXml(stream, result);
+    }
+
+    // Reenable the debugger hook
+    EnableIntercepts(true);
+    SetHookMode(api, L, HookMode_Full);
+    if(GetVm(L)->haveActiveBreakpoints || m_mode == Mode_StepInto || m_mode == Mode_StepOver){
+    }
 
     int t2 = lua_gettop_dll(api, L);
     assert(t1 == t2);
 
+    return error == 0;
+
 }
 
-bool DebugBackend::CreateEnvironment(unsigned long api, lua_State* L, int stackLevel, int nilSentinel)
+bool DebugBackend::ExpandTable(unsigned long api, lua_State* L, unsigned int handle, unsigned int start, std::string& result)
 {
 
-    int t1 = lua_gettop_dll(api, L);
+    if (!GetIsLuaLoaded() || !GetPagedTables())
+    {
+        return false;
+    }
 
-    lua_Debug stackEntry = { 0 };
+    {
 
-    if (lua_getstack_dll(api, L, stackLevel, &stackEntry) != 1)
+        CriticalSectionLock lock(m_criticalSection);
+
+        // Make sure the handle hasn't been released since it was sent.
+
+        VirtualMachine* vm = GetVm(L);
+        
+        if (vm == NULL || !vm->stopped || GetTableRef(vm, handle) == NULL)
+        {
+            return false;
+        }
+
+    }
+
+    if (!lua_checkstack_dll(api, L, 1))
     {
         return false;
     }
 
-    const char* name = NULL;
+    int t1 = lua_gettop_dll(api, L);
 
-    // Copy the local variables into a new table.
+    // Disable the debugger hook since displaying the elements can call meta-methods.
+    SetHookMode(api, L, HookMode_None);
+    EnableIntercepts(false);
 
-    lua_newtable_dll(api, L);
-    int localTable = lua_gettop_dll(api, L);
+    lua_rawgeti_dll(api, L, GetRegistryIndex(api), handle);
 
-    for (int local = 1; name = lua_getlocal_dll(api, L, &stackEntry, local); ++local) 
+    bool success = false;
+
+    if (lua_type_dll(api, L, -1) == LUA_TTABLE)
     {
-        if (!GetIsInternalVariable(name))
-        {
-            // If the value is nil, we use the nil sentinel so we can differentiate
-            // between undeclared, and declared but set to nil for lexical scoping.
-            if (lua_isnil_dll(api, L, -1))
-            {
-                lua_pop_dll(api, L, 1);
-                lua_pushstring_dll(api, L, name);
-                lua_pushvalue_dll(api, L, nilSentinel);
-            }
-            else
-            {
-                lua_pushstring_dll(api, L, name);
-                lua_insert_dll(api, L, -2);
-            }
-            lua_rawset_dll(api, L, localTable);
-        }
-        else
-        {
-            lua_pop_dll(api, L, 1);
-        }
+        // The page is written like the elements of a top level table.
+        ValueWriter writer(result);
+        success = WritePagedTable(api, L, writer, -1, s_pagedMaxDepth - 1, NULL, start, handle);
     }
 
-    // Copy the up values into a new table.
-    
-    lua_newtable_dll(api, L);
-    int upValueTable = lua_gettop_dll(api, L);
-    
-    // Get the function which is the call stack entry so that we can examine
-    // the up values and get the environment.
-    lua_getinfo_dll(api, L, "fu", &stackEntry);
-    int functionIndex = lua_gettop_dll(api, L);
+    lua_pop_dll(api, L, 1);
 
-    for (int upValue = 1; name = lua_getupvalue_dll(api, L, functionIndex, upValue); ++upValue) 
+    EnableIntercepts(true);
+    SetHookMode(api, L, HookMode_Full);
+
+    int t2 = lua_gettop_dll(api, L);
+    assert(t1 == t2);
+
+    if (!success)
     {
-        // C function up values has no name, so skip those.
-        if( name && *name)
+        result.clear();
+    }
+
+    return success;
+
+}
+
+bool DebugBackend::CallMetaMethod(unsigned long api, lua_State* L, int valueIndex, const char* method, int numResults, int& result) const
+{
+
+    if (!lua_checkstack_dll(api, L, 3))
+    {
+        return false;
+    }
+
+    if (lua_getmetatable_dll(api, L, valueIndex))
+    {
+
+        int metaTableIndex = lua_gettop_dll(api, L);
+
+        if (!lua_isnil_dll(api, L, metaTableIndex))
         {
-            // If the value is nil, we use the nil sentinel so we can differentiate
-            // between undeclared, and declared but set to nil for lexical scoping.
+
+            lua_pushstring_dll(api, L, method);
+            lua_gettable_dll(api, L, metaTableIndex);
+
             if (lua_isnil_dll(api, L, -1))
             {
+                // The meta-method doesn't exist.
                 lua_pop_dll(api, L, 1);
-                lua_pushstring_dll(api, L, name);
-                lua_pushvalue_dll(api, L, nilSentinel);
+                lua_remove_dll(api, L, metaTableIndex);
+                return false;
             }
             else
             {
-                lua_pushstring_dll(api, L, name);
-                lua_insert_dll(api, L, -2);
+                lua_pushvalue_dll(api, L, valueIndex);
+                result = lua_pcall_dll(api, L, 1, numResults, 0);
             }
-            lua_rawset_dll(api, L, upValueTable);
-        }
-        else
-        {
-            lua_pop_dll(api, L, 1);
-        }
-    }
 
-    // Create an environment table that chains all three of the tables together.
-    // They are accessed like this: local -> upvalue -> global
-    
-    lua_getfenv_dll(api, L, functionIndex);
-    int globalTable = lua_gettop_dll(api, L);
+        }
 
-    CreateChainedTable(api, L, nilSentinel, localTable, upValueTable, globalTable);
+        lua_remove_dll(api, L, metaTableIndex);
+        return true;
 
-    // Remove the function and global table from the stack.
-    lua_remove_dll(api, L, globalTable);
-    lua_remove_dll(api, L, functionIndex);
+    }
 
-    int t2 = lua_gettop_dll(api, L);
-    assert(t2 - t1 == 3);
-    
-    return true;
+    return false;
 
 }
 
-int DebugBackend::IndexChained(unsigned long api, lua_State* L)
+void DebugBackend::MergeTables(unsigned long api, lua_State* L, unsigned int tableIndex1, unsigned int tableIndex2) const
 {
+    
+    if (!lua_checkstack_dll(api, L, 3))
+    {
+        return;
+    }
 
-    LUA_CHECK_STACK(api, L, 1)
+    tableIndex1 = lua_absindex_dll(api, L, tableIndex1);
+    tableIndex2 = lua_absindex_dll(api, L, tableIndex2);
 
-    int key = 2;
+    lua_newtable_dll(api, L);
+    int dstTableIndex = lua_gettop_dll(api, L);
 
-    int nilSentinel = lua_upvalueindex_dll(api, 1);
+    // Iterate over the keys in table 1, inserting them into the
+    // target table.
 
-    int table[3];
-    table[0] = lua_upvalueindex_dll(api, 2); // Locals
-    table[1] = lua_upvalueindex_dll(api, 3); // Up values
-    table[2] = lua_upvalueindex_dll(api, 4); // Globals
+    lua_pushnil_dll(api, L);
 
-    // Get from the local table.
-    lua_pushvalue_dll(api, L, key);
-    lua_gettable_dll(api, L, table[0]);
-        
-    // If it wasn't found, get from the up value table.
-    if (lua_isnil_dll(api, L, -1))
-    {
-        lua_pop_dll(api, L, 1);
-        lua_pushvalue_dll(api, L, key);
-        lua_gettable_dll(api, L, table[1]);
-    }
-    
-    // If it wasn't found, get from the global table.
-    if (lua_isnil_dll(api, L, -1))
+    while (lua_next_dll(api, L, tableIndex1) != 0)
     {
-        lua_pop_dll(api, L, 1);
-        lua_pushvalue_dll(api, L, key);
-        lua_gettable_dll(api, L, table[2]);
+        lua_pushvalue_dll(api, L, -2);
+        lua_insert_dll(api, L, -2);
+        lua_rawset_dll(api, L, dstTableIndex);
     }
 
-    // If the value is our nil sentinel, convert it to an actual nil.
-    if (lua_rawequal_dll(api, L, -1, nilSentinel))
+    // Iterate over the keys in table 2, inserting them into the
+    // target table.
+
+    lua_pushnil_dll(api, L);
+
+    while (lua_next_dll(api, L, tableIndex2) != 0)
     {
-        lua_pop_dll(api, L, 1);
-        lua_pushnil_dll(api, L);
+        lua_pushvalue_dll(api, L, -2);
+        lua_insert_dll(api, L, -2);
+        lua_rawset_dll(api, L, dstTableIndex);
     }
 
-    return 1;
-
 }
 
-int DebugBackend::NewIndexChained(unsigned long api, lua_State* L)
+bool DebugBackend::WriteLuaBindClassValue(unsigned long api, lua_State* L, ValueWriter& writer, unsigned int maxDepth, bool displayAsKey)
 {
 
-    LUA_CHECK_STACK(api, L, 0)
-
-    int key   = 2;
-    int value = 3;
-
-    int nilSentinel = lua_upvalueindex_dll(api, 1);
-    
-    int table[3];
-    table[0] = lua_upvalueindex_dll(api, 2); // Locals
-    table[1] = lua_upvalueindex_dll(api, 3); // Up values
-    table[2] = lua_upvalueindex_dll(api, 4); // Globals
+    if (!lua_checkstack_dll(api, L, 3))
+    {
+        return false;
+    }
 
-    // Try to set the value in the local table.
-    
-    for (int i = 0; i < 2; ++i)
+    if (lua_getmetatable_dll(api, L, -1))
     {
-    
-        lua_pushvalue_dll(api, L, key);
-        lua_rawget_dll(api, L, table[i]); 
+        
+        lua_pushstring_dll(api, L, "__luabind_class");
+        lua_rawget_dll(api, L, -2);
+
+        bool luabindClass = !lua_isnil_dll(api, L, -1);
 
-        bool exists = !lua_isnil_dll(api, L, -1);
-        lua_pop_dll(api, L, 1);
-        
-        if (exists)
-        {
-            
-            lua_pushvalue_dll(api, L, key);
-            
-            // Convert from nils to sentinel nils if necessary.
-            if (lua_isnil_dll(api, L, value))
-            {
-                lua_pushvalue_dll(api, L, nilSentinel);
-            }
-            else
-            {
-                lua_pushvalue_dll(api, L, value);
-            }
-            
-            lua_settable_dll(api, L, table[i]);
-            return 0;
+        // Remove the value and the metatable from the stack.
+        lua_pop_dll(api, L, 2);
 
+        if (!luabindClass)
+        {
+            // This userdata doesn't have the luabind class signature in its
+            // metatable.
+            return false;
         }
 
     }
 
-    // Set on the global table.
-    lua_pushvalue_dll(api, L, key);
-    lua_pushvalue_dll(api, L, value);
-    lua_settable_dll(api, L, table[2]);
+    const char* className = "luabind";
 
-    return 0;
+    // Luabind stores the accessible methods in the environment for the userdata
+    // so we can directly convert that into the value.
+    lua_getfenv_dll(api, L, -1);
 
-}
+    bool written = false;
 
-void DebugBackend::CreateChainedTable(unsigned long api, lua_State* L, int nilSentinel, int localTable, int upValueTable, int globalTable)
-{
+    // If the environment has a metatable, those are the class methods and we
+    // need to merge them into the 
+    if (lua_getmetatable_dll(api, L, -1))
+    {
 
-    lua_newtable_dll(api, L);
-    int metaTable = lua_gettop_dll(api, L);
+        MergeTables(api, L, -1, -2);
 
-    // Set the __index method of the metatable.
+        int tableIndex = lua_gettop_dll(api, L);
+        written = WriteValue(api, L, writer, tableIndex, maxDepth, className, displayAsKey); 
 
-    lua_pushstring_dll(api, L, "__index");
-    
-    lua_pushvalue_dll(api, L, nilSentinel);
-    lua_pushvalue_dll(api, L, localTable);
-    lua_pushvalue_dll(api, L, upValueTable);
-    lua_pushvalue_dll(api, L, globalTable);
-    
-    lua_pushcclosure_dll(api, L, m_apis[api].IndexChained, 4);
-    lua_settable_dll(api, L, metaTable);
-    
-    // Set the __newindex method of the metatable.
+        lua_pop_dll(api, L, 2);
 
-    lua_pushstring_dll(api, L, "__newindex");
-    
-    lua_pushvalue_dll(api, L, nilSentinel);
-    lua_pushvalue_dll(api, L, localTable);
-    lua_pushvalue_dll(api, L, upValueTable);
-    lua_pushvalue_dll(api, L, globalTable);
-    
-    lua_pushcclosure_dll(api, L, m_apis[api].NewIndexChained, 4);
-    lua_settable_dll(api, L, metaTable);
+    }
+    else
+    {
+        int tableIndex = lua_gettop_dll(api, L);
+        written = WriteValue(api, L, writer, tableIndex, maxDepth, className, displayAsKey); 
+    }
 
-    // Set the table's metatable to be itself so we don't need an extra table
-    // to act as the proxy.
+    // Remove the value from the stack.
+    lua_pop_dll(api, L, 1);
 
-    lua_pushvalue_dll(api, L, metaTable);
-    lua_setmetatable_dll(api, L, -1);
+    return written;
 
 }
 
-void DebugBackend::SetLocals(unsigned long api, lua_State* L, int stackLevel, int localTable, int nilSentinel)
+bool DebugBackend::WriteValue(unsigned long api, lua_State* L, ValueWriter& writer, int n, int maxDepth, const char* typeNameOverride, bool displayAsKey)
 {
 
-    lua_Debug stackEntry;
+    int t1 = lua_gettop_dll(api, L);
 
-    int result = lua_getstack_dll(api, L, stackLevel, &stackEntry);
-    assert(result);        
+    if (!lua_checkstack_dll(api, L, 1))
+    {
+        return false;
+    }
 
-    const char* name = NULL;
+    // Duplicate the item since calling to* can modify the value.
+    lua_pushvalue_dll(api, L, n);
 
-    for (int local = 1; name = lua_getlocal_dll(api, L, &stackEntry, local); ++local) 
+    int type = lua_type_dll(api, L, -1);
+    const char* typeName = lua_typename_dll(api, L, type);
+
+    if (typeNameOverride == NULL)
     {
-        
-        // Drop the local value, we don't need it.
-        lua_pop_dll(api, L, 1);
+        typeNameOverride = typeName;
+    }
 
-        if (!GetIsInternalVariable(name))
+    bool written = false;
+
+    if (strcmp(typeName, "table") == 0)
+    {
+        int stackStart = lua_gettop_dll(api, L);
+        int result = 0;
+        std::string className;
+        if (CallMetaMethod(api, L, stackStart, "__towatch", LUA_MULTRET, result))
         {
+            if (result == 0)
+            {
+                int numResults = lua_gettop_dll(api, L) - stackStart;
 
-            // Get the new value for the local from the same named global.
-            lua_pushstring_dll(api, L, name);
-            lua_rawget_dll(api, L, localTable);
+                if( numResults == 0)
+                {
+                    lua_pushnil_dll( api, L);
+                    numResults = 1;
+                }
+                else if (numResults > 1)
+                {
+                    // First result is the class name if multiple results are 
+                    // returned.
+                    className = lua_tostring_dll(api, L, -numResults);
+                }
 
-            // Convert from nil sentinels to real nils.
-            if (lua_rawequal_dll(api, L, -1, nilSentinel))
+                written = WriteValue(api, L, writer, -1, maxDepth, className.c_str(), displayAsKey);
+
+                // Remove the table value.
+                lua_pop_dll(api, L, numResults);
+
+            }
+            else
             {
+                // Remove the error message and just display the table.
                 lua_pop_dll(api, L, 1);
-                lua_pushnil_dll(api, L);
             }
-            
-            // Update the local with this value.
-            lua_setlocal_dll(api, L, &stackEntry, local);
-
         }
+        if (!written)
+        {
+            written = WriteTable(api, L, writer, -1, maxDepth - 1, typeNameOverride);
+        }
+        // Remove the duplicated value.
+        lua_pop_dll(api, L, 1);
+    }
+    else if (strcmp(typeName, "function") == 0)
+    {
 
-    }              
-
-}
+        lua_Debug ar;
+        lua_getinfo_dll(api, L, ">Sn", &ar);
 
-void DebugBackend::SetUpValues(unsigned long api, lua_State* L, int stackLevel, int upValueTable, int nilSentinel)
-{
+        int scriptIndex = GetScriptIndex(GetSource(api, &ar));
 
-    lua_Debug stackEntry;
+        writer.WriteFunction(scriptIndex, GetLineDefined(api, &ar) - 1);
+        written = true;
+    
+    }
+    else
+    {
+        if (strcmp(typeName, "wstring") == 0)
+        {
 
-    int result = lua_getstack_dll(api, L, stackLevel, &stackEntry);
-    assert(result);        
+            size_t length = 0;
+            const lua_WChar* string = lua_towstring_dll(api, L, -1); 
+            
+            if (string != NULL)
+            {
+                length = wcslen(reinterpret_cast<const wchar_t*>(string)) * sizeof(lua_WChar);
+            }
 
-    // Get the function at the stack level.
-    lua_getinfo_dll(api, L, "f", &stackEntry);
-    int functionIndex = lua_gettop_dll(api, L);
+            std::string text;
+            bool wide;
 
-    const char* name = NULL;
+            if (!displayAsKey)
+            {
+                text += "L\"";
+            }
+            
+            text += GetAsciiString(string, length, wide, true);
+            
+            if (!displayAsKey)
+            {
+                text += "\"";
+            }
 
-    for (int upValue = 1; name = lua_getupvalue_dll(api, L, functionIndex, upValue); ++upValue)
-    {
-        
-        // Drop the up value value, we don't need it.
-        lua_pop_dll(api, L, 1);
+            writer.WriteValue(typeNameOverride, text);
+            written = true;
 
-        if (strlen(name) > 0)
+        }
+        else if (strcmp(typeName, "string") == 0)
         {
 
-            // Get the new value for the local from the same named global.
-            lua_pushstring_dll(api, L, name);
-            lua_rawget_dll(api, L, upValueTable);
+            size_t length;
+            const char* string = lua_tolstring_dll(api, L, -1, &length); 
 
-            // Convert from nil sentinels to real nils.
-            if (lua_rawequal_dll(api, L, -1, nilSentinel))
+            bool wide;
+            std::string result = GetAsciiString(string, length, wide);
+
+            std::string text;
+
+            if (!displayAsKey)
             {
-                lua_pop_dll(api, L, 1);
-                lua_pushnil_dll(api, L);
+                if (wide)
+                {
+                    text += "L"; 
+                }
+                text += "\"";
             }
 
-            // Update the up value with this value.
-            lua_setupvalue_dll(api, L, functionIndex, upValue);
+            text += result;
 
-        }
+            if (!displayAsKey)
+            {
+                text += "\"";
+            }
 
-    }    
+            writer.WriteValue(typeNameOverride, text);
+            written = true;
 
-    // Remove the function from the stack.
-    lua_pop_dll(api, L, 1);
+        }
+        else if (strcmp(typeName, "userdata") == 0)
+        {
 
-}
+            const char* temp = GetClassNameForUserdata(api, L, -1);
+            std::string className;
 
-bool DebugBackend::Evaluate(unsigned long api, lua_State* L, const std::string& expression, int stackLevel, std::string& result)
-{
+            if (temp != NULL)
+            {
+                className = temp;
+            }
 
-    if (!GetIsLuaLoaded())
-    {
-        return false;
-    }
-            
-    // Adjust the desired stack level based on the number of stack levels we skipped when
-    // we sent the front end the call stack.
+            int valueIndex = lua_gettop_dll(api, L);
 
-    {
+            if (className.empty())
+            {
+                className = "userdata";
+            }
 
-        CriticalSectionLock lock(m_criticalSection);
+            // Check if this is a luabind class instance.
+            //written = WriteLuaBindClassValue(api, L, writer, maxDepth, displayAsKey);
 
-        StateToVmMap::iterator stateIterator = m_stateToVm.find(L);
-        assert(stateIterator != m_stateToVm.end());
+            if (!written)
+            {
 
-        if (stateIterator != m_stateToVm.end())
-        {
-            stackLevel += stateIterator->second->stackTop;
-        }
-    
-    }
+                // Check to see if the user data's metatable has a __towatch method. This is
+                // a custom method used to provide data to the watch window.
 
-    int t1 = lua_gettop_dll(api, L);
+                int result = 0;
+                int stackStart = lua_gettop_dll(api, L);
 
-    // Create a sentinel value used in place of nil in the local and upvalue tables.
-    // We do this since we can't store a nil value in a table, but we need to preserve
-    // the fact that those variables were declared.
-    
-    lua_newuserdata_dll(api, L, 0);
-    int nilSentinel = lua_gettop_dll(api, L);    
-    
-    if (!CreateEnvironment(api, L, stackLevel, nilSentinel))
-    {
-        lua_pop_dll(api, L, 1);
-        return false;
-    }
+                if (CallMetaMethod(api, L, valueIndex, "__towatch", LUA_MULTRET, result))
+                {
+                    if (result == 0)
+                    {
+                       
+                        int tableIndex = lua_gettop_dll(api, L);
+                        int numResults = tableIndex - stackStart;
 
-    int envTable     = lua_gettop_dll(api, L);
-    int upValueTable = envTable - 1;
-    int localTable   = envTable - 2;
+                        if( numResults == 0)
+                        {
+                            lua_pushnil_dll( api, L);
+                            ++ tableIndex;
+                            numResults = 1;
+                        }
+                        else if (numResults > 1)
+                        {
+                            // First result is the class name if multiple results are 
+                            // returned.
+                            className = lua_tostring_dll(api, L, -numResults);
+                        }
 
-    // Disable the debugger hook so that we don't try to debug the expression.
-    SetHookMode(api, L, HookMode_None);
-    EnableIntercepts(false);
-    
-    int stackTop = lua_gettop_dll(api, L);    
-    
-    // Turn the expression into a statement by making it a return.
+                        written = WriteValue(api, L, writer, tableIndex, maxDepth, className.c_str(), displayAsKey); 
 
-    std::string statement;
+                        // Remove the table value.
+                        lua_pop_dll(api, L, numResults);
 
-    statement  = "return \n";
-    statement += expression;
-    
-    int error = LoadScriptWithoutIntercept(api, L, statement.c_str());
+                    }
+                }
+                else if (CallMetaMethod(api, L, valueIndex, "__tostring", 1, result))
+                {
+                    if (result == 0)
+                    {
 
-    if (error == LUA_ERRSYNTAX)
-    {
-        // The original expression may be a statement, so try loading it that way.
-        lua_pop_dll(api, L, 1);
-        error = LoadScriptWithoutIntercept(api, L, expression.c_str());
-    }
+                        const char* string = lua_tostring_dll(api, L, -1);
+                        
+                        if (string != NULL)
+                        {
+                            writer.WriteValue(className.c_str(), string);
+                            written = true;
+                        }
 
-    if (error == 0)
-    {
-        lua_pushvalue_dll(api, L, envTable);
-        lua_setfenv_dll(api, L, -2);
-        error = lua_pcall_dll(api, L, 0, LUA_MULTRET, 0);
-    }
+                        // Remove the string value.
+                        lua_pop_dll(api, L, 1);
 
-    TiXmlDocument document;
-        
-    if (error == 0)
-    {
+                    }
+                }
 
-        // Figure out how many values were pushed into the stack when we evaluated the
-        // expression.
-        int nresults = lua_gettop_dll(api, L) - stackTop;
+                // Check to see if we called a meta-method and got an error back.
+                if (result != 0)
+                {
 
-        TiXmlNode* root = NULL;
+                    const char* error = lua_tostring_dll(api, L, -1);
 
-        // If there are multiple results, create a root "values" node.
+                    if (error == NULL)
+                    {
+                        // This shouldn't happen, but we check just to make it a little
+                        // more robust.
+                        error = "Error executing __tostring";
+                    }
 
-        if (nresults > 1)
-        {
-            root = new TiXmlElement("values");
-            document.LinkEndChild(root);
-        }
-        else
-        {
-            root = &document;
-        }
+                    writer.WriteError(error);
+                    written = true;
+                
+                    // Remove the error message.
+                    lua_pop_dll(api, L, 1);
 
-        for (int i = 0; i < nresults; ++i)
-        {
+                }
 
-            TiXmlNode* node = GetValueAsText(api, L, -1 - (nresults - 1 - i));
+            }
 
-            if (node != NULL)
+            // If we did't find a way to display the user data, just display the class name.
+            if (!written)
             {
-                root->LinkEndChild(node);
-            }
+
+                if (!m_warnedAboutUserData)
+                {
+                    DebugBackend::Get().Message("Warning 1008: No __tostring or __towatch metamethod was provided for userdata", MessageType_Warning);
+                    m_warnedAboutUserData = true;
+                }
         
-        }
+                void* p = lua_touserdata_dll(api, L, valueIndex);
 
-        // Remove the results from the stack.
-        lua_pop_dll(api, L, nresults);
+                char buffer[32];
 
-    }
-    else
-    {
-        
-        // The error message will have the form "junk:2: message" so remove the first bit
-        // that isn't useful.
+                if (displayAsKey)
+                {
+                    sprintf(buffer, "[0x%p]", p);
+                }
+                else
+                {
+                    sprintf(buffer, "0x%p", p);
+                }
+
+                writer.WriteValue(className.c_str(), buffer);
+                written = true;
+
+            }
 
-        const char* wholeMessage = lua_tostring_dll(api, L, -1);
-        const char* errorMessage = strstr(wholeMessage, ":2: ");
-        
-        if (errorMessage == NULL)
-        {
-            errorMessage = wholeMessage;
         }
         else
         {
-            // Skip over the ":2: " part.
-            errorMessage += 4;
-        }
-
-        std::string text;
-
-        text = "Error: ";
-        text += errorMessage;
 
-        document.LinkEndChild(WriteXmlNode("error", text));
+            const char* string = lua_tostring_dll(api, L, -1);
+            std::string result;
 
-        lua_pop_dll(api, L, 1);
+            if (string == NULL)
+            {
+            
+                // If tostring failed for some reason, fallback to our own version.
+                char value[64] = { 0 };
 
-    }
+                if (strcmp(typeName, "nil") == 0)
+                {
+                    _snprintf(value, 64, "%s", "nil");
+                }
+                else if (strcmp(typeName, "number") == 0)
+                {
+                    _snprintf(value, 64, "%0.2f", lua_tonumber_dll(api, L, -1));
+                }
+                else if (strcmp(typeName, "boolean") == 0)
+                {
+                    _snprintf(value, 64, "%s", lua_toboolean_dll(api, L, -1) ? "true" : "false");
+                }
+                else if (strcmp(typeName, "thread") == 0)
+                {
+                    _snprintf(value, 64, "%s", "thread");
+                }
 
-    // Copy any changes to the up values due to evaluating the watch back.
-    SetLocals(api, L, stackLevel, localTable, nilSentinel);
-    SetUpValues(api, L, stackLevel, upValueTable, nilSentinel);
+                result = value;
 
-    // Remove the local, up value and environment tables from the stack.
-    lua_pop_dll(api, L, 3);
+            }
+            else
+            {
+                result = string;
+            }
 
-    // Remove the nil sentinel.
-    lua_pop_dll(api, L, 1);
+            if (displayAsKey)
+            {
+                result = "[" + result + "]"; 
+            }
 
-    // Convert from XML to a string.
+            writer.WriteValue(typeNameOverride, result);
+            written = true;
 
-    TiXmlPrinter printer;
-    printer.SetIndent("\t");
+        }
 
-    document.Accept( &printer );
-    result = printer.Str();
+        // Remove the duplicated value.
+        lua_pop_dll(api, L, 1);
 
-    // Reenable the debugger hook
-    EnableIntercepts(true);
-    SetHookMode(api, L, HookMode_Full);
-    if(GetVm(L)->haveActiveBreakpoints || m_mode == Mode_StepInto || m_mode == Mode_StepOver){
     }
 
     int t2 = lua_gettop_dll(api, L);
-    assert(t1 == t2);
+    assert(t2 - t1 == 0);
 
-    return error == 0;
+    return written;
 
 }
 
-bool DebugBackend::CallMetaMethod(unsigned long api, lua_State* L, int valueIndex, const char* method, int numResults, int& result) const
+bool DebugBackend::WriteTable(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth, const char* typeNameOverride)
 {
 
-    if (!lua_checkstack_dll(api, L, 3))
+    if (GetPagedTables())
+    {
+        return WritePagedTable(api, L, writer, t, maxDepth, typeNameOverride, 0, LUA_NOREF);
+    }
+
+    if (!lua_checkstack_dll(api, L, 2))
     {
         return false;
+    }    
+    
+    int t1 = lua_gettop_dll(api, L);
+
+    // Get the absolute index since we need to refer to the table position
+    // later once we've put additional stuff on the stack.
+    t = lua_absindex_dll(api, L, t);
+
+    if (WriteTableRef(api, L, writer, t, maxDepth, typeNameOverride))
+    {
+        return true;
     }
 
-    if (lua_getmetatable_dll(api, L, valueIndex))
+    writer.BeginTable(typeNameOverride);
+
+    if (maxDepth > 0)
     {
 
-        int metaTableIndex = lua_gettop_dll(api, L);
+        // First key.
+        lua_pushnil_dll(api, L);
 
-        if (!lua_isnil_dll(api, L, metaTableIndex))
+        while (lua_next_dll(api, L, t) != 0)
         {
 
-            lua_pushstring_dll(api, L, method);
-            lua_gettable_dll(api, L, metaTableIndex);
+            // Every key needs a value after it, so if we couldn't write
+            // either one we write an error in its place.
 
-            if (lua_isnil_dll(api, L, -1))
+            if (!WriteValue(api, L, writer, -2, maxDepth - 1, NULL, true))
             {
-                // The meta-method doesn't exist.
-                lua_pop_dll(api, L, 1);
-                lua_remove_dll(api, L, metaTableIndex);
-                return false;
+                writer.WriteError("Error: stack overflow");
             }
-            else
+
+            if (!WriteValue(api, L, writer, -1, maxDepth - 1))
             {
-                lua_pushvalue_dll(api, L, valueIndex);
-                result = lua_pcall_dll(api, L, 1, numResults, 0);
+                writer.WriteError("Error: stack overflow");
             }
+            
+            // Leave the key on the stack for the next call to lua_next.
+            lua_pop_dll(api, L, 1);
+        
+        }    
+    
+    }
+
+    writer.EndTable();
+
+    int t2 = lua_gettop_dll(api, L);
+    assert(t2 - t1 == 0);
+
+    return true;
+
+}
+
+bool DebugBackend::WritePagedTable(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth, const char* typeNameOverride, unsigned int start, int ref)
+{
+
+    if (!lua_checkstack_dll(api, L, 4))
+    {
+        return false;
+    }    
+    
+    int t1 = lua_gettop_dll(api, L);
 
-        }
+    t = lua_absindex_dll(api, L, t);
 
-        lua_remove_dll(api, L, metaTableIndex);
+    if (WriteTableRef(api, L, writer, t, maxDepth, typeNameOverride))
+    {
         return true;
-
     }
 
-    return false;
+    writer.BeginPagedTable(typeNameOverride, start);
 
-}
+    // Nested tables below the depth limit are sent without any elements, so
+    // the frontend only gets them if the user expands them.
+    unsigned int end = start + (maxDepth > 0 ? s_tablePageSize : 0);
 
-void DebugBackend::MergeTables(unsigned long api, lua_State* L, unsigned int tableIndex1, unsigned int tableIndex2) const
-{
-    
-    if (!lua_checkstack_dll(api, L, 3))
+    unsigned int position  = 0;
+    int          arraySize = -1;
+    int          key       = LUA_NOREF;
+
+    if (ref != LUA_NOREF)
     {
-        return;
-    }
 
-    tableIndex1 = lua_absindex_dll(api, L, tableIndex1);
-    tableIndex2 = lua_absindex_dll(api, L, tableIndex2);
+        // If this page follows the last one we sent, pick up where it ended
+        // instead of walking the table from the start.
 
-    lua_newtable_dll(api, L);
-    int dstTableIndex = lua_gettop_dll(api, L);
+        CriticalSectionLock lock(m_criticalSection);
 
-    // Iterate over the keys in table 1, inserting them into the
-    // target table.
+        TableRef* tableRef = GetTableRef(GetVm(L), ref);
 
-    lua_pushnil_dll(api, L);
+        if (tableRef != NULL && tableRef->position == start)
+        {
+            position  = tableRef->position;
+            arraySize = tableRef->arraySize;
+            key       = tableRef->key;
+        }
 
-    while (lua_next_dll(api, L, tableIndex1) != 0)
-    {
-        lua_pushvalue_dll(api, L, -2);
-        lua_insert_dll(api, L, -2);
-        lua_rawset_dll(api, L, dstTableIndex);
     }
 
-    // Iterate over the keys in table 2, inserting them into the
-    // target table.
-
-    lua_pushnil_dll(api, L);
+    // While we're walking the hash part the key to continue from is kept on
+    // the top of the stack.
+    bool haveKey = false;
 
-    while (lua_next_dll(api, L, tableIndex2) != 0)
+    if (key != LUA_NOREF)
     {
-        lua_pushvalue_dll(api, L, -2);
-        lua_insert_dll(api, L, -2);
-        lua_rawset_dll(api, L, dstTableIndex);
-    }
 
-}
+        // lua_next raises an error if the key isn't in the table anymore, so
+        // in that case we start over.
 
-TiXmlNode* DebugBackend::GetLuaBindClassValue(unsigned long api, lua_State* L, unsigned int maxDepth, bool displayAsKey) const
-{
+        lua_rawgeti_dll(api, L, GetRegistryIndex(api), key);
+        lua_pushvalue_dll(api, L, -1);
+        lua_rawget_dll(api, L, t);
 
-    if (!lua_checkstack_dll(api, L, 3))
+        haveKey = lua_type_dll(api, L, -1) != LUA_TNIL;
+        lua_pop_dll(api, L, haveKey ? 1 : 2);
+
+        if (!haveKey)
+        {
+            position  = 0;
+            arraySize = -1;
+        }
+
+    }
+    else if (arraySize >= 0)
     {
-        return NULL;
+        lua_pushnil_dll(api, L);
+        haveKey = true;
     }
 
-    if (lua_getmetatable_dll(api, L, -1))
-    {
-        
-        lua_pushstring_dll(api, L, "__luabind_class");
-        lua_rawget_dll(api, L, -2);
+    bool more = false;
 
-        bool luabindClass = !lua_isnil_dll(api, L, -1);
+    // The elements of the array part are indexed directly.
 
-        // Remove the value and the metatable from the stack.
-        lua_pop_dll(api, L, 2);
+    while (arraySize < 0)
+    {
 
-        if (!luabindClass)
+        lua_rawgeti_dll(api, L, t, position + 1);
+
+        if (lua_type_dll(api, L, -1) == LUA_TNIL)
         {
-            // This userdata doesn't have the luabind class signature in its
-            // metatable.
-            return NULL;
+            lua_pop_dll(api, L, 1);
+            arraySize = position;
+            lua_pushnil_dll(api, L);
+            haveKey = true;
+            break;
         }
 
-    }
+        if (position == end)
+        {
+            lua_pop_dll(api, L, 1);
+            more = true;
+            break;
+        }
 
-    const char* className = "luabind";
+        if (position >= start)
+        {
 
-    // Luabind stores the accessible methods in the environment for the userdata
-    // so we can directly convert that into the value.
-    lua_getfenv_dll(api, L, -1);
+            lua_pushinteger_dll(api, L, position + 1);
 
-    TiXmlNode* node = NULL;
+            if (!WriteValue(api, L, writer, -1, maxDepth - 1, NULL, true))
+            {
+                writer.WriteError("Error: stack overflow");
+            }
 
-    // If the environment has a metatable, those are the class methods and we
-    // need to merge them into the 
-    if (lua_getmetatable_dll(api, L, -1))
-    {
+            if (!WriteValue(api, L, writer, -2, maxDepth - 1))
+            {
+                writer.WriteError("Error: stack overflow");
+            }
 
-        MergeTables(api, L, -1, -2);
+            lua_pop_dll(api, L, 1);
 
-        int tableIndex = lua_gettop_dll(api, L);
-        node = GetValueAsText(api, L, tableIndex, maxDepth, className, displayAsKey); 
+        }
 
-        lua_pop_dll(api, L, 2);
+        lua_pop_dll(api, L, 1);
+        ++position;
 
     }
-    else
+
+    // The rest of the elements are walked with lua_next.
+
+    while (haveKey)
     {
-        int tableIndex = lua_gettop_dll(api, L);
-        node = GetValueAsText(api, L, tableIndex, maxDepth, className, displayAsKey); 
-    }
 
-    // Remove the value from the stack.
-    lua_pop_dll(api, L, 1);
+        if (position == end)
+        {
+            // Look ahead with a copy of the key so the original is left for
+            // the next page.
+            lua_pushvalue_dll(api, L, -1);
+            if (NextHashElement(api, L, t, arraySize) != 0)
+            {
+                lua_pop_dll(api, L, 2);
+                more = true;
+            }
+            break;
+        }
 
-    return node;
+        if (NextHashElement(api, L, t, arraySize) == 0)
+        {
+            haveKey = false;
+            break;
+        }
 
-}
+        if (position >= start)
+        {
 
-TiXmlNode* DebugBackend::GetValueAsText(unsigned long api, lua_State* L, int n, int maxDepth, const char* typeNameOverride, bool displayAsKey) const
-{
+            if (!WriteValue(api, L, writer, -2, maxDepth - 1, NULL, true))
+            {
+                writer.WriteError("Error: stack overflow");
+            }
 
-    int t1 = lua_gettop_dll(api, L);
+            if (!WriteValue(api, L, writer, -1, maxDepth - 1))
+            {
+                writer.WriteError("Error: stack overflow");
+            }
 
-    if (!lua_checkstack_dll(api, L, 1))
-    {
-        return NULL;
-    }
+        }
 
-    // Duplicate the item since calling to* can modify the value.
-    lua_pushvalue_dll(api, L, n);
+        // Leave the key on the stack for the next call to lua_next.
+        lua_pop_dll(api, L, 1);
+        ++position;
 
-    int type = lua_type_dll(api, L, -1);
-    const char* typeName = lua_typename_dll(api, L, type);
+    }
 
-    if (typeNameOverride == NULL)
+    key = LUA_NOREF;
+
+    if (haveKey)
     {
-        typeNameOverride = typeName;
+        if (more && lua_type_dll(api, L, -1) != LUA_TNIL)
+        {
+            key = luaL_ref_dll(api, L, GetRegistryIndex(api));
+        }
+        else
+        {
+            lua_pop_dll(api, L, 1);
+        }
     }
 
-    TiXmlNode* node = NULL;
-
-    if (strcmp(typeName, "table") == 0)
+    if (more)
     {
-        int stackStart = lua_gettop_dll(api, L);
-        int result = 0;
-        std::string className;
-        if (CallMetaMethod(api, L, stackStart, "__towatch", LUA_MULTRET, result))
+
+        // Keep the table alive in the registry until the VM continues so the
+        // rest of it can be requested.
+
+        if (ref == LUA_NOREF)
         {
-            if (result == 0)
-            {
-                int numResults = lua_gettop_dll(api, L) - stackStart;
+            lua_pushvalue_dll(api, L, t);
+            ref = luaL_ref_dll(api, L, GetRegistryIndex(api));
+        }
 
-                if( numResults == 0)
-                {
-                    lua_pushnil_dll( api, L);
-                    numResults = 1;
-                }
-                else if (numResults > 1)
-                {
-                    // First result is the class name if multiple results are 
-                    // returned.
-                    className = lua_tostring_dll(api, L, -numResults);
-                }
+        CriticalSectionLock lock(m_criticalSection);
+        
+        VirtualMachine* vm = GetVm(L);
 
-                node = GetValueAsText(api, L, -1, maxDepth, className.c_str(), displayAsKey);
+        if (vm != NULL)
+        {
 
-                // Remove the table value.
-                lua_pop_dll(api, L, numResults);
+            TableRef* tableRef = GetTableRef(vm, ref);
 
+            if (tableRef == NULL)
+            {
+                vm->tableRefs.push_back(TableRef());
+                tableRef = &vm->tableRefs.back();
+                tableRef->table = ref;
             }
+            else if (tableRef->key != LUA_NOREF)
+            {
+                luaL_unref_dll(api, L, GetRegistryIndex(api), tableRef->key);
+            }
+
+            tableRef->key       = key;
+            tableRef->position  = position;
+            tableRef->arraySize = arraySize;
+
         }
-        if( node == NULL)
+        else
         {
-        node = GetTableAsText(api, L, -1, maxDepth - 1, typeNameOverride);
+            luaL_unref_dll(api, L, GetRegistryIndex(api), key);
+            luaL_unref_dll(api, L, GetRegistryIndex(api), ref);
+            more = false;
         }
-        // Remove the duplicated value.
-        lua_pop_dll(api, L, 1);
+
     }
-    else if (strcmp(typeName, "function") == 0)
-    {
 
-        lua_Debug ar;
-        lua_getinfo_dll(api, L, ">Sn", &ar);
+    writer.EndPagedTable(more ? ref : 0);
 
-        int scriptIndex = GetScriptIndex(GetSource(api, &ar));
+    int t2 = lua_gettop_dll(api, L);
+    assert(t2 - t1 == 0);
 
-        node = new TiXmlElement("function");
-        node->LinkEndChild(WriteXmlNode("script", scriptIndex));
-        node->LinkEndChild(WriteXmlNode("line",   GetLineDefined(api, &ar) - 1));
-    
-    }
-    else
+    return true;
+
+}
+
+int DebugBackend::NextHashElement(unsigned long api, lua_State* L, int t, int arraySize)
+{
+
+    while (lua_next_dll(api, L, t) != 0)
     {
-        if (strcmp(typeName, "wstring") == 0)
+
+        if (lua_type_dll(api, L, -2) == LUA_TNUMBER)
         {
 
-            size_t length = 0;
-            const lua_WChar* string = lua_towstring_dll(api, L, -1); 
-            
-            if (string != NULL)
+            lua_Number index = lua_tonumber_dll(api, L, -2);
+
+            if (index >= 1 && index <= arraySize && index == static_cast<int>(index))
             {
-                length = wcslen(reinterpret_cast<const wchar_t*>(string)) * sizeof(lua_WChar);
+                // Already sent with the array part.
+                lua_pop_dll(api, L, 1);
+                continue;
             }
 
-            std::string text;
-            bool wide;
+        }
 
-            if (!displayAsKey)
-            {
-                text += "L\"";
-            }
-            
-            text += GetAsciiString(string, length, wide, true);
-            
-            if (!displayAsKey)
+        return 1;
+
+    }
+
+    return 0;
+
+}
+
+DebugBackend::TableRef* DebugBackend::GetTableRef(VirtualMachine* vm, int ref)
+{
+
+    if (vm != NULL)
+    {
+        for (unsigned int i = 0; i < vm->tableRefs.size(); ++i)
+        {
+            if (vm->tableRefs[i].table == ref)
             {
-                text += "\"";
+                return &vm->tableRefs[i];
             }
+        }
+    }
 
-            node = new TiXmlElement("value");
-            node->LinkEndChild( WriteXmlNode("data", text) );
-            node->LinkEndChild( WriteXmlNode("type", typeNameOverride) );
+    return NULL;
 
-        }
-        else if (strcmp(typeName, "string") == 0)
-        {
+}
 
-            size_t length;
-            const char* string = lua_tolstring_dll(api, L, -1, &length); 
+bool DebugBackend::WriteTableRef(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth, const char* typeNameOverride)
+{
 
-            bool wide;
-            std::string result = GetAsciiString(string, length, wide);
+    const void* table = lua_topointer_dll(api, L, t);
 
-            std::string text;
+    if (table == NULL)
+    {
+        // We can't tell tables apart, so they're always written in full.
+        return false;
+    }
 
-            if (!displayAsKey)
-            {
-                if (wide)
-                {
-                    text += "L"; 
-                }
-                text += "\"";
-            }
+    if (writer.WriteTableRef(typeNameOverride, table))
+    {
+        return true;
+    }
+
+    // Only tables whose elements are written are worth referring back to.
+    if (maxDepth > 0)
+    {
+        writer.AddTable(table);
+    }
+
+    return false;
+
+}
+
+bool DebugBackend::GetPagedTables() const
+{
+    // Paged tables are only part of the binary form.
+    const unsigned int capabilities = Capability_BinaryValues | Capability_PagedTables;
+    return (m_capabilities & capabilities) == capabilities;
+}
 
-            text += result;
+bool DebugBackend::GetReadOnlyEvaluate() const
+{
+    return (m_capabilities & Capability_ReadOnlyEvaluate) != 0;
+}
 
-            if (!displayAsKey)
-            {
-                text += "\"";
-            }
+void DebugBackend::PushNilSentinel(unsigned long api, lua_State* L)
+{
 
-            node = new TiXmlElement("value");
-            node->LinkEndChild( WriteXmlNode("data", text) );
-            node->LinkEndChild( WriteXmlNode("type", typeNameOverride) );
+    // The sentinel is a unique value used in place of nil in the local and up
+    // value tables. It also carries the state of the environment it belongs to.
 
-        }
-        else if (strcmp(typeName, "userdata") == 0)
-        {
+    EnvironmentState* state = static_cast<EnvironmentState*>(lua_newuserdata_dll(api, L, sizeof(EnvironmentState)));
+    state->readOnly = false;
+    state->modified = false;
 
-            const char* temp = GetClassNameForUserdata(api, L, -1);
-            std::string className;
+}
 
-            if (temp != NULL)
-            {
-                className = temp;
-            }
+void DebugBackend::EndBreak()
+{
 
-            int valueIndex = lua_gettop_dll(api, L);
+    CriticalSectionLock lock(m_criticalSection);
 
-            if (className.empty())
-            {
-                className = "userdata";
-            }
+    for (unsigned int i = 0; i < m_vms.size(); ++i)
+    {
+        m_vms[i]->stopped = false;
+    }
 
-            // Check if this is a luabind class instance.
-            //node = GetLuaBindClassValue(api, L, maxDepth, displayAsKey);
+}
 
-            if (node == NULL)
-            {
+void DebugBackend::ReleaseBreakData(VirtualMachine* vm)
+{
 
-                // Check to see if the user data's metatable has a __towatch method. This is
-                // a custom method used to provide data to the watch window.
+    ReleaseEnvironment(vm->api, vm->L, vm);
 
-                int result = 0;
-                int stackStart = lua_gettop_dll(api, L);
+    for (unsigned int i = 0; i < vm->tableRefs.size(); ++i)
+    {
+        luaL_unref_dll(vm->api, vm->L, GetRegistryIndex(vm->api), vm->tableRefs[i].table);
+        luaL_unref_dll(vm->api, vm->L, GetRegistryIndex(vm->api), vm->tableRefs[i].key);
+    }
 
-                if (CallMetaMethod(api, L, valueIndex, "__towatch", LUA_MULTRET, result))
-                {
-                    if (result == 0)
-                    {
-                       
-                        int tableIndex = lua_gettop_dll(api, L);
-                        int numResults = tableIndex - stackStart;
+    vm->tableRefs.clear();
 
-                        if( numResults == 0)
-                        {
-                            lua_pushnil_dll( api, L);
-                            ++ tableIndex;
-                            numResults = 1;
-                        }
-                        else if (numResults > 1)
-                        {
-                            // First result is the class name if multiple results are 
-                            // returned.
-                            className = lua_tostring_dll(api, L, -numResults);
-                        }
+}
 
-                        node = GetValueAsText(api, L, tableIndex, maxDepth, className.c_str(), displayAsKey); 
+bool DebugBackend::PushEnvironment(unsigned long api, lua_State* L, VirtualMachine* vm, int stackLevel)
+{
 
-                        // Remove the table value.
-                        lua_pop_dll(api, L, numResults);
+    if (!lua_checkstack_dll(api, L, 5))
+    {
+        return false;
+    }
 
-                    }
-                }
-                else if (CallMetaMethod(api, L, valueIndex, "__tostring", 1, result))
-                {
-                    if (result == 0)
-                    {
+    // Only one environment is kept for each VM, since the up values are shared
+    // between the stack levels and two environments could hold different copies.
 
-                        const char* string = lua_tostring_dll(api, L, -1);
-                        
-                        if (string != NULL)
-                        {
-                            node = new TiXmlElement("value");
-                            node->LinkEndChild( WriteXmlNode("data", string) );
-                            node->LinkEndChild( WriteXmlNode("type", className) );
-                        }
+    if (vm->environment != LUA_NOREF && vm->environmentStackLevel != stackLevel)
+    {
+        ReleaseEnvironment(api, L, vm);
+    }
 
-                        // Remove the string value.
-                        lua_pop_dll(api, L, 1);
+    if (vm->environment == LUA_NOREF)
+    {
 
-                    }
-                }
+        // Create a sentinel value used in place of nil in the local and upvalue tables.
+        // We do this since we can't store a nil value in a table, but we need to preserve
+        // the fact that those variables were declared.
 
-                // Check to see if we called a meta-method and got an error back.
-                if (result != 0)
-                {
+        PushNilSentinel(api, L);
+        int nilSentinel = lua_gettop_dll(api, L);
 
-                    const char* error = lua_tostring_dll(api, L, -1);
+        if (!CreateEnvironment(api, L, stackLevel, nilSentinel))
+        {
+            lua_pop_dll(api, L, 1);
+            return false;
+        }
 
-                    if (error == NULL)
-                    {
-                        // This shouldn't happen, but we check just to make it a little
-                        // more robust.
-                        error = "Error executing __tostring";
-                    }
+        // Store the sentinel and the tables so the next watch can reuse them.
 
-                    node = WriteXmlNode("error", error);
-                
-                    // Remove the error message.
-                    lua_pop_dll(api, L, 1);
+        lua_newtable_dll(api, L);
 
-                }
+        for (int i = 0; i < 4; ++i)
+        {
+            lua_pushinteger_dll(api, L, i + 1);
+            lua_pushvalue_dll(api, L, nilSentinel + i);
+            lua_rawset_dll(api, L, -3);
+        }
 
-            }
+        vm->environment           = luaL_ref_dll(api, L, GetRegistryIndex(api));
+        vm->environmentStackLevel = stackLevel;
 
-            // If we did't find a way to display the user data, just display the class name.
-            if (node == NULL)
-            {
+    }
+    else
+    {
 
-                if (!m_warnedAboutUserData)
-                {
-                    DebugBackend::Get().Message("Warning 1008: No __tostring or __towatch metamethod was provided for userdata", MessageType_Warning);
-                    m_warnedAboutUserData = true;
-                }
-        
-                void* p = lua_touserdata_dll(api, L, valueIndex);
+        lua_rawgeti_dll(api, L, GetRegistryIndex(api), vm->environment);
+        int container = lua_gettop_dll(api, L);
 
-                char buffer[32];
+        for (int i = 0; i < 4; ++i)
+        {
+            lua_rawgeti_dll(api, L, container, i + 1);
+        }
 
-                if (displayAsKey)
-                {
-                    sprintf(buffer, "[0x%p]", p);
-                }
-                else
-                {
-                    sprintf(buffer, "0x%p", p);
-                }
+        lua_remove_dll(api, L, container);
 
-                node = new TiXmlElement("value");
-                node->LinkEndChild( WriteXmlNode("data", buffer) );
-                node->LinkEndChild( WriteXmlNode("type", className) );
+    }
 
-            }
+    return true;
 
-        }
-        else
-        {
+}
 
-            const char* string = lua_tostring_dll(api, L, -1);
-            std::string result;
+void DebugBackend::ReleaseEnvironment(unsigned long api, lua_State* L, VirtualMachine* vm)
+{
 
-            if (string == NULL)
-            {
-            
-                // If tostring failed for some reason, fallback to our own version.
-                char value[64] = { 0 };
+    if (vm->environment == LUA_NOREF)
+    {
+        return;
+    }
 
-                if (strcmp(typeName, "nil") == 0)
-                {
-                    _snprintf(value, 64, "%s", "nil");
-                }
-                else if (strcmp(typeName, "number") == 0)
-                {
-                    _snprintf(value, 64, "%0.2f", lua_tonumber_dll(api, L, -1));
-                }
-                else if (strcmp(typeName, "boolean") == 0)
-                {
-                    _snprintf(value, 64, "%s", lua_toboolean_dll(api, L, -1) ? "true" : "false");
-                }
-                else if (strcmp(typeName, "thread") == 0)
-                {
-                    _snprintf(value, 64, "%s", "thread");
-                }
+    if (lua_checkstack_dll(api, L, 4))
+    {
 
-                result = value;
+        lua_rawgeti_dll(api, L, GetRegistryIndex(api), vm->environment);
+        int container = lua_gettop_dll(api, L);
 
-            }
-            else
-            {
-                result = string;
-            }
+        lua_rawgeti_dll(api, L, container, 1);
+        lua_rawgeti_dll(api, L, container, 2);
+        lua_rawgeti_dll(api, L, container, 3);
 
-            node = new TiXmlElement("value");
+        int upValueTable = lua_gettop_dll(api, L);
+        int localTable   = upValueTable - 1;
+        int nilSentinel  = upValueTable - 2;
 
-            if (displayAsKey)
-            {
-                result = "[" + result + "]"; 
-            }
+        // Copy any changes to the locals and up values due to evaluating the watches
+        // back. This walks all of them, so it's skipped when nothing was assigned.
 
-            node->LinkEndChild( WriteXmlNode("data", result) );
-            node->LinkEndChild( WriteXmlNode("type", typeNameOverride) );
+        const EnvironmentState* state = static_cast<const EnvironmentState*>(lua_touserdata_dll(api, L, nilSentinel));
 
+        if (state->modified)
+        {
+            SetLocals(api, L, vm->environmentStackLevel, localTable, nilSentinel);
+            SetUpValues(api, L, vm->environmentStackLevel, upValueTable, nilSentinel);
         }
 
-        // Remove the duplicated value.
-        lua_pop_dll(api, L, 1);
+        lua_pop_dll(api, L, 4);
 
     }
 
-    int t2 = lua_gettop_dll(api, L);
-    assert(t2 - t1 == 0);
-
-    return node;
+    luaL_unref_dll(api, L, GetRegistryIndex(api), vm->environment);
+    vm->environment = LUA_NOREF;
 
 }
 
-TiXmlNode* DebugBackend::GetTableAsText(unsigned long api, lua_State* L, int t, int maxDepth, const char* typeNameOverride) const
+int DebugBackend::LoadExpression(unsigned long api, lua_State* L, VirtualMachine* vm, const std::string& expression)
 {
 
-    if (!lua_checkstack_dll(api, L, 2))
+    stdext::hash_map<std::string, int>::const_iterator iterator = vm->expressions.find(expression);
+
+    if (iterator != vm->expressions.end())
     {
-        return NULL;
-    }    
-    
-    int t1 = lua_gettop_dll(api, L);
+        lua_rawgeti_dll(api, L, GetRegistryIndex(api), iterator->second);
+        return 0;
+    }
 
-    // Get the absolute index since we need to refer to the table position
-    // later once we've put additional stuff on the stack.
-    t = lua_absindex_dll(api, L, t);
+    // Turn the expression into a statement by making it a return.
+
+    std::string statement;
 
-    TiXmlNode* node = new TiXmlElement("table");
+    statement  = "return \n";
+    statement += expression;
+    
+    int error = LoadScriptWithoutIntercept(api, L, statement.c_str());
 
-    if (typeNameOverride)
+    if (error == LUA_ERRSYNTAX)
     {
-        node->LinkEndChild( WriteXmlNode("type", typeNameOverride) );
+        // The original expression may be a statement, so try loading it that way.
+        lua_pop_dll(api, L, 1);
+        error = LoadScriptWithoutIntercept(api, L, expression.c_str());
     }
 
-    if (maxDepth > 0)
+    if (error == 0)
     {
 
-        // First key.
-        lua_pushnil_dll(api, L);
+        // Keep the number of compiled expressions bounded in case the frontend
+        // sends a different expression every time (like hovering over code).
 
-        while (lua_next_dll(api, L, t) != 0)
+        if (vm->expressions.size() >= s_maxExpressions)
         {
+            ClearExpressions(api, L, vm);
+        }
 
-            TiXmlNode* key = new TiXmlElement("key");
-            key->LinkEndChild( GetValueAsText(api, L, -2, maxDepth - 1, NULL, true) );
+        lua_pushvalue_dll(api, L, -1);
+        vm->expressions[expression] = luaL_ref_dll(api, L, GetRegistryIndex(api));
 
-            TiXmlNode* value = new TiXmlElement("data");
-            value->LinkEndChild( GetValueAsText(api, L, -1, maxDepth - 1) );
+    }
 
-            TiXmlNode* element = new TiXmlElement("element");
+    return error;
 
-            element->LinkEndChild(key);
-            element->LinkEndChild(value);
-            node->LinkEndChild(element);
-            
-            // Leave the key on the stack for the next call to lua_next.
-            lua_pop_dll(api, L, 1);
-        
-        }    
-    
-    }
+}
 
-    int t2 = lua_gettop_dll(api, L);
-    assert(t2 - t1 == 0);
+void DebugBackend::ClearExpressions(unsigned long api, lua_State* L, VirtualMachine* vm)
+{
 
-    return node;
+    stdext::hash_map<std::string, int>::const_iterator iterator = vm->expressions.begin();
+
+    while (iterator != vm->expressions.end())
+    {
+        luaL_unref_dll(api, L, GetRegistryIndex(api), iterator->second);
+        ++iterator;
+    }
+
+    vm->expressions.clear();
 
 }
 
@@ -3171,18 +5475,67 @@ unsigned int DebugBackend::GetCStack(HANDLE hThread, StackEntry stack[], unsigne
 
 }
 
-int DebugBackend::GetStackDepth(unsigned long api, lua_State* L) const
+int DebugBackend::GetStackDepth(unsigned long api, lua_State* L, int hint) const
 {
 
+    // lua_getstack walks down the stack to the requested level, so calling it
+    // for every level is quadratic in the depth. Instead we check the hint and
+    // then search for the first level that doesn't exist.
+
     lua_Debug ar;
 
-    int level = 0;
-    while (lua_getstack_dll(api, L, level, &ar))
+    int low  = 0;   // The depth is at least this.
+    int high = -1;  // The depth is at most this, or unknown if negative.
+
+    if (hint > 0)
+    {
+        if (lua_getstack_dll(api, L, hint - 1, &ar))
+        {
+            low = hint;
+        }
+        else
+        {
+            high = hint - 1;
+        }
+    }
+
+    if (high < 0)
+    {
+
+        if (!lua_getstack_dll(api, L, low, &ar))
+        {
+            return low;
+        }
+
+        // Double the step until we're past the top of the stack.
+
+        int step = 1;
+        ++low;
+
+        while (lua_getstack_dll(api, L, low + step - 1, &ar))
+        {
+            low  += step;
+            step *= 2;
+        }
+
+        high = low + step - 1;
+
+    }
+
+    while (low < high)
     {
-        ++level;
+        int level = low + (high - low) / 2;
+        if (lua_getstack_dll(api, L, level, &ar))
+        {
+            low = level + 1;
+        }
+        else
+        {
+            high = level;
+        }
     }
 
-    return level;
+    return low;
 
 }
 
@@ -3257,7 +5610,7 @@ unsigned int DebugBackend::GetUnifiedStack(unsigned long api, const StackEntry n
                 break;
             }
 
-            stack[stackSize].scriptIndex = GetScriptIndex(GetSource(api, ar));
+            stack[stackSize].scriptIndex = GetScriptIndexForSource(GetSource(api, ar));
             stack[stackSize].line        = GetCurrentLine(api, ar) - 1;
             
             strncpy(stack[stackSize].name, function, s_maxEntryNameLength);
@@ -26,6 +26,9 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 #include "Channel.h"
 #include "Protocol.h"
 #include "CriticalSection.h"
+#include "SourceIndex.h"
+#include "BreakpointSet.h"
+#include "HookFastPath.h"
 #include "LuaDll.h"
 
 #include <vector>
@@ -39,6 +42,7 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 //
 
 class TiXmlNode;
+class ValueWriter;
 
 /**
  * This class encapsulates the part of the debugger that runs inside the
@@ -129,9 +133,18 @@ public:
 
     /**
      * Evalates the expression. If there was an error evaluating the expression the
-     * method returns false and the error message is stored in the result.
+     * method returns false and the error message is stored in the result. If
+     * readOnly is true, assigning to a variable is an error. The state has to be
+     * stopped in WaitForContinue.
+     */
+    bool Evaluate(unsigned long api, lua_State* L, const std::string& expression, int stackLevel, bool readOnly, std::string& result);
+
+    /**
+     * Writes the page of the table with the handle starting at the specified
+     * element to the result. The handle comes from a table in a value that was
+     * returned by Evaluate since the VM last continued.
      */
-    bool Evaluate(unsigned long api, lua_State* L, const std::string& expression, int stackLevel, std::string& result);
+    bool ExpandTable(unsigned long api, lua_State* L, unsigned int handle, unsigned int start, std::string& result);
 
     /**
      * Evalates the expression. If there was an error evaluating the expression the
@@ -145,6 +158,13 @@ public:
      */
     static int StaticProtectedEvaluate(lua_State* L);
 
+    /**
+     * Evaluates the expression and writes the result to the event channel as an
+     * EventId_EvaluateResult tagged with the request id. The event channel isn't
+     * flushed so that several results can be sent together.
+     */
+    void WriteEvaluateResult(lua_State* L, unsigned int requestId, const std::string& expression, int stackLevel);
+
     /**
      * Gets the value of a variable. The variable can include member selection.
      */
@@ -156,14 +176,27 @@ public:
      */
     void ToggleBreakpoint(lua_State* L, unsigned int scriptIndex, unsigned int line);
     
-    void BreakpointsActiveForScript(int scriptIndex);
-    
     /**
-     * Returns whether any loaded script still have any breakpoints set
+     * Sets the condition for the breakpoint on the line. The breakpoint will only
+     * stop execution when the expression is true (or if it's empty), and then only
+     * on the hitCount time that happens (or every time if hitCount is 0). Setting
+     * a condition resets the hit count. If there is no breakpoint on the line the
+     * condition is ignored.
      */
-    bool GetHaveActiveBreakpoints();
+    void SetBreakpointCondition(unsigned int scriptIndex, unsigned int line, const std::string& expression, unsigned int hitCount);
 
-    void SetHaveActiveBreakpoints(bool breakpointsActive);
+    /**
+     * Turns the breakpoint on the line into a logpoint. When the breakpoint's
+     * condition is met, the message expression is evaluated and written to the
+     * output rather than stopping execution. An empty message turns it back into
+     * a normal breakpoint.
+     */
+    void SetLogpoint(unsigned int scriptIndex, unsigned int line, const std::string& message);
+
+    /**
+     * Returns whether any loaded script still have any breakpoints set
+     */
+    bool GetHaveActiveBreakpoints() const;
 
     void DeleteAllBreakpoints();
     /**
@@ -179,7 +212,22 @@ public:
      */
     int GetScriptIndex(const char* name) const;
 
-    bool StackHasBreakpoint(unsigned long api, lua_State* L);
+    /**
+     * Returns the index of the script with the specified source name, where the
+     * name is the source field from a lua_Debug. This is the same as GetScriptIndex
+     * but is faster since it caches by the address of the name, which Lua keeps
+     * the same for a chunk. The critical section must be held.
+     */
+    int GetScriptIndexForSource(const char* source);
+
+
+    /**
+     * Returns true if the function described by the debug info (which must
+     * have the "S" fields filled in) contains a breakpoint. If registerScript
+     * is true and the function's script hasn't been seen before, it's
+     * registered.
+     */
+    bool GetFunctionHasBreakpoint(unsigned long api, lua_State* L, lua_Debug* ar, bool registerScript);
 
     /**
      * Returns the class name associated with the metatable index. This makes
@@ -199,11 +247,44 @@ public:
      */
     void RegisterClassName(unsigned long api, lua_State* L, const char* name, int metaTable);
 
+    /**
+     * Sets the name of the VM that's displayed in the frontend. This is called
+     * by the decoda.set_vm_name Lua function.
+     */
+    void SetVmName(lua_State* L, const char* name);
+
     /**
      * Sends a text message to the front end.
      */
     void Message(const char* message, MessageType type = MessageType_Normal);
 
+    /**
+     * Handles the handshake from the frontend (see PackHandshake). The features
+     * supported by both sides are enabled and the result is sent back with
+     * EventId_Handshake.
+     */
+    void Handshake(unsigned int handshake);
+
+    /**
+     * Sets how script sources are sent to the frontend and acknowledges the
+     * change with an EventId_SourceEncoding event.
+     */
+    void SetSourceEncoding(SourceEncoding encoding);
+
+    /**
+     * Sends the full source for a script to the frontend. This is used when
+     * the frontend was only sent the hash of the source and needs the body.
+     */
+    void SendScriptSource(unsigned int scriptIndex);
+
+    /**
+     * Sets the file titles of the scripts that have breakpoints in the
+     * frontend. Once this is set, loading a script only waits for the frontend
+     * if the script's title is in the filter, since otherwise there are no
+     * breakpoints to send before the script starts running.
+     */
+    void SetLoadFilter(const std::vector<std::string>& titles);
+
     /**
      * Ignores the specified exception whenever it occurs.
      */
@@ -220,6 +301,12 @@ public:
      */
     void HookCallback(unsigned long api, lua_State* L, lua_Debug* ar);
 
+    /**
+     * Releases the per thread data for the calling thread. This is called
+     * when a thread exits.
+     */
+    void ThreadDetach();
+
     /**
      * Called when a new API is created.
      */
@@ -234,6 +321,18 @@ public:
 
 private:
 
+    /**
+     * Condition that has to be met for a breakpoint to stop execution.
+     */
+    struct BreakpointCondition
+    {
+        std::string     expression;     // Lua expression, or empty if there isn't one.
+        std::string     logMessage;     // Lua expression written to the output instead of stopping, or empty.
+        unsigned int    hitCount;       // Only stop on this hit, or on every hit if 0.
+        unsigned int    numHits;        // Number of times the breakpoint was reached with the expression true.
+        stdext::hash_map<lua_State*, int> functions;    // Compiled expression in each universe, as a registry reference.
+    };
+
     struct Script
     {
 
@@ -249,13 +348,24 @@ private:
 
         bool HasBreakpointsActive();
 
+        /**
+         * Moves the line to the first line at or after it that's valid for a
+         * breakpoint. Returns false if there isn't one.
+         */
+        bool GetValidLine(unsigned int& line) const;
+
         void ClearBreakpoints();
 
         std::string                 name;
         std::string                 source;
         std::string                 title;
-        std::vector<unsigned int>   breakpoints;    // Lines that have breakpoints on them.
+        bool                        isFile;         // The source came from a file the frontend can read.
+        unsigned long long          hash;           // Content hash of the source.
+        bool                        waitForLoad;    // The frontend was told we're waiting for CommandId_LoadDone.
+        BreakpointSet               breakpoints;    // Lines that have breakpoints on them.
+        stdext::hash_map<unsigned int, BreakpointCondition> conditions; // Conditions for the breakpoints that have them, by line.
         std::vector<unsigned int>   validLines;     // Lines that can have breakpoints on them.
+        std::vector<lua_State*>     universes;      // Universes of the virtual machines that loaded the script.
 
     };
 
@@ -278,9 +388,10 @@ private:
 
     /**
      * Blocks execution until the the debugger is instructed to continue
-     * executing.
+     * executing. Expressions can only be evaluated in the state while it's
+     * waiting here.
      */
-    void WaitForContinue();
+    void WaitForContinue(unsigned long api, lua_State* L);
 
     /**
      * Entry point into the command handling thread.
@@ -293,6 +404,12 @@ private:
      */
     static DWORD WINAPI StaticCommandThreadProc(LPVOID param);
 
+    /**
+     * Timer callback that sends the logpoint output buffered by all of the
+     * threads.
+     */
+    static VOID CALLBACK StaticLogTimerProc(PVOID param, BOOLEAN timerOrWaitFired);
+
     /**
      * Breaks from inside the script code. This will block until execution
      * is resumed.
@@ -331,22 +448,109 @@ private:
     bool GetStartupDirectory(char* path, int maxPathLength);
 
     /**
-     * Gets the value at location n on the stack as text. If expandTable is true
-     * then tables will be returned in their expanded form (i.e. "{ ... }")
+     * Writes the value at location n on the stack to the value stream. Tables
+     * are expanded up to maxDepth levels. Returns false if nothing could be
+     * written.
+     */
+    bool WriteValue(unsigned long api, lua_State* L, ValueWriter& writer, int n, int maxDepth = 10, const char* typeNameOverride = NULL, bool displayAsKey = false);
+
+    /**
+     * Writes the luabind class instance on the top of the stack to the value
+     * stream. Returns false if the value isn't a luabind class instance.
+     */
+    bool WriteLuaBindClassValue(unsigned long api, lua_State* L, ValueWriter& writer, unsigned int maxDepth, bool displayAsKey = false);
+
+    /**
+     * Writes the table at location t on the stack to the value stream,
+     * iterating over it in place.
+     */
+    bool WriteTable(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth = 10, const char* typeNameOverride = NULL);
+
+    /**
+     * Writes one page of the table at location t on the stack to the value
+     * stream, starting at the specified element. If there are more elements
+     * the table is given a handle so the frontend can ask for them, reusing
+     * ref if the table already has one. When start is where the last page
+     * for ref ended, the page picks up from there.
+     */
+    bool WritePagedTable(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth, const char* typeNameOverride, unsigned int start, int ref);
+
+    /**
+     * Pushes the next key and value of the table at location t after the key
+     * on the top of the stack like lua_next, skipping the keys in the array
+     * part which is arraySize long.
+     */
+    int NextHashElement(unsigned long api, lua_State* L, int t, int arraySize);
+
+    /**
+     * Returns the handle data for the table reference, or NULL if the virtual
+     * machine doesn't hold it. The critical section must be held.
+     */
+    TableRef* GetTableRef(VirtualMachine* vm, int ref);
+
+    /**
+     * Writes a reference to the table at location t on the stack if it's
+     * already been written by this writer and returns true. Otherwise the
+     * table is remembered so later occurrences refer back to it, which keeps
+     * tables that link to each other from being written over and over.
+     */
+    bool WriteTableRef(unsigned long api, lua_State* L, ValueWriter& writer, int t, int maxDepth, const char* typeNameOverride);
+
+    /**
+     * Returns true if tables in values are sent a page at a time.
+     */
+    bool GetPagedTables() const;
+
+    /**
+     * Returns true if the evaluate commands from the frontend can't assign to
+     * variables.
+     */
+    bool GetReadOnlyEvaluate() const;
+
+    /**
+     * Pushes a new nil sentinel for CreateEnvironment onto the stack.
+     */
+    void PushNilSentinel(unsigned long api, lua_State* L);
+
+    /**
+     * Marks the VMs as running so that nothing more is evaluated in them. The
+     * data cached while a VM was stopped is released by ReleaseBreakData once
+     * it wakes up.
+     */
+    void EndBreak();
+
+    /**
+     * Releases the data that's only valid while the VM is stopped: the handles
+     * for the tables in the values sent to the frontend and the cached
+     * environment. This has to be called on the VM's own thread since it
+     * copies assignments back into its locals and up values.
      */
-    TiXmlNode* GetValueAsText(unsigned long api, lua_State* L, int n, int maxDepth = 10, const char* typeNameOverride = NULL, bool displayAsKey = false) const;
+    void ReleaseBreakData(VirtualMachine* vm);
 
     /**
-     * Gets the value at location n on the stack as text. If expandTable is true
-     * then tables will be returned in their expanded form (i.e. "{ ... }")
+     * Pushes the nil sentinel, local table, up value table and environment
+     * table used to evaluate expressions at the stack level. These are built
+     * once per stop and stack level and reused by the rest of the watches.
      */
-    TiXmlNode* GetLuaBindClassValue(unsigned long api, lua_State* L, unsigned int maxDepth, bool displayAsKey = false) const;
+    bool PushEnvironment(unsigned long api, lua_State* L, VirtualMachine* vm, int stackLevel);
 
     /**
-     * Gets the table value at location n on the stack as text. Nested tables are
-     * not expanded.
+     * Copies any changes made through the cached environment back to the
+     * local and up values and releases the environment.
      */
-    TiXmlNode* GetTableAsText(unsigned long api, lua_State* L, int t, int maxDepth = 10, const char* typeNameOverride = NULL) const;
+    void ReleaseEnvironment(unsigned long api, lua_State* L, VirtualMachine* vm);
+
+    /**
+     * Pushes the compiled function for an expression, or an error message if
+     * it couldn't be compiled. The compiled functions are cached by the text
+     * of the expression, since the same watches are evaluated at every stop.
+     */
+    int LoadExpression(unsigned long api, lua_State* L, VirtualMachine* vm, const std::string& expression);
+
+    /**
+     * Releases the compiled expressions cached for the VM.
+     */
+    void ClearExpressions(unsigned long api, lua_State* L, VirtualMachine* vm);
 
     /**
      * Returns true if the name belongs to a Lua internal variable that we
@@ -374,9 +578,17 @@ private:
 
 private:
 
+    static const unsigned int s_capabilities = Capability_Compression | Capability_ContentHash |
+                                               Capability_LoadFilter | Capability_RingTransport |
+                                               Capability_AsyncEvaluate | Capability_BreakpointConditions |
+                                               Capability_Logpoints | Capability_BinaryValues |
+                                               Capability_PagedTables | Capability_ReadOnlyEvaluate;
+
     static const int s_maxModuleNameLength = 32;
     static const int s_maxEntryNameLength  = 256;
 
+    static const unsigned int s_ringConnectTimeout = 5000;  // Milliseconds to wait for the frontend to connect to the ring.
+
     enum Mode
     {
         Mode_Continue,
@@ -384,6 +596,16 @@ private:
         Mode_StepInto,
     };
     
+    /**
+     * Stored in the nil sentinel of an environment so that the chained table
+     * functions can tell how the environment is being used.
+     */
+    struct EnvironmentState
+    {
+        bool            readOnly;           // Assigning to a variable raises an error.
+        bool            modified;           // A local or up value has been assigned.
+    };
+
     struct Api
     {
         Api() : IndexChained(NULL), NewIndexChained(NULL) { }
@@ -398,6 +620,32 @@ private:
         std::string     name;
     };
 
+    /**
+     * Table that can be expanded with CommandId_ExpandTable, along with where
+     * the last page sent from it ended so the next one doesn't have to walk
+     * the table from the start. The elements are ordered with the array part
+     * (1 up to the first nil) first, followed by the rest in lua_next order.
+     */
+    struct TableRef
+    {
+        int             table;      // Registry reference to the table, which is its handle.
+        int             key;        // Registry reference to the key the next page follows in lua_next order, or LUA_NOREF to start at the first key.
+        unsigned int    position;   // Element the next page starts at.
+        int             arraySize;  // Number of elements in the array part, or -1 if the end of it hasn't been reached yet.
+    };
+
+    /**
+     * Entry in the shadow stack a virtual machine keeps to track which functions
+     * on the Lua stack contain breakpoints. The function is identified by its
+     * source name (which Lua interns) and the line it's defined on.
+     */
+    struct BreakpointFrame
+    {
+        const char*     source;
+        int             lineDefined;
+        bool            hasBreakpoint;
+    };
+
     struct VirtualMachine
     {
         lua_State*      L;
@@ -408,12 +656,86 @@ private:
         int             lastStepLine;
         int             lastStepScript;
         unsigned long   api;
+        lua_State*      universe;           // Shared by all of the threads of a state, or NULL if unknown.
         std::string     name;
         unsigned int    stackTop;
+        int             stackDepth;         // Stack depth counted from call and return events.
         bool            luaJitWorkAround;
-        bool            breakpointInStack;
-        bool            haveActiveBreakpoints;
-        std::string     lastFunctions;
+        std::vector<BreakpointFrame> breakpointFrames;  // Shadow stack of the functions that may have breakpoints.
+        int             numBreakpointFrames;    // Number of entries in breakpointFrames with a breakpoint.
+        bool            breakpointFramesValid;
+        unsigned int    breakpointFramesScriptGeneration;
+        unsigned int    breakpointFramesBreakpointGeneration;
+        volatile bool   haveActiveBreakpoints;
+        bool            stopped;            // Waiting in WaitForContinue, so expressions can be evaluated.
+        std::vector<TableRef> tableRefs;    // Tables that can be expanded with CommandId_ExpandTable.
+        int             environment;        // Registry reference to the cached environment used by Evaluate, or LUA_NOREF.
+        int             environmentStackLevel;
+        stdext::hash_map<std::string, int> expressions; // Registry references to the compiled expressions.
+    };
+
+    /**
+     * Remembers whether or not a function contains a breakpoint. The entry is
+     * only valid if no new scripts or code with breakpoints have been loaded
+     * and no breakpoints have changed since it was stored.
+     */
+    struct FunctionCacheEntry
+    {
+        const char*     source;
+        int             lineDefined;
+        int             lastLineDefined;
+        unsigned int    scriptGeneration;
+        unsigned int    breakpointGeneration;
+        bool            hasBreakpoint;
+    };
+
+    /**
+     * Maps the address of a source name to the index of its script. The entry
+     * is only valid if nothing has been loaded since it was stored.
+     */
+    struct ScriptCacheEntry
+    {
+        const char*     source;
+        int             scriptIndex;
+        unsigned int    loadGeneration;
+    };
+
+    /**
+     * Per thread record of the last state the hook was called for, so the hook
+     * can find the virtual machine without locking.
+     */
+    /**
+     * Logpoint output written by a thread that hasn't been sent yet. The owning
+     * thread adds to it and the log timer sends it.
+     */
+    struct LogBuffer
+    {
+        CriticalSection criticalSection;
+        std::string     text;
+        bool            orphaned;       // The thread has exited, so the buffer can be deleted once it's sent.
+    };
+
+    struct HookCache
+    {
+        lua_State*      L;
+        VirtualMachine* vm;
+        unsigned int    vmGeneration;   // Value of m_vmGeneration when the entry was stored.
+        LogBuffer*      logBuffer;      // Created the first time the thread hits a logpoint.
+    };
+
+    /**
+     * What RunHookFastPath needs to turn the hook off for one VM.
+     */
+    struct FastPathHook
+    {
+        bool GetIsContinuing() const;
+        void TurnOff();
+        void TurnOn();
+
+        DebugBackend*   backend;
+        unsigned long   api;
+        lua_State*      L;
+        VirtualMachine* vm;
     };
 
     struct StackEntry
@@ -425,6 +747,30 @@ private:
         unsigned int    line;
     };
 
+    /**
+     * Writes the encoding and source for the script to the event channel. If
+     * the source can't be usefully sent with the requested encoding, a
+     * different one is used.
+     */
+    void WriteScriptSource(const Script* script, SourceEncoding encoding);
+
+    /**
+     * Blocks until the frontend is done processing the load of the script,
+     * if the script was registered as one that waits for it.
+     */
+    void WaitForLoad(int scriptIndex);
+
+    /**
+     * Returns true if loading the script should wait until the frontend has
+     * had a chance to set breakpoints in it.
+     */
+    bool GetShouldWaitForLoad(const Script* script) const;
+
+    /**
+     * Converts a file title to the form used in the load filter.
+     */
+    static std::string GetLoadFilterKey(const std::string& title);
+
     /**
      * Waits for the specified event or the detached event.
      */
@@ -540,6 +886,10 @@ private:
      */
     void LogHookEvent(unsigned long api, lua_State* L, lua_Debug* ar);
 
+    /**
+     * Picks the hook mode for the virtual machine after a call or return
+     * event. The "S" fields of the hook event must already be filled in.
+     */
     void UpdateHookMode(unsigned long api, lua_State* L, lua_Debug* hookEvent);
 
     /**
@@ -562,9 +912,92 @@ private:
     void MergeTables(unsigned long api, lua_State* L, unsigned int tableIndex1, unsigned int tableIndex2) const;
 
     /**
-     * Gets the number of functions on the Lua stack.
+     * Checks the condition for the breakpoint on the line, which execution has
+     * just reached, and updates its hit count. Returns true if execution should
+     * stop. This must be called from the hook without the critical section held
+     * since the condition is evaluated in the virtual machine.
+     */
+    bool GetBreakpointConditionMet(unsigned long api, lua_State* L, VirtualMachine* vm, unsigned int scriptIndex, unsigned int line);
+
+    /**
+     * Queues the compiled functions for the condition to be released. They can
+     * only be released from a thread in the universe they were compiled in.
      */
-    int GetStackDepth(unsigned long api, lua_State* L) const;
+    void ReleaseBreakpointCondition(BreakpointCondition& condition);
+
+    /**
+     * Releases the compiled conditions queued by ReleaseBreakpointCondition
+     * that belong to the universe.
+     */
+    void ReleaseUnusedConditions(unsigned long api, lua_State* L, lua_State* universe);
+
+    /**
+     * Returns the universe for the Lua state. All of the threads created from
+     * the same state share the universe, which is identified by the first of
+     * them we attached to. Returns NULL if the universe can't be determined.
+     */
+    lua_State* GetUniverse(unsigned long api, lua_State* L) const;
+
+    /**
+     * Forgets everything recorded for a universe that's being closed. The
+     * compiled conditions are dropped without being released since their
+     * registry is going away with the state.
+     */
+    void RemoveUniverse(lua_State* universe);
+
+    /**
+     * Records that the script was loaded into the virtual machine's universe,
+     * arming the hook in that universe if the script has breakpoints.
+     */
+    void AddScriptUniverse(unsigned int scriptIndex, lua_State* L);
+
+    /**
+     * Called when the code for an existing script is loaded again. Discards
+     * the cached breakpoint information if the script has breakpoints.
+     */
+    void InvalidateBreakpointCaches(unsigned int scriptIndex);
+
+    /**
+     * Adds the number of breakpoints to the count for each universe the script
+     * was loaded into. The number may be negative. The critical section must
+     * be held so the counts stay in step with m_numBreakpoints.
+     */
+    void AddScriptBreakpoints(const Script* script, int numBreakpoints);
+
+    /**
+     * Returns true if a script loaded into the universe has a breakpoint. Since
+     * we don't know which scripts a NULL universe has loaded, this returns true
+     * for it if any script has a breakpoint.
+     */
+    bool GetUniverseHasBreakpoints(lua_State* universe) const;
+
+    /**
+     * Updates whether or not each virtual machine has active breakpoints. The
+     * hook is turned on in virtual machines that gained them; it's left to
+     * UpdateHookMode to turn it off in the others. This takes the critical
+     * section since it walks the virtual machines and the breakpoint counts.
+     */
+    void UpdateActiveBreakpoints();
+
+    /**
+     * Rebuilds the virtual machine's shadow stack of functions with breakpoints
+     * by walking the Lua stack. Functions below the deepest one with a breakpoint
+     * aren't included.
+     */
+    void RebuildBreakpointFrames(unsigned long api, lua_State* L, VirtualMachine* vm);
+
+    /**
+     * Removes the function that's returning from the virtual machine's shadow
+     * stack, along with any functions above it that were unwound by an error.
+     */
+    void PopBreakpointFrame(VirtualMachine* vm, const char* source, int lineDefined) const;
+
+    /**
+     * Gets the number of functions on the Lua stack. The hint is a guess at
+     * the depth; if it's right only two levels of the stack are checked,
+     * otherwise the depth is found with a binary search.
+     */
+    int GetStackDepth(unsigned long api, lua_State* L, int hint = 0) const;
 
     /**
      * Returns the virtual machine that corresponds to the specified Lua state.
@@ -572,6 +1005,64 @@ private:
      */
     VirtualMachine* GetVm(lua_State* L);
 
+    /**
+     * Returns the index in the function cache for the function.
+     */
+    static unsigned int GetFunctionCacheSlot(const char* source, int lineDefined);
+
+    /**
+     * Updates the name of the VM and tells the frontend if it changed. The
+     * critical section must be held.
+     */
+    void UpdateVmName(VirtualMachine* vm, const char* name);
+
+    /**
+     * Checks the legacy decoda_name global for a new name for the VM. This is
+     * only done occasionally since it requires a table lookup.
+     */
+    void PollVmName(unsigned long api, lua_State* L, VirtualMachine* vm);
+
+    /**
+     * Returns the virtual machine for the state from the calling thread's
+     * cache, or NULL if it isn't cached. This doesn't require the critical
+     * section to be held.
+     */
+    VirtualMachine* GetCachedVm(lua_State* L) const;
+
+    /**
+     * Stores the virtual machine for the state in the calling thread's cache.
+     * The critical section must be held.
+     */
+    void SetCachedVm(lua_State* L, VirtualMachine* vm);
+
+    /**
+     * Returns the calling thread's cache, creating it if necessary. Returns NULL
+     * if we couldn't allocate a TLS slot for it.
+     */
+    HookCache* GetHookCache();
+
+    /**
+     * Adds a line of logpoint output to the calling thread's buffer. The buffer
+     * is sent when it gets large, and otherwise by the log timer.
+     */
+    void WriteLog(const std::string& message);
+
+    /**
+     * Sends the logpoint output buffered by all of the threads as one message.
+     */
+    void FlushLogBuffers();
+
+    /**
+     * Sends logpoint output to the frontend as an EventId_Message.
+     */
+    void SendLog(std::string& text);
+
+    /**
+     * Stops the timer that flushes the logpoint output. This waits for the timer
+     * callback to finish, so the critical section must not be held.
+     */
+    void StopLogTimer();
+
     /**
      * Creates a call stack that unifies the native call stack and the script
      * call stack.
@@ -584,13 +1075,22 @@ private:
 
     typedef stdext::hash_map<lua_State*, VirtualMachine*>   StateToVmMap;
     typedef stdext::hash_map<std::string, unsigned int>     NameToScriptMap;
+    typedef stdext::hash_map<lua_State*, unsigned int>      UniverseToCountMap;
 
     static DebugBackend*            s_instance;
     static const unsigned int       s_maxStackSize  = 100;
+    static const unsigned int       s_functionCacheSize = 1024;     // Must be a power of 2.
+    static const unsigned int       s_scriptCacheSize   = 256;      // Must be a power of 2.
+    static char                     s_universeKey;                  // Address is the registry key for the universe.
+    static const unsigned int       s_logBufferSize     = 4096;     // Logpoint output is sent once a thread has this much.
+    static const unsigned int       s_logFlushInterval  = 100;      // Milliseconds between sending the logpoint output.
+    static const unsigned int       s_tablePageSize     = 100;      // Number of table elements sent at once when tables are paged.
+    static const int                s_pagedMaxDepth     = 2;        // Depth passed to WriteValue when tables are paged, so nested tables are only sent with a handle.
+    static const unsigned int       s_maxExpressions    = 256;      // Compiled expressions cached for each VM before the cache is cleared.
 
     FILE*                           m_log;
 
-    Mode                            m_mode;
+    volatile Mode                   m_mode;
     HANDLE                          m_stepEvent;
     HANDLE                          m_loadEvent;
     HANDLE                          m_detachEvent;
@@ -600,6 +1100,17 @@ private:
 
     std::vector<Script*>            m_scripts;
     NameToScriptMap                 m_nameToScript;
+    SourceIndex                     m_sourceIndex;
+
+    SourceEncoding                  m_sourceEncoding;
+    bool                            m_sendSourceEncoding;   // Load events include the encoding of the source.
+
+    unsigned int                    m_protocolVersion;
+    unsigned int                    m_capabilities;         // Capabilities supported by both sides.
+
+    bool                            m_useLoadFilter;        // Only wait for the frontend on loads of scripts in the filter.
+    bool                            m_sendWaitForLoad;      // Load events say if we're waiting for the frontend.
+    stdext::hash_set<std::string>   m_loadFilter;           // Keys of the file titles that have breakpoints.
 
     Channel                         m_eventChannel;
 
@@ -609,6 +1120,22 @@ private:
     std::list<ClassInfo>            m_classInfos;
     std::vector<VirtualMachine*>    m_vms;
     StateToVmMap                    m_stateToVm;
+
+    unsigned int                    m_scriptGeneration;     // Incremented whenever a new script or code with breakpoints is loaded.
+    unsigned int                    m_loadGeneration;       // Incremented whenever anything is loaded.
+    unsigned int                    m_breakpointGeneration; // Incremented whenever a breakpoint changes.
+    unsigned int                    m_numBreakpoints;       // Number of breakpoints in all of the scripts.
+    UniverseToCountMap              m_universeBreakpoints;  // Number of breakpoints in the scripts loaded into each universe.
+    std::vector<std::pair<lua_State*, int> > m_unusedConditions;    // Compiled conditions waiting to be released, with their universe.
+
+    HANDLE                          m_logTimer;             // Timer that sends the logpoint output, or NULL.
+    CriticalSection                 m_logBuffersLock;       // Controls access to m_logBuffers.
+    std::vector<LogBuffer*>         m_logBuffers;
+    FunctionCacheEntry              m_functionCache[s_functionCacheSize];
+    ScriptCacheEntry                m_scriptCache[s_scriptCacheSize];
+
+    DWORD                           m_hookCacheIndex;       // TLS slot holding the thread's HookCache.
+    volatile LONG                   m_vmGeneration;         // Incremented whenever a virtual machine is deleted.
     
     mutable CriticalSection         m_exceptionCriticalSection; // Controls access to ignoreExceptions 
     stdext::hash_set<std::string>   m_ignoreExceptions;
@@ -103,6 +103,7 @@ typedef void            (*lua_newtable_cdecl_t)         (lua_State*);
 typedef void            (*lua_createtable_cdecl_t)      (lua_State*, int, int);
 typedef int             (*lua_next_cdecl_t)             (lua_State*, int);
 typedef int             (*lua_rawequal_cdecl_t)         (lua_State *L, int idx1, int idx2);
+typedef const void*     (*lua_topointer_cdecl_t)        (lua_State *L, int idx);
 typedef int             (*lua_getmetatable_cdecl_t)     (lua_State*, int objindex);
 typedef int             (*lua_setmetatable_cdecl_t)     (lua_State*, int objindex);
 typedef int             (*luaL_ref_cdecl_t)             (lua_State *L, int t);
@@ -176,6 +177,7 @@ typedef void            (__stdcall *lua_newtable_stdcall_t)       (lua_State*);
 typedef void            (__stdcall *lua_createtable_stdcall_t)    (lua_State*, int, int);
 typedef int             (__stdcall *lua_next_stdcall_t)           (lua_State*, int);
 typedef int             (__stdcall *lua_rawequal_stdcall_t)       (lua_State *L, int idx1, int idx2);
+typedef const void*     (__stdcall *lua_topointer_stdcall_t)      (lua_State *L, int idx);
 typedef int             (__stdcall *lua_getmetatable_stdcall_t)   (lua_State*, int objindex);
 typedef int             (__stdcall *lua_setmetatable_stdcall_t)   (lua_State*, int objindex);
 typedef int             (__stdcall *luaL_ref_stdcall_t)           (lua_State *L, int t);
@@ -273,6 +275,7 @@ struct LuaInterface
     lua_createtable_cdecl_t      lua_createtable_dll_cdecl;
     lua_next_cdecl_t             lua_next_dll_cdecl;
     lua_rawequal_cdecl_t         lua_rawequal_dll_cdecl;
+    lua_topointer_cdecl_t        lua_topointer_dll_cdecl;
     lua_getmetatable_cdecl_t     lua_getmetatable_dll_cdecl;
     lua_setmetatable_cdecl_t     lua_setmetatable_dll_cdecl;
     luaL_ref_cdecl_t             luaL_ref_dll_cdecl;
@@ -347,6 +350,7 @@ struct LuaInterface
     lua_createtable_stdcall_t    lua_createtable_dll_stdcall;
     lua_next_stdcall_t           lua_next_dll_stdcall;
     lua_rawequal_stdcall_t       lua_rawequal_dll_stdcall;
+    lua_topointer_stdcall_t      lua_topointer_dll_stdcall;
     lua_getmetatable_stdcall_t   lua_getmetatable_dll_stdcall;
     lua_setmetatable_stdcall_t   lua_setmetatable_dll_stdcall;
     luaL_ref_stdcall_t           luaL_ref_dll_stdcall;
@@ -369,6 +373,7 @@ struct LuaInterface
     lua_checkstack_stdcall_t     lua_checkstack_dll_stdcall;
 
     lua_CFunction                DecodaOutput;
+    lua_CFunction                DecodaSetVmName;
     lua_CFunction                CPCallHandler;
     lua_Hook                     HookHandler;
 
@@ -538,6 +543,34 @@ __declspec(naked) int DecodaOutput(unsigned long api, lua_State* L)
 
 }
 
+#pragma auto_inline(off)
+int DecodaSetVmNameWorker(unsigned long api, lua_State* L, bool& stdcall)
+{
+
+    stdcall = g_interfaces[api].stdcall;
+
+    const char* name = lua_tostring_dll(api, L, 1);
+    DebugBackend::Get().SetVmName(L, name);
+    
+    return 0;
+
+}
+#pragma auto_inline()
+
+__declspec(naked) int DecodaSetVmName(unsigned long api, lua_State* L)
+{
+
+    int result;
+    bool stdcall;
+
+    INTERCEPT_PROLOG()
+
+    result = DecodaSetVmNameWorker(api, L, stdcall);
+
+    INTERCEPT_EPILOG(4)
+
+}
+
 #pragma auto_inline(off)
 int CPCallHandlerWorker(unsigned long api, lua_State* L, bool& stdcall)
 {
@@ -945,7 +978,19 @@ bool GetAreInterceptsEnabled()
 
 void RegisterDebugLibrary(unsigned long api, lua_State* L)
 {
+
     lua_register_dll(api, L, "decoda_output", g_interfaces[api].DecodaOutput);
+
+    lua_newtable_dll(api, L);
+
+    lua_pushcfunction_dll(api, L, g_interfaces[api].DecodaOutput);
+    lua_setfield_dll(api, L, -2, "output");
+
+    lua_pushcfunction_dll(api, L, g_interfaces[api].DecodaSetVmName);
+    lua_setfield_dll(api, L, -2, "set_vm_name");
+
+    lua_setglobal_dll(api, L, "decoda");
+
 }
 
 int GetGlobalsIndex(unsigned long api)
@@ -1757,6 +1802,20 @@ int lua_rawequal_dll(unsigned long api, lua_State *L, int idx1, int idx2)
     }
 }
 
+const void* lua_topointer_dll(unsigned long api, lua_State *L, int idx)
+{
+    if (g_interfaces[api].lua_topointer_dll_cdecl != NULL)
+    {
+        return g_interfaces[api].lua_topointer_dll_cdecl(L, idx);
+    }
+    else if (g_interfaces[api].lua_topointer_dll_stdcall != NULL)
+    {
+        return g_interfaces[api].lua_topointer_dll_stdcall(L, idx);
+    }
+    // Not available, so values can't be identified.
+    return NULL;
+}
+
 int lua_getmetatable_dll(unsigned long api, lua_State* L, int index)
 {
     if (g_interfaces[api].lua_getmetatable_dll_cdecl != NULL)
@@ -2111,6 +2170,7 @@ void FinishLoadingLua(unsigned long api, bool stdcall)
         SET_STDCALL(lua_load_510);
         SET_STDCALL(lua_next);
         SET_STDCALL(lua_rawequal);
+        SET_STDCALL(lua_topointer);
         SET_STDCALL(lua_getmetatable);
         SET_STDCALL(lua_setmetatable);
         SET_STDCALL(luaL_ref);
@@ -3328,6 +3388,7 @@ bool LoadLuaFunctions(const stdext::hash_map<std::string, DWORD64>& symbols, HAN
     GET_FUNCTION(lua_load);
     GET_FUNCTION(lua_next);
     GET_FUNCTION(lua_rawequal);
+    GET_FUNCTION_OPTIONAL(lua_topointer);
     GET_FUNCTION(lua_getmetatable);
     GET_FUNCTION(lua_setmetatable);
     GET_FUNCTION_OPTIONAL(luaL_ref);
@@ -3402,9 +3463,10 @@ bool LoadLuaFunctions(const stdext::hash_map<std::string, DWORD64>& symbols, HAN
     
     // Setup our API.
 
-    luaInterface.DecodaOutput  = (lua_CFunction)InstanceFunction(DecodaOutput, api);
-    luaInterface.CPCallHandler = (lua_CFunction)InstanceFunction(CPCallHandler, api);
-    luaInterface.HookHandler   = (lua_Hook)InstanceFunction(HookHandler, api);
+    luaInterface.DecodaOutput    = (lua_CFunction)InstanceFunction(DecodaOutput, api);
+    luaInterface.DecodaSetVmName = (lua_CFunction)InstanceFunction(DecodaSetVmName, api);
+    luaInterface.CPCallHandler   = (lua_CFunction)InstanceFunction(CPCallHandler, api);
+    luaInterface.HookHandler     = (lua_Hook)InstanceFunction(HookHandler, api);
 
     g_interfaces.push_back( luaInterface );
 
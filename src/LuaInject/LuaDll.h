@@ -78,6 +78,7 @@ int             lua_pcall_dll           (unsigned long api, lua_State*, int, int
 void            lua_newtable_dll        (unsigned long api, lua_State*);
 int             lua_next_dll            (unsigned long api, lua_State*, int);
 int             lua_rawequal_dll        (unsigned long api, lua_State *L, int idx1, int idx2);
+const void*     lua_topointer_dll       (unsigned long api, lua_State *L, int idx);
 int             lua_getmetatable_dll    (unsigned long api, lua_State*, int objindex);
 int             lua_setmetatable_dll    (unsigned long api, lua_State* L, int index);
 int             luaL_loadfile_dll       (unsigned long api, lua_State*, const char*);
@@ -143,7 +144,9 @@ bool InstallLuaHooker(HINSTANCE hInstance, const char* symbolsDirectory);
 bool GetIsLuaLoaded();
 
 /**
- * Registers the "luacode" Lua library with the state.
+ * Registers the debugger's Lua functions with the state. These are the
+ * decoda_output global and the decoda table (decoda.output and
+ * decoda.set_vm_name).
  */
 void RegisterDebugLibrary(unsigned long api, lua_State* L);
 
@@ -46,6 +46,10 @@ BOOL WINAPI DllMain(HINSTANCE hInstance, DWORD reason, LPVOID reserved)
         }
 
     }
+    else if (reason == DLL_THREAD_DETACH)
+    {
+        DebugBackend::Get().ThreadDetach();
+    }
     else if (reason == DLL_PROCESS_DETACH)
     {
         DebugBackend::Destroy();
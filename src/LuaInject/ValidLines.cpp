@@ -0,0 +1,575 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ValidLines.h"
+
+#include <string.h>
+#include <string>
+
+/**
+ * Returns the level of the long bracket that opens at the position, or -1 if
+ * there isn't one. The level is the number of = signs between the brackets.
+ */
+static int GetLongBracketLevel(const char* source, size_t size, size_t position)
+{
+
+    if (position >= size || source[position] != '[')
+    {
+        return -1;
+    }
+
+    size_t end = position + 1;
+
+    while (end < size && source[end] == '=')
+    {
+        ++end;
+    }
+
+    if (end < size && source[end] == '[')
+    {
+        return static_cast<int>(end - position - 1);
+    }
+
+    return -1;
+
+}
+
+/**
+ * Returns true if a long bracket of the specified level closes at the position.
+ */
+static bool GetIsLongBracketClose(const char* source, size_t size, size_t position, int level)
+{
+
+    if (position + level + 1 >= size || source[position] != ']')
+    {
+        return false;
+    }
+
+    for (int i = 1; i <= level; ++i)
+    {
+        if (source[position + i] != '=')
+        {
+            return false;
+        }
+    }
+
+    return source[position + level + 1] == ']';
+
+}
+
+/**
+ * Skips over the newline at the position, treating \r\n and \n\r as a single
+ * newline the way the Lua lexer does. Returns the position after it.
+ */
+static size_t SkipNewline(const char* source, size_t size, size_t position)
+{
+
+    char c = source[position];
+    ++position;
+
+    if (position < size && (source[position] == '\r' || source[position] == '\n') && source[position] != c)
+    {
+        ++position;
+    }
+
+    return position;
+
+}
+
+/**
+ * Skips over the long string or comment that opens at the position, counting
+ * the lines in it. Returns the position after the closing bracket.
+ */
+static size_t SkipLongBracket(const char* source, size_t size, size_t position, int level, unsigned int& line)
+{
+
+    position += level + 2;
+
+    while (position < size)
+    {
+
+        char c = source[position];
+
+        if (c == '\r' || c == '\n')
+        {
+            position = SkipNewline(source, size, position);
+            ++line;
+        }
+        else if (GetIsLongBracketClose(source, size, position, level))
+        {
+            return position + level + 2;
+        }
+        else
+        {
+            ++position;
+        }
+
+    }
+
+    return position;
+
+}
+
+/**
+ * Skips over the quoted string that starts at the position, counting the lines
+ * continued with a backslash. Returns the position after the closing quote.
+ */
+static size_t SkipQuotedString(const char* source, size_t size, size_t position, unsigned int& line)
+{
+
+    char quote = source[position];
+    ++position;
+
+    while (position < size)
+    {
+
+        char c = source[position];
+
+        if (c == quote)
+        {
+            return position + 1;
+        }
+        else if (c == '\r' || c == '\n')
+        {
+            // Unfinished string; the newline is left for the caller.
+            return position;
+        }
+        else if (c == '\\' && position + 1 < size)
+        {
+
+            ++position;
+            c = source[position];
+
+            if (c == '\r' || c == '\n')
+            {
+                position = SkipNewline(source, size, position);
+                ++line;
+            }
+            else if (c == 'z')
+            {
+
+                // Lua 5.2 skips the whitespace (including newlines) after \z.
+
+                ++position;
+
+                while (position < size && (source[position] == ' ' || source[position] == '\t' ||
+                       source[position] == '\r' || source[position] == '\n'))
+                {
+                    if (source[position] == '\r' || source[position] == '\n')
+                    {
+                        position = SkipNewline(source, size, position);
+                        ++line;
+                    }
+                    else
+                    {
+                        ++position;
+                    }
+                }
+
+            }
+            else
+            {
+                ++position;
+            }
+
+        }
+        else
+        {
+            ++position;
+        }
+
+    }
+
+    return position;
+
+}
+
+/**
+ * Adds the line to the end of the list if it isn't already there.
+ */
+static void AddValidLine(std::vector<unsigned int>& validLines, unsigned int line)
+{
+    if (validLines.empty() || validLines.back() != line)
+    {
+        validLines.push_back(line);
+    }
+}
+
+/**
+ * Returns true if the character can start a Lua name.
+ */
+static bool GetIsNameStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+/**
+ * Returns true if the character can continue a Lua name.
+ */
+static bool GetIsNameChar(char c)
+{
+    return GetIsNameStart(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * Returns the position after the number that starts at the position.
+ */
+static size_t SkipNumber(const char* source, size_t size, size_t position)
+{
+
+    // Hexadecimal numbers have p exponents rather than e exponents.
+    char exponent = 'e';
+
+    if (source[position] == '0' && position + 1 < size && (source[position + 1] == 'x' || source[position + 1] == 'X'))
+    {
+        exponent = 'p';
+        position += 2;
+    }
+
+    while (position < size)
+    {
+        char c = source[position];
+        if ((c == '+' || c == '-') && (source[position - 1] | 0x20) == exponent)
+        {
+            ++position;
+        }
+        else if (GetIsNameChar(c) || c == '.')
+        {
+            ++position;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return position;
+
+}
+
+/**
+ * Returns the length of the operator or punctuation that starts at the
+ * position.
+ */
+static size_t GetOperatorLength(const char* source, size_t size, size_t position)
+{
+
+    static const char* operators[] = { "...", "==", "~=", "<=", ">=", "..", "::", "//", "<<", ">>" };
+
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i)
+    {
+        size_t length = strlen(operators[i]);
+        if (position + length <= size && strncmp(source + position, operators[i], length) == 0)
+        {
+            return length;
+        }
+    }
+
+    return 1;
+
+}
+
+/**
+ * Block opened by a keyword, and the bracket nesting it was opened at.
+ */
+struct ValidLinesBlock
+{
+    enum Type
+    {
+        Type_Function,
+        Type_Block,         // Closed by end.
+        Type_Loop,          // A while or for whose do hasn't been reached.
+        Type_Repeat,        // Closed by until.
+    };
+
+    Type            type;
+    unsigned int    bracketDepth;
+};
+
+void GetValidLines(const char* source, size_t size, std::vector<unsigned int>& validLines)
+{
+
+    validLines.clear();
+
+    size_t position = 0;
+    unsigned int line = 0;
+
+    // Lua skips the first line if it starts with #, so that the file can be
+    // used as a Unix shell script.
+    if (size > 0 && source[0] == '#')
+    {
+        while (position < size && source[position] != '\r' && source[position] != '\n')
+        {
+            ++position;
+        }
+    }
+
+    // A line has code on it if a statement starts on it. Tokens inside
+    // brackets or after an operator are the continuation of an expression
+    // that started on an earlier line, and closers like end and else don't
+    // generate any code, except for the end of a function, which is where
+    // the return at the end of the function is placed.
+
+    std::vector<ValidLinesBlock> blocks;
+
+    unsigned int bracketDepth    = 0;       // Brackets open in the current function.
+    bool         operandExpected = false;   // The last token needs something after it.
+    bool         labelOpen       = false;
+
+    while (position < size)
+    {
+
+        char c = source[position];
+
+        if (c == '\r' || c == '\n')
+        {
+            position = SkipNewline(source, size, position);
+            ++line;
+            continue;
+        }
+        else if (c == ' ' || c == '\t' || c == '\f' || c == '\v')
+        {
+            ++position;
+            continue;
+        }
+        else if (c == '-' && position + 1 < size && source[position + 1] == '-')
+        {
+
+            position += 2;
+
+            int level = GetLongBracketLevel(source, size, position);
+
+            if (level >= 0)
+            {
+                position = SkipLongBracket(source, size, position, level, line);
+            }
+            else
+            {
+                while (position < size && source[position] != '\r' && source[position] != '\n')
+                {
+                    ++position;
+                }
+            }
+
+            continue;
+
+        }
+
+        bool statementStart = bracketDepth == 0 && !operandExpected;
+        int  level          = GetLongBracketLevel(source, size, position);
+
+        if (level >= 0 || c == '"' || c == '\'')
+        {
+
+            unsigned int startLine = line;
+
+            if (level >= 0)
+            {
+                position = SkipLongBracket(source, size, position, level, line);
+            }
+            else
+            {
+                position = SkipQuotedString(source, size, position, line);
+            }
+
+            // Lua gives the code for a string that spans several lines the line
+            // where the string ends.
+            if (line != startLine)
+            {
+                AddValidLine(validLines, line);
+            }
+
+            operandExpected = false;
+
+        }
+        else if (GetIsNameStart(c))
+        {
+
+            size_t start = position;
+
+            while (position < size && GetIsNameChar(source[position]))
+            {
+                ++position;
+            }
+
+            std::string name(source + start, position - start);
+
+            if (name == "function")
+            {
+
+                if (statementStart)
+                {
+                    AddValidLine(validLines, line);
+                }
+
+                ValidLinesBlock block;
+                block.type         = ValidLinesBlock::Type_Function;
+                block.bracketDepth = bracketDepth;
+                blocks.push_back(block);
+
+                bracketDepth    = 0;
+                operandExpected = false;
+
+            }
+            else if (name == "end")
+            {
+
+                if (!blocks.empty())
+                {
+                    if (blocks.back().type == ValidLinesBlock::Type_Function)
+                    {
+                        AddValidLine(validLines, line);
+                    }
+                    bracketDepth = blocks.back().bracketDepth;
+                    blocks.pop_back();
+                }
+
+                operandExpected = false;
+
+            }
+            else if (name == "if" || name == "while" || name == "for")
+            {
+
+                if (statementStart)
+                {
+                    AddValidLine(validLines, line);
+                }
+
+                ValidLinesBlock block;
+                block.type         = name == "if" ? ValidLinesBlock::Type_Block : ValidLinesBlock::Type_Loop;
+                block.bracketDepth = bracketDepth;
+                blocks.push_back(block);
+
+                operandExpected = true;
+
+            }
+            else if (name == "do" || name == "repeat")
+            {
+
+                if (name == "do" && !blocks.empty() && blocks.back().type == ValidLinesBlock::Type_Loop)
+                {
+                    blocks.back().type = ValidLinesBlock::Type_Block;
+                }
+                else
+                {
+                    ValidLinesBlock block;
+                    block.type         = name == "do" ? ValidLinesBlock::Type_Block : ValidLinesBlock::Type_Repeat;
+                    block.bracketDepth = bracketDepth;
+                    blocks.push_back(block);
+                }
+
+                operandExpected = false;
+
+            }
+            else if (name == "until")
+            {
+
+                if (statementStart)
+                {
+                    AddValidLine(validLines, line);
+                }
+
+                if (!blocks.empty())
+                {
+                    bracketDepth = blocks.back().bracketDepth;
+                    blocks.pop_back();
+                }
+
+                operandExpected = true;
+
+            }
+            else if (name == "then" || name == "else")
+            {
+                operandExpected = false;
+            }
+            else if (name == "and" || name == "or" || name == "not" || name == "in")
+            {
+                operandExpected = true;
+            }
+            else if (name == "nil" || name == "true" || name == "false")
+            {
+                operandExpected = false;
+            }
+            else
+            {
+
+                // Names and the keywords that start statements.
+                if (statementStart)
+                {
+                    AddValidLine(validLines, line);
+                }
+
+                operandExpected = name == "local" || name == "return" || name == "elseif" || name == "goto";
+
+            }
+
+        }
+        else if ((c >= '0' && c <= '9') || (c == '.' && position + 1 < size && source[position + 1] >= '0' && source[position + 1] <= '9'))
+        {
+            position = SkipNumber(source, size, position);
+            operandExpected = false;
+        }
+        else
+        {
+
+            size_t length = GetOperatorLength(source, size, position);
+            position += length;
+
+            if (length == 2 && c == ':' && source[position - 1] == ':')
+            {
+                // Labels don't generate any code.
+                labelOpen       = !labelOpen;
+                operandExpected = labelOpen;
+            }
+            else if (c == '(' || c == '[' || c == '{')
+            {
+                // A statement like (f or g)() is rare enough, and impossible to
+                // tell apart from a call continued on the next line, that an
+                // opening parenthesis is always treated as a continuation.
+                ++bracketDepth;
+                operandExpected = false;
+            }
+            else if (c == ')' || c == ']' || c == '}')
+            {
+                if (bracketDepth > 0)
+                {
+                    --bracketDepth;
+                }
+                operandExpected = false;
+            }
+            else if (c == ';' || length == 3)
+            {
+                operandExpected = false;
+            }
+            else
+            {
+                // Everything else is a binary or unary operator, or a comma,
+                // a field access or an assignment, all of which need to be
+                // followed by more of the expression.
+                operandExpected = true;
+            }
+
+        }
+
+    }
+
+}
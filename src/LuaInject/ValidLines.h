@@ -0,0 +1,41 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef VALID_LINES_H
+#define VALID_LINES_H
+
+#include <vector>
+#include <stddef.h>
+
+/**
+ * Gets the lines of the Lua source code that can have breakpoints on them,
+ * which are the lines where a statement starts, plus the end of each function
+ * and the last line of strings that span several lines. Lines that only have
+ * whitespace, comments, or closers like end, else and ) on them, and lines
+ * that continue an expression from an earlier line, aren't included. This
+ * covers the functions defined in the script as well as the main chunk,
+ * which lua_getinfo can't give us without running the code. The line numbers
+ * are zero based and are returned in sorted order.
+ */
+void GetValidLines(const char* source, size_t size, std::vector<unsigned int>& validLines);
+
+#endif
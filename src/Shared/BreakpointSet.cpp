@@ -0,0 +1,69 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "BreakpointSet.h"
+
+#include <algorithm>
+
+bool BreakpointSet::GetHasBreakpointInRange(unsigned int start, unsigned int end) const
+{
+    // The list is sorted, so this only needs to check the first breakpoint
+    // at or after the start of the range.
+    std::vector<unsigned int>::const_iterator first = std::lower_bound(m_lines.begin(), m_lines.end(), start);
+    return first != m_lines.end() && *first < end;
+}
+
+bool BreakpointSet::Toggle(unsigned int line)
+{
+
+    std::vector<unsigned int>::iterator result = std::lower_bound(m_lines.begin(), m_lines.end(), line);
+
+    if (line >= m_lineFlags.size())
+    {
+        m_lineFlags.resize(line + 1, 0);
+    }
+
+    if (result == m_lines.end() || *result != line)
+    {
+        m_lines.insert(result, line);
+        m_lineFlags[line] = 1;
+        return true;
+    }
+    else
+    {
+        m_lines.erase(result);
+        m_lineFlags[line] = 0;
+        return false;
+    }
+
+}
+
+void BreakpointSet::Clear()
+{
+    m_lines.clear();
+    m_lineFlags.clear();
+}
+
+unsigned int BreakpointSet::GetNumBreakpoints() const
+{
+    return static_cast<unsigned int>(m_lines.size());
+}
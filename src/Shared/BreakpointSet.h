@@ -0,0 +1,78 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BREAKPOINT_SET_H
+#define BREAKPOINT_SET_H
+
+#include <vector>
+
+/**
+ * The lines in a script that have breakpoints on them. Checking a single
+ * line is done for every line the debugger executes, so it's inline and is a
+ * bounds check and a byte read; checking a range of lines is done for every
+ * function call and is a binary search.
+ */
+class BreakpointSet
+{
+
+public:
+
+    /**
+     * Returns true if there is a breakpoint on the line.
+     */
+    bool GetHasBreakpoint(unsigned int line) const;
+
+    /**
+     * Returns true if there is a breakpoint on any of the lines from start
+     * up to but not including end.
+     */
+    bool GetHasBreakpointInRange(unsigned int start, unsigned int end) const;
+
+    /**
+     * Adds a breakpoint on the line if there isn't one, otherwise removes it.
+     * Returns true if the breakpoint was added.
+     */
+    bool Toggle(unsigned int line);
+
+    /**
+     * Removes all of the breakpoints.
+     */
+    void Clear();
+
+    /**
+     * Returns the number of lines with breakpoints.
+     */
+    unsigned int GetNumBreakpoints() const;
+
+private:
+
+    std::vector<unsigned int>   m_lines;        // Lines that have breakpoints on them, sorted.
+    std::vector<unsigned char>  m_lineFlags;    // Indexed by line; non-zero if the line has a breakpoint.
+
+};
+
+inline bool BreakpointSet::GetHasBreakpoint(unsigned int line) const
+{
+    return line < m_lineFlags.size() && m_lineFlags[line] != 0;
+}
+
+#endif
@@ -21,182 +21,196 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "Channel.h"
-#include <stdio.h>
-#include <assert.h>
+#include "Transport.h"
+#include "CriticalSectionLock.h"
+
+#include <string.h>
 
 Channel::Channel()
 {
-    m_pipe      = INVALID_HANDLE_VALUE;
-    m_doneEvent = INVALID_HANDLE_VALUE;
-    m_readEvent = INVALID_HANDLE_VALUE;
-    m_creator   = false;
+    m_transport     = Transport::CreateDefault();
+    m_nextTransport = NULL;
+    m_open          = false;
+    m_readPosition  = 0;
+    m_committedSize = s_headerSize;
+    m_messageDepth  = 0;
+
+    // Reserve space at the start of the message buffer for the frame header
+    // so the frame can be sent without copying the payload.
+    m_writeBuffer.resize(s_headerSize);
 }
 
-Channel::~Channel()
+Channel::Channel(Transport* transport)
 {
-    Destroy();
+    m_transport     = transport;
+    m_nextTransport = NULL;
+    m_open          = false;
+    m_readPosition  = 0;
+    m_committedSize = s_headerSize;
+    m_messageDepth  = 0;
+
+    m_writeBuffer.resize(s_headerSize);
 }
 
-bool Channel::Create(const char* name)
+Channel::~Channel()
 {
 
-    char pipeName[256];
-    _snprintf(pipeName, 256, "\\\\.\\pipe\\%s", name);
-
-    DWORD bufferSize = 2048;
+    Destroy();
 
-    m_pipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, 1, bufferSize, bufferSize, 0, NULL);
+    delete m_transport;
+    delete m_nextTransport;
 
-    if (m_pipe != INVALID_HANDLE_VALUE)
+    for (unsigned int i = 0; i < m_oldTransports.size(); ++i)
     {
-        // Remember that we're the creator of the pipe so we can properly
-        // destroy it.
-        m_creator = true;
+        delete m_oldTransports[i];
     }
 
-    if (m_pipe != INVALID_HANDLE_VALUE)
-    {
-        m_doneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        m_readEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-    }
-
-    return m_pipe != INVALID_HANDLE_VALUE;
+}
 
+bool Channel::Create(const char* name)
+{
+    m_readBuffer.clear();
+    m_readPosition = 0;
+    m_open = m_transport->Create(name);
+    return m_open;
 }
 
 bool Channel::Connect(const char* name)
 {
-
-    char pipeName[256];
-    _snprintf(pipeName, 256, "\\\\.\\pipe\\%s", name);
-
-    m_pipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-
-    if (m_pipe != INVALID_HANDLE_VALUE)
-    {
-        m_doneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        m_readEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        DWORD flags = PIPE_READMODE_MESSAGE;
-        SetNamedPipeHandleState(m_pipe, &flags, NULL, NULL);
-    }
-
-    return m_pipe != INVALID_HANDLE_VALUE;
-
+    m_readBuffer.clear();
+    m_readPosition = 0;
+    m_open = m_transport->Connect(name);
+    return m_open;
 }
 
 bool Channel::WaitForConnection()
 {
-    return ConnectNamedPipe(m_pipe, NULL) != FALSE;
+    return m_transport->WaitForConnection();
 }
 
 void Channel::Destroy()
 {
 
-    if (m_creator)
+    m_transport->Destroy();
+    m_open = false;
+
+    if (m_nextTransport != NULL)
     {
-        FlushFileBuffers(m_pipe);
-        DisconnectNamedPipe(m_pipe);
-        m_creator = false;
+        m_nextTransport->Destroy();
     }
 
-    if (m_doneEvent != INVALID_HANDLE_VALUE)
+    for (unsigned int i = 0; i < m_oldTransports.size(); ++i)
     {
-        
-        // Signal the done event so that if we're currently blocked reading,
-        // we'll stop.
+        m_oldTransports[i]->Destroy();
+    }
+
+    // The read buffer is left alone since another thread may still be
+    // returning from a blocked read; it's reset when the channel is reopened.
+    CriticalSectionLock lock(m_writeLock);
+    m_writeBuffer.resize(s_headerSize);
+    m_committedSize = s_headerSize;
 
-        SetEvent(m_doneEvent);
+}
 
-        CloseHandle(m_doneEvent);
-        m_doneEvent = INVALID_HANDLE_VALUE;
+bool Channel::SwitchTransport(Transport* transport)
+{
 
-    }
+    CriticalSectionLock lock(m_writeLock);
 
-    if (m_readEvent != INVALID_HANDLE_VALUE)
+    bool result = Flush();
+
+    if (result)
     {
-        CloseHandle(m_readEvent);
-        m_readEvent = INVALID_HANDLE_VALUE;
+        unsigned int marker = s_switchFrame;
+        result = m_transport->Write(&marker, s_headerSize);
     }
 
-    if (m_pipe != INVALID_HANDLE_VALUE)
+    if (!result)
     {
-        CloseHandle(m_pipe);
-        m_pipe = INVALID_HANDLE_VALUE;
+        delete transport;
+        return false;
     }
 
+    m_oldTransports.push_back(m_transport);
+    m_transport = transport;
+
+    return true;
+
 }
 
-bool Channel::Write(const void* buffer, unsigned int length)
+void Channel::SetNextTransport(Transport* transport)
 {
+    CriticalSectionLock lock(m_writeLock);
+    delete m_nextTransport;
+    m_nextTransport = transport;
+}
 
-    assert(m_pipe != INVALID_HANDLE_VALUE);
+void Channel::BeginMessage()
+{
+    // The lock is held until the matching EndMessage.
+    m_writeLock.Enter();
+    ++m_messageDepth;
+}
 
-    if (length == 0)
+void Channel::EndMessage()
+{
+
+    if (--m_messageDepth == 0)
     {
-        // Because of the way message pipes work, writing 0 is different than
-        // writing nothing.
-        return true;
+        m_committedSize = m_writeBuffer.size();
     }
 
-    OVERLAPPED overlapped = { 0 };
-    overlapped.hEvent = m_readEvent;
+    m_writeLock.Exit();
 
-    BOOL result = WriteFile(m_pipe, buffer, length, NULL, &overlapped) != 0;
+}
 
-    if (result == FALSE)
-    {
-        DWORD error = GetLastError();
+bool Channel::Write(const void* buffer, unsigned int length)
+{
 
-        if (error == ERROR_IO_PENDING)
-        {
-           // Wait for the operation to complete so that we don't need to keep around
-           // the buffer.
-           WaitForSingleObject(m_readEvent, INFINITE);
+    if (length > 0)
+    {
 
-           DWORD numBytesWritten = 0;
+        CriticalSectionLock lock(m_writeLock);
+        
+        const char* data = static_cast<const char*>(buffer);
+        m_writeBuffer.insert(m_writeBuffer.end(), data, data + length);
 
-           if (GetOverlappedResult(m_pipe, &overlapped, &numBytesWritten, FALSE))
-           {
-               result = (numBytesWritten == length);
-           }
+        // A write that isn't part of a message is complete by itself.
+        if (m_messageDepth == 0)
+        {
+            m_committedSize = m_writeBuffer.size();
         }
+
     }
 
-    return result == TRUE;
+    return true;
 
 }
 
 bool Channel::WriteUInt32(unsigned int value)
 {
-    DWORD temp = value;
-    return Write(&temp, 4);
+    return Write(&value, 4);
 }
 
 bool Channel::WriteString(const char* value)
 {
-    unsigned int length = static_cast<int>(strlen(value));
-    if (!WriteUInt32(length))
-    {
-        return false;
-    }
-    if (length > 0)
-    {
-        return Write(value, length);
-    }
-    return true;
+    return WriteString(value, static_cast<unsigned int>(strlen(value)));
 }
 
 bool Channel::WriteString(const std::string& value)
 {
-    unsigned int length = value.length();
+    return WriteString(value.data(), static_cast<unsigned int>(value.length()));
+}
+
+bool Channel::WriteString(const char* value, unsigned int length)
+{
     if (!WriteUInt32(length))
     {
         return false;
     }
     if (length > 0)
     {
-        return Write(value.c_str(), length);
+        return Write(value, length);
     }
     return true;
 }
@@ -208,13 +222,7 @@ bool Channel::WriteBool(bool value)
 
 bool Channel::ReadUInt32(unsigned int& value)
 {
-    DWORD temp;
-    if (!Read(&temp, 4))
-    {
-        return false;
-    }
-    value = temp;
-    return true;
+    return Read(&value, 4);
 }
 
 bool Channel::ReadString(std::string& value)
@@ -227,28 +235,56 @@ bool Channel::ReadString(std::string& value)
         return false;
     }
 
-    if (length != 0)
+    // Read straight into the string rather than going through a temporary.
+    value.resize(length);
+
+    if (length != 0 && !Read(&value[0], length))
     {
+        value.clear();
+        return false;
+    }
+
+    return true;
 
-        char* buffer = new char[length + 1];
+}
 
-        if (!Read(buffer, length))
-        {
-            delete [] buffer;
-            return false;
-        }
+bool Channel::ReadString(const char*& value, unsigned int& length)
+{
 
-        buffer[length] = 0;
-        value = buffer;
-        
-        delete [] buffer;
+    if (!ReadUInt32(length))
+    {
+        return false;
+    }
 
+    if (length == 0)
+    {
+        value = "";
+        return true;
     }
-    else
+
+    if (length <= m_readBuffer.size() - m_readPosition)
     {
-        value.clear();
+        value = &m_readBuffer[m_readPosition];
+        m_readPosition += length;
+        return true;
     }
 
+    // The string continues in the next frame, so there's no single piece of
+    // the read buffer we can point at. The previous string is no longer in
+    // use, so don't hold on to a large buffer from it.
+    if (m_stringBuffer.capacity() > s_maxRetainedBuffer && length <= s_maxRetainedBuffer)
+    {
+        std::vector<char>().swap(m_stringBuffer);
+    }
+
+    m_stringBuffer.resize(length);
+
+    if (!Read(&m_stringBuffer[0], length))
+    {
+        return false;
+    }
+
+    value = &m_stringBuffer[0];
     return true;
 
 }
@@ -271,58 +307,149 @@ bool Channel::ReadBool(bool& value)
 bool Channel::Read(void* buffer, unsigned int length)
 {
 
-    assert(m_pipe != INVALID_HANDLE_VALUE);
-    
-    if (length == 0)
+    char* data = static_cast<char*>(buffer);
+
+    while (length > 0)
     {
-        // Because of the way message pipes work, reading 0 is different than
-        // reading nothing.
-        return true;
+
+        if (m_readPosition == m_readBuffer.size())
+        {
+
+            // A peer can't answer a request it hasn't received, so make sure
+            // anything we've written is sent before we block waiting for data.
+            Flush();
+
+            if (!ReadFrame())
+            {
+                return false;
+            }
+
+        }
+
+        unsigned int amount = m_readBuffer.size() - m_readPosition;
+
+        if (amount > length)
+        {
+            amount = length;
+        }
+
+        memcpy(data, &m_readBuffer[m_readPosition], amount);
+
+        m_readPosition += amount;
+        data           += amount;
+        length         -= amount;
+
     }
 
-    OVERLAPPED overlapped = { 0 };
-    overlapped.hEvent = m_readEvent;
+    return true;
+
+}
+
+bool Channel::ReadFrame()
+{
 
-    DWORD numBytesRead;
-    BOOL result = ReadFile(m_pipe, buffer, length, &numBytesRead, &overlapped);
+    unsigned int frameSize = 0;
 
-    if (result == FALSE)
+    do
     {
 
-        DWORD error = GetLastError();
+        if (!m_transport->Read(&frameSize, s_headerSize))
+        {
+            return false;
+        }
 
-        if (error == ERROR_IO_PENDING)
+        if (frameSize == s_switchFrame && m_nextTransport != NULL)
         {
-        
-            // Wait for the operation to complete.
-            
-            HANDLE events[] =
-                {
-                    m_readEvent,
-                    m_doneEvent,
-                };
+            // Everything after the marker comes over the new transport.
+            CriticalSectionLock lock(m_writeLock);
+            m_oldTransports.push_back(m_transport);
+            m_transport     = m_nextTransport;
+            m_nextTransport = NULL;
+            frameSize       = 0;
+        }
 
-            WaitForMultipleObjects(2, events, FALSE, INFINITE);
+    }
+    while (frameSize == 0);
 
-            if (WaitForSingleObject(m_doneEvent, 0) == WAIT_OBJECT_0)
-            {
-                // The pipe has been closed.
-                result = FALSE;
-            }
-            else if (GetOverlappedResult(m_pipe, &overlapped, &numBytesRead, FALSE))
-            {
-                result = (numBytesRead == length);
-            }
-        
-        }
+    if (frameSize > s_maxFrameSize)
+    {
+        // The length didn't come from a channel, so don't trust anything else
+        // from the other end.
+        m_transport->Destroy();
+        m_open = false;
+        m_readBuffer.clear();
+        m_readPosition = 0;
+        return false;
+    }
+
+    m_readBuffer.resize(frameSize);
+    m_readPosition = 0;
 
+    if (!m_transport->Read(&m_readBuffer[0], frameSize))
+    {
+        m_readBuffer.clear();
+        return false;
     }
 
-    return result == TRUE;
+    return true;
 
 }
 
-void Channel::Flush()
+bool Channel::Flush()
 {
-    //FlushFileBuffers(m_pipe);
+
+    CriticalSectionLock lock(m_writeLock);
+
+    unsigned int payloadSize = m_committedSize - s_headerSize;
+
+    if (payloadSize == 0)
+    {
+        return true;
+    }
+
+    bool result = false;
+
+    if (m_open)
+    {
+
+        // The first frame uses the space reserved for the header. Anything
+        // over the maximum frame size goes in additional frames; the reader
+        // doesn't care where a frame ends.
+
+        unsigned int frameSize = payloadSize < s_maxFrameSize ? payloadSize : s_maxFrameSize;
+        memcpy(&m_writeBuffer[0], &frameSize, s_headerSize);
+
+        result = m_transport->Write(&m_writeBuffer[0], s_headerSize + frameSize);
+
+        const char*  data      = &m_writeBuffer[s_headerSize] + frameSize;
+        unsigned int remaining = payloadSize - frameSize;
+
+        while (result && remaining > 0)
+        {
+            frameSize = remaining < s_maxFrameSize ? remaining : s_maxFrameSize;
+            result    = m_transport->Write(&frameSize, s_headerSize) && m_transport->Write(data, frameSize);
+            data      += frameSize;
+            remaining -= frameSize;
+        }
+
+    }
+
+    // Keep the part of a message the calling thread is still in the middle
+    // of writing; it goes out with a later flush.
+    std::vector<char> pending(m_writeBuffer.begin() + m_committedSize, m_writeBuffer.end());
+
+    // Don't hold on to the memory from an unusually large message (for
+    // example the source for a big script) for the lifetime of the channel.
+    if (m_writeBuffer.capacity() > s_maxRetainedBuffer)
+    {
+        std::vector<char> empty;
+        m_writeBuffer.swap(empty);
+    }
+
+    m_writeBuffer.resize(s_headerSize);
+    m_writeBuffer.insert(m_writeBuffer.end(), pending.begin(), pending.end());
+    m_committedSize = s_headerSize;
+
+    return result;
+
 }
@@ -23,13 +23,33 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
-#include <windows.h>
+#include "CriticalSection.h"
+
 #include <string>
+#include <vector>
+
+//
+// Forward declarations.
+//
+
+class Transport;
 
 /**
- * Communication channel used to between two processess. The current
- * implementation uses pipes, however in the future we may expand this
- * to include sockets for communictating across a network.
+ * Communication channel used to between two processess. The bytes are
+ * moved by a Transport, which is a named pipe on Windows and a Unix domain
+ * socket on other platforms, unless the owner chooses a different one. Once
+ * connected, the writer can move the channel to another transport such as
+ * the shared memory RingTransport with SwitchTransport; the reader follows
+ * when it reaches the switch in the stream.
+ *
+ * Writes are collected in a message buffer and are only sent when Flush is
+ * called, so each logical message (an event or a command) goes across the
+ * pipe as a single frame. A frame is a 32-bit payload length followed by the
+ * payload, which lets the reader pull a whole message with one read.
+ *
+ * When more than one thread writes to the channel, each message has to be
+ * written between BeginMessage and EndMessage. Flush only sends complete
+ * messages, so a frame never contains part of another thread's message.
  */
 class Channel
 {
@@ -40,6 +60,12 @@ public:
      * Constructor. Create must be called on the channel before it can be used.
      */
     Channel();
+
+    /**
+     * Constructor. The channel takes ownership of the transport, which is
+     * deleted when the channel is destroyed.
+     */
+    explicit Channel(Transport* transport);
     
     /**
      * Destructor.
@@ -67,22 +93,58 @@ public:
     void Destroy();
 
     /**
-     * Writes a 32-bit unsigned integer to the channel and returns immediately.
+     * Sends the messages written so far over the current transport followed
+     * by a marker telling the other end to switch, and sends everything after
+     * that over the new transport, which must already be connected. The old
+     * transport is kept open until the channel is destroyed so the other end
+     * doesn't see it as a disconnect. The channel takes ownership of the
+     * transport.
+     */
+    bool SwitchTransport(Transport* transport);
+
+    /**
+     * Sets the transport the channel reads from after it reaches the marker
+     * written by SwitchTransport on the other end. The transport must already
+     * be connected. The channel takes ownership of the transport.
+     */
+    void SetNextTransport(Transport* transport);
+
+    /**
+     * Starts a message. Writes from other threads wait until the matching
+     * EndMessage, so the fields of the message are kept together. Calls can
+     * be nested, in which case the outermost pair delimits the message.
+     */
+    void BeginMessage();
+
+    /**
+     * Finishes the message started with BeginMessage. The message is sent
+     * with the next Flush.
+     */
+    void EndMessage();
+
+    /**
+     * Writes a 32-bit unsigned integer to the message buffer.
      */
     bool WriteUInt32(unsigned int value);
 
     /**
-     * Writes a string to the channel and returns immediately.
+     * Writes a string to the message buffer.
      */
     bool WriteString(const char* value);
 
     /**
-     * Writes a string to the channel and returns immediately.
+     * Writes a string to the message buffer.
      */
     bool WriteString(const std::string& value);
 
     /**
-     * Writes a boolean to the channel and returns immediately.
+     * Writes a string of the specified length to the message buffer. The
+     * string doesn't need to be null terminated.
+     */
+    bool WriteString(const char* value, unsigned int length);
+
+    /**
+     * Writes a boolean to the message buffer.
      */
     bool WriteBool(bool value);
 
@@ -98,6 +160,16 @@ public:
      */
     bool ReadString(std::string& value);
 
+    /**
+     * Reads a string from the channel without copying it. On return value
+     * points at the string in the channel's read buffer; it is not null
+     * terminated and is only valid until the next read from the channel.
+     * Strings that continue into the next frame (messages larger than the
+     * maximum frame size are split) are copied into a separate buffer.
+     * This operation blocks until the data is available.
+     */
+    bool ReadString(const char*& value, unsigned int& length);
+
     /**
      * Reads a boolean from the channel. This operation blocks until the
      * data is available.
@@ -105,30 +177,62 @@ public:
     bool ReadBool(bool& value);
 
     /**
-     * Flushes the buffers, causing any written data to be sent.
+     * Flushes the buffers, causing the complete messages written since the
+     * last flush to be sent as a single frame. A message that's still being
+     * written by the calling thread is left in the buffer.
      */
-    void Flush();
+    bool Flush();
 
 private:
 
     /**
-     * Writes data to the channel and returns immediately.
+     * Appends data to the message buffer.
      */
     bool Write(const void* buffer, unsigned int length);
 
     /**
-     * Reads data to the channel. Returns when the specified amount has been
-     * read or when an error occurs.
+     * Reads data from the current frame, pulling the next frame from the
+     * transport when the current one is exhausted. Returns when the specified
+     * amount has been read or when an error occurs.
      */
     bool Read(void* buffer, unsigned int length);
 
+    /**
+     * Reads the next frame from the transport into the read buffer. If the
+     * frame is larger than s_maxFrameSize the transport is shut down.
+     */
+    bool ReadFrame();
+
+    /**
+     * Prevent copying.
+     */
+    Channel(const Channel&);
+
+    /**
+     * Prevent copying.
+     */
+    Channel& operator=(const Channel&);
+
 private:
 
-    HANDLE  m_pipe;
-    HANDLE  m_doneEvent;
-    HANDLE  m_readEvent;
+    static const unsigned int   s_headerSize        = 4;
+    static const unsigned int   s_maxRetainedBuffer = 1024 * 1024;
+    static const unsigned int   s_maxFrameSize      = 64 * 1024 * 1024;    // Larger frames are treated as a corrupt stream.
+    static const unsigned int   s_switchFrame       = 0xFFFFFFFF;          // Frame size used as the SwitchTransport marker.
+
+    Transport*                  m_transport;
+    Transport*                  m_nextTransport;    // Transport to read from after the switch marker.
+    std::vector<Transport*>     m_oldTransports;    // Transports we've switched away from.
+    bool                        m_open;
+
+    CriticalSection             m_writeLock;
+    std::vector<char>           m_writeBuffer;      // Header placeholder followed by the pending messages.
+    unsigned int                m_committedSize;    // Size of the write buffer up to the end of the last complete message.
+    unsigned int                m_messageDepth;     // Number of BeginMessage calls without an EndMessage.
 
-    bool    m_creator;
+    std::vector<char>           m_readBuffer;       // Payload of the frame currently being read.
+    unsigned int                m_readPosition;
+    std::vector<char>           m_stringBuffer;     // Strings read without copying that span frames.
 
 };
 
@@ -0,0 +1,226 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Compression.h"
+
+#include <string.h>
+#include <vector>
+
+static const size_t         s_minMatchLength    = 4;
+static const size_t         s_maxOffset         = 0xFFFF;
+static const unsigned int   s_hashBits          = 12;
+
+static inline unsigned int ReadUInt32(const char* data)
+{
+    unsigned int value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+static inline unsigned int HashSequence(unsigned int value)
+{
+    return (value * 2654435761U) >> (32 - s_hashBits);
+}
+
+static void WriteLength(std::string& result, size_t length)
+{
+    while (length >= 255)
+    {
+        result += static_cast<char>(255);
+        length -= 255;
+    }
+    result += static_cast<char>(length);
+}
+
+static bool ReadLength(const unsigned char*& data, const unsigned char* end, size_t& length)
+{
+    unsigned char value;
+    do
+    {
+        if (data == end)
+        {
+            return false;
+        }
+        value   = *data++;
+        length += value;
+    }
+    while (value == 255);
+    return true;
+}
+
+/**
+ * Writes a block. If matchLength is 0, the block only contains literals.
+ */
+static void WriteBlock(std::string& result, const char* literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+
+    size_t matchCode = matchLength > 0 ? matchLength - s_minMatchLength : 0;
+
+    unsigned char token = static_cast<unsigned char>(
+        ((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+
+    result += static_cast<char>(token);
+
+    if (literalLength >= 15)
+    {
+        WriteLength(result, literalLength - 15);
+    }
+
+    result.append(literals, literalLength);
+
+    if (matchLength > 0)
+    {
+        result += static_cast<char>(offset & 0xFF);
+        result += static_cast<char>(offset >> 8);
+        if (matchCode >= 15)
+        {
+            WriteLength(result, matchCode - 15);
+        }
+    }
+
+}
+
+void CompressLz(const char* data, size_t size, std::string& result)
+{
+
+    result.clear();
+    result.reserve(size + size / 255 + 16);
+
+    // Most recent position (plus one, so zero means empty) where each hashed
+    // four byte sequence was seen.
+    std::vector<size_t> table(1 << s_hashBits, 0);
+
+    size_t anchor   = 0;
+    size_t position = 0;
+
+    while (position + s_minMatchLength <= size)
+    {
+
+        unsigned int sequence = ReadUInt32(data + position);
+        size_t& entry = table[HashSequence(sequence)];
+
+        size_t candidate = entry;
+        entry = position + 1;
+
+        if (candidate == 0 || position - (candidate - 1) > s_maxOffset ||
+            ReadUInt32(data + candidate - 1) != sequence)
+        {
+            ++position;
+            continue;
+        }
+
+        size_t match  = candidate - 1;
+        size_t length = s_minMatchLength;
+
+        while (position + length < size && data[match + length] == data[position + length])
+        {
+            ++length;
+        }
+
+        WriteBlock(result, data + anchor, position - anchor, position - match, length);
+
+        position += length;
+        anchor    = position;
+
+    }
+
+    WriteBlock(result, data + anchor, size - anchor, 0, 0);
+
+}
+
+bool DecompressLz(const char* data, size_t size, size_t originalSize, std::string& result)
+{
+
+    result.resize(originalSize);
+
+    const unsigned char* input    = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* inputEnd = input + size;
+
+    size_t position = 0;
+
+    while (input < inputEnd)
+    {
+
+        unsigned char token = *input++;
+
+        size_t literalLength = token >> 4;
+
+        if (literalLength == 15 && !ReadLength(input, inputEnd, literalLength))
+        {
+            return false;
+        }
+
+        if (literalLength > static_cast<size_t>(inputEnd - input) ||
+            literalLength > originalSize - position)
+        {
+            return false;
+        }
+
+        if (literalLength > 0)
+        {
+            memcpy(&result[position], input, literalLength);
+        }
+
+        input    += literalLength;
+        position += literalLength;
+
+        if (input == inputEnd)
+        {
+            // The last block only has literals.
+            break;
+        }
+
+        if (inputEnd - input < 2)
+        {
+            return false;
+        }
+
+        size_t offset = input[0] | (input[1] << 8);
+        input += 2;
+
+        size_t matchLength = token & 0x0F;
+
+        if (matchLength == 15 && !ReadLength(input, inputEnd, matchLength))
+        {
+            return false;
+        }
+
+        matchLength += s_minMatchLength;
+
+        if (offset == 0 || offset > position || matchLength > originalSize - position)
+        {
+            return false;
+        }
+
+        // The match can overlap the bytes being written, so copy one at a time.
+        for (size_t i = 0; i < matchLength; ++i)
+        {
+            result[position + i] = result[position - offset + i];
+        }
+
+        position += matchLength;
+
+    }
+
+    return position == originalSize;
+
+}
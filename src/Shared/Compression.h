@@ -0,0 +1,47 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+
+/**
+ * Compresses the data with a simple byte oriented LZ77 scheme (similar to
+ * LZ4). This is tuned for speed rather than ratio since it's used to shrink
+ * script sources on their way to the frontend, where the time spent
+ * compressing has to be less than the time saved sending the data.
+ *
+ * The compressed data is a sequence of blocks, each made of a token byte
+ * holding a literal length and a match length, the literal bytes, and a
+ * 16-bit offset back into the output for the match. The last block only
+ * has literals.
+ */
+void CompressLz(const char* data, size_t size, std::string& result);
+
+/**
+ * Decompresses data that was compressed with CompressLz. The size of the
+ * original data has to be known. Returns false if the data is corrupt.
+ */
+bool DecompressLz(const char* data, size_t size, size_t originalSize, std::string& result);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <stddef.h>
+
+/**
+ * Computes a 64-bit FNV-1a hash of the data. This is used to identify
+ * script sources without sending the whole source, so the frontend has to
+ * compute exactly the same value from the file on disk.
+ */
+unsigned long long GetContentHash(const void* data, size_t size);
+
+#endif
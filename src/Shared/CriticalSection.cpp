@@ -22,6 +22,8 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "CriticalSection.h"
 
+#ifdef _WIN32
+
 CriticalSection::CriticalSection()
 {
     InitializeCriticalSection(&m_criticalSection);
@@ -46,3 +48,37 @@ bool CriticalSection::TryEnter()
 {
     return TryEnterCriticalSection(&m_criticalSection) != FALSE;
 }
+
+#else
+
+CriticalSection::CriticalSection()
+{
+    // Critical sections are recursive on Windows, so match that here.
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_criticalSection, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+    
+CriticalSection::~CriticalSection()
+{
+    pthread_mutex_destroy(&m_criticalSection);
+}
+
+void CriticalSection::Enter()
+{
+    pthread_mutex_lock(&m_criticalSection);
+}
+
+void CriticalSection::Exit()
+{
+    pthread_mutex_unlock(&m_criticalSection);
+}
+
+bool CriticalSection::TryEnter()
+{
+    return pthread_mutex_trylock(&m_criticalSection) == 0;
+}
+
+#endif
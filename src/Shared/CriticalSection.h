@@ -23,10 +23,14 @@ along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CRITICAL_SECTION_H
 #define CRITICAL_SECTION_H
 
+#ifdef _WIN32
 #ifndef _WIN32_WINNT 
 #define _WIN32_WINNT 0x400
 #endif
 #include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 /**
  * Critical section class.
@@ -80,7 +84,11 @@ private:
 
 private:
 
+#ifdef _WIN32
     CRITICAL_SECTION    m_criticalSection;
+#else
+    pthread_mutex_t     m_criticalSection;
+#endif
 
 };
 
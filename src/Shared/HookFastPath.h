@@ -0,0 +1,110 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef HOOK_FAST_PATH_H
+#define HOOK_FAST_PATH_H
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT 
+#define _WIN32_WINNT 0x400
+#endif
+#include <windows.h>
+#endif
+
+#include <stddef.h>
+
+/**
+ * The checks the debugger's hook makes on every event before it takes the
+ * critical section. They're templates over the backend's types so that the
+ * benchmarks in the tests run the same code as DebugBackend::HookCallback.
+ *
+ * A VM needs an initialized flag and a volatile haveActiveBreakpoints flag.
+ * A cache entry needs the state L, the VM and the vmGeneration it was stored
+ * with. A hook needs GetIsContinuing, TurnOff and TurnOn.
+ */
+
+/**
+ * Looks up the VM for the state in the calling thread's cache entry. Returns
+ * false if the entry is for a different state or was stored before a VM was
+ * deleted.
+ */
+template <class Cache, class Vm>
+inline bool GetHookCacheHit(const Cache* cache, const void* L, unsigned int vmGeneration, Vm*& vm)
+{
+    if (cache != NULL && cache->L == L && cache->vmGeneration == vmGeneration)
+    {
+        vm = cache->vm;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Returns true if nothing in the VM can cause a break, which is when it's
+ * initialized, isn't stepping and has no breakpoints in its universe.
+ */
+template <class Vm>
+inline bool GetHookCantBreak(const Vm* vm, bool continuing)
+{
+    return vm != NULL && vm->initialized && continuing && !vm->haveActiveBreakpoints;
+}
+
+/**
+ * Orders turning the hook off before the flags are read again.
+ */
+inline void HookMemoryBarrier()
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+/**
+ * Turns the hook off if the VM can't break. A break or a new breakpoint may be
+ * set while the hook is being turned off, so the flags are checked again after
+ * it is and the hook is turned back on if either changed. Returns true if the
+ * event was handled; otherwise the hook has to take the slow path.
+ */
+template <class Vm, class Hook>
+inline bool RunHookFastPath(Vm* vm, Hook& hook)
+{
+
+    if (!GetHookCantBreak(vm, hook.GetIsContinuing()))
+    {
+        return false;
+    }
+
+    hook.TurnOff();
+    HookMemoryBarrier();
+
+    if (!hook.GetIsContinuing() || vm->haveActiveBreakpoints)
+    {
+        hook.TurnOn();
+    }
+
+    return true;
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PIPE_TRANSPORT_H
+#define PIPE_TRANSPORT_H
+
+#include "Transport.h"
+
+#include <windows.h>
+
+/**
+ * Transport implemented on top of a Windows named pipe.
+ */
+class PipeTransport : public Transport
+{
+
+public:
+
+    /**
+     * Constructor.
+     */
+    PipeTransport();
+
+    /**
+     * Destructor.
+     */
+    virtual ~PipeTransport();
+
+    virtual bool Create(const char* name);
+    virtual bool Connect(const char* name);
+    virtual bool WaitForConnection();
+    virtual void Destroy();
+    virtual bool Write(const void* buffer, unsigned int length);
+    virtual bool Read(void* buffer, unsigned int length);
+
+private:
+
+    static const unsigned int   s_pipeBufferSize = 64 * 1024;
+
+    HANDLE                      m_pipe;
+    HANDLE                      m_doneEvent;
+    HANDLE                      m_readEvent;
+    HANDLE                      m_writeEvent;
+
+    bool                        m_creator;
+
+};
+
+#endif
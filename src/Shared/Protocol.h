@@ -37,6 +37,107 @@ enum CodeState
     CodeState_Binary            = 2,    // The code was loaded as a binary/compiled file
 };
 
+/**
+ * Version of the protocol described in this file. This is sent in the
+ * CommandId_Handshake and EventId_Handshake messages and is incremented
+ * whenever the meaning of an existing message changes.
+ */
+enum ProtocolVersion
+{
+    ProtocolVersion_Legacy      = 0,    // A peer that doesn't perform the handshake.
+    ProtocolVersion_Current     = 1,
+};
+
+/**
+ * Optional features of the protocol. Each side advertises the ones it
+ * supports in the handshake, and only the ones supported by both are used.
+ *
+ * Capability_PagedTables cuts tables off at a page of elements and at a
+ * shallow depth, leaving the rest to be fetched with CommandId_ExpandTable.
+ * The WatchCtrl in this tree can display paged tables but has no way to
+ * fetch the rest, so the frontend must not request this capability until
+ * DebugFrontend sends CommandId_ExpandTable and WatchCtrl expands tables
+ * with it. Otherwise its only visible effect is truncated values.
+ */
+enum Capability
+{
+    Capability_Compression      = 0x00000001,   // Script sources can be sent compressed (SourceEncoding_Lz).
+    Capability_ContentHash      = 0x00000002,   // Script sources can be sent as a hash (SourceEncoding_Hash).
+    Capability_LoadFilter       = 0x00000004,   // Script loads only wait for the frontend if they're in the load filter.
+    Capability_RingTransport    = 0x00000008,   // The event channel moves to a shared memory ring after EventId_Handshake (see Channel::SwitchTransport).
+    Capability_AsyncEvaluate    = 0x00000010,   // Expressions can be evaluated with CommandId_EvaluateAsync and CommandId_EvaluateMany.
+    Capability_BreakpointConditions = 0x00000020, // Breakpoints can have conditions and hit counts set with CommandId_SetBreakpointCondition.
+    Capability_Logpoints        = 0x00000040,   // Breakpoints can be turned into logpoints with CommandId_SetLogpoint.
+    Capability_BinaryValues     = 0x00000080,   // Evaluated values are sent in the binary form from ValueStream.h instead of XML.
+    Capability_PagedTables      = 0x00000100,   // Tables in binary values are sent a page at a time and expanded with CommandId_ExpandTable. Requires Capability_BinaryValues. Not to be requested by the in-tree frontend yet (see above).
+    Capability_ReadOnlyEvaluate = 0x00000200,   // Expressions from the evaluate commands can't assign to variables. Assignments are made with CommandId_Execute.
+    Capability_Mask             = 0x00FFFFFF,
+};
+
+/**
+ * The handshake carries the version and the capabilities packed into a
+ * single 32-bit value. This is also what makes it safe to send to a backend
+ * that doesn't know about the handshake, since every unknown command is read
+ * as the command id followed by one 32-bit value.
+ */
+inline unsigned int PackHandshake(unsigned int version, unsigned int capabilities)
+{
+    return (version << 24) | (capabilities & Capability_Mask);
+}
+
+inline void UnpackHandshake(unsigned int value, unsigned int& version, unsigned int& capabilities)
+{
+    version      = value >> 24;
+    capabilities = value & Capability_Mask;
+}
+
+/**
+ * Picks the version and capabilities to use from a handshake sent by the
+ * peer and the capabilities we support. The result is what goes back in the
+ * reply.
+ */
+inline void NegotiateHandshake(unsigned int handshake, unsigned int supported, unsigned int& version, unsigned int& capabilities)
+{
+    const unsigned int currentVersion = ProtocolVersion_Current;
+    UnpackHandshake(handshake, version, capabilities);
+    version       = version < currentVersion ? version : currentVersion;
+    capabilities &= supported;
+}
+
+/**
+ * How the source for a script is sent to the frontend. The encoding is
+ * picked from the capabilities in the handshake or explicitly chosen with
+ * CommandId_SetSourceEncoding; until then sources are sent raw and the
+ * EventId_LoadScript event doesn't include an encoding.
+ *
+ * Raw:  string source
+ * Lz:   uint32 originalSize, string compressed (see CompressLz)
+ * Hash: uint32 hashLow, uint32 hashHigh, uint32 size (see GetContentHash)
+ */
+enum SourceEncoding
+{
+    SourceEncoding_Raw          = 0,    // The source is sent as is.
+    SourceEncoding_Lz           = 1,    // The source is compressed.
+    SourceEncoding_Hash         = 2,    // Only a hash of the source is sent; the frontend asks for the body with CommandId_RequestScriptSource if it needs it. Sources that aren't files are sent compressed.
+};
+
+/**
+ * Returns the cheapest way to send sources that's enabled by the negotiated
+ * capabilities.
+ */
+inline SourceEncoding GetSourceEncoding(unsigned int capabilities)
+{
+    if (capabilities & Capability_ContentHash)
+    {
+        return SourceEncoding_Hash;
+    }
+    if (capabilities & Capability_Compression)
+    {
+        return SourceEncoding_Lz;
+    }
+    return SourceEncoding_Raw;
+}
+
 enum EventId
 {
     EventId_Initialize          = 11,   // Sent when the backend is ready to have its initialize function called
@@ -50,6 +151,11 @@ enum EventId
     EventId_Message             = 9,    // Event containing a string message from the debugger.
     EventId_SessionEnd          = 8,    // This is used internally and shouldn't be sent.
     EventId_NameVM              = 10,   // Sent when the name of a VM is set.
+    EventId_SourceEncoding      = 12,   // Sent in response to CommandId_SetSourceEncoding. Load events after this one include the encoding.
+    EventId_ScriptSource        = 13,   // Sent in response to CommandId_RequestScriptSource.
+    EventId_LoadFilter          = 14,   // Sent in response to CommandId_SetLoadFilter. Load events after this one end with a flag saying if the backend is waiting for CommandId_LoadDone.
+    EventId_Handshake           = 15,   // Sent in response to CommandId_Handshake with the version and the capabilities that will be used. Load events after this one use the formats enabled by those capabilities.
+    EventId_EvaluateResult      = 16,   // Sent with the result of an expression from CommandId_EvaluateAsync or CommandId_EvaluateMany.
 };
 
 enum CommandId
@@ -67,6 +173,16 @@ enum CommandId
     CommandId_LoadDone          = 12,   // Signals to the backend that the frontend has finished processing a load.
     CommandId_IgnoreException   = 13,   // Instructs the backend to ignore the specified exception message in the future.
     CommandId_DeleteAllBreakpoints = 14,// Instructs the backend to clear all breakpoints set
+    CommandId_SetSourceEncoding = 15,   // Selects how script sources are sent. This command isn't associated with a VM.
+    CommandId_RequestScriptSource = 16, // Requests the full source for a script that was sent as a hash.
+    CommandId_SetLoadFilter     = 17,   // Sets the file titles the backend stops on when they're loaded. Other scripts load without waiting for CommandId_LoadDone. This command isn't associated with a VM.
+    CommandId_Handshake         = 18,   // Sends the frontend's protocol version and capabilities (see PackHandshake). This command isn't associated with a VM.
+    CommandId_EvaluateAsync     = 19,   // Evaluates an expression like CommandId_Evaluate, but the result is sent as an EventId_EvaluateResult tagged with a request id.
+    CommandId_EvaluateMany      = 20,   // Evaluates a list of expressions at the same stack level. Each result is sent as an EventId_EvaluateResult.
+    CommandId_SetBreakpointCondition = 21,  // Sets the condition and hit count for the breakpoint on a line. The backend only stops there when they're met.
+    CommandId_SetLogpoint       = 22,   // Sets an expression for the breakpoint on a line that's written to the output instead of stopping. The output is sent in batches as EventId_Message.
+    CommandId_ExpandTable       = 23,   // Requests a page of a table from an evaluated value by its handle. The handles are released when the VM continues.
+    CommandId_Execute           = 24,   // Evaluates an expression like CommandId_Evaluate, but allows it to assign to variables. Requires Capability_ReadOnlyEvaluate.
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,649 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RingTransport.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/**
+ * Control block for one direction of the transport. The head and tail are
+ * free running byte counts, so the amount of data in the ring is always
+ * head - tail. They're kept on separate cache lines since they're written
+ * by different processes.
+ */
+struct RingBuffer
+{
+    volatile unsigned int   head;           // Only written by the producer.
+    char                    pad0[60];
+    volatile unsigned int   tail;           // Only written by the consumer.
+    char                    pad1[60];
+    volatile unsigned int   waiting[2];     // Set while a thread is about to block on the ring.
+    char                    pad2[56];
+};
+
+/**
+ * Layout of the start of the shared memory. The data for the two rings
+ * follows the header.
+ */
+struct RingHeader
+{
+    unsigned int            magic;
+    unsigned int            ringSize;
+    volatile unsigned int   state[2];       // Indexed by side.
+    volatile unsigned int   processId[2];   // Indexed by side.
+    char                    pad[40];
+    RingBuffer              ring[2];        // Indexed by the side that writes the ring.
+};
+
+enum RingState
+{
+    RingState_None      = 0,
+    RingState_Open      = 1,
+    RingState_Closed    = 2,
+};
+
+static const unsigned int s_ringMagic = 0x474E4952;    // 'RING'
+
+/**
+ * Makes sure all of the memory accesses before the barrier are visible to
+ * the other process before any of the ones after it.
+ */
+static inline void FullMemoryBarrier()
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+static unsigned int GetProcessIdentifier()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<unsigned int>(getpid());
+#endif
+}
+
+static void SleepMilliseconds(unsigned int milliseconds)
+{
+#ifdef _WIN32
+    Sleep(milliseconds);
+#else
+    usleep(milliseconds * 1000);
+#endif
+}
+
+RingTransport::RingTransport()
+{
+
+    m_header        = NULL;
+    m_data[0]       = NULL;
+    m_data[1]       = NULL;
+    m_side          = Side_Creator;
+    m_destroyed     = false;
+
+#ifdef _WIN32
+    m_mapping       = NULL;
+    m_peerProcess   = NULL;
+    for (unsigned int ring = 0; ring < 2; ++ring)
+    {
+        m_event[ring][Waiter_Data]  = NULL;
+        m_event[ring][Waiter_Space] = NULL;
+    }
+#endif
+
+}
+
+RingTransport::~RingTransport()
+{
+    Destroy();
+    Close();
+}
+
+bool RingTransport::Create(const char* name)
+{
+
+    if (!Open(name, true))
+    {
+        return false;
+    }
+
+    m_side = Side_Creator;
+
+    m_header->processId[m_side] = GetProcessIdentifier();
+    FullMemoryBarrier();
+    m_header->state[m_side] = RingState_Open;
+
+    return true;
+
+}
+
+bool RingTransport::Connect(const char* name)
+{
+
+    if (!Open(name, false))
+    {
+        return false;
+    }
+
+    m_side = Side_Connector;
+
+    // Only one connection is allowed, and the creator has to still be there.
+    if (m_header->state[Side_Creator] != RingState_Open ||
+        m_header->state[Side_Connector] != RingState_None)
+    {
+        Close();
+        return false;
+    }
+
+#ifdef _WIN32
+    m_peerProcess = OpenProcess(SYNCHRONIZE, FALSE, m_header->processId[Side_Creator]);
+#endif
+
+    m_header->processId[m_side] = GetProcessIdentifier();
+    FullMemoryBarrier();
+    m_header->state[m_side] = RingState_Open;
+
+    return true;
+
+}
+
+bool RingTransport::WaitForConnection()
+{
+    return WaitForConnection(0xFFFFFFFF);
+}
+
+bool RingTransport::WaitForConnection(unsigned int timeout)
+{
+
+    if (m_header == NULL)
+    {
+        return false;
+    }
+
+    // This only happens once per session, so there's no need for anything
+    // fancier than polling.
+    unsigned int waited = 0;
+
+    while (m_header->state[Side_Connector] == RingState_None)
+    {
+        if (m_destroyed || waited >= timeout)
+        {
+            return false;
+        }
+        SleepMilliseconds(10);
+        waited += 10;
+    }
+
+    if (m_header->state[Side_Connector] != RingState_Open)
+    {
+        return false;
+    }
+
+    FullMemoryBarrier();
+
+#ifdef _WIN32
+    m_peerProcess = OpenProcess(SYNCHRONIZE, FALSE, m_header->processId[Side_Connector]);
+#endif
+
+    return true;
+
+}
+
+void RingTransport::Destroy()
+{
+
+    if (m_header == NULL || m_destroyed)
+    {
+        return;
+    }
+
+    m_destroyed = true;
+    m_header->state[m_side] = RingState_Closed;
+
+    // Wake up anyone blocked on either ring, in this process or the other
+    // one, so they notice the transport has been shut down. The memory stays
+    // mapped until the transport is reopened or deleted since another thread
+    // may still be returning from a read.
+    for (unsigned int ring = 0; ring < 2; ++ring)
+    {
+        Wake(ring, Waiter_Data,  &m_header->ring[ring].head);
+        Wake(ring, Waiter_Space, &m_header->ring[ring].tail);
+    }
+
+#ifndef _WIN32
+    if (!m_path.empty())
+    {
+        shm_unlink(m_path.c_str());
+        m_path.clear();
+    }
+#endif
+
+}
+
+bool RingTransport::Write(const void* buffer, unsigned int length)
+{
+
+    if (m_header == NULL)
+    {
+        return false;
+    }
+
+    RingBuffer& ring = m_header->ring[m_side];
+    char*       base = m_data[m_side];
+
+    const char* data = static_cast<const char*>(buffer);
+
+    while (length > 0)
+    {
+
+        if (m_destroyed || m_header->state[1 - m_side] == RingState_Closed)
+        {
+            return false;
+        }
+
+        unsigned int head  = ring.head;
+        unsigned int tail  = ring.tail;
+        unsigned int space = s_ringSize - (head - tail);
+
+        if (space == 0)
+        {
+            if (!Block(m_side, Waiter_Space, &ring.tail, tail))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // Don't write over the data until we've seen the reader is done with it.
+        FullMemoryBarrier();
+
+        unsigned int amount = space < length ? space : length;
+        unsigned int offset = head & (s_ringSize - 1);
+        unsigned int first  = s_ringSize - offset;
+
+        if (first > amount)
+        {
+            first = amount;
+        }
+
+        memcpy(base + offset, data, first);
+        memcpy(base, data + first, amount - first);
+
+        // The data has to be visible before the reader can see the new head.
+        FullMemoryBarrier();
+        ring.head = head + amount;
+
+        Wake(m_side, Waiter_Data, &ring.head);
+
+        data   += amount;
+        length -= amount;
+
+    }
+
+    return true;
+
+}
+
+bool RingTransport::Read(void* buffer, unsigned int length)
+{
+
+    if (m_header == NULL)
+    {
+        return false;
+    }
+
+    unsigned int side = 1 - m_side;
+
+    RingBuffer& ring = m_header->ring[side];
+    const char* base = m_data[side];
+
+    char* data = static_cast<char*>(buffer);
+
+    while (length > 0)
+    {
+
+        if (m_destroyed)
+        {
+            return false;
+        }
+
+        unsigned int head      = ring.head;
+        unsigned int tail      = ring.tail;
+        unsigned int available = head - tail;
+
+        if (available == 0)
+        {
+            if (!Block(side, Waiter_Data, &ring.head, head))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // Don't read the data until we've seen the head that covers it.
+        FullMemoryBarrier();
+
+        unsigned int amount = available < length ? available : length;
+        unsigned int offset = tail & (s_ringSize - 1);
+        unsigned int first  = s_ringSize - offset;
+
+        if (first > amount)
+        {
+            first = amount;
+        }
+
+        memcpy(data, base + offset, first);
+        memcpy(data + first, base, amount - first);
+
+        // We have to be done with the data before the writer can reuse it.
+        FullMemoryBarrier();
+        ring.tail = tail + amount;
+
+        Wake(side, Waiter_Space, &ring.tail);
+
+        data   += amount;
+        length -= amount;
+
+    }
+
+    return true;
+
+}
+
+bool RingTransport::Open(const char* name, bool create)
+{
+
+    Close();
+
+    m_destroyed = false;
+
+    unsigned int size = s_headerSize + 2 * s_ringSize;
+    void* view = NULL;
+
+#ifdef _WIN32
+
+    char mappingName[256];
+    _snprintf(mappingName, 256, "%s.Ring", name);
+
+    if (create)
+    {
+        m_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, mappingName);
+        if (m_mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            // Someone else is already using this name.
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+    }
+    else
+    {
+        m_mapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, mappingName);
+    }
+
+    if (m_mapping == NULL)
+    {
+        return false;
+    }
+
+    view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+    if (view == NULL)
+    {
+        Close();
+        return false;
+    }
+
+    for (unsigned int ring = 0; ring < 2; ++ring)
+    {
+        for (unsigned int waiter = 0; waiter < 2; ++waiter)
+        {
+            char eventName[256];
+            _snprintf(eventName, 256, "%s.Ring.%d.%d", name, ring, waiter);
+            m_event[ring][waiter] = CreateEvent(NULL, FALSE, FALSE, eventName);
+            if (m_event[ring][waiter] == NULL)
+            {
+                UnmapViewOfFile(view);
+                Close();
+                return false;
+            }
+        }
+    }
+
+#else
+
+    std::string path = "/";
+    path += name;
+    path += ".Ring";
+
+    int file;
+
+    if (create)
+    {
+        // Remove shared memory left behind by a previous session with the same name.
+        shm_unlink(path.c_str());
+        file = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (file != -1 && ftruncate(file, size) != 0)
+        {
+            close(file);
+            shm_unlink(path.c_str());
+            file = -1;
+        }
+    }
+    else
+    {
+        file = shm_open(path.c_str(), O_RDWR, 0);
+    }
+
+    if (file == -1)
+    {
+        return false;
+    }
+
+    view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+
+    if (view == MAP_FAILED)
+    {
+        if (create)
+        {
+            shm_unlink(path.c_str());
+        }
+        return false;
+    }
+
+    if (create)
+    {
+        // Remember that we created the shared memory so we can remove it.
+        m_path = path;
+    }
+
+#endif
+
+    m_header  = static_cast<RingHeader*>(view);
+    m_data[0] = static_cast<char*>(view) + s_headerSize;
+    m_data[1] = m_data[0] + s_ringSize;
+
+    if (create)
+    {
+        // New shared memory is zero filled, so both rings start out empty.
+        m_header->magic    = s_ringMagic;
+        m_header->ringSize = s_ringSize;
+    }
+    else if (m_header->magic != s_ringMagic || m_header->ringSize != s_ringSize)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+
+}
+
+void RingTransport::Close()
+{
+
+    if (m_header != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(m_header);
+#else
+        munmap(m_header, s_headerSize + 2 * s_ringSize);
+#endif
+        m_header  = NULL;
+        m_data[0] = NULL;
+        m_data[1] = NULL;
+    }
+
+#ifdef _WIN32
+
+    for (unsigned int ring = 0; ring < 2; ++ring)
+    {
+        for (unsigned int waiter = 0; waiter < 2; ++waiter)
+        {
+            if (m_event[ring][waiter] != NULL)
+            {
+                CloseHandle(m_event[ring][waiter]);
+                m_event[ring][waiter] = NULL;
+            }
+        }
+    }
+
+    if (m_peerProcess != NULL)
+    {
+        CloseHandle(m_peerProcess);
+        m_peerProcess = NULL;
+    }
+
+    if (m_mapping != NULL)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+
+#else
+
+    if (!m_path.empty())
+    {
+        shm_unlink(m_path.c_str());
+        m_path.clear();
+    }
+
+#endif
+
+}
+
+bool RingTransport::Block(unsigned int ring, Waiter waiter, volatile unsigned int* address, unsigned int value)
+{
+
+    volatile unsigned int& waiting = m_header->ring[ring].waiting[waiter];
+
+    // Announce that we're about to sleep before checking the value one last
+    // time. The other side changes the value before checking the flag, so
+    // one of us is guaranteed to see the other's write.
+    waiting = 1;
+    FullMemoryBarrier();
+
+    if (*address == value && !m_destroyed && GetIsPeerAlive())
+    {
+#ifdef _WIN32
+        HANDLE handles[2] = { m_event[ring][waiter], m_peerProcess };
+        WaitForMultipleObjects(m_peerProcess != NULL ? 2 : 1, handles, FALSE, s_pollInterval);
+#elif defined(__linux__)
+        // The futex only puts us to sleep if the value still hasn't changed.
+        timespec timeout = { 0, s_pollInterval * 1000000 };
+        syscall(SYS_futex, address, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+        SleepMilliseconds(1);
+#endif
+    }
+
+    waiting = 0;
+
+    if (m_destroyed)
+    {
+        return false;
+    }
+
+    // Let the caller pick up anything the other side wrote before it closed.
+    if (*address != value)
+    {
+        return true;
+    }
+
+    return GetIsPeerAlive();
+
+}
+
+void RingTransport::Wake(unsigned int ring, Waiter waiter, volatile unsigned int* address)
+{
+
+    FullMemoryBarrier();
+
+    if (m_header->ring[ring].waiting[waiter])
+    {
+#ifdef _WIN32
+        SetEvent(m_event[ring][waiter]);
+#elif defined(__linux__)
+        syscall(SYS_futex, address, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+        // The waiter is polling.
+        (void)address;
+#endif
+    }
+
+}
+
+bool RingTransport::GetIsPeerAlive() const
+{
+
+    unsigned int peer = 1 - m_side;
+
+    if (m_header->state[peer] != RingState_Open)
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    return m_peerProcess == NULL || WaitForSingleObject(m_peerProcess, 0) != WAIT_OBJECT_0;
+#else
+    return kill(static_cast<pid_t>(m_header->processId[peer]), 0) == 0 || errno == EPERM;
+#endif
+
+}
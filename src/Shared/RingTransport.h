@@ -0,0 +1,142 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RING_TRANSPORT_H
+#define RING_TRANSPORT_H
+
+#include "Transport.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <string>
+
+//
+// Forward declarations.
+//
+
+struct RingHeader;
+
+/**
+ * Transport implemented as a pair of single producer, single consumer ring
+ * buffers in shared memory, one for each direction. Writing is a copy into
+ * the ring and the reader is only woken up (with an event on Windows or a
+ * futex on Linux) when it's actually waiting for data, so a steady stream of
+ * events doesn't cost a kernel transition per message.
+ *
+ * Each ring has exactly one writer and one reader. The Channel serializes
+ * writers with its write lock, and reading from a channel is only done from
+ * a single thread.
+ */
+class RingTransport : public Transport
+{
+
+public:
+
+    /**
+     * Constructor.
+     */
+    RingTransport();
+
+    /**
+     * Destructor.
+     */
+    virtual ~RingTransport();
+
+    virtual bool Create(const char* name);
+    virtual bool Connect(const char* name);
+    virtual bool WaitForConnection();
+    virtual void Destroy();
+    virtual bool Write(const void* buffer, unsigned int length);
+    virtual bool Read(void* buffer, unsigned int length);
+
+    /**
+     * Waits up to timeout milliseconds for the other end to connect. Returns
+     * false if it didn't.
+     */
+    bool WaitForConnection(unsigned int timeout);
+
+private:
+
+    enum Side
+    {
+        Side_Creator    = 0,
+        Side_Connector  = 1,
+    };
+
+    enum Waiter
+    {
+        Waiter_Data     = 0,    // Reader waiting for the ring to have data.
+        Waiter_Space    = 1,    // Writer waiting for the ring to have space.
+    };
+
+    /**
+     * Maps the shared memory and sets up the wake up objects. If create is
+     * true the shared memory is created, otherwise an existing one is opened.
+     */
+    bool Open(const char* name, bool create);
+
+    /**
+     * Releases the shared memory and the wake up objects.
+     */
+    void Close();
+
+    /**
+     * Blocks the calling thread while the value at the address is equal to
+     * value. Returns false if the transport was shut down or the process on
+     * the other end went away.
+     */
+    bool Block(unsigned int ring, Waiter waiter, volatile unsigned int* address, unsigned int value);
+
+    /**
+     * Wakes up the thread blocked on the ring, if there is one.
+     */
+    void Wake(unsigned int ring, Waiter waiter, volatile unsigned int* address);
+
+    /**
+     * Returns true if the other end of the transport is still usable.
+     */
+    bool GetIsPeerAlive() const;
+
+private:
+
+    static const unsigned int   s_ringSize      = 1024 * 1024;  // Must be a power of 2.
+    static const unsigned int   s_headerSize    = 4096;
+    static const unsigned int   s_pollInterval  = 100;          // Milliseconds.
+
+    RingHeader*                 m_header;
+    char*                       m_data[2];      // Data for the ring written by each side.
+    Side                        m_side;
+    volatile bool               m_destroyed;
+
+#ifdef _WIN32
+    HANDLE                      m_mapping;
+    HANDLE                      m_event[2][2];  // Indexed by ring and waiter.
+    HANDLE                      m_peerProcess;
+#else
+    std::string                 m_path;         // Name of the shared memory if we created it.
+#endif
+
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ScriptSource.h"
+#include "Channel.h"
+#include "Compression.h"
+
+void WriteScriptSource(Channel& channel, const std::string& source, unsigned long long hash, bool isFile, SourceEncoding encoding)
+{
+
+    if (encoding == SourceEncoding_Hash)
+    {
+        if (isFile && !source.empty())
+        {
+            channel.WriteUInt32(SourceEncoding_Hash);
+            channel.WriteUInt32(static_cast<unsigned int>(hash));
+            channel.WriteUInt32(static_cast<unsigned int>(hash >> 32));
+            channel.WriteUInt32(source.length());
+            return;
+        }
+        // The frontend has no file to check the hash against, so send the
+        // body instead. Asking for hashes implies compression is supported.
+        encoding = SourceEncoding_Lz;
+    }
+
+    // Small sources aren't worth the time it takes to compress them.
+    static const size_t minCompressSize = 256;
+
+    if (encoding == SourceEncoding_Lz && source.length() >= minCompressSize)
+    {
+        std::string compressed;
+        CompressLz(source.data(), source.length(), compressed);
+        if (compressed.length() < source.length())
+        {
+            channel.WriteUInt32(SourceEncoding_Lz);
+            channel.WriteUInt32(source.length());
+            channel.WriteString(compressed);
+            return;
+        }
+    }
+
+    channel.WriteUInt32(SourceEncoding_Raw);
+    channel.WriteString(source);
+
+}
+
+bool ReadScriptSource(Channel& channel, SourceEncoding& encoding, std::string& source, unsigned long long& hash, unsigned int& size)
+{
+
+    unsigned int value;
+
+    if (!channel.ReadUInt32(value))
+    {
+        return false;
+    }
+
+    encoding = static_cast<SourceEncoding>(value);
+    source.clear();
+
+    if (encoding == SourceEncoding_Hash)
+    {
+        unsigned int hashLow;
+        unsigned int hashHigh;
+        if (!channel.ReadUInt32(hashLow) || !channel.ReadUInt32(hashHigh) || !channel.ReadUInt32(size))
+        {
+            return false;
+        }
+        hash = (static_cast<unsigned long long>(hashHigh) << 32) | hashLow;
+        return true;
+    }
+    else if (encoding == SourceEncoding_Lz)
+    {
+        std::string compressed;
+        if (!channel.ReadUInt32(size) || !channel.ReadString(compressed))
+        {
+            return false;
+        }
+        return DecompressLz(compressed.data(), compressed.length(), size, source);
+    }
+    else if (encoding == SourceEncoding_Raw)
+    {
+        if (!channel.ReadString(source))
+        {
+            return false;
+        }
+        size = source.length();
+        return true;
+    }
+
+    return false;
+
+}
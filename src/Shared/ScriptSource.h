@@ -0,0 +1,53 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SCRIPT_SOURCE_H
+#define SCRIPT_SOURCE_H
+
+#include "Protocol.h"
+
+#include <string>
+
+//
+// Forward declarations.
+//
+
+class Channel;
+
+/**
+ * Writes the source of a script as it's sent in EventId_LoadScript and
+ * EventId_ScriptSource, starting with the encoding that was actually used.
+ * Only a hash is sent for files, since the frontend needs the file to check
+ * the hash against; other sources fall back to being compressed. Sources
+ * that don't get smaller when compressed are sent raw.
+ */
+void WriteScriptSource(Channel& channel, const std::string& source, unsigned long long hash, bool isFile, SourceEncoding encoding);
+
+/**
+ * Reads a source written by WriteScriptSource. If encoding is returned as
+ * SourceEncoding_Hash only the hash and size of the source were sent and
+ * source is left empty. Returns false if the data couldn't be read or is
+ * corrupt.
+ */
+bool ReadScriptSource(Channel& channel, SourceEncoding& encoding, std::string& source, unsigned long long& hash, unsigned int& size);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _WIN32
+
+#include "SocketTransport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+SocketTransport::SocketTransport()
+{
+    m_listenSocket  = -1;
+    m_socket        = -1;
+    m_numUsers      = 0;
+}
+
+SocketTransport::~SocketTransport()
+{
+    Destroy();
+}
+
+std::string SocketTransport::GetSocketPath(const char* name)
+{
+
+    const char* directory = getenv("TMPDIR");
+
+    if (directory == NULL || directory[0] == 0)
+    {
+        directory = "/tmp";
+    }
+
+    std::string path = directory;
+
+    if (path[path.length() - 1] != '/')
+    {
+        path += '/';
+    }
+
+    path += name;
+    return path;
+
+}
+
+bool SocketTransport::Create(const char* name)
+{
+
+    std::string path = GetSocketPath(name);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+
+    if (path.length() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    m_listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (m_listenSocket == -1)
+    {
+        return false;
+    }
+
+    // Remove a socket file left behind by a previous session with the same name.
+    unlink(path.c_str());
+
+    if (bind(m_listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(m_listenSocket, 1) != 0)
+    {
+        close(m_listenSocket);
+        m_listenSocket = -1;
+        return false;
+    }
+
+    // Remember that we created the socket file so we can properly destroy it.
+    m_path = path;
+
+    return true;
+
+}
+
+bool SocketTransport::Connect(const char* name)
+{
+
+    std::string path = GetSocketPath(name);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+
+    if (path.length() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (m_socket == -1)
+    {
+        return false;
+    }
+
+    if (connect(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    return true;
+
+}
+
+bool SocketTransport::WaitForConnection()
+{
+
+    int listenSocket = AcquireSocket(m_listenSocket);
+
+    if (listenSocket == -1)
+    {
+        return false;
+    }
+
+    int result;
+
+    do
+    {
+        result = accept(listenSocket, NULL, NULL);
+    }
+    while (result == -1 && errno == EINTR);
+
+    ReleaseSocket();
+
+    if (result == -1)
+    {
+        return false;
+    }
+
+    m_socket = result;
+
+    // Only one connection is accepted, like a single instance pipe. We were
+    // the only user of the listening socket, so it can be closed right away.
+    listenSocket = TakeSocket(m_listenSocket);
+
+    if (listenSocket == -1)
+    {
+        // Destroy was called while we were accepting the connection.
+        int socket = TakeSocket(m_socket);
+        if (socket != -1)
+        {
+            close(socket);
+        }
+        return false;
+    }
+
+    close(listenSocket);
+
+    return true;
+
+}
+
+void SocketTransport::Destroy()
+{
+
+    int socket       = TakeSocket(m_socket);
+    int listenSocket = TakeSocket(m_listenSocket);
+
+    // Shutting down the sockets wakes up any thread blocked on them. The
+    // descriptors aren't closed until those threads have returned, since
+    // otherwise the numbers could be reused by another open and then read
+    // by the wrong owner.
+
+    if (socket != -1)
+    {
+        shutdown(socket, SHUT_RDWR);
+    }
+
+    if (listenSocket != -1)
+    {
+        shutdown(listenSocket, SHUT_RDWR);
+    }
+
+    while (m_numUsers > 0)
+    {
+        usleep(1000);
+    }
+
+    if (socket != -1)
+    {
+        close(socket);
+    }
+
+    if (listenSocket != -1)
+    {
+        close(listenSocket);
+    }
+
+    if (!m_path.empty())
+    {
+        unlink(m_path.c_str());
+        m_path.clear();
+    }
+
+}
+
+bool SocketTransport::Write(const void* buffer, unsigned int length)
+{
+
+    int socket = AcquireSocket(m_socket);
+
+    if (socket == -1)
+    {
+        return false;
+    }
+
+    const char* data = static_cast<const char*>(buffer);
+    bool result = true;
+
+    while (length > 0)
+    {
+
+        ssize_t numBytesWritten = send(socket, data, length, MSG_NOSIGNAL);
+
+        if (numBytesWritten == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (numBytesWritten <= 0)
+        {
+            result = false;
+            break;
+        }
+
+        data   += numBytesWritten;
+        length -= static_cast<unsigned int>(numBytesWritten);
+
+    }
+
+    ReleaseSocket();
+    return result;
+
+}
+
+bool SocketTransport::Read(void* buffer, unsigned int length)
+{
+
+    int socket = AcquireSocket(m_socket);
+
+    if (socket == -1)
+    {
+        return false;
+    }
+
+    char* data = static_cast<char*>(buffer);
+    bool result = true;
+
+    while (length > 0)
+    {
+
+        ssize_t numBytesRead = recv(socket, data, length, 0);
+
+        if (numBytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (numBytesRead <= 0)
+        {
+            // Either the other end closed the connection or we were shut down.
+            result = false;
+            break;
+        }
+
+        data   += numBytesRead;
+        length -= static_cast<unsigned int>(numBytesRead);
+
+    }
+
+    ReleaseSocket();
+    return result;
+
+}
+
+int SocketTransport::AcquireSocket(volatile int& socket)
+{
+
+    // Register as a user before looking at the descriptor. Destroy clears
+    // the descriptor before it checks for users, so either it sees us or we
+    // see that the socket is gone.
+    __sync_fetch_and_add(&m_numUsers, 1);
+
+    int result = socket;
+
+    if (result == -1)
+    {
+        ReleaseSocket();
+    }
+
+    return result;
+
+}
+
+void SocketTransport::ReleaseSocket()
+{
+    __sync_fetch_and_sub(&m_numUsers, 1);
+}
+
+int SocketTransport::TakeSocket(volatile int& socket)
+{
+    int descriptor = __sync_lock_test_and_set(&socket, -1);
+    __sync_synchronize();
+    return descriptor;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SOCKET_TRANSPORT_H
+#define SOCKET_TRANSPORT_H
+
+#include "Transport.h"
+
+#include <string>
+
+/**
+ * Transport implemented on top of a POSIX Unix domain socket. The socket
+ * file is created in the temporary directory using the channel name.
+ */
+class SocketTransport : public Transport
+{
+
+public:
+
+    /**
+     * Constructor.
+     */
+    SocketTransport();
+
+    /**
+     * Destructor.
+     */
+    virtual ~SocketTransport();
+
+    virtual bool Create(const char* name);
+    virtual bool Connect(const char* name);
+    virtual bool WaitForConnection();
+    virtual void Destroy();
+    virtual bool Write(const void* buffer, unsigned int length);
+    virtual bool Read(void* buffer, unsigned int length);
+
+private:
+
+    /**
+     * Gets the file system path for the socket with the specified name.
+     */
+    static std::string GetSocketPath(const char* name);
+
+    /**
+     * Returns the descriptor stored in socket and marks it as in use so
+     * that Destroy doesn't close it until ReleaseSocket is called. Returns
+     * -1 if the socket isn't open, in which case ReleaseSocket isn't called.
+     */
+    int AcquireSocket(volatile int& socket);
+
+    /**
+     * Marks a descriptor returned by AcquireSocket as no longer in use.
+     */
+    void ReleaseSocket();
+
+    /**
+     * Takes the descriptor stored in socket, leaving -1 in its place so that
+     * no new calls can start using it.
+     */
+    static int TakeSocket(volatile int& socket);
+
+private:
+
+    volatile int    m_listenSocket;
+    volatile int    m_socket;
+    volatile int    m_numUsers;     // Number of threads inside a call that uses one of the descriptors.
+    std::string     m_path;         // Path of the socket file if we created it.
+
+};
+
+#endif
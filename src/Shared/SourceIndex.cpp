@@ -0,0 +1,63 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SourceIndex.h"
+
+#include <string.h>
+
+void SourceIndex::Insert(unsigned int index, const std::string& title, const std::string& source, unsigned long long hash)
+{
+
+    Entry entry;
+    entry.index  = index;
+    entry.title  = &title;
+    entry.source = &source;
+
+    m_entries.insert(std::make_pair(hash, entry));
+
+}
+
+int SourceIndex::Find(const std::string& title, const char* source, size_t size, unsigned long long hash) const
+{
+
+    std::pair<HashToEntryMap::const_iterator, HashToEntryMap::const_iterator> range = m_entries.equal_range(hash);
+
+    // Different sources can have the same hash, so the candidates still
+    // need to be compared, but that's normally just the one that matches.
+    for (HashToEntryMap::const_iterator iterator = range.first; iterator != range.second; ++iterator)
+    {
+        const Entry& entry = iterator->second;
+        if (*entry.title == title && entry.source->size() == size &&
+            (size == 0 || memcmp(entry.source->data(), source, size) == 0))
+        {
+            return entry.index;
+        }
+    }
+
+    return -1;
+
+}
+
+void SourceIndex::Clear()
+{
+    m_entries.clear();
+}
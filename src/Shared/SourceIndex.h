@@ -0,0 +1,72 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SOURCE_INDEX_H
+#define SOURCE_INDEX_H
+
+#include <string>
+#include <unordered_map>
+
+/**
+ * Index of the loaded script sources by content hash. This is used to find
+ * a script that was already loaded with the same code under a different
+ * chunk name without comparing against the source of every loaded script.
+ */
+class SourceIndex
+{
+
+public:
+
+    /**
+     * Adds a script to the index. The title and source are referenced rather
+     * than copied, so they must stay unchanged while the script is in the
+     * index. The hash is the GetContentHash of the source.
+     */
+    void Insert(unsigned int index, const std::string& title, const std::string& source, unsigned long long hash);
+
+    /**
+     * Returns the index of a script with the same file title and source, or
+     * -1 if there isn't one. The hash is the GetContentHash of the source.
+     */
+    int Find(const std::string& title, const char* source, size_t size, unsigned long long hash) const;
+
+    /**
+     * Removes all of the scripts from the index.
+     */
+    void Clear();
+
+private:
+
+    struct Entry
+    {
+        unsigned int        index;
+        const std::string*  title;
+        const std::string*  source;
+    };
+
+    typedef std::unordered_multimap<unsigned long long, Entry> HashToEntryMap;
+
+    HashToEntryMap      m_entries;
+
+};
+
+#endif
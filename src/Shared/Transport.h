@@ -0,0 +1,82 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/**
+ * Byte stream connection between two processes that a Channel sends its
+ * frames over. Implementations only need to move raw bytes; message framing
+ * and buffering are handled by the Channel.
+ */
+class Transport
+{
+
+public:
+
+    /**
+     * Destructor.
+     */
+    virtual ~Transport();
+
+    /**
+     * Creates a new transport suitable for the current platform. The caller
+     * is responsible for deleting the returned object.
+     */
+    static Transport* CreateDefault();
+
+    /**
+     * Creates the named end point that the other process will connect to.
+     */
+    virtual bool Create(const char* name) = 0;
+
+    /**
+     * Connects to an existing end point.
+     */
+    virtual bool Connect(const char* name) = 0;
+
+    /**
+     * Waits for someone to connect to the end point created with Create.
+     */
+    virtual bool WaitForConnection() = 0;
+
+    /**
+     * Shuts down the transport. Any read that is currently blocked will
+     * return with an error.
+     */
+    virtual void Destroy() = 0;
+
+    /**
+     * Writes data to the transport. Returns when all of the data has been
+     * written or when an error occurs.
+     */
+    virtual bool Write(const void* buffer, unsigned int length) = 0;
+
+    /**
+     * Reads data from the transport. Returns when the specified amount has
+     * been read or when an error occurs.
+     */
+    virtual bool Read(void* buffer, unsigned int length) = 0;
+
+};
+
+#endif
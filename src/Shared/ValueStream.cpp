@@ -0,0 +1,367 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ValueStream.h"
+
+#include <string.h>
+
+ValueWriter::ValueWriter(std::string& buffer)
+    : m_buffer(buffer)
+{
+    m_numTables = 0;
+    WriteTag(ValueTag_Stream);
+}
+
+void ValueWriter::WriteValue(const char* type, const std::string& text)
+{
+    WriteTag(ValueTag_Value);
+    WriteType(type);
+    WriteString(text.c_str(), text.length());
+}
+
+void ValueWriter::BeginTable(const char* type)
+{
+    WriteTag(ValueTag_Table);
+    WriteType(type);
+    ++m_numTables;
+}
+
+void ValueWriter::EndTable()
+{
+    WriteTag(ValueTag_End);
+}
+
+void ValueWriter::WriteFunction(unsigned int scriptIndex, unsigned int line)
+{
+    WriteTag(ValueTag_Function);
+    WriteVarint(scriptIndex);
+    WriteVarint(line);
+}
+
+void ValueWriter::WriteError(const std::string& message)
+{
+    WriteTag(ValueTag_Error);
+    WriteString(message.c_str(), message.length());
+}
+
+void ValueWriter::BeginValues(unsigned int count)
+{
+    WriteTag(ValueTag_Values);
+    WriteVarint(count);
+}
+
+void ValueWriter::BeginPagedTable(const char* type, unsigned int start)
+{
+    WriteTag(ValueTag_PagedTable);
+    WriteType(type);
+    WriteVarint(start);
+    ++m_numTables;
+}
+
+void ValueWriter::EndPagedTable(unsigned int handle)
+{
+    WriteTag(ValueTag_End);
+    WriteVarint(handle);
+}
+
+bool ValueWriter::WriteTableRef(const char* type, const void* table)
+{
+
+    TableToIndexMap::const_iterator iterator = m_tables.find(table);
+
+    if (iterator == m_tables.end())
+    {
+        return false;
+    }
+
+    WriteTag(ValueTag_TableRef);
+    WriteType(type);
+    WriteVarint(iterator->second);
+
+    return true;
+
+}
+
+void ValueWriter::AddTable(const void* table)
+{
+    if (table != NULL)
+    {
+        m_tables.insert(std::make_pair(table, m_numTables));
+    }
+}
+
+void ValueWriter::WriteTag(ValueTag tag)
+{
+    m_buffer += static_cast<char>(tag);
+}
+
+void ValueWriter::WriteVarint(unsigned int value)
+{
+    while (value >= 0x80)
+    {
+        m_buffer += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    m_buffer += static_cast<char>(value);
+}
+
+void ValueWriter::WriteString(const char* value, size_t length)
+{
+    WriteVarint(static_cast<unsigned int>(length));
+    m_buffer.append(value, length);
+}
+
+void ValueWriter::WriteType(const char* type)
+{
+
+    if (type == NULL)
+    {
+        type = "";
+    }
+
+    // There are only a handful of different type names in a value, so a
+    // linear search is fine.
+    for (unsigned int i = 0; i < m_types.size(); ++i)
+    {
+        if (m_types[i] == type)
+        {
+            WriteVarint(i + 1);
+            return;
+        }
+    }
+
+    m_types.push_back(type);
+
+    WriteVarint(0);
+    WriteString(type, strlen(type));
+
+}
+
+bool ValueReader::GetIsValueStream(const char* data, size_t length)
+{
+    return length > 0 && data[0] == ValueTag_Stream;
+}
+
+ValueReader::ValueReader(const char* data, size_t length)
+{
+
+    m_data  = reinterpret_cast<const unsigned char*>(data);
+    m_end   = m_data + length;
+    m_valid = GetIsValueStream(data, length);
+
+    if (m_valid)
+    {
+        // Skip over the stream header.
+        ++m_data;
+    }
+
+}
+
+bool ValueReader::GetIsValid() const
+{
+    return m_valid;
+}
+
+bool ValueReader::ReadTag(ValueTag& tag)
+{
+
+    if (!m_valid || m_data == m_end)
+    {
+        m_valid = false;
+        return false;
+    }
+
+    // Tags from a newer writer can't be skipped since we don't know their
+    // layout, so the stream is treated as corrupt.
+    if (*m_data > ValueTag_Last)
+    {
+        m_valid = false;
+        return false;
+    }
+
+    tag = static_cast<ValueTag>(*m_data);
+    ++m_data;
+
+    return true;
+
+}
+
+bool ValueReader::ReadVarint(unsigned int& value)
+{
+
+    value = 0;
+
+    for (unsigned int shift = 0; m_valid && m_data != m_end && shift < 32; shift += 7)
+    {
+
+        unsigned char byte = *m_data;
+        ++m_data;
+
+        value |= static_cast<unsigned int>(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+
+    }
+
+    m_valid = false;
+    return false;
+
+}
+
+bool ValueReader::ReadString(std::string& value)
+{
+
+    unsigned int length;
+
+    if (!ReadVarint(length))
+    {
+        return false;
+    }
+
+    if (length > static_cast<size_t>(m_end - m_data))
+    {
+        m_valid = false;
+        return false;
+    }
+
+    value.assign(reinterpret_cast<const char*>(m_data), length);
+    m_data += length;
+
+    return true;
+
+}
+
+bool ValueReader::ReadType(std::string& type)
+{
+
+    unsigned int id;
+
+    if (!ReadVarint(id))
+    {
+        return false;
+    }
+
+    if (id == 0)
+    {
+        if (!ReadString(type))
+        {
+            return false;
+        }
+        m_types.push_back(type);
+        return true;
+    }
+
+    if (id > m_types.size())
+    {
+        m_valid = false;
+        return false;
+    }
+
+    type = m_types[id - 1];
+    return true;
+
+}
+
+bool ValueReader::SkipValue(ValueTag tag)
+{
+
+    std::string temp;
+    unsigned int value;
+
+    switch (tag)
+    {
+    case ValueTag_Value:
+        return ReadType(temp) && ReadString(temp);
+    case ValueTag_Table:
+    case ValueTag_PagedTable:
+        {
+
+            if (!ReadType(temp))
+            {
+                return false;
+            }
+
+            if (tag == ValueTag_PagedTable && !ReadVarint(value))
+            {
+                return false;
+            }
+
+            ValueTag tableTag = tag;
+
+            // Skip over the key/value pairs.
+            while (ReadTag(tag) && tag != ValueTag_End)
+            {
+                ValueTag dataTag;
+                if (!SkipValue(tag) || !ReadTag(dataTag) || !SkipValue(dataTag))
+                {
+                    return false;
+                }
+            }
+
+            if (tableTag == ValueTag_PagedTable)
+            {
+                // Skip the handle.
+                ReadVarint(value);
+            }
+
+            return m_valid;
+
+        }
+    case ValueTag_Function:
+        return ReadVarint(value) && ReadVarint(value);
+    case ValueTag_Error:
+        return ReadString(temp);
+    case ValueTag_TableRef:
+        return ReadType(temp) && ReadVarint(value);
+    case ValueTag_Values:
+        {
+
+            unsigned int count;
+
+            if (!ReadVarint(count))
+            {
+                return false;
+            }
+
+            for (unsigned int i = 0; i < count; ++i)
+            {
+                if (!ReadTag(tag) || !SkipValue(tag))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+
+        }
+    default:
+        break;
+    }
+
+    // Unknown tag.
+    m_valid = false;
+    return false;
+
+}
@@ -0,0 +1,167 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef VALUE_STREAM_H
+#define VALUE_STREAM_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * Tags used in the binary form of an evaluated value. The stream starts with
+ * ValueTag_Stream (a zero byte, which can't start the XML form) and is
+ * followed by a single value:
+ *
+ * Value:    type, string text
+ * Table:    type, then key/value pairs until ValueTag_End
+ * Function: varint scriptIndex, varint line
+ * Error:    string message
+ * Values:   varint count, then count values
+ * Paged:    type, varint start, then key/value pairs until ValueTag_End,
+ *           then varint handle
+ * TableRef: type, varint table
+ *
+ * Numbers are LEB128 varints and strings are a varint length followed by
+ * the bytes. A type is a varint id; 0 introduces a new name (a string)
+ * which is given the next id, so each type name is only sent once.
+ *
+ * A paged table holds the elements starting at index start. If the handle
+ * isn't 0 there are more elements, which can be requested with
+ * CommandId_ExpandTable starting after the last one sent.
+ *
+ * A table that appears more than once is only written the first time; after
+ * that it's written as a TableRef, which holds the index of the first one
+ * among the Table and Paged values in the stream.
+ */
+enum ValueTag
+{
+    ValueTag_Stream             = 0,
+    ValueTag_End                = 0,
+    ValueTag_Value              = 1,
+    ValueTag_Table              = 2,
+    ValueTag_Function           = 3,
+    ValueTag_Error              = 4,
+    ValueTag_Values             = 5,
+    ValueTag_PagedTable         = 6,
+    ValueTag_TableRef           = 7,
+    ValueTag_Last               = ValueTag_TableRef,
+};
+
+/**
+ * Writes the binary form of a value into a buffer.
+ */
+class ValueWriter
+{
+
+public:
+
+    /**
+     * Constructor. The stream header is appended to the buffer.
+     */
+    explicit ValueWriter(std::string& buffer);
+
+    void WriteValue(const char* type, const std::string& text);
+    void BeginTable(const char* type);
+    void EndTable();
+    void WriteFunction(unsigned int scriptIndex, unsigned int line);
+    void WriteError(const std::string& message);
+    void BeginValues(unsigned int count);
+    void BeginPagedTable(const char* type, unsigned int start);
+    void EndPagedTable(unsigned int handle);
+
+    /**
+     * If the table has already been written to the stream, writes a reference
+     * to it and returns true. The table is identified by its address.
+     */
+    bool WriteTableRef(const char* type, const void* table);
+
+    /**
+     * Remembers that the table is written by the next BeginTable or
+     * BeginPagedTable, so later occurrences can refer back to it.
+     */
+    void AddTable(const void* table);
+
+private:
+
+    void WriteTag(ValueTag tag);
+    void WriteVarint(unsigned int value);
+    void WriteString(const char* value, size_t length);
+    void WriteType(const char* type);
+
+private:
+
+    typedef std::map<const void*, unsigned int> TableToIndexMap;
+
+    std::string&                m_buffer;
+    std::vector<std::string>    m_types;
+    TableToIndexMap             m_tables;
+    unsigned int                m_numTables;
+
+};
+
+/**
+ * Reads the binary form of a value written by ValueWriter. The reader is
+ * used by walking the stream in order, so the value never has to be
+ * decoded into an intermediate tree.
+ */
+class ValueReader
+{
+
+public:
+
+    /**
+     * Returns true if the data is in the binary form rather than XML.
+     */
+    static bool GetIsValueStream(const char* data, size_t length);
+
+    /**
+     * Constructor. The data must remain valid for the life of the reader.
+     */
+    ValueReader(const char* data, size_t length);
+
+    /**
+     * Returns false if the end of the data has been reached or the data is
+     * corrupt.
+     */
+    bool GetIsValid() const;
+
+    bool ReadTag(ValueTag& tag);
+    bool ReadVarint(unsigned int& value);
+    bool ReadString(std::string& value);
+    bool ReadType(std::string& type);
+
+    /**
+     * Skips over the rest of a value whose tag has already been read.
+     */
+    bool SkipValue(ValueTag tag);
+
+private:
+
+    const unsigned char*        m_data;
+    const unsigned char*        m_end;
+    bool                        m_valid;
+    std::vector<std::string>    m_types;
+
+};
+
+#endif
@@ -0,0 +1,135 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include "BreakpointSet.h"
+
+#include <stdio.h>
+#include <vector>
+
+TEST(BreakpointSetToggle)
+{
+
+    BreakpointSet breakpoints;
+
+    TEST_CHECK(!breakpoints.GetHasBreakpoint(0));
+    TEST_CHECK(!breakpoints.GetHasBreakpointInRange(0, 1000));
+
+    TEST_CHECK(breakpoints.Toggle(20));
+    TEST_CHECK(breakpoints.Toggle(5));
+    TEST_CHECK(breakpoints.Toggle(12));
+    TEST_CHECK(breakpoints.GetNumBreakpoints() == 3);
+
+    TEST_CHECK(breakpoints.GetHasBreakpoint(5) && breakpoints.GetHasBreakpoint(12) && breakpoints.GetHasBreakpoint(20));
+    TEST_CHECK(!breakpoints.GetHasBreakpoint(6) && !breakpoints.GetHasBreakpoint(21) && !breakpoints.GetHasBreakpoint(100000));
+
+    // The end of a range isn't included.
+    TEST_CHECK(breakpoints.GetHasBreakpointInRange(6, 13));
+    TEST_CHECK(!breakpoints.GetHasBreakpointInRange(6, 12));
+    TEST_CHECK(!breakpoints.GetHasBreakpointInRange(21, 1000));
+    TEST_CHECK(breakpoints.GetHasBreakpointInRange(0, 6));
+
+    TEST_CHECK(!breakpoints.Toggle(12));
+    TEST_CHECK(!breakpoints.GetHasBreakpoint(12));
+    TEST_CHECK(!breakpoints.GetHasBreakpointInRange(6, 20));
+    TEST_CHECK(breakpoints.GetNumBreakpoints() == 2);
+
+    breakpoints.Clear();
+    TEST_CHECK(breakpoints.GetNumBreakpoints() == 0);
+    TEST_CHECK(!breakpoints.GetHasBreakpoint(5));
+
+}
+
+/**
+ * The check the line hook made before BreakpointSet.
+ */
+static bool GetHasBreakpointByScan(const std::vector<unsigned int>& breakpoints, unsigned int line)
+{
+    for (size_t i = 0; i < breakpoints.size(); i++)
+    {
+        if (breakpoints[i] == line)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Measures the breakpoint check the line hook does for every line executed,
+ * with a tight 10 line loop running in a script that has 0, 10 or 1000
+ * breakpoints elsewhere in it. This is the per-line part of running under
+ * HookMode_Full; the rest of the hook doesn't depend on the number of
+ * breakpoints.
+ */
+BENCHMARK(BreakpointLineHookBenchmark)
+{
+
+    static const unsigned int numBreakpointsList[] = { 0, 10, 1000 };
+    static const unsigned int numLines = 100000000;
+
+    for (unsigned int k = 0; k < sizeof(numBreakpointsList) / sizeof(numBreakpointsList[0]); ++k)
+    {
+
+        unsigned int numBreakpoints = numBreakpointsList[k];
+
+        BreakpointSet breakpoints;
+        std::vector<unsigned int> breakpointList;
+
+        for (unsigned int i = 0; i < numBreakpoints; ++i)
+        {
+            unsigned int line = 100 + i * 3;
+            breakpoints.Toggle(line);
+            breakpointList.push_back(line);
+        }
+
+        // The lines of the loop are read through a volatile so the compiler
+        // can't hoist the checks out of it.
+        volatile unsigned int firstLine = 10;
+        unsigned int numHits = 0;
+
+        double startTime = GetTestTime();
+
+        for (unsigned int i = 0; i < numLines; ++i)
+        {
+            numHits += GetHasBreakpointByScan(breakpointList, firstLine + i % 10);
+        }
+
+        double scanTime = GetTestTime() - startTime;
+        startTime = GetTestTime();
+
+        for (unsigned int i = 0; i < numLines; ++i)
+        {
+            numHits += breakpoints.GetHasBreakpoint(firstLine + i % 10);
+        }
+
+        double setTime = GetTestTime() - startTime;
+
+        TEST_CHECK(numHits == 0);
+
+        printf("  %4u breakpoints: scan %6.2f ns/line, flags %6.2f ns/line\n",
+            numBreakpoints, scanTime / numLines * 1e9, setTime / numLines * 1e9);
+
+    }
+
+}
@@ -0,0 +1,305 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include "CriticalSection.h"
+#include "HookFastPath.h"
+
+#include <stdio.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <hash_map>
+#else
+#include <unordered_map>
+#endif
+
+#ifdef _WIN32
+#define TEST_THREAD_LOCAL __declspec(thread)
+#else
+#define TEST_THREAD_LOCAL __thread
+#endif
+
+/**
+ * Stands in for the state DebugBackend::HookCallback reads on every hook
+ * event, since the hook itself needs a Lua host. The fast path decision (the
+ * cache lookup, the generation check, the can't-break test and the recheck
+ * after turning the hook off) is the shipped code from HookFastPath.h. The
+ * rest is a model: turning the hook off just sets a flag instead of calling
+ * lua_sethook, and the locked path is only the critical section and the
+ * state to VM lookup. The numbers are for that combination, not a measurement
+ * of HookCallback itself.
+ */
+struct HookModelVm
+{
+    bool            initialized;
+    volatile bool   haveActiveBreakpoints;
+    bool            hookOn;
+};
+
+#ifdef _WIN32
+typedef stdext::hash_map<void*, HookModelVm*>   HookModelStateToVmMap;
+#else
+typedef std::unordered_map<void*, HookModelVm*> HookModelStateToVmMap;
+#endif
+
+struct HookModel
+{
+    CriticalSection                             criticalSection;
+    HookModelStateToVmMap                       stateToVm;
+    volatile bool                               continueMode;
+    volatile unsigned int                       vmGeneration;
+};
+
+/**
+ * What RunHookFastPath uses to turn the hook off in the model.
+ */
+struct HookModelHook
+{
+    bool GetIsContinuing() const
+    {
+        return model->continueMode;
+    }
+    void TurnOff()
+    {
+        vm->hookOn = false;
+    }
+    void TurnOn()
+    {
+        vm->hookOn = true;
+    }
+    HookModel*      model;
+    HookModelVm*    vm;
+};
+
+struct HookModelCache
+{
+    void*           L;
+    HookModelVm*    vm;
+    unsigned int    vmGeneration;
+};
+
+static TEST_THREAD_LOCAL HookModelCache s_hookCache;
+
+/**
+ * What the hook did before the fast path: everything under the lock.
+ * Returns true if the event could cause a break.
+ */
+static bool LockedHook(HookModel& model, void* L)
+{
+
+    model.criticalSection.Enter();
+
+    HookModelVm* vm = NULL;
+    HookModelStateToVmMap::const_iterator iterator = model.stateToVm.find(L);
+
+    if (iterator != model.stateToVm.end())
+    {
+        vm = iterator->second;
+    }
+
+    bool mayBreak = vm == NULL || !vm->initialized || !model.continueMode || vm->haveActiveBreakpoints;
+
+    model.criticalSection.Exit();
+    return mayBreak;
+
+}
+
+/**
+ * The hook with the fast path in front of it, the way HookCallback does it.
+ */
+static bool CachedHook(HookModel& model, void* L)
+{
+
+    HookModelCache& cache = s_hookCache;
+    HookModelVm* vm = NULL;
+
+    if (GetHookCacheHit(&cache, L, model.vmGeneration, vm))
+    {
+
+        HookModelHook hook;
+        hook.model = &model;
+        hook.vm    = vm;
+
+        if (RunHookFastPath(vm, hook))
+        {
+            return false;
+        }
+
+    }
+
+    model.criticalSection.Enter();
+
+    vm = model.stateToVm[L];
+
+    cache.L            = L;
+    cache.vm           = vm;
+    cache.vmGeneration = model.vmGeneration;
+
+    bool mayBreak = !vm->initialized || !model.continueMode || vm->haveActiveBreakpoints;
+
+    model.criticalSection.Exit();
+    return mayBreak;
+
+}
+
+struct HookThreadData
+{
+    HookModel*      model;
+    void*           L;
+    bool            cached;
+    unsigned int    numEvents;
+    unsigned int    numBreaks;
+};
+
+static void HookThread(void* param)
+{
+
+    HookThreadData* data = static_cast<HookThreadData*>(param);
+    data->numBreaks = 0;
+
+    for (unsigned int i = 0; i < data->numEvents; ++i)
+    {
+        if (data->cached)
+        {
+            data->numBreaks += CachedHook(*data->model, data->L);
+        }
+        else
+        {
+            data->numBreaks += LockedHook(*data->model, data->L);
+        }
+    }
+
+}
+
+TEST(HookFastPathDecision)
+{
+
+    HookModel model;
+    model.continueMode = true;
+    model.vmGeneration = 1;
+
+    HookModelVm vm;
+    vm.initialized           = true;
+    vm.haveActiveBreakpoints = false;
+    vm.hookOn                = true;
+
+    HookModelCache cache;
+    cache.L            = &vm;
+    cache.vm           = &vm;
+    cache.vmGeneration = 1;
+
+    // The cache only hits for the same state and generation.
+    HookModelVm* cachedVm = NULL;
+    TEST_CHECK(GetHookCacheHit(&cache, &vm, 1, cachedVm) && cachedVm == &vm);
+    TEST_CHECK(!GetHookCacheHit(&cache, &vm, 2, cachedVm));
+    TEST_CHECK(!GetHookCacheHit(&cache, &model, 1, cachedVm));
+    TEST_CHECK(!GetHookCacheHit(static_cast<HookModelCache*>(NULL), &vm, 1, cachedVm));
+
+    HookModelHook hook;
+    hook.model = &model;
+    hook.vm    = &vm;
+
+    // Nothing to debug, so the hook is turned off.
+    TEST_CHECK(RunHookFastPath(&vm, hook));
+    TEST_CHECK(!vm.hookOn);
+
+    // Anything that could break takes the slow path and leaves the hook alone.
+    vm.hookOn = true;
+    vm.haveActiveBreakpoints = true;
+    TEST_CHECK(!RunHookFastPath(&vm, hook));
+    vm.haveActiveBreakpoints = false;
+    model.continueMode = false;
+    TEST_CHECK(!RunHookFastPath(&vm, hook));
+    model.continueMode = true;
+    vm.initialized = false;
+    TEST_CHECK(!RunHookFastPath(&vm, hook));
+    TEST_CHECK(!RunHookFastPath(static_cast<HookModelVm*>(NULL), hook));
+    TEST_CHECK(vm.hookOn);
+
+}
+
+/**
+ * Measures hook events per second with N VMs each running on its own
+ * thread and nothing to debug, with and without the lock-free fast path.
+ */
+BENCHMARK(HookThreadsBenchmark)
+{
+
+    static const unsigned int numThreadsList[] = { 1, 2, 4, 8 };
+    static const unsigned int numEvents = 10000000;
+
+    for (unsigned int k = 0; k < sizeof(numThreadsList) / sizeof(numThreadsList[0]); ++k)
+    {
+
+        unsigned int numThreads = numThreadsList[k];
+
+        HookModel model;
+        model.continueMode = true;
+        model.vmGeneration = 1;
+
+        std::vector<HookModelVm> vms(numThreads);
+
+        for (unsigned int i = 0; i < numThreads; ++i)
+        {
+            vms[i].initialized           = true;
+            vms[i].haveActiveBreakpoints = false;
+            vms[i].hookOn                = true;
+            model.stateToVm[&vms[i]] = &vms[i];
+        }
+
+        double times[2];
+
+        for (unsigned int cached = 0; cached < 2; ++cached)
+        {
+
+            std::vector<HookThreadData> data(numThreads);
+            std::vector<void*> threads(numThreads);
+
+            double startTime = GetTestTime();
+
+            for (unsigned int i = 0; i < numThreads; ++i)
+            {
+                data[i].model     = &model;
+                data[i].L         = &vms[i];
+                data[i].cached    = cached != 0;
+                data[i].numEvents = numEvents / numThreads;
+                threads[i] = StartTestThread(HookThread, &data[i]);
+            }
+
+            for (unsigned int i = 0; i < numThreads; ++i)
+            {
+                JoinTestThread(threads[i]);
+                TEST_CHECK(data[i].numBreaks == 0);
+            }
+
+            times[cached] = GetTestTime() - startTime;
+
+        }
+
+        printf("  %u threads: locked %7.1f M events/s, fast path %7.1f M events/s\n",
+            numThreads, numEvents / times[0] / 1e6, numEvents / times[1] / 1e6);
+
+    }
+
+}
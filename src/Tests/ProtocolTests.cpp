@@ -0,0 +1,325 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+#include "TestTransports.h"
+
+#include "Channel.h"
+#include "Protocol.h"
+#include "ContentHash.h"
+#include "ScriptSource.h"
+
+#include <string>
+
+/**
+ * Conformance of the handshake between frontends and backends from before
+ * and after it was added. Both peers are models of the real ones: they send
+ * and parse exactly the messages involved in the handshake and in loading a
+ * script, using the same protocol helpers as DebugBackend.
+ */
+
+static const char* s_fileName = "@scripts/game/Module.lua";
+
+/**
+ * What each side of the connection supports. A legacy peer doesn't know
+ * about the handshake at all.
+ */
+struct TestPeer
+{
+    bool            legacy;
+    unsigned int    capabilities;
+};
+
+struct BackendPeerData
+{
+    TestPeer        peer;
+    Channel*        events;
+    Channel*        commands;
+    std::string     source;
+};
+
+/**
+ * Model of the backend. It handles commands until CommandId_LoadDone, which
+ * the test uses to trigger a script load, and then sends the load event.
+ */
+static void BackendPeerThread(void* param)
+{
+
+    BackendPeerData* data = static_cast<BackendPeerData*>(param);
+
+    SourceEncoding encoding          = SourceEncoding_Raw;
+    bool           sendEncoding      = false;
+    bool           sendWaitForLoad   = false;
+
+    unsigned int commandId;
+
+    while (data->commands->ReadUInt32(commandId))
+    {
+
+        if (commandId == CommandId_Handshake && !data->peer.legacy)
+        {
+
+            unsigned int handshake;
+            data->commands->ReadUInt32(handshake);
+
+            unsigned int version;
+            unsigned int capabilities;
+            NegotiateHandshake(handshake, data->peer.capabilities, version, capabilities);
+
+            encoding        = GetSourceEncoding(capabilities);
+            sendEncoding    = encoding != SourceEncoding_Raw;
+            sendWaitForLoad = (capabilities & Capability_LoadFilter) != 0;
+
+            data->events->BeginMessage();
+            data->events->WriteUInt32(EventId_Handshake);
+            data->events->WriteUInt32(PackHandshake(version, capabilities));
+            data->events->EndMessage();
+            data->events->Flush();
+
+        }
+        else
+        {
+
+            // Every other command, including ones a legacy backend doesn't
+            // know about, is the id followed by the VM.
+            unsigned int vm;
+            data->commands->ReadUInt32(vm);
+
+            if (commandId == CommandId_LoadDone)
+            {
+                break;
+            }
+
+        }
+
+    }
+
+    data->events->BeginMessage();
+    data->events->WriteUInt32(EventId_LoadScript);
+    data->events->WriteUInt32(0x12345678);
+    data->events->WriteString(s_fileName + 1);
+
+    if (sendEncoding)
+    {
+        WriteScriptSource(*data->events, data->source, GetContentHash(data->source.data(), data->source.size()), true, encoding);
+    }
+    else
+    {
+        data->events->WriteString(data->source);
+    }
+
+    data->events->WriteUInt32(CodeState_Normal);
+
+    if (sendWaitForLoad)
+    {
+        data->events->WriteBool(true);
+    }
+
+    data->events->EndMessage();
+    data->events->Flush();
+
+}
+
+/**
+ * What the frontend ended up with after the load event.
+ */
+struct FrontendResult
+{
+    bool            gotHandshake;
+    unsigned int    capabilities;
+    SourceEncoding  encoding;
+    bool            sourceMatches;
+    bool            waitForLoad;
+};
+
+/**
+ * Runs a frontend against a backend and returns what the frontend saw.
+ * Returns false if the frontend couldn't parse the events.
+ */
+static bool RunHandshake(const TestPeer& frontend, const TestPeer& backend, FrontendResult& result)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    Channel frontendEvents(types[0].create());
+    Channel frontendCommands(types[0].create());
+    Channel backendEvents(types[0].create());
+    Channel backendCommands(types[0].create());
+
+    if (!ConnectTestChannels(frontendEvents, backendEvents) ||
+        !ConnectTestChannels(frontendCommands, backendCommands))
+    {
+        return false;
+    }
+
+    BackendPeerData data;
+    data.peer       = backend;
+    data.events     = &backendEvents;
+    data.commands   = &backendCommands;
+    data.source     = std::string(1000, '-') + "\nreturn 1\n";
+
+    void* thread = StartTestThread(BackendPeerThread, &data);
+
+    if (!frontend.legacy)
+    {
+        frontendCommands.WriteUInt32(CommandId_Handshake);
+        frontendCommands.WriteUInt32(PackHandshake(ProtocolVersion_Current, frontend.capabilities));
+    }
+
+    frontendCommands.WriteUInt32(CommandId_LoadDone);
+    frontendCommands.WriteUInt32(0);
+    frontendCommands.Flush();
+
+    result.gotHandshake = false;
+    result.capabilities = 0;
+    result.encoding     = SourceEncoding_Raw;
+    result.waitForLoad  = false;
+
+    bool sendEncoding    = false;
+    bool sendWaitForLoad = false;
+    bool success         = true;
+
+    unsigned int eventId = 0;
+    success = frontendEvents.ReadUInt32(eventId);
+
+    if (success && eventId == EventId_Handshake)
+    {
+
+        unsigned int handshake;
+        unsigned int version;
+
+        success = frontendEvents.ReadUInt32(handshake);
+        UnpackHandshake(handshake, version, result.capabilities);
+
+        result.gotHandshake = true;
+        sendEncoding    = GetSourceEncoding(result.capabilities) != SourceEncoding_Raw;
+        sendWaitForLoad = (result.capabilities & Capability_LoadFilter) != 0;
+
+        success = success && version == ProtocolVersion_Current && frontendEvents.ReadUInt32(eventId);
+
+    }
+
+    unsigned int vm;
+    std::string  fileName;
+    std::string  source;
+    unsigned int state;
+
+    success = success && eventId == EventId_LoadScript &&
+              frontendEvents.ReadUInt32(vm) && frontendEvents.ReadString(fileName);
+
+    if (success && sendEncoding)
+    {
+        unsigned long long hash = 0;
+        unsigned int size = 0;
+        success = ReadScriptSource(frontendEvents, result.encoding, source, hash, size);
+        if (result.encoding == SourceEncoding_Hash)
+        {
+            // The frontend would check this against the file on disk.
+            result.sourceMatches = hash == GetContentHash(data.source.data(), data.source.size()) &&
+                                   size == data.source.size();
+        }
+        else
+        {
+            result.sourceMatches = source == data.source;
+        }
+    }
+    else if (success)
+    {
+        success = frontendEvents.ReadString(source);
+        result.sourceMatches = source == data.source;
+    }
+
+    success = success && frontendEvents.ReadUInt32(state) && state == CodeState_Normal;
+
+    if (success && sendWaitForLoad)
+    {
+        success = frontendEvents.ReadBool(result.waitForLoad);
+    }
+
+    JoinTestThread(thread);
+
+    return success;
+
+}
+
+static const unsigned int s_allCapabilities = Capability_Compression | Capability_ContentHash | Capability_LoadFilter;
+
+TEST(HandshakeLegacyPeers)
+{
+
+    TestPeer legacy  = { true,  0 };
+    TestPeer current = { false, s_allCapabilities };
+
+    FrontendResult result;
+
+    // Neither side knows about the handshake.
+    TEST_CHECK(RunHandshake(legacy, legacy, result));
+    TEST_CHECK(!result.gotHandshake && result.sourceMatches);
+
+    // A new backend keeps the old formats until it hears from the frontend.
+    TEST_CHECK(RunHandshake(legacy, current, result));
+    TEST_CHECK(!result.gotHandshake && result.sourceMatches);
+
+    // An old backend skips the handshake command and the frontend never
+    // hears back, so it keeps using the old formats.
+    TEST_CHECK(RunHandshake(current, legacy, result));
+    TEST_CHECK(!result.gotHandshake && result.sourceMatches);
+
+}
+
+TEST(HandshakeCurrentPeers)
+{
+
+    TestPeer frontend = { false, s_allCapabilities };
+    TestPeer backend  = { false, s_allCapabilities };
+
+    FrontendResult result;
+
+    TEST_CHECK(RunHandshake(frontend, backend, result));
+    TEST_CHECK(result.gotHandshake && result.capabilities == s_allCapabilities);
+    TEST_CHECK(result.encoding == SourceEncoding_Hash && result.sourceMatches);
+    TEST_CHECK(result.waitForLoad);
+
+    // Only the capabilities both sides have are used.
+    TestPeer compressionFrontend = { false, Capability_Compression };
+
+    TEST_CHECK(RunHandshake(compressionFrontend, backend, result));
+    TEST_CHECK(result.gotHandshake && result.capabilities == Capability_Compression);
+    TEST_CHECK(result.encoding == SourceEncoding_Lz && result.sourceMatches);
+    TEST_CHECK(!result.waitForLoad);
+
+    TestPeer compressionBackend = { false, Capability_Compression | Capability_LoadFilter };
+
+    TEST_CHECK(RunHandshake(frontend, compressionBackend, result));
+    TEST_CHECK(result.gotHandshake && result.capabilities == (Capability_Compression | Capability_LoadFilter));
+    TEST_CHECK(result.encoding == SourceEncoding_Lz && result.sourceMatches);
+    TEST_CHECK(result.waitForLoad);
+
+    // Capabilities from a newer frontend that we've never heard of are
+    // ignored.
+    TestPeer newerFrontend = { false, s_allCapabilities | 0x00800000 };
+
+    TEST_CHECK(RunHandshake(newerFrontend, backend, result));
+    TEST_CHECK(result.gotHandshake && result.capabilities == s_allCapabilities);
+
+}
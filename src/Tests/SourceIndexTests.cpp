@@ -0,0 +1,198 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include "SourceIndex.h"
+#include "ContentHash.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/**
+ * Checks that a script is only found when both the title and the source
+ * match.
+ */
+TEST(SourceIndexFind)
+{
+
+    std::string title  = "Module.lua";
+    std::string source = "local x = 1\nreturn x\n";
+    std::string empty;
+
+    SourceIndex index;
+    index.Insert(3, title, source, GetContentHash(source.data(), source.size()));
+    index.Insert(4, title, empty, GetContentHash(empty.data(), empty.size()));
+
+    std::string other = "local x = 2\nreturn x\n";
+
+    TEST_CHECK(index.Find(title, source.data(), source.size(), GetContentHash(source.data(), source.size())) == 3);
+    TEST_CHECK(index.Find("Other.lua", source.data(), source.size(), GetContentHash(source.data(), source.size())) == -1);
+    TEST_CHECK(index.Find(title, other.data(), other.size(), GetContentHash(other.data(), other.size())) == -1);
+    TEST_CHECK(index.Find(title, NULL, 0, GetContentHash(NULL, 0)) == 4);
+
+    // Same hash but different contents, as if there was a collision.
+    TEST_CHECK(index.Find(title, other.data(), other.size(), GetContentHash(source.data(), source.size())) == -1);
+
+    index.Clear();
+    TEST_CHECK(index.Find(title, source.data(), source.size(), GetContentHash(source.data(), source.size())) == -1);
+
+}
+
+struct TestScript
+{
+    std::string     title;
+    std::string     source;
+};
+
+/**
+ * Registers the chunks the way DebugBackend::RegisterScript did before it
+ * had the index: a scan over every loaded script comparing the title and a
+ * copy of the source. Returns the number of new scripts.
+ */
+static unsigned int RegisterByScan(const std::vector<TestScript>& chunks, std::vector<TestScript*>& scripts)
+{
+
+    for (unsigned int i = 0; i < chunks.size(); ++i)
+    {
+
+        const char* source = chunks[i].source.data();
+        size_t size = chunks[i].source.size();
+
+        bool found = false;
+
+        for (unsigned int j = 0; j < scripts.size() && !found; ++j)
+        {
+            found = scripts[j]->title == chunks[i].title &&
+                    scripts[j]->source == std::string(source, size);
+        }
+
+        if (!found)
+        {
+            scripts.push_back(new TestScript(chunks[i]));
+        }
+
+    }
+
+    return scripts.size();
+
+}
+
+/**
+ * Registers the chunks the way DebugBackend::RegisterScript does now.
+ * Returns the number of new scripts.
+ */
+static unsigned int RegisterByIndex(const std::vector<TestScript>& chunks, std::vector<TestScript*>& scripts, SourceIndex& index)
+{
+
+    for (unsigned int i = 0; i < chunks.size(); ++i)
+    {
+
+        const char* source = chunks[i].source.data();
+        size_t size = chunks[i].source.size();
+
+        unsigned long long hash = GetContentHash(source, size);
+
+        if (index.Find(chunks[i].title, source, size, hash) == -1)
+        {
+            TestScript* script = new TestScript(chunks[i]);
+            index.Insert(scripts.size(), script->title, script->source, hash);
+            scripts.push_back(script);
+        }
+
+    }
+
+    return scripts.size();
+
+}
+
+/**
+ * Measures registering 10k chunks where some of them are the same code
+ * loaded again under a different chunk name, which is what games that
+ * reload their scripts do. The scan gets slower with the number of scripts
+ * while the index only pays for hashing each source.
+ */
+BENCHMARK(SourceIndexRegisterBenchmark)
+{
+
+    static const unsigned int numChunks = 10000;
+    static const unsigned int numSourcesList[] = { 1000, 5000, 10000 };
+
+    for (unsigned int k = 0; k < sizeof(numSourcesList) / sizeof(numSourcesList[0]); ++k)
+    {
+
+        unsigned int numSources = numSourcesList[k];
+
+        std::vector<TestScript> chunks(numChunks);
+
+        for (unsigned int i = 0; i < numChunks; ++i)
+        {
+
+            unsigned int sourceIndex = i % numSources;
+
+            char title[64];
+            sprintf(title, "Module%u.lua", sourceIndex);
+
+            chunks[i].title = title;
+
+            // Sources share a long common prefix like real scripts do, so the
+            // comparisons aren't decided by the first byte.
+            chunks[i].source.assign(4096, '-');
+
+            char line[64];
+            sprintf(line, "\nreturn %u\n", sourceIndex);
+            chunks[i].source += line;
+
+        }
+
+        std::vector<TestScript*> scanScripts;
+        std::vector<TestScript*> indexScripts;
+        SourceIndex index;
+
+        double startTime = GetTestTime();
+        unsigned int numScanScripts = RegisterByScan(chunks, scanScripts);
+        double scanTime = GetTestTime() - startTime;
+
+        startTime = GetTestTime();
+        unsigned int numIndexScripts = RegisterByIndex(chunks, indexScripts, index);
+        double indexTime = GetTestTime() - startTime;
+
+        TEST_CHECK(numScanScripts == numSources);
+        TEST_CHECK(numIndexScripts == numSources);
+
+        printf("  %u chunks, %5u unique: scan %8.1f ms, index %8.1f ms\n",
+            numChunks, numSources, scanTime * 1000.0, indexTime * 1000.0);
+
+        for (unsigned int i = 0; i < scanScripts.size(); ++i)
+        {
+            delete scanScripts[i];
+        }
+
+        for (unsigned int i = 0; i < indexScripts.size(); ++i)
+        {
+            delete indexScripts[i];
+        }
+
+    }
+
+}
@@ -0,0 +1,215 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+struct TestInfo
+{
+    const char*     name;
+    TestFunction    function;
+    bool            benchmark;
+};
+
+static unsigned int s_numFailures = 0;
+
+/**
+ * The list is created on first use since registrars in other files can be
+ * constructed before this file's statics.
+ */
+static std::vector<TestInfo>& GetTests()
+{
+    static std::vector<TestInfo> tests;
+    return tests;
+}
+
+TestRegistrar::TestRegistrar(const char* name, TestFunction function, bool benchmark)
+{
+    TestInfo info;
+    info.name       = name;
+    info.function   = function;
+    info.benchmark  = benchmark;
+    GetTests().push_back(info);
+}
+
+void TestCheck(bool condition, const char* text, const char* file, int line)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "%s(%d): check failed: %s\n", file, line, text);
+        ++s_numFailures;
+    }
+}
+
+const char* GetTestChannelName()
+{
+
+    static unsigned int index = 0;
+    static char name[64];
+
+#ifdef _WIN32
+    unsigned int processId = GetCurrentProcessId();
+#else
+    unsigned int processId = getpid();
+#endif
+
+    sprintf(name, "Decoda.Test.%x.%u", processId, ++index);
+    return name;
+
+}
+
+double GetTestTime()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / static_cast<double>(frequency.QuadPart);
+#else
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
+
+struct ThreadStart
+{
+    void (*function)(void*);
+    void* param;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadProc(LPVOID param)
+#else
+static void* ThreadProc(void* param)
+#endif
+{
+    ThreadStart* start = static_cast<ThreadStart*>(param);
+    start->function(start->param);
+    delete start;
+    return 0;
+}
+
+void* StartTestThread(void (*function)(void*), void* param)
+{
+
+    ThreadStart* start = new ThreadStart;
+    start->function = function;
+    start->param    = param;
+
+#ifdef _WIN32
+    return CreateThread(NULL, 0, ThreadProc, start, 0, NULL);
+#else
+    pthread_t* thread = new pthread_t;
+    pthread_create(thread, NULL, ThreadProc, start);
+    return thread;
+#endif
+
+}
+
+void JoinTestThread(void* thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_t* handle = static_cast<pthread_t*>(thread);
+    pthread_join(*handle, NULL);
+    delete handle;
+#endif
+}
+
+/**
+ * Runs the tests, and the benchmarks if --bench is passed. Any other
+ * arguments select tests and benchmarks by name.
+ */
+int main(int argc, char* argv[])
+{
+
+    bool benchmarks = false;
+    std::vector<const char*> names;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--bench") == 0)
+        {
+            benchmarks = true;
+        }
+        else
+        {
+            names.push_back(argv[i]);
+        }
+    }
+
+    const std::vector<TestInfo>& tests = GetTests();
+    unsigned int numRun = 0;
+
+    for (unsigned int i = 0; i < tests.size(); ++i)
+    {
+
+        const TestInfo& test = tests[i];
+
+        bool selected = names.empty() ? (!test.benchmark || benchmarks) : false;
+
+        for (unsigned int j = 0; j < names.size(); ++j)
+        {
+            if (strcmp(names[j], test.name) == 0)
+            {
+                selected = true;
+            }
+        }
+
+        if (selected)
+        {
+
+            unsigned int numFailures = s_numFailures;
+
+            printf("%s\n", test.name);
+            fflush(stdout);
+
+            test.function();
+            ++numRun;
+
+            if (s_numFailures != numFailures)
+            {
+                printf("%s FAILED\n", test.name);
+            }
+
+        }
+
+    }
+
+    printf("%u run, %u failed checks\n", numRun, s_numFailures);
+    return s_numFailures == 0 ? 0 : 1;
+
+}
@@ -0,0 +1,93 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/**
+ * Minimal test harness for the code that can run outside of the debugger
+ * processes. Tests and benchmarks register themselves with the TEST and
+ * BENCHMARK macros and are run by the driver in Test.cpp. Tests always run;
+ * benchmarks only run when the driver is started with --bench.
+ */
+
+typedef void (*TestFunction)();
+
+/**
+ * Adds a test or benchmark to the list the driver runs. Instances are
+ * created by the TEST and BENCHMARK macros.
+ */
+class TestRegistrar
+{
+
+public:
+
+    /**
+     * Constructor.
+     */
+    TestRegistrar(const char* name, TestFunction function, bool benchmark);
+
+};
+
+/**
+ * Records the result of a check. Failures are printed with the location of
+ * the check and make the driver exit with an error.
+ */
+void TestCheck(bool condition, const char* text, const char* file, int line);
+
+/**
+ * Returns a name for a channel or transport that's unique to this process,
+ * so that tests running at the same time don't connect to each other.
+ */
+const char* GetTestChannelName();
+
+/**
+ * Returns a time stamp in seconds for measuring benchmarks.
+ */
+double GetTestTime();
+
+/**
+ * Starts a thread running the function. The returned handle is passed to
+ * JoinTestThread.
+ */
+void* StartTestThread(void (*function)(void*), void* param);
+
+/**
+ * Waits for a thread started with StartTestThread to finish.
+ */
+void JoinTestThread(void* thread);
+
+#define TEST(name) \
+    static void name(); \
+    static TestRegistrar name##Registrar(#name, name, false); \
+    static void name()
+
+#define BENCHMARK(name) \
+    static void name(); \
+    static TestRegistrar name##Registrar(#name, name, true); \
+    static void name()
+
+#define TEST_CHECK(condition) TestCheck((condition) != 0, #condition, __FILE__, __LINE__)
+
+#endif
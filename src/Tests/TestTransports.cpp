@@ -0,0 +1,120 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "TestTransports.h"
+#include "Test.h"
+
+#include "Channel.h"
+#include "Transport.h"
+#include "RingTransport.h"
+
+#ifdef _WIN32
+#include "PipeTransport.h"
+#else
+#include "SocketTransport.h"
+#endif
+
+#include <string>
+
+#ifdef _WIN32
+
+static Transport* CreatePipeTransport()
+{
+    return new PipeTransport;
+}
+
+#else
+
+static Transport* CreateSocketTransport()
+{
+    return new SocketTransport;
+}
+
+#endif
+
+static Transport* CreateRingTransport()
+{
+    return new RingTransport;
+}
+
+static const TestTransportType s_transportTypes[] =
+    {
+#ifdef _WIN32
+        { "pipe",   CreatePipeTransport     },
+#else
+        { "socket", CreateSocketTransport   },
+#endif
+        { "ring",   CreateRingTransport     },
+    };
+
+const TestTransportType* GetTestTransportTypes(unsigned int& numTypes)
+{
+    numTypes = sizeof(s_transportTypes) / sizeof(s_transportTypes[0]);
+    return s_transportTypes;
+}
+
+struct WaitForConnectionData
+{
+    Channel*    channel;
+    bool        result;
+};
+
+static void WaitForConnectionThread(void* param)
+{
+    WaitForConnectionData* data = static_cast<WaitForConnectionData*>(param);
+    data->result = data->channel->WaitForConnection();
+}
+
+bool ConnectTestChannels(Channel& server, Channel& client)
+{
+
+    std::string name = GetTestChannelName();
+
+    if (!server.Create(name.c_str()))
+    {
+        return false;
+    }
+
+    WaitForConnectionData data;
+    data.channel = &server;
+    data.result  = false;
+
+    void* thread = StartTestThread(WaitForConnectionThread, &data);
+
+    // The server may not be waiting yet, so keep trying for a little while.
+    bool connected = false;
+    double endTime = GetTestTime() + 5.0;
+
+    while (!connected && GetTestTime() < endTime)
+    {
+        connected = client.Connect(name.c_str());
+    }
+
+    if (!connected)
+    {
+        server.Destroy();
+    }
+
+    JoinTestThread(thread);
+    return connected && data.result;
+
+}
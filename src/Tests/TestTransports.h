@@ -0,0 +1,54 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TEST_TRANSPORTS_H
+#define TEST_TRANSPORTS_H
+
+//
+// Forward declarations.
+//
+
+class Channel;
+class Transport;
+
+/**
+ * A kind of transport the tests and benchmarks are run over.
+ */
+struct TestTransportType
+{
+    const char*     name;
+    Transport*      (*create)();
+};
+
+/**
+ * Returns the transports available on this platform.
+ */
+const TestTransportType* GetTestTransportTypes(unsigned int& numTypes);
+
+/**
+ * Creates the server channel, connects the client channel to it and waits
+ * for the connection like the frontend and backend do. Returns false if the
+ * channels couldn't be connected.
+ */
+bool ConnectTestChannels(Channel& server, Channel& client);
+
+#endif
@@ -0,0 +1,452 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+#include "TestTransports.h"
+
+#include "Channel.h"
+#include "Transport.h"
+#include "RingTransport.h"
+#include "Protocol.h"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * Checks that messages go both ways over each of the transports.
+ */
+TEST(TransportRoundTrip)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    for (unsigned int i = 0; i < numTypes; ++i)
+    {
+
+        Channel server(types[i].create());
+        Channel client(types[i].create());
+
+        TEST_CHECK(ConnectTestChannels(server, client));
+
+        client.WriteUInt32(CommandId_Evaluate);
+        client.WriteString("x + 1");
+        client.WriteBool(true);
+        TEST_CHECK(client.Flush());
+
+        unsigned int commandId = 0;
+        std::string  expression;
+        bool         flag = false;
+
+        TEST_CHECK(server.ReadUInt32(commandId) && commandId == CommandId_Evaluate);
+        TEST_CHECK(server.ReadString(expression) && expression == "x + 1");
+        TEST_CHECK(server.ReadBool(flag) && flag);
+
+        server.WriteString(std::string());
+        server.WriteString(std::string(100000, 'a'));
+        TEST_CHECK(server.Flush());
+
+        std::string result;
+        TEST_CHECK(client.ReadString(result) && result.empty());
+        TEST_CHECK(client.ReadString(result) && result == std::string(100000, 'a'));
+
+    }
+
+}
+
+struct StringWriterData
+{
+    Channel*        channel;
+    std::string     value;
+};
+
+static void StringWriterThread(void* param)
+{
+    StringWriterData* data = static_cast<StringWriterData*>(param);
+    data->channel->WriteString(data->value);
+    data->channel->WriteString("next");
+    data->channel->Flush();
+}
+
+/**
+ * Checks that reading a string without copying works when the string is
+ * split across frames, which happens to messages over the maximum frame
+ * size.
+ */
+TEST(TransportReadStringAcrossFrames)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    Channel server(types[0].create());
+    Channel client(types[0].create());
+
+    TEST_CHECK(ConnectTestChannels(server, client));
+
+    StringWriterData data;
+    data.channel = &client;
+    data.value.resize(65 * 1024 * 1024);
+
+    for (unsigned int i = 0; i < data.value.size(); ++i)
+    {
+        data.value[i] = static_cast<char>(i * 7);
+    }
+
+    void* thread = StartTestThread(StringWriterThread, &data);
+
+    const char*  value  = NULL;
+    unsigned int length = 0;
+
+    TEST_CHECK(server.ReadString(value, length));
+    TEST_CHECK(length == data.value.size() && memcmp(value, data.value.data(), length) == 0);
+
+    TEST_CHECK(server.ReadString(value, length));
+    TEST_CHECK(length == 4 && memcmp(value, "next", 4) == 0);
+
+    JoinTestThread(thread);
+
+}
+
+struct BlockedReadData
+{
+    Channel*    channel;
+    bool        result;
+};
+
+static void BlockedReadThread(void* param)
+{
+    BlockedReadData* data = static_cast<BlockedReadData*>(param);
+    unsigned int value;
+    data->result = data->channel->ReadUInt32(value);
+}
+
+/**
+ * Checks that shutting down a channel wakes up a thread blocked reading it.
+ */
+TEST(TransportDestroyWakesReader)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    for (unsigned int i = 0; i < numTypes; ++i)
+    {
+
+        Channel server(types[i].create());
+        Channel client(types[i].create());
+
+        TEST_CHECK(ConnectTestChannels(server, client));
+
+        BlockedReadData data;
+        data.channel = &client;
+        data.result  = true;
+
+        void* thread = StartTestThread(BlockedReadThread, &data);
+
+        // Give the thread a chance to block before shutting the channel down.
+        double endTime = GetTestTime() + 0.05;
+        while (GetTestTime() < endTime)
+        {
+        }
+
+        client.Destroy();
+        JoinTestThread(thread);
+
+        TEST_CHECK(!data.result);
+
+    }
+
+}
+
+/**
+ * Writes an EventId_LoadScript event with a source of the specified size.
+ */
+static void WriteLoadScript(Channel& channel, const std::string& fileName, const std::string& source)
+{
+    channel.BeginMessage();
+    channel.WriteUInt32(EventId_LoadScript);
+    channel.WriteUInt32(0x12345678);
+    channel.WriteString(fileName);
+    channel.WriteString(source);
+    channel.WriteUInt32(CodeState_Normal);
+    channel.EndMessage();
+    channel.Flush();
+}
+
+/**
+ * Reads an event written by WriteLoadScript.
+ */
+static bool ReadLoadScript(Channel& channel, std::string& fileName, std::string& source)
+{
+    unsigned int eventId;
+    unsigned int vm;
+    unsigned int state;
+    return channel.ReadUInt32(eventId) && channel.ReadUInt32(vm) &&
+           channel.ReadString(fileName) && channel.ReadString(source) &&
+           channel.ReadUInt32(state);
+}
+
+struct LoadScriptWriterData
+{
+    Channel*        channel;
+    Channel*        commands;       // If set, each event waits for CommandId_LoadDone.
+    unsigned int    numEvents;
+    std::string     source;
+};
+
+static void LoadScriptWriterThread(void* param)
+{
+
+    LoadScriptWriterData* data = static_cast<LoadScriptWriterData*>(param);
+
+    for (unsigned int i = 0; i < data->numEvents; ++i)
+    {
+
+        WriteLoadScript(*data->channel, "@scripts/game/Module.lua", data->source);
+
+        if (data->commands != NULL)
+        {
+            unsigned int commandId;
+            unsigned int vm;
+            data->commands->ReadUInt32(commandId);
+            data->commands->ReadUInt32(vm);
+        }
+
+    }
+
+}
+
+/**
+ * Measures how fast EventId_LoadScript events move over each transport.
+ * Throughput streams events from one thread to another. Latency is the time
+ * for a load event to get to the frontend and for its CommandId_LoadDone to
+ * come back, which is what a script load waits for.
+ */
+BENCHMARK(TransportLoadScriptBenchmark)
+{
+
+    static const unsigned int sourceSizes[] = { 1024, 16 * 1024, 256 * 1024 };
+    static const unsigned int numSizes = sizeof(sourceSizes) / sizeof(sourceSizes[0]);
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    for (unsigned int i = 0; i < numTypes; ++i)
+    {
+        for (unsigned int j = 0; j < numSizes; ++j)
+        {
+
+            Channel events(types[i].create());
+            Channel frontendEvents(types[i].create());
+            Channel commands(types[i].create());
+            Channel frontendCommands(types[i].create());
+
+            TEST_CHECK(ConnectTestChannels(frontendEvents, events));
+            TEST_CHECK(ConnectTestChannels(frontendCommands, commands));
+
+            std::string source(sourceSizes[j], 'x');
+            std::string fileName;
+            std::string received;
+
+            // Throughput.
+
+            LoadScriptWriterData data;
+            data.channel    = &events;
+            data.commands   = NULL;
+            data.numEvents  = (64 * 1024 * 1024) / sourceSizes[j];
+            data.source     = source;
+
+            double startTime = GetTestTime();
+            void* thread = StartTestThread(LoadScriptWriterThread, &data);
+
+            for (unsigned int k = 0; k < data.numEvents; ++k)
+            {
+                TEST_CHECK(ReadLoadScript(frontendEvents, fileName, received));
+            }
+
+            JoinTestThread(thread);
+            double throughputTime = GetTestTime() - startTime;
+
+            TEST_CHECK(received == source);
+
+            // Latency. The backend runs on its own thread since a large event
+            // doesn't fit in the transport's buffer.
+
+            LoadScriptWriterData roundTrips = data;
+            roundTrips.commands  = &commands;
+            roundTrips.numEvents = 1000;
+
+            startTime = GetTestTime();
+            thread = StartTestThread(LoadScriptWriterThread, &roundTrips);
+
+            for (unsigned int k = 0; k < roundTrips.numEvents; ++k)
+            {
+                ReadLoadScript(frontendEvents, fileName, received);
+                frontendCommands.WriteUInt32(CommandId_LoadDone);
+                frontendCommands.WriteUInt32(0x12345678);
+                frontendCommands.Flush();
+            }
+
+            JoinTestThread(thread);
+            double latencyTime = GetTestTime() - startTime;
+
+            printf("  %-8s %6u KB source: %8.0f events/s %8.1f MB/s, load round trip %7.1f us\n",
+                types[i].name, sourceSizes[j] / 1024,
+                data.numEvents / throughputTime,
+                data.numEvents * (sourceSizes[j] / (1024.0 * 1024.0)) / throughputTime,
+                latencyTime / roundTrips.numEvents * 1e6);
+
+        }
+    }
+
+}
+
+/**
+ * Checks that a channel moved to a ring with SwitchTransport keeps the
+ * messages in order, the way the event channel moves after the handshake
+ * when both sides support Capability_RingTransport.
+ */
+TEST(TransportSwitchToRing)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    Channel backend(types[0].create());
+    Channel frontend(types[0].create());
+
+    TEST_CHECK(ConnectTestChannels(frontend, backend));
+
+    std::string name = GetTestChannelName();
+
+    RingTransport* backendRing  = new RingTransport;
+    RingTransport* frontendRing = new RingTransport;
+
+    TEST_CHECK(backendRing->Create(name.c_str()));
+
+    backend.WriteUInt32(EventId_Handshake);
+    backend.WriteUInt32(PackHandshake(ProtocolVersion_Current, Capability_RingTransport));
+    TEST_CHECK(backend.Flush());
+
+    unsigned int eventId   = 0;
+    unsigned int handshake = 0;
+
+    TEST_CHECK(frontend.ReadUInt32(eventId) && eventId == EventId_Handshake);
+    TEST_CHECK(frontend.ReadUInt32(handshake));
+
+    TEST_CHECK(frontendRing->Connect(name.c_str()));
+    frontend.SetNextTransport(frontendRing);
+
+    TEST_CHECK(backendRing->WaitForConnection(5000));
+
+    // Leave a message that's only partially committed when switching, to
+    // check that it stays together on the new transport.
+    backend.WriteUInt32(1);
+    backend.BeginMessage();
+    backend.WriteUInt32(2);
+    TEST_CHECK(backend.SwitchTransport(backendRing));
+    backend.WriteString("after");
+    backend.EndMessage();
+    TEST_CHECK(backend.Flush());
+
+    unsigned int value = 0;
+    std::string  text;
+
+    TEST_CHECK(frontend.ReadUInt32(value) && value == 1);
+    TEST_CHECK(frontend.ReadUInt32(value) && value == 2);
+    TEST_CHECK(frontend.ReadString(text) && text == "after");
+
+}
+
+struct MessageWriterData
+{
+    Channel*        channel;
+    unsigned int    numEvents;
+};
+
+static void MessageWriterThread(void* param)
+{
+
+    MessageWriterData* data = static_cast<MessageWriterData*>(param);
+
+    for (unsigned int i = 0; i < data->numEvents; ++i)
+    {
+        data->channel->BeginMessage();
+        data->channel->WriteUInt32(EventId_Message);
+        data->channel->WriteUInt32(0x12345678);
+        data->channel->WriteUInt32(MessageType_Normal);
+        data->channel->WriteString("Warning: Script file 'Module.lua' loaded twice");
+        data->channel->EndMessage();
+        data->channel->Flush();
+    }
+
+}
+
+/**
+ * Measures how many small events per second each transport carries, which
+ * is what the ring transport is meant to improve on. Each event is flushed
+ * on its own like the backend does.
+ */
+BENCHMARK(TransportEventRateBenchmark)
+{
+
+    unsigned int numTypes;
+    const TestTransportType* types = GetTestTransportTypes(numTypes);
+
+    for (unsigned int i = 0; i < numTypes; ++i)
+    {
+
+        Channel events(types[i].create());
+        Channel frontendEvents(types[i].create());
+
+        TEST_CHECK(ConnectTestChannels(frontendEvents, events));
+
+        MessageWriterData data;
+        data.channel    = &events;
+        data.numEvents  = 1000000;
+
+        double startTime = GetTestTime();
+        void* thread = StartTestThread(MessageWriterThread, &data);
+
+        unsigned int eventId;
+        unsigned int vm;
+        unsigned int type;
+        std::string  message;
+
+        for (unsigned int k = 0; k < data.numEvents; ++k)
+        {
+            frontendEvents.ReadUInt32(eventId);
+            frontendEvents.ReadUInt32(vm);
+            frontendEvents.ReadUInt32(type);
+            frontendEvents.ReadString(message);
+        }
+
+        JoinTestThread(thread);
+        double time = GetTestTime() - startTime;
+
+        printf("  %-8s %10.0f events/s\n", types[i].name, data.numEvents / time);
+
+    }
+
+}
@@ -0,0 +1,149 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include "ValidLines.h"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * Returns the valid lines of the source as a string of 0s and 1s, one for
+ * each line, which makes the expected results easy to read.
+ */
+static std::string GetValidLineMap(const char* source)
+{
+
+    std::vector<unsigned int> validLines;
+    GetValidLines(source, strlen(source), validLines);
+
+    unsigned int numLines = 1;
+
+    for (const char* c = source; *c != 0; ++c)
+    {
+        numLines += *c == '\n';
+    }
+
+    std::string map(numLines, '0');
+
+    for (unsigned int i = 0; i < validLines.size(); ++i)
+    {
+        if (validLines[i] < numLines)
+        {
+            map[validLines[i]] = '1';
+        }
+    }
+
+    return map;
+
+}
+
+TEST(ValidLinesStatements)
+{
+
+    TEST_CHECK(GetValidLineMap(
+        "local x = 1\n"         // 1
+        "\n"                    // 0
+        "-- comment\n"          // 0
+        "--[[ long\n"           // 0
+        "comment ]]\n"          // 0
+        "print(x)\n"            // 1
+        "x = x + 1; y = 2"      // 1
+        ) == "1000011");
+
+}
+
+TEST(ValidLinesClosers)
+{
+
+    TEST_CHECK(GetValidLineMap(
+        "if x then\n"           // 1
+        "    a()\n"             // 1
+        "else\n"                // 0
+        "    b()\n"             // 1
+        "end\n"                 // 0
+        "while x do\n"          // 1
+        "    x = f()\n"         // 1
+        "end\n"                 // 0
+        "repeat\n"              // 0
+        "    x = x - 1\n"       // 1
+        "until x == 0\n"        // 1
+        "do\n"                  // 0
+        "    local y\n"         // 1
+        "end"                   // 0
+        ) == "11010110011010");
+
+    // The end of a function has the return at the end of the function.
+    TEST_CHECK(GetValidLineMap(
+        "function f(a)\n"       // 1
+        "    if a then\n"       // 1
+        "        return 1\n"    // 1
+        "    end\n"             // 0
+        "end\n"                 // 1
+        "::top::\n"             // 0
+        "goto top"              // 1
+        ) == "1110101");
+
+}
+
+TEST(ValidLinesContinuations)
+{
+
+    TEST_CHECK(GetValidLineMap(
+        "local t = {\n"         // 1
+        "    a = 1,\n"          // 0
+        "    b = 2,\n"          // 0
+        "}\n"                   // 0
+        "local x = a +\n"       // 1
+        "    b\n"               // 0
+        "local y = a\n"         // 1
+        "    .. b\n"            // 0
+        "foo(a,\n"              // 1
+        "    b)\n"              // 0
+        "obj:method()\n"        // 1
+        "    :other()"          // 0
+        ) == "100010101010");
+
+    // A function inside an expression starts a new list of statements.
+    TEST_CHECK(GetValidLineMap(
+        "foo(1, function(a,\n"  // 1
+        "                b)\n"  // 0
+        "    print(a)\n"        // 1
+        "end)\n"                // 1
+        "local t = {\n"         // 1
+        "    f = function()\n"  // 0
+        "        g()\n"         // 1
+        "    end,\n"            // 1
+        "}"                     // 0
+        ) == "101110110");
+
+    // The code for a string that spans lines is on the line where it ends.
+    TEST_CHECK(GetValidLineMap(
+        "local s = [[\n"        // 1
+        "text\n"                // 0
+        "]]\n"                  // 1
+        "local n = 0x1p-4 + 1e-3 - .5"  // 1
+        ) == "1011");
+
+}
@@ -0,0 +1,684 @@
+/*
+
+Decoda
+Copyright (C) 2007-2013 Unknown Worlds Entertainment, Inc. 
+
+This file is part of Decoda.
+
+Decoda is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Decoda is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Decoda.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Test.h"
+
+#include "ValueStream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * Reads a Value and checks its type and text.
+ */
+static bool ReadTestValue(ValueReader& reader, const char* type, const char* text)
+{
+    ValueTag tag;
+    std::string valueType;
+    std::string valueText;
+    return reader.ReadTag(tag) && tag == ValueTag_Value &&
+           reader.ReadType(valueType) && valueType == type &&
+           reader.ReadString(valueText) && valueText == text;
+}
+
+/**
+ * Writes a stream with one of each kind of value that isn't paged.
+ */
+static void WriteTestStream(std::string& stream)
+{
+
+    ValueWriter writer(stream);
+
+    writer.BeginValues(5);
+
+    writer.WriteValue("number", "42");
+
+    writer.BeginTable("Vector");
+    writer.WriteValue("string", "x");
+    writer.WriteValue("number", "1.5");
+    writer.WriteValue("string", "update");
+    writer.WriteFunction(3, 17);
+    writer.EndTable();
+
+    writer.WriteFunction(7, 200);
+    writer.WriteError("Error: attempt to index a nil value");
+
+    // Empty strings and types have to survive too.
+    writer.WriteValue(NULL, "");
+
+}
+
+TEST(ValueStreamRoundTrip)
+{
+
+    std::string stream;
+    WriteTestStream(stream);
+
+    TEST_CHECK(ValueReader::GetIsValueStream(stream.c_str(), stream.length()));
+
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+    unsigned int value;
+    std::string text;
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Values);
+    TEST_CHECK(reader.ReadVarint(value) && value == 5);
+
+    TEST_CHECK(ReadTestValue(reader, "number", "42"));
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Table);
+    TEST_CHECK(reader.ReadType(text) && text == "Vector");
+    TEST_CHECK(ReadTestValue(reader, "string", "x"));
+    TEST_CHECK(ReadTestValue(reader, "number", "1.5"));
+    TEST_CHECK(ReadTestValue(reader, "string", "update"));
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Function);
+    TEST_CHECK(reader.ReadVarint(value) && value == 3);
+    TEST_CHECK(reader.ReadVarint(value) && value == 17);
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_End);
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Function);
+    TEST_CHECK(reader.ReadVarint(value) && value == 7);
+    TEST_CHECK(reader.ReadVarint(value) && value == 200);
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Error);
+    TEST_CHECK(reader.ReadString(text) && text == "Error: attempt to index a nil value");
+
+    TEST_CHECK(ReadTestValue(reader, "", ""));
+    TEST_CHECK(reader.GetIsValid());
+
+    // That's the end of the stream.
+    TEST_CHECK(!reader.ReadTag(tag));
+    TEST_CHECK(!reader.GetIsValid());
+
+    // The XML form isn't mistaken for a stream.
+    const char* xml = "<value><data>42</data></value>";
+    TEST_CHECK(!ValueReader::GetIsValueStream(xml, strlen(xml)));
+    TEST_CHECK(!ValueReader::GetIsValueStream("", 0));
+
+}
+
+TEST(ValueStreamVarints)
+{
+
+    static const unsigned int values[]  = { 0, 1, 127, 128, 16383, 16384, 0x7FFFFFFF, 0xFFFFFFFF };
+    static const size_t       lengths[] = { 1, 1, 1,   2,   2,     3,     5,          5 };
+
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+
+        // The count of a Values is written as a varint on its own.
+        std::string stream;
+        ValueWriter writer(stream);
+        writer.BeginValues(values[i]);
+
+        // The stream header and the tag come before the varint.
+        TEST_CHECK(stream.length() == 2 + lengths[i]);
+
+        ValueReader reader(stream.c_str(), stream.length());
+
+        ValueTag tag;
+        unsigned int value;
+
+        TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Values);
+        TEST_CHECK(reader.ReadVarint(value) && value == values[i]);
+
+    }
+
+}
+
+TEST(ValueStreamSkip)
+{
+
+    std::string stream;
+
+    {
+
+        ValueWriter writer(stream);
+
+        writer.BeginValues(3);
+
+        // Tables nested in tables, with a list of values and tables as keys.
+        writer.BeginTable("Outer");
+        writer.WriteValue("string", "inner");
+        writer.BeginTable("Inner");
+        writer.BeginTable(NULL);
+        writer.EndTable();
+        writer.BeginValues(2);
+        writer.WriteError("Error: one");
+        writer.WriteFunction(1, 2);
+        writer.EndTable();
+        writer.WriteValue("number", "1");
+        writer.WriteValue("number", "2");
+        writer.EndTable();
+
+        writer.WriteFunction(4, 5);
+        writer.WriteValue("string", "after");
+
+    }
+
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+    unsigned int value;
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Values);
+    TEST_CHECK(reader.ReadVarint(value) && value == 3);
+
+    TEST_CHECK(reader.ReadTag(tag) && reader.SkipValue(tag));
+    TEST_CHECK(reader.ReadTag(tag) && reader.SkipValue(tag));
+
+    // Type names defined inside skipped values still count, so the one used
+    // here refers back to the "string" from the skipped table.
+    TEST_CHECK(ReadTestValue(reader, "string", "after"));
+
+    // Skipping the whole stream from the start ends exactly at its end.
+    ValueReader skipper(stream.c_str(), stream.length());
+    TEST_CHECK(skipper.ReadTag(tag) && skipper.SkipValue(tag));
+    TEST_CHECK(!skipper.ReadTag(tag));
+
+}
+
+TEST(ValueStreamTruncated)
+{
+
+    std::string stream;
+    WriteTestStream(stream);
+
+    // Every prefix of the stream has to fail without reading past its end.
+    // Each one is copied into a buffer of exactly its length so tools like
+    // address sanitizer catch an over read.
+
+    for (size_t length = 1; length < stream.length(); ++length)
+    {
+
+        std::vector<char> data(stream.begin(), stream.begin() + length);
+
+        ValueReader reader(&data[0], length);
+
+        ValueTag tag;
+        bool success = reader.ReadTag(tag) && reader.SkipValue(tag);
+
+        TEST_CHECK(!success);
+        TEST_CHECK(!reader.GetIsValid());
+
+    }
+
+}
+
+TEST(ValueStreamCorrupt)
+{
+
+    ValueTag tag;
+    unsigned int value;
+    std::string text;
+
+    // A varint with more than 5 bytes.
+    {
+        const char data[] = { ValueTag_Stream, ValueTag_Values, '\x80', '\x80', '\x80', '\x80', '\x80', '\x01' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(reader.ReadTag(tag) && !reader.ReadVarint(value));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    // A string longer than the rest of the data.
+    {
+        const char data[] = { ValueTag_Stream, ValueTag_Error, '\x7F', 'a', 'b' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(reader.ReadTag(tag) && !reader.ReadString(text));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    // A string length that would wrap around the end of the buffer.
+    {
+        const char data[] = { ValueTag_Stream, ValueTag_Error, '\xFF', '\xFF', '\xFF', '\xFF', '\x0F', 'a' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(reader.ReadTag(tag) && !reader.ReadString(text));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    // A type id that hasn't been defined.
+    {
+        const char data[] = { ValueTag_Stream, ValueTag_Value, '\x03', '\x00' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(reader.ReadTag(tag) && !reader.SkipValue(tag));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    // A tag that doesn't exist, at the top and inside a table.
+    {
+        const char data[] = { ValueTag_Stream, '\x7E', '\x00' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(!reader.ReadTag(tag));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    {
+        const char data[] = { ValueTag_Stream, ValueTag_Table, '\x00', '\x00', '\x7E', '\x00' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(reader.ReadTag(tag) && !reader.SkipValue(tag));
+        TEST_CHECK(!reader.GetIsValid());
+    }
+
+    // Nothing can be read once the reader has failed.
+    {
+        const char data[] = { ValueTag_Stream, '\x7E', ValueTag_Function, '\x01', '\x02' };
+        ValueReader reader(data, sizeof(data));
+        TEST_CHECK(!reader.ReadTag(tag));
+        TEST_CHECK(!reader.ReadTag(tag) && !reader.ReadVarint(value));
+    }
+
+}
+
+/**
+ * Reads the key/value pairs of a table whose header has been read, checking
+ * that the keys are the numbers first to first + count - 1.
+ */
+static bool ReadTestElements(ValueReader& reader, unsigned int first, unsigned int count)
+{
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        char key[16];
+        sprintf(key, "%u", first + i);
+        if (!ReadTestValue(reader, "number", key) || !ReadTestValue(reader, "string", "element"))
+        {
+            return false;
+        }
+    }
+
+    ValueTag tag;
+    return reader.ReadTag(tag) && tag == ValueTag_End;
+
+}
+
+TEST(ValueStreamPagedTable)
+{
+
+    // The second page of a table, which has more elements after it, and the
+    // last page, which doesn't.
+
+    std::string stream;
+
+    {
+
+        ValueWriter writer(stream);
+
+        writer.BeginValues(2);
+
+        writer.BeginPagedTable("Inventory", 100);
+        for (unsigned int i = 100; i < 103; ++i)
+        {
+            char key[16];
+            sprintf(key, "%u", i);
+            writer.WriteValue("number", key);
+            writer.WriteValue("string", "element");
+        }
+        writer.EndPagedTable(12);
+
+        writer.BeginPagedTable("Inventory", 200);
+        writer.WriteValue("number", "200");
+        writer.WriteValue("string", "element");
+        writer.EndPagedTable(0);
+
+    }
+
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+    unsigned int value;
+    std::string type;
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Values);
+    TEST_CHECK(reader.ReadVarint(value) && value == 2);
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_PagedTable);
+    TEST_CHECK(reader.ReadType(type) && type == "Inventory");
+    TEST_CHECK(reader.ReadVarint(value) && value == 100);
+    TEST_CHECK(ReadTestElements(reader, 100, 3));
+    TEST_CHECK(reader.ReadVarint(value) && value == 12);
+
+    // A handle of 0 means the table has been sent in full.
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_PagedTable);
+    TEST_CHECK(reader.ReadType(type) && type == "Inventory");
+    TEST_CHECK(reader.ReadVarint(value) && value == 200);
+    TEST_CHECK(ReadTestElements(reader, 200, 1));
+    TEST_CHECK(reader.ReadVarint(value) && value == 0);
+
+    TEST_CHECK(reader.GetIsValid());
+    TEST_CHECK(!reader.ReadTag(tag));
+
+}
+
+TEST(ValueStreamSkipPagedTable)
+{
+
+    // A reader that only understands plain tables has to skip over a paged
+    // one, including its trailing handle, and stay in step with the stream.
+
+    std::string stream;
+
+    {
+
+        ValueWriter writer(stream);
+
+        writer.BeginTable(NULL);
+
+        writer.WriteValue("string", "paged");
+        writer.BeginPagedTable("Inventory", 5);
+        writer.WriteValue("number", "5");
+        writer.BeginPagedTable("Item", 0);
+        writer.EndPagedTable(0x12345);
+        writer.EndPagedTable(0xFFFFFFFF);
+
+        writer.WriteValue("string", "plain");
+        writer.WriteValue("number", "7");
+
+        writer.EndTable();
+
+    }
+
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+    std::string type;
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Table);
+    TEST_CHECK(reader.ReadType(type) && type == "");
+
+    TEST_CHECK(ReadTestValue(reader, "string", "paged"));
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_PagedTable);
+    TEST_CHECK(reader.SkipValue(tag));
+
+    TEST_CHECK(ReadTestValue(reader, "string", "plain"));
+    TEST_CHECK(ReadTestValue(reader, "number", "7"));
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_End);
+    TEST_CHECK(reader.GetIsValid());
+
+    // Cutting off the last byte of the handle is caught while skipping.
+
+    std::string paged;
+
+    {
+        ValueWriter writer(paged);
+        writer.BeginPagedTable("Inventory", 0);
+        writer.EndPagedTable(0xFFFFFFFF);
+    }
+
+    ValueReader truncated(paged.c_str(), paged.length() - 1);
+    TEST_CHECK(truncated.ReadTag(tag) && !truncated.SkipValue(tag));
+    TEST_CHECK(!truncated.GetIsValid());
+
+}
+
+/**
+ * A table in a graph for the back-reference tests. Each one is written with
+ * its name as its type and its children as the values of numbered keys.
+ */
+struct TestTable
+{
+    const char*                 name;
+    std::vector<TestTable*>     children;
+};
+
+/**
+ * Writes the table the way DebugBackend::WriteTable does: a table that was
+ * already written becomes a reference, otherwise it's remembered and written
+ * in full.
+ */
+static void WriteTestTable(ValueWriter& writer, TestTable* table)
+{
+
+    if (writer.WriteTableRef(table->name, table))
+    {
+        return;
+    }
+
+    writer.AddTable(table);
+    writer.BeginTable(table->name);
+
+    for (unsigned int i = 0; i < table->children.size(); ++i)
+    {
+        char key[16];
+        sprintf(key, "%u", i + 1);
+        writer.WriteValue("number", key);
+        WriteTestTable(writer, table->children[i]);
+    }
+
+    writer.EndTable();
+
+}
+
+/**
+ * Reads a table written by WriteTestTable. The tables are numbered in the
+ * order they appear in the stream, and each reference has to point at one
+ * that's already been read. The names of the tables and the references
+ * are added to the text in the order they're read.
+ */
+static bool ReadTestTable(ValueReader& reader, std::vector<std::string>& tables, std::string& text)
+{
+
+    ValueTag tag;
+    std::string type;
+
+    if (!reader.ReadTag(tag) || !reader.ReadType(type))
+    {
+        return false;
+    }
+
+    if (tag == ValueTag_TableRef)
+    {
+
+        unsigned int index;
+
+        if (!reader.ReadVarint(index) || index >= tables.size() || tables[index] != type)
+        {
+            return false;
+        }
+
+        text += "@" + type + " ";
+        return true;
+
+    }
+
+    if (tag != ValueTag_Table)
+    {
+        return false;
+    }
+
+    tables.push_back(type);
+    text += type + " ";
+
+    while (reader.ReadTag(tag) && tag != ValueTag_End)
+    {
+        if (!reader.SkipValue(tag) || !ReadTestTable(reader, tables, text))
+        {
+            return false;
+        }
+    }
+
+    return reader.GetIsValid();
+
+}
+
+TEST(ValueStreamTableRefs)
+{
+
+    // A table that contains itself.
+    {
+
+        TestTable self;
+        self.name = "self";
+        self.children.push_back(&self);
+
+        std::string stream;
+        ValueWriter writer(stream);
+        WriteTestTable(writer, &self);
+
+        ValueReader reader(stream.c_str(), stream.length());
+        std::vector<std::string> tables;
+        std::string text;
+
+        TEST_CHECK(ReadTestTable(reader, tables, text));
+        TEST_CHECK(text == "self @self ");
+        TEST_CHECK(tables.size() == 1);
+
+    }
+
+    // Two tables that point at each other, reached from a root that holds
+    // both of them. Each one is only written once.
+    {
+
+        TestTable a;
+        a.name = "a";
+        TestTable b;
+        b.name = "b";
+        TestTable root;
+        root.name = "root";
+
+        a.children.push_back(&b);
+        b.children.push_back(&a);
+        root.children.push_back(&a);
+        root.children.push_back(&b);
+        root.children.push_back(&root);
+
+        std::string stream;
+        ValueWriter writer(stream);
+        WriteTestTable(writer, &root);
+
+        ValueReader reader(stream.c_str(), stream.length());
+        std::vector<std::string> tables;
+        std::string text;
+
+        TEST_CHECK(ReadTestTable(reader, tables, text));
+        TEST_CHECK(text == "root a b @a @b @root ");
+
+        // The indices follow the order the tables were written in.
+        TEST_CHECK(tables.size() == 3 && tables[0] == "root" && tables[1] == "a" && tables[2] == "b");
+
+    }
+
+    // A chain of tables that all point back at every table before them grows
+    // with the number of links rather than blowing up.
+    {
+
+        const unsigned int numTables = 50;
+
+        std::vector<TestTable> chain(numTables);
+
+        for (unsigned int i = 0; i < numTables; ++i)
+        {
+            chain[i].name = "link";
+            for (unsigned int j = 0; j <= i; ++j)
+            {
+                chain[i].children.push_back(&chain[j]);
+            }
+            if (i + 1 < numTables)
+            {
+                chain[i].children.push_back(&chain[i + 1]);
+            }
+        }
+
+        std::string stream;
+        ValueWriter writer(stream);
+        WriteTestTable(writer, &chain[0]);
+
+        // Each reference is a handful of bytes.
+        TEST_CHECK(stream.length() < numTables * numTables * 8);
+
+        ValueReader reader(stream.c_str(), stream.length());
+        std::vector<std::string> tables;
+        std::string text;
+
+        TEST_CHECK(ReadTestTable(reader, tables, text));
+        TEST_CHECK(tables.size() == numTables);
+
+    }
+
+}
+
+TEST(ValueStreamTableRefIndices)
+{
+
+    // Tables that are written without being remembered, like the ones the
+    // backend writes below the depth limit, still take up an index, and paged
+    // tables count the same as plain ones.
+
+    int first;
+    int second;
+    int third;
+
+    std::string stream;
+
+    {
+
+        ValueWriter writer(stream);
+
+        writer.BeginValues(5);
+
+        writer.AddTable(&first);
+        writer.BeginTable("first");
+        writer.EndTable();
+
+        writer.BeginTable("unremembered");
+        writer.EndTable();
+
+        writer.AddTable(&second);
+        writer.BeginPagedTable("second", 0);
+        writer.EndPagedTable(0);
+
+        // Unknown tables aren't referred to.
+        TEST_CHECK(!writer.WriteTableRef("third", &third));
+        TEST_CHECK(!writer.WriteTableRef("null", NULL));
+
+        TEST_CHECK(writer.WriteTableRef("second", &second));
+        TEST_CHECK(writer.WriteTableRef("first", &first));
+
+    }
+
+    ValueReader reader(stream.c_str(), stream.length());
+
+    ValueTag tag;
+    unsigned int value;
+    std::string type;
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_Values);
+    TEST_CHECK(reader.ReadVarint(value) && value == 5);
+
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        TEST_CHECK(reader.ReadTag(tag) && reader.SkipValue(tag));
+    }
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_TableRef);
+    TEST_CHECK(reader.ReadType(type) && type == "second");
+    TEST_CHECK(reader.ReadVarint(value) && value == 2);
+
+    TEST_CHECK(reader.ReadTag(tag) && tag == ValueTag_TableRef);
+    TEST_CHECK(reader.ReadType(type) && type == "first");
+    TEST_CHECK(reader.ReadVarint(value) && value == 0);
+
+    TEST_CHECK(reader.GetIsValid());
+
+}